@@ -24,6 +24,7 @@ option(COPROTO_ASAN "build the library with asan enabled." false)
 
 
 option(COPROTO_ENABLE_ASSERTS "compile the library with asserts enabled" ON)
+option(COPROTO_ALLOC_TEST "count and register allocations so that the tests can check for them. Requires linking coproto_tests." OFF)
 
 message(STATUS "Option: COPROTO_CPP_VER         = ${COPROTO_CPP_VER}")
 message(STATUS "Option: COPROTO_PIC             = ${COPROTO_PIC}")
@@ -32,7 +33,8 @@ message(STATUS "Option: COPROTO_ENABLE_BOOST    = ${COPROTO_ENABLE_BOOST}")
 message(STATUS "Option: COPROTO_ENABLE_SPAN     = ${COPROTO_ENABLE_SPAN}")
 message(STATUS "Option: COPROTO_ENABLE_OPENSSL  = ${COPROTO_ENABLE_OPENSSL}")
 
-message(STATUS "Option: COPROTO_ENABLE_ASSERTS  = ${COPROTO_ENABLE_ASSERTS}\n")
+message(STATUS "Option: COPROTO_ENABLE_ASSERTS  = ${COPROTO_ENABLE_ASSERTS}")
+message(STATUS "Option: COPROTO_ALLOC_TEST      = ${COPROTO_ALLOC_TEST}\n")
 
 
 
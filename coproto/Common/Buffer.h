@@ -0,0 +1,137 @@
+#pragma once
+// © 2022 Visa.
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "coproto/Common/Defines.h"
+#include "coproto/Common/span.h"
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace coproto
+{
+	// A contiguous buffer of trivial T whose memory is aligned to
+	// Align bytes. Unlike std::vector, resize(...) does not initialize 
+	// new elements. The capacity is kept when the size is reduced and 
+	// is reused by later calls to resize(...). This is intended for
+	// receiving large messages with Socket::recvResize(...).
+	template<typename T, u64 Align = 64>
+	class Buffer
+	{
+		static_assert(std::is_trivial<T>::value, "Buffer<T> requires a trivial T.");
+		static_assert(Align >= alignof(T) && (Align & (Align - 1)) == 0,
+			"Align must be a power of two that is at least alignof(T).");
+
+	public:
+		using value_type = T;
+		using size_type = u64;
+		using iterator = T*;
+		using const_iterator = const T*;
+
+		static constexpr u64 alignment = Align;
+
+		Buffer() = default;
+
+		explicit Buffer(size_type size) { resize(size); }
+
+		Buffer(const Buffer& o)
+		{
+			resize(o.size());
+			if (mSize)
+				std::memcpy(mData, o.mData, mSize * sizeof(T));
+		}
+
+		Buffer(Buffer&& o) noexcept
+			: mData(std::exchange(o.mData, nullptr))
+			, mSize(std::exchange(o.mSize, 0))
+			, mCapacity(std::exchange(o.mCapacity, 0))
+		{}
+
+		Buffer& operator=(const Buffer& o)
+		{
+			if (this != &o)
+			{
+				resize(o.size());
+				if (mSize)
+					std::memcpy(mData, o.mData, mSize * sizeof(T));
+			}
+			return *this;
+		}
+
+		Buffer& operator=(Buffer&& o) noexcept
+		{
+			if (this != &o)
+			{
+				deallocate();
+				mData = std::exchange(o.mData, nullptr);
+				mSize = std::exchange(o.mSize, 0);
+				mCapacity = std::exchange(o.mCapacity, 0);
+			}
+			return *this;
+		}
+
+		~Buffer() { deallocate(); }
+
+		T* data() { return mData; }
+		const T* data() const { return mData; }
+		size_type size() const { return mSize; }
+		size_type capacity() const { return mCapacity; }
+		bool empty() const { return mSize == 0; }
+
+		iterator begin() { return mData; }
+		iterator end() { return mData + mSize; }
+		const_iterator begin() const { return mData; }
+		const_iterator end() const { return mData + mSize; }
+
+		T& operator[](size_type i) { return mData[i]; }
+		const T& operator[](size_type i) const { return mData[i]; }
+
+		// change the size. Existing elements are preserved up to the 
+		// smaller of the two sizes. New elements are not initialized.
+		void resize(size_type size)
+		{
+			reserve(size);
+			mSize = size;
+		}
+
+		// make sure that size elements can be held without reallocating.
+		void reserve(size_type size)
+		{
+			if (size <= mCapacity)
+				return;
+
+			auto data = static_cast<T*>(::operator new(size * sizeof(T), std::align_val_t(Align)));
+			if (mSize)
+				std::memcpy(data, mData, mSize * sizeof(T));
+			auto s = mSize;
+			deallocate();
+			mData = data;
+			mSize = s;
+			mCapacity = size;
+		}
+
+		void clear() { mSize = 0; }
+
+		span<T> asSpan() { return span<T>(mData, mSize); }
+
+	private:
+		void deallocate()
+		{
+			if (mData)
+				::operator delete(mData, std::align_val_t(Align));
+			mData = nullptr;
+			mSize = 0;
+			mCapacity = 0;
+		}
+
+		T* mData = nullptr;
+		size_type mSize = 0;
+		size_type mCapacity = 0;
+	};
+}
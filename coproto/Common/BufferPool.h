@@ -0,0 +1,237 @@
+#pragma once
+// © 2022 Visa.
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "coproto/Common/Defines.h"
+#include "coproto/Common/span.h"
+#include <vector>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include <utility>
+#include <new>
+
+namespace coproto
+{
+	// A thread safe pool of memory. It hands out std::vector<u8> buffers,
+	// see acquire(...), and uninitialized blocks whose sizes are powers
+	// of two, see acquireBlock(...). The latter are used through 
+	// BufferLease objects which hold a reference to the pool and return 
+	// the block when destroyed. As such, a lease can outlive the socket.
+	// Released memory is retained as long as the pool holds at most 
+	// mMaxFreeBytes bytes, otherwise it is freed.
+	class BufferPool
+	{
+	public:
+		// the smallest block size is 1 << mMinClass.
+		static constexpr u64 mMinClass = 6;
+		static constexpr u64 mNumClasses = 64 - mMinClass;
+
+		BufferPool(u64 maxFreeBytes = 1ull << 22)
+			: mMaxFreeBytes(maxFreeBytes)
+		{}
+
+		BufferPool(const BufferPool&) = delete;
+		BufferPool& operator=(const BufferPool&) = delete;
+
+		// returns a buffer of the given size. If possible, a previously 
+		// released buffer is reused. Its old contents are not cleared,
+		// only bytes beyond its previous size are zeroed by resize(...).
+		// A buffer that is at least size bytes is therefore preferred.
+		std::vector<u8> acquire(u64 size)
+		{
+			std::vector<u8> ret;
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				if (mFree.size())
+				{
+					u64 best = 0;
+					for (u64 i = 1; i < mFree.size() && mFree[best].size() < size; ++i)
+						if (mFree[i].size() > mFree[best].size())
+							best = i;
+
+					std::swap(mFree[best], mFree.back());
+					ret = std::move(mFree.back());
+					mFree.pop_back();
+					mFreeBytes -= ret.capacity();
+				}
+			}
+			ret.resize(size);
+			return ret;
+		}
+
+		// return a buffer to the pool.
+		void release(std::vector<u8>&& buffer)
+		{
+			auto n = buffer.capacity();
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (n && mFreeBytes + n <= mMaxFreeBytes)
+			{
+				mFreeBytes += n;
+				mFree.push_back(std::move(buffer));
+			}
+		}
+
+		// the index of the smallest size class that can hold size bytes.
+		// Throws std::bad_alloc if there is none.
+		static u64 sizeClass(u64 size)
+		{
+			if (size > classSize(mNumClasses - 1))
+				throw std::bad_alloc();
+
+			u64 c = mMinClass;
+			while ((1ull << c) < size)
+				++c;
+			return c - mMinClass;
+		}
+
+		static u64 classSize(u64 c) { return 1ull << (c + mMinClass); }
+
+		// returns an uninitialized block of size classSize(c). 
+		std::unique_ptr<u8[]> acquireBlock(u64 c)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				auto& f = mFreeBlocks[c];
+				if (f.size())
+				{
+					auto ret = std::move(f.back());
+					f.pop_back();
+					mFreeBytes -= classSize(c);
+					return ret;
+				}
+			}
+			return std::unique_ptr<u8[]>(new u8[classSize(c)]);
+		}
+
+		// return a block that was returned by acquireBlock(c).
+		void releaseBlock(u64 c, std::unique_ptr<u8[]>&& block)
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (mFreeBytes + classSize(c) <= mMaxFreeBytes)
+			{
+				mFreeBytes += classSize(c);
+				mFreeBlocks[c].push_back(std::move(block));
+			}
+		}
+
+		// the number of buffers and blocks that are available for reuse.
+		u64 size()
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			u64 n = mFree.size();
+			for (auto& f : mFreeBlocks)
+				n += f.size();
+			return n;
+		}
+
+		// the number of bytes that are retained for reuse.
+		u64 freeBytes()
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			return mFreeBytes;
+		}
+
+	private:
+		u64 mMaxFreeBytes;
+		u64 mFreeBytes = 0;
+		std::mutex mMutex;
+		std::vector<std::vector<u8>> mFree;
+		std::array<std::vector<std::unique_ptr<u8[]>>, mNumClasses> mFreeBlocks;
+	};
+
+	// A byte buffer whose memory is borrowed from a BufferPool. Unlike
+	// std::vector, resize(...) does not initialize the memory. The memory
+	// is returned to the pool when the lease is destroyed. A lease 
+	// without a pool allocates its memory directly. Use 
+	// Socket::recv<BufferLease>() to receive into the socket's pool.
+	class BufferLease
+	{
+	public:
+		using value_type = u8;
+		using size_type = u64;
+
+		BufferLease() = default;
+
+		BufferLease(std::shared_ptr<BufferPool> pool)
+			: mPool(std::move(pool))
+		{}
+
+		BufferLease(const BufferLease&) = delete;
+		BufferLease& operator=(const BufferLease&) = delete;
+
+		BufferLease(BufferLease&& o) noexcept
+			: mPool(std::move(o.mPool))
+			, mBlock(std::move(o.mBlock))
+			, mClass(o.mClass)
+			, mSize(std::exchange(o.mSize, 0))
+		{}
+
+		BufferLease& operator=(BufferLease&& o) noexcept
+		{
+			if (this != &o)
+			{
+				reset();
+				mPool = std::move(o.mPool);
+				mBlock = std::move(o.mBlock);
+				mClass = o.mClass;
+				mSize = std::exchange(o.mSize, 0);
+			}
+			return *this;
+		}
+
+		~BufferLease() { reset(); }
+
+		u8* data() { return mBlock.get(); }
+		const u8* data() const { return mBlock.get(); }
+		size_type size() const { return mSize; }
+		u8* begin() { return data(); }
+		u8* end() { return data() + mSize; }
+		u8& operator[](u64 i) { return mBlock[i]; }
+
+		// the number of bytes that can be held without a new block.
+		u64 capacity() const { return mBlock ? BufferPool::classSize(mClass) : 0; }
+
+		// change the size. The contents are preserved up to the smaller
+		// of the two sizes. New bytes are not initialized.
+		void resize(size_type size)
+		{
+			if (size > capacity())
+			{
+				auto c = BufferPool::sizeClass(size);
+				auto block = mPool ? 
+					mPool->acquireBlock(c) : 
+					std::unique_ptr<u8[]>(new u8[BufferPool::classSize(c)]);
+				if (mSize)
+					std::memcpy(block.get(), mBlock.get(), mSize);
+				reset();
+				mBlock = std::move(block);
+				mClass = c;
+			}
+			mSize = size;
+		}
+
+		span<u8> asSpan() { return span<u8>(data(), mSize); }
+
+		// return the memory to the pool.
+		void reset()
+		{
+			if (mBlock && mPool)
+				mPool->releaseBlock(mClass, std::move(mBlock));
+			mBlock.reset();
+			mSize = 0;
+		}
+
+	private:
+		std::shared_ptr<BufferPool> mPool;
+		std::unique_ptr<u8[]> mBlock;
+		u64 mClass = 0;
+		u64 mSize = 0;
+	};
+}
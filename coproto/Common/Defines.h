@@ -6,10 +6,17 @@
 // 
 // THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include "coproto/config.h"
+#if defined(COPROTO_ALLOC_TEST) && !defined(ALLOC_TEST)
+#define ALLOC_TEST
+#endif
 #include <cstdint>
 #include <exception>
 #include <cassert>
 #include <iostream>
+#include <string>
+#ifdef ALLOC_TEST
+#include <atomic>
+#endif
 
 #define COPRO_STRINGIZE_DETAIL(x) #x
 #define COPRO_STRINGIZE(x) COPRO_STRINGIZE_DETAIL(x)
@@ -59,27 +66,34 @@
 namespace coproto
 {
 
+    typedef uint64_t u64;
+    typedef int64_t i64;
+    typedef uint32_t u32;
+    typedef int32_t i32;
+    typedef uint16_t u16;
+    typedef int16_t i16;
+    typedef uint8_t u8;
+    typedef int8_t i8;
+
 #ifdef ALLOC_TEST
+    // registers the allocations made by coproto. mNewIdx counts 
+    // the allocations so far.
     void regNew_(void* ptr, std::string name);
     void regDel_(void* ptr);
     std::string regStr();
 #define COPROTO_REG_NEW(p, n) regNew_(p,n)
 #define COPROTO_REG_DEL(p) regDel_(p)
     extern u64 mNewIdx;
+
+    // the number of calls to the global operator new. This also 
+    // counts allocations that are not registered, e.g. those 
+    // made by unique_function or stop_callback.
+    extern std::atomic<u64> gNumAllocs;
 #else
 #define COPROTO_REG_NEW(p, n) 
 #define COPROTO_REG_DEL(p)
 #endif
 
-    typedef uint64_t u64;
-    typedef int64_t i64;
-    typedef uint32_t u32;
-    typedef int32_t i32;
-    typedef uint16_t u16;
-    typedef int16_t i16;
-    typedef uint8_t u8;
-    typedef int8_t i8;
-
     template<typename T>
     class ProtoV;
 
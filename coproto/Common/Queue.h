@@ -241,7 +241,7 @@ namespace coproto
 		{
 			auto allocSize = sizeof(Block) + nextSize * sizeof(Entry);
 			auto ptr = ::operator new(allocSize, std::align_val_t{ 32 });
-			//std::cout << "new " << hexPtr(ptr) << " " << nextSize << std::endl;
+			COPROTO_REG_NEW(ptr, "Queue::Block");
 
 			auto blk = new (ptr) Block(nextSize);
 			if (mLast)
@@ -295,7 +295,7 @@ namespace coproto
 					auto n = mBegin->mNext;
 					if ((u8*)mBegin != (u8*)&mInitalBuff)
 					{
-						//std::cout << "del " << hexPtr(mBegin) << " " << mBegin->capacity() << std::endl;
+						COPROTO_REG_DEL(mBegin);
 						::operator delete((void*)mBegin, std::align_val_t{ 32 });
 					}
 					mBegin = n;
@@ -311,7 +311,7 @@ namespace coproto
 			// the last buffer;
 			if (mBegin != (Block*)&mInitalBuff)
 			{
-				//std::cout << "del " << hexPtr(mBegin) << " " << mBegin->capacity() << std::endl;
+				COPROTO_REG_DEL(mBegin);
 				::operator delete((void*)mBegin, std::align_val_t{ 32 });
 			}
 		}
@@ -23,8 +23,8 @@ namespace { // anonymous namespace
 
 			case coproto::code::cancel:
 				return "coproto::code::cancel: The operation has been canceled by the local party.";
-			//case coproto::code::remoteCancel:
-			//	return "coproto::code::remoteCancel: The operation has been cancels by the remote party.";
+			case coproto::code::remoteCancel:
+				return "coproto::code::remoteCancel: The operation has been canceled by the remote party.";
 			case coproto::code::closed:
 				return "coproto::code::closed: The connection has been closed by the local party.";
 			case coproto::code::remoteClosed:
@@ -20,7 +20,8 @@ namespace coproto
 		// The operation has been suspended.
 		suspend,
 		cancel,
-		//remoteCancel,
+		// The operation has been canceled by the remote party.
+		remoteCancel,
 
 		closed,
 		remoteClosed,
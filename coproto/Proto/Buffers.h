@@ -18,6 +18,7 @@
 
 #include "coproto/Socket/SocketScheduler.h"
 #include <source_location>
+#include <tuple>
 #include "macoro/trace.h"
 
 namespace coproto
@@ -78,18 +79,18 @@ namespace coproto
 		struct SendAwaiterBase : macoro::basic_traceable
 		{
 			SockScheduler* mSock = nullptr;
-			SessionID mId;
+			SocketForkRef mFork;
 			macoro::stop_token mToken;
 			std::exception_ptr mExPtr;
-			SendAwaiterBase(SockScheduler* s, SessionID sid, macoro::stop_token&& token)
+			SendAwaiterBase(SockScheduler* s, SocketForkRef fork, macoro::stop_token&& token)
 				: mSock(s)
-				, mId(sid)
+				, mFork(fork)
 				, mToken(std::move(token))
 			{}
 
 			SendAwaiterBase(SendAwaiterBase&& other)
 				: mSock(other.mSock)
-				, mId(other.mId)
+				, mFork(other.mFork)
 				, mToken(std::move(other.mToken))
 			{
 				assert(!other.mExPtr);
@@ -106,14 +107,14 @@ namespace coproto
 			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise> h, std::source_location loc = std::source_location::current())
 			{
 				set_parent(macoro::detail::get_traceable(h), loc);
-				return mSock->send(mId, self().getBuffer(), coroutine_handle<>(h), std::move(mToken)).std_cast();
+				return mSock->send(mFork, self().getBuffer(), coroutine_handle<>(h), std::move(mToken)).std_cast();
 			}
 #endif
 			template<typename promise>
 			coroutine_handle<> await_suspend(coroutine_handle<promise> h, std::source_location loc = std::source_location::current())
 			{
 				set_parent(macoro::detail::get_traceable(h), loc);
-				return mSock->send(mId, self().getBuffer(), h, std::move(mToken));
+				return mSock->send(mFork, self().getBuffer(), h, std::move(mToken));
 			}
 
 			void await_resume()
@@ -139,19 +140,19 @@ namespace coproto
 		{
 		public:
 			SockScheduler* mSock = nullptr;
-			SessionID mId;
+			SocketForkRef mFork;
 			macoro::stop_token mToken;
 			std::exception_ptr mExPtr;
 
-			RecvAwaiterBase(SockScheduler* s, SessionID sid, macoro::stop_token&& token)
+			RecvAwaiterBase(SockScheduler* s, SocketForkRef fork, macoro::stop_token&& token)
 				: mSock(s)
-				, mId(sid)
+				, mFork(fork)
 				, mToken(std::move(token))
 			{}
 
 			RecvAwaiterBase(RecvAwaiterBase&& other)
 				: mSock(other.mSock)
-				, mId(other.mId)
+				, mFork(other.mFork)
 				, mToken(std::move(other.mToken))
 			{
 				assert(!other.mExPtr);
@@ -169,7 +170,7 @@ namespace coproto
 			{
 				set_parent(macoro::detail::get_traceable(h), loc);
 
-				return mSock->recv(mId, self().getBuffer(), coroutine_handle<>(h), std::move(mToken)).std_cast();
+				return mSock->recv(mFork, self().getBuffer(), coroutine_handle<>(h), std::move(mToken)).std_cast();
 			}
 #endif
 			template<typename promise>
@@ -178,7 +179,7 @@ namespace coproto
 				std::source_location loc = std::source_location::current())
 			{
 				set_parent(macoro::detail::get_traceable(h), loc);
-				return mSock->recv(mId, self().getBuffer(), h, std::move(mToken));
+				return mSock->recv(mFork, self().getBuffer(), h, std::move(mToken));
 			}
 
 			void await_resume()
@@ -203,13 +204,13 @@ namespace coproto
 			Container mContainer;
 			RefRecvBuffer<Container, allowResize> mRef;
 
-			MoveRecvAwaiter(SockScheduler* s, SessionID id, Container&& c, macoro::stop_token&& token)
-				: Base(s, id, std::move(token))
+			MoveRecvAwaiter(SockScheduler* s, SocketForkRef fork, Container&& c, macoro::stop_token&& token)
+				: Base(s, fork, std::move(token))
 				, mContainer(std::forward<Container>(c))
 				, mRef(mContainer, &this->mExPtr)
 			{}
-			MoveRecvAwaiter(SockScheduler* s, SessionID id, macoro::stop_token&& token)
-				: Base(s, id, std::move(token))
+			MoveRecvAwaiter(SockScheduler* s, SocketForkRef fork, macoro::stop_token&& token)
+				: Base(s, fork, std::move(token))
 				, mContainer()
 				, mRef(mContainer, &this->mExPtr)
 			{}
@@ -241,8 +242,8 @@ namespace coproto
 			Container& mContainer;
 			RefRecvBuffer<Container, allowResize> mRef;
 
-			RefRecvAwaiter(SockScheduler* s, SessionID id, Container& t, macoro::stop_token&& token)
-				: Base(s, id, std::move(token))
+			RefRecvAwaiter(SockScheduler* s, SocketForkRef fork, Container& t, macoro::stop_token&& token)
+				: Base(s, fork, std::move(token))
 				, mContainer(t)
 				, mRef(mContainer, &this->mExPtr)
 			{
@@ -263,6 +264,34 @@ namespace coproto
 		};
 
 
+		// receives one message into several containers. The size of the
+		// message must be the total size of the containers.
+		template<typename... Containers>
+		class MultiRefRecvAwaiter final : public RecvAwaiterBase<MultiRefRecvAwaiter<Containers...>>
+		{
+		public:
+			using Base = RecvAwaiterBase<MultiRefRecvAwaiter<Containers...>>;
+			RefRecvBuffers<sizeof...(Containers)> mRef;
+
+			MultiRefRecvAwaiter(SockScheduler* s, SocketForkRef fork, macoro::stop_token&& token, Containers&... c)
+				: Base(s, fork, std::move(token))
+				, mRef(&this->mExPtr, c...)
+			{
+#ifdef COPROTO_LOGGING
+				setName("recv_" + std::to_string(gProtoIdx++));
+#endif
+			}
+
+			MultiRefRecvAwaiter(MultiRefRecvAwaiter&& m)
+				: Base(std::move((Base&)m))
+				, mRef(m.mRef)
+			{
+				mRef.mExPtr = &this->mExPtr;
+			}
+
+			RecvBuffer* getBuffer() { return &mRef; }
+		};
+
 		template<typename Container>
 		class RefSendAwaiter final : public SendAwaiterBase<RefSendAwaiter<Container>>
 		{
@@ -270,8 +299,8 @@ namespace coproto
 			using Base = SendAwaiterBase<RefSendAwaiter<Container>>;
 			Container& mContainer;
 
-			RefSendAwaiter(SockScheduler* s, SessionID id, Container& t, macoro::stop_token&& token)
-				: Base(s, id, std::move(token))
+			RefSendAwaiter(SockScheduler* s, SocketForkRef fork, Container& t, macoro::stop_token&& token)
+				: Base(s, fork, std::move(token))
 				, mContainer(t)
 			{
 #ifdef COPROTO_LOGGING
@@ -303,15 +332,93 @@ namespace coproto
 		};
 
 
+		// sends several containers as one message. The message is
+		// the concatenation of the containers.
+		template<typename... Containers>
+		class MultiRefSendAwaiter final : public SendAwaiterBase<MultiRefSendAwaiter<Containers...>>
+		{
+		public:
+			using Base = SendAwaiterBase<MultiRefSendAwaiter<Containers...>>;
+			std::tuple<Containers&...> mContainers;
+
+			MultiRefSendAwaiter(SockScheduler* s, SocketForkRef fork, macoro::stop_token&& token, Containers&... c)
+				: Base(s, fork, std::move(token))
+				, mContainers(c...)
+			{
+#ifdef COPROTO_LOGGING
+				setName("send_" + std::to_string(gProtoIdx++));
+#endif
+			}
+
+			MultiRefSendAwaiter(MultiRefSendAwaiter&& m)
+				: Base(std::move((Base&)m))
+				, mContainers(m.mContainers)
+			{
+			}
+
+			RefSendBuffers<sizeof...(Containers)> getBuffer()
+			{
+				return std::apply([this](Containers&... c) {
+					return RefSendBuffers<sizeof...(Containers)>(&this->mExPtr, c...);
+					}, mContainers);
+			}
+
+			void await_resume()
+			{
+				if (this->mExPtr)
+				{
+					std::vector<std::source_location> stack;
+					this->get_call_stack(stack);
+					addTraceRethrow(this->mExPtr, stack);
+				}
+			}
+		};
+
+		// sends an empty message, see EmptySendBuffer.
+		class EmptySendAwaiter final : public SendAwaiterBase<EmptySendAwaiter>
+		{
+		public:
+			using Base = SendAwaiterBase<EmptySendAwaiter>;
+
+			EmptySendAwaiter(SockScheduler* s, SocketForkRef fork, macoro::stop_token&& token)
+				: Base(s, fork, std::move(token))
+			{
+#ifdef COPROTO_LOGGING
+				setName("send_" + std::to_string(gProtoIdx++));
+#endif
+			}
+
+			EmptySendAwaiter(EmptySendAwaiter&& m)
+				: Base(std::move((Base&)m))
+			{
+			}
+
+			EmptySendBuffer getBuffer()
+			{
+				return EmptySendBuffer(&this->mExPtr);
+			}
+
+			void await_resume()
+			{
+				if (this->mExPtr)
+				{
+					std::vector<std::source_location> stack;
+					this->get_call_stack(stack);
+					addTraceRethrow(this->mExPtr, stack);
+				}
+			}
+		};
+
 		template<typename Container>
 		class MoveSendAwaiter final : public SendAwaiterBase<MoveSendAwaiter<Container>>
 		{
 		public:
 			using Base = SendAwaiterBase<MoveSendAwaiter<Container>>;
 			Container mContainer;
+			SendCapacityWaiter mWaiter;
 
-			MoveSendAwaiter(SockScheduler* s, SessionID id, Container&& t, macoro::stop_token&& token)
-				: Base(s, id, std::move(token))
+			MoveSendAwaiter(SockScheduler* s, SocketForkRef fork, Container&& t, macoro::stop_token&& token)
+				: Base(s, fork, std::move(token))
 				, mContainer(std::move(t))
 			{
 #ifdef COPROTO_LOGGING
@@ -320,18 +427,32 @@ namespace coproto
 			}
 
 #ifdef COPROTO_CPP20
+			// The caller is resumed immediately unless the send buffer limits 
+			// have been exceeded, see Socket::setSendBufferLimit(...).
 			template<typename promise>
 			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise> h, std::source_location loc = std::source_location::current())
 			{
-				this->mSock->send(this->mId, getBuffer(), macoro::noop_coroutine(), std::move(this->mToken)).resume();
-				return h;
+				this->set_parent(macoro::detail::get_traceable(h), loc);
+				this->mSock->send(this->mFork, getBuffer(), macoro::noop_coroutine(), macoro::stop_token(this->mToken)).resume();
+				return this->mSock->waitForSendCapacity(this->mFork, mWaiter, coroutine_handle<>(h), std::move(this->mToken)).std_cast();
 			}
 #endif
 			template<typename promise>
 			coroutine_handle<> await_suspend(coroutine_handle<promise> h, std::source_location loc = std::source_location::current())
 			{
-				this->mSock->send(this->mId, getBuffer(), macoro::noop_coroutine(), std::move(this->mToken)).resume();
-				return h;
+				this->set_parent(macoro::detail::get_traceable(h), loc);
+				this->mSock->send(this->mFork, getBuffer(), macoro::noop_coroutine(), macoro::stop_token(this->mToken)).resume();
+				return this->mSock->waitForSendCapacity(this->mFork, mWaiter, h, std::move(this->mToken));
+			}
+
+			// the send itself has already been queued. Only the wait for 
+			// the send buffer to drain can fail here. The error is reported
+			// with the call stack like other send errors.
+			void await_resume()
+			{
+				if (mWaiter.mEC && !this->mExPtr)
+					this->mExPtr = std::make_exception_ptr(std::system_error(mWaiter.mEC));
+				Base::await_resume();
 			}
 
 
@@ -352,8 +473,21 @@ namespace coproto
 		{
 		public:
 			SockScheduler* mSock;
-			Flush(SockScheduler* s)
+
+			// the fork that awaits the flush.
+			SocketForkRef mFork;
+
+			// if set, only the operations of mFork are flushed. Otherwise 
+			// those of all forks.
+			bool mForkOnly;
+
+			// the node that the scheduler links into its waiting flushes.
+			FlushToken mToken;
+
+			Flush(SockScheduler* s, SocketForkRef fork, bool forkOnly)
 				:mSock(s)
+				,mFork(fork)
+				,mForkOnly(forkOnly)
 			{}
 
 			bool await_ready() { return false; }
@@ -362,19 +496,32 @@ namespace coproto
 			coroutine_handle<> await_suspend(coroutine_handle<promise> h, std::source_location loc = std::source_location::current())
 			{
 				set_parent(macoro::detail::get_traceable(h), loc);
-				return mSock->flush(h);
+				mToken.mHandle = h;
+				return mSock->flush(mToken, mFork, mForkOnly);
 			}
 #ifdef MACORO_CPP_20
 			template<typename promise>
 			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise> h, std::source_location loc = std::source_location::current())
 			{
 				set_parent(macoro::detail::get_traceable(h), loc);
-				auto h2 = coroutine_handle<>(h);
-				auto f = mSock->flush(h2);
+				mToken.mHandle = coroutine_handle<>(h);
+				auto f = mSock->flush(mToken, mFork, mForkOnly);
 				return f.std_cast();
 			}
 #endif
-			void await_resume() {};
+
+			// a send by reference that was issued while corked does not 
+			// wait for its message to be written, see Socket::cork(). If
+			// it fails, the error is reported here.
+			void await_resume()
+			{
+				if (mToken.mEC)
+				{
+					std::vector<std::source_location> stack;
+					get_call_stack(stack);
+					addTraceRethrow(std::make_exception_ptr(std::system_error(mToken.mEC)), stack);
+				}
+			}
 		};
 
 	}
@@ -14,9 +14,12 @@
 #include "coproto/Common/error_code.h"
 #include "coproto/Common/Function.h"
 #include "macoro/trace.h"
+#include <array>
+#include <vector>
 #include "macoro/stop.h"
 #include "coproto/Common/macoro.h"
 #include "coproto/Common/Exceptions.h"
+#include "coproto/Socket/Executor.h"
 
 namespace coproto
 {
@@ -195,6 +198,24 @@ namespace coproto
 			}
 
 			virtual span<u8> asSpan() = 0;
+
+			// the buffers that are sent as one message. By default
+			// this is the single buffer asSpan(), which is stored in
+			// single. The result is only valid while single is.
+			virtual span<span<u8>> asSpans(span<u8>& single)
+			{
+				single = asSpan();
+				return span<span<u8>>(&single, 1);
+			}
+
+			// the vector that holds the message if the buffer owns it.
+			// Sockets that support it can hand this vector to the other
+			// party instead of sending its bytes. 
+			virtual std::vector<u8>* ownedVector() { return nullptr; }
+
+			// true if the buffer holds the message, i.e. the caller does
+			// not have to keep it alive until it has been sent.
+			virtual bool owned() { return false; }
 		};
 
 		// Similar to a send buffer but does not provide storage.
@@ -213,6 +234,20 @@ namespace coproto
 					*mExPtr = std::make_exception_ptr(std::system_error(e));
 			}
 			virtual span<u8> asSpan(u64 resize) = 0;
+
+			// the buffers that one message is received into. By 
+			// default this is the single buffer asSpan(size), which
+			// is stored in single, see SendBuffer::asSpans(...).
+			virtual span<span<u8>> asSpans(u64 size, span<u8>& single)
+			{
+				single = asSpan(size);
+				return span<span<u8>>(&single, 1);
+			}
+
+			// take the ownership of the message msg, see 
+			// SendBuffer::ownedVector(). Returns false if the buffer 
+			// can not take it and the message must be copied.
+			virtual bool take(std::vector<u8>& msg) { return false; }
 		};
 
 
@@ -232,6 +267,16 @@ namespace coproto
 			{
 				return ::coproto::internal::asSpan(mCont);
 			}
+
+			std::vector<u8>* ownedVector() override
+			{
+				if constexpr (std::is_same<Container, std::vector<u8>>::value)
+					return &mCont;
+				else
+					return nullptr;
+			}
+
+			bool owned() override { return true; }
 		};
 
 		struct RefSendBuffer : public SendBuffer
@@ -249,6 +294,20 @@ namespace coproto
 			}
 		};
 
+		// an empty message. It is sent as a control block, see
+		// SendStream::finish(). Other buffers must not be empty.
+		struct EmptySendBuffer : public SendBuffer
+		{
+			EmptySendBuffer(std::exception_ptr* e)
+				: SendBuffer(e)
+			{}
+
+			span<u8> asSpan() override
+			{
+				return {};
+			}
+		};
+
 		template<typename Container, bool allowResize>
 		struct RefRecvBuffer : public RecvBuffer
 		{
@@ -274,23 +333,101 @@ namespace coproto
 				}
 				return r;
 			}
+
+			// a resizable vector simply becomes the message.
+			bool take(std::vector<u8>& msg) override
+			{
+				if constexpr (allowResize && std::is_same<Container, std::vector<u8>>::value)
+				{
+					mData = std::move(msg);
+					return true;
+				}
+				else
+					return false;
+			}
 		};
 
-		// an operation that can be queued. Its is simply a callback.
-		// it is used to check when all pending operations are completed.
-		struct FlushToken
+		// several buffers that are sent as one message. The 
+		// message is the concatenation of the buffers.
+		template<u64 N>
+		struct RefSendBuffers : public SendBuffer
 		{
-			// the callback
-			coroutine_handle<> mHandle;
+			template<typename... Containers>
+			RefSendBuffers(std::exception_ptr* e, Containers&... c)
+				: SendBuffer(e)
+				, mData{ coproto::internal::asSpan(c)... }
+			{}
 
-			FlushToken(coroutine_handle<> h) :mHandle(h) {
-				assert(mHandle);
+			std::array<span<u8>, N> mData;
+
+			// must not be called, the buffers are accessed with asSpans(...).
+			span<u8> asSpan() override
+			{
+				COPROTO_ASSERT_MSG(false, "the buffers must be accessed with asSpans(...)");
+				return {};
 			}
-			~FlushToken()
+
+			span<span<u8>> asSpans(span<u8>&) override
 			{
-				assert(!mHandle);
+				return mData;
 			}
 		};
 
+		// several buffers that one message is received into. The
+		// size of the message must match the total size of the 
+		// buffers. The buffers are not resized.
+		template<u64 N>
+		struct RefRecvBuffers : public RecvBuffer
+		{
+			template<typename... Containers>
+			RefRecvBuffers(std::exception_ptr* e, Containers&... c)
+				: RecvBuffer(e)
+				, mData{ coproto::internal::asSpan(c)... }
+			{}
+
+			std::array<span<u8>, N> mData;
+
+			// must not be called, the buffers are accessed with asSpans(...).
+			span<u8> asSpan(u64) override
+			{
+				COPROTO_ASSERT_MSG(false, "the buffers must be accessed with asSpans(...)");
+				return {};
+			}
+
+			span<span<u8>> asSpans(u64 size, span<u8>&) override
+			{
+				u64 total = 0;
+				for (auto& d : mData)
+					total += d.size();
+
+				if (total != size)
+				{
+					COPROTO_ASSERT(mExPtr);
+					*mExPtr = std::make_exception_ptr(BadReceiveBufferSize(total, size));
+					mExPtr = nullptr;
+					return {};
+				}
+				return mData;
+			}
+		};
+
+		// a flush that is waiting for the pending operations to complete,
+		// see FlushEpochs. The tokens of an epoch form an intrusive list.
+		struct FlushToken
+		{
+			// the callback
+			coroutine_handle<> mHandle;
+
+			FlushToken* mNext = nullptr;
+
+			// the executor of the socket that awaits the flush. It is 
+			// resumed on it.
+			ExecutorRef mExecutor;
+
+			// the error of a send that the caller no longer waited 
+			// for, see FlushEpochs::fail(...).
+			error_code mEC;
+		};
+
 	}
 }
\ No newline at end of file
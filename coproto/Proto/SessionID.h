@@ -37,7 +37,15 @@ namespace coproto
 		SessionID(const SessionID&) = default;
 		SessionID& operator=(const SessionID&) = default;
 
+		// returns the next child id and advances mChildIdx.
 		SessionID derive()
+		{
+			return derive(mChildIdx++);
+		}
+
+		// returns the child id with index childIdx. Does not
+		// change this id.
+		SessionID derive(u64 childIdx) const
 		{
 
 			auto bHash = [](u64 v)
@@ -54,12 +62,11 @@ namespace coproto
 			{
 				u64& l = ret.mVal[(i & 1) ^ 0];
 				u64& r = ret.mVal[(i & 1) ^ 1];
-				l = bHash(r + mChildIdx + 32243534) ^ l ^ 9478532833;
+				l = bHash(r + childIdx + 32243534) ^ l ^ 9478532833;
 			}
 			ret.mVal[0] ^= mVal[0];
 			ret.mVal[1] ^= mVal[1];
 
-			++mChildIdx;
 			return ret;
 		}
 
@@ -71,6 +78,17 @@ namespace coproto
 		}
 		bool operator!=(const SessionID& o) const { return !(*this == o); }
 
+		// a hash of both words. Derived ids are already well mixed but
+		// user provided ids, e.g. root(), might not be.
+		u64 hash() const
+		{
+			u64 h = mVal[0] ^ (mVal[1] * 0x9e3779b97f4a7c15ull);
+			h ^= h >> 32;
+			h *= 0xd6e8feb86659fd93ull;
+			h ^= h >> 32;
+			return h;
+		}
+
 
 		static SessionID random()
 		{
@@ -108,6 +126,6 @@ struct std::hash<coproto::SessionID>
 {
 	std::size_t operator()(coproto::SessionID const& s) const noexcept
 	{
-		return s.mVal[0];
+		return s.hash();
 	}
 };
@@ -165,6 +165,40 @@ namespace coproto
 #endif
 		};
 
+		// Adapts a span<span<u8>> to an asio buffer sequence. This allows
+		// vectored operations to be passed to async_write and async_read
+		// without copying the buffer list. Buffer should be either
+		// boost::asio::const_buffer or boost::asio::mutable_buffer.
+		template<typename Buffer>
+		struct BufferSequence
+		{
+			struct const_iterator
+			{
+				using iterator_category = std::bidirectional_iterator_tag;
+				using value_type = Buffer;
+				using difference_type = std::ptrdiff_t;
+				using pointer = const Buffer*;
+				using reference = Buffer;
+
+				const span<u8>* mPtr = nullptr;
+
+				Buffer operator*() const { return Buffer(mPtr->data(), mPtr->size()); }
+				const_iterator& operator++() { ++mPtr; return *this; }
+				const_iterator operator++(int) { auto r = *this; ++mPtr; return r; }
+				const_iterator& operator--() { --mPtr; return *this; }
+				const_iterator operator--(int) { auto r = *this; --mPtr; return r; }
+				bool operator==(const const_iterator& o) const { return mPtr == o.mPtr; }
+				bool operator!=(const const_iterator& o) const { return mPtr != o.mPtr; }
+			};
+
+			using value_type = Buffer;
+
+			span<span<u8>> mBuffers;
+
+			const_iterator begin() const { return { mBuffers.data() }; }
+			const_iterator end() const { return { mBuffers.data() + mBuffers.size() }; }
+		};
+
 		template<typename SocketType = boost::asio::ip::tcp::socket>
 		struct AsioSocket : public Socket
 		{
@@ -201,8 +235,20 @@ namespace coproto
 
 
 				Awaiter(Sock* ss, span<u8> dd, bool send, macoro::stop_token&& t, i64 idx = 0)
+					: Awaiter(ss, dd, {}, send, std::move(t), idx)
+				{}
+
+				// A vectored operation. All of the buffers are sent/received as a
+				// single asio operation.
+				Awaiter(Sock* ss, span<span<u8>> buffers, bool send, macoro::stop_token&& t, i64 idx = 0)
+					: Awaiter(ss, buffers.size() ? buffers[0] : span<u8>{}, buffers, send, std::move(t), idx)
+				{}
+
+				Awaiter(Sock* ss, span<u8> dd, span<span<u8>> buffers, bool send, macoro::stop_token&& t, i64 idx, bool some = false)
 					: mSock(ss)
 					, mData(dd)
+					, mBuffers(buffers)
+					, mSome(some)
 					, mType(send ? Type::send : Type::recv)
 					, mCancellationRequested(false)
 					, mSynchronousFlag(false)
@@ -213,7 +259,7 @@ namespace coproto
 					, mIdx(idx)
 #endif
 				{
-					COPROTO_ASSERT(dd.size());
+					COPROTO_ASSERT(dd.size() || buffers.size());
 					if (mToken.stop_possible())
 					{
 						mReg.emplace(mToken, [this] {
@@ -229,6 +275,14 @@ namespace coproto
 
 				Sock* mSock;
 				span<u8> mData;
+
+				// if non-empty, the operation is vectored and these 
+				// are the buffers. mData is then the first buffer.
+				span<span<u8>> mBuffers;
+
+				// if true, the receive completes once some data has 
+				// been read, i.e. async_read_some is used.
+				bool mSome = false;
 				u64 mBt = 0;
 				enum Type { send, recv };
 				Type mType;
@@ -371,6 +425,17 @@ namespace coproto
 				Awaiter send(span<u8> data, macoro::stop_token token, u64 idx) { return Awaiter(this, data, true, std::move(token), idx); };
 				Awaiter recv(span<u8> data, macoro::stop_token token, u64 idx) { return Awaiter(this, data, false, std::move(token), idx); };
 
+				// optional scatter/gather interface. The buffers are written/read 
+				// with a single async_write/async_read.
+				Awaiter sendv(span<span<u8>> data, macoro::stop_token token = {}) { return Awaiter(this, data, true, std::move(token)); };
+				Awaiter recvv(span<span<u8>> data, macoro::stop_token token = {}) { return Awaiter(this, data, false, std::move(token)); };
+
+				// optional partial receive. Completes once some data has been read.
+				Awaiter recvSome(span<u8> data, macoro::stop_token token = {}) 
+				{
+					return Awaiter(this, data, {}, false, std::move(token), 0, true);
+				};
+
 #ifdef COPROTO_ASIO_LOG
 				void log(std::string msg)
 				{
@@ -470,33 +535,30 @@ namespace coproto
 						std::terminate();
 #endif
 
+					auto handler = boost::asio::bind_cancellation_slot(
+						mCancelSignal.slot(),
+						[this,
+						lt0 = mSock->mState->mOpCount.lock(),
+						lt1 = mActiveCount.lock()
+						](boost::system::error_code error, std::size_t n) mutable {
+							callback(error, n, std::move(lt0), std::move(lt1));
+						});
+
 					if (mType == Type::send)
 					{
-						async_write(mSock->mState->mSock_, boost::asio::const_buffer(mData.data(), mData.size()),
-							boost::asio::bind_cancellation_slot(
-								mCancelSignal.slot(),
-								[this,
-								lt0 = mSock->mState->mOpCount.lock(),
-								lt1 = mActiveCount.lock()
-								](boost::system::error_code error, std::size_t n) mutable {
-									callback(error, n, std::move(lt0), std::move(lt1));
-								}
-						));
+						if (mBuffers.size())
+							async_write(mSock->mState->mSock_, BufferSequence<const_buffer>{ mBuffers }, std::move(handler));
+						else
+							async_write(mSock->mState->mSock_, const_buffer(mData.data(), mData.size()), std::move(handler));
 					}
 					else
 					{
-						async_read(mSock->mState->mSock_, boost::asio::mutable_buffer(mData.data(), mData.size()),
-							boost::asio::bind_cancellation_slot(
-								mCancelSignal.slot(),
-								[this,
-								lt0 = mSock->mState->mOpCount.lock(),
-								lt1 = mActiveCount.lock()
-								](boost::system::error_code error, std::size_t n) mutable {
-
-									callback(error, n, std::move(lt0), std::move(lt1));
-
-								}
-						));
+						if (mBuffers.size())
+							async_read(mSock->mState->mSock_, BufferSequence<mutable_buffer>{ mBuffers }, std::move(handler));
+						else if (mSome)
+							mSock->mState->mSock_.async_read_some(mutable_buffer(mData.data(), mData.size()), std::move(handler));
+						else
+							async_read(mSock->mState->mSock_, mutable_buffer(mData.data(), mData.size()), std::move(handler));
 					}
 
 #ifdef COPROTO_ASIO_DEBUG
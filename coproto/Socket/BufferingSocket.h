@@ -87,7 +87,12 @@ namespace coproto
 		struct SendRecvAwaiter
 		{
 
-			SendRecvAwaiter(SockImpl* ss, span<u8> dd, bool send, macoro::stop_token&& t);
+			SendRecvAwaiter(SockImpl* ss, span<u8> dd, bool send, macoro::stop_token&& t)
+				: SendRecvAwaiter(ss, dd, {}, send, std::move(t))
+			{}
+
+			// A vectored operation where the data is dd followed by the buffers in rest.
+			SendRecvAwaiter(SockImpl* ss, span<u8> dd, span<span<u8>> rest, bool send, macoro::stop_token&& t);
 
 			// The socket that the operation is performed on.
 			SockImpl* mSock;
@@ -95,6 +100,12 @@ namespace coproto
 			// The data to be sent or received.
 			span<u8> mData;
 
+			// For vectored operations, the buffers that follow mData.
+			span<span<u8>> mRest;
+
+			// The total number of bytes to be sent or received.
+			u64 mSize;
+
 			enum Type { send, recv };
 
 			// the type of operation.
@@ -131,7 +142,7 @@ namespace coproto
 			// of bytes that were sent or received.
 			std::pair<error_code, u64> await_resume() {
 				COPROTO_ASSERT(mEc);
-				auto bt = (!*mEc) ? mData.size() : 0;
+				auto bt = (!*mEc) ? mSize : 0;
 				return { *mEc, bt };
 			}
 
@@ -198,6 +209,27 @@ namespace coproto
 			}
 
 
+			// add all of the buffers to the buffer as a single chunk.
+			void push(span<u8> data, span<span<u8>> rest)
+			{
+				if (rest.size() == 0)
+					return push(data);
+
+				auto n = data.size();
+				for (auto& r : rest)
+					n += r.size();
+
+				mData.emplace_back();
+				auto& b = mData.back();
+				b.reserve(n);
+				b.insert(b.end(), data.begin(), data.end());
+				for (auto& r : rest)
+					b.insert(b.end(), r.begin(), r.end());
+
+				mSize += n;
+				size();
+			}
+
 			// add the data to the buffer.
 			void push(Buffer&& data)
 			{
@@ -252,6 +284,10 @@ namespace coproto
 
 			SendRecvAwaiter send(span<u8> data, macoro::stop_token token = {}) { return SendRecvAwaiter(this, data, true, std::move(token)); };
 			SendRecvAwaiter recv(span<u8> data, macoro::stop_token token = {}) { return SendRecvAwaiter(this, data, false, std::move(token)); };
+
+			// optional scatter/gather interface. The buffers are sent/received as a single operation.
+			SendRecvAwaiter sendv(span<span<u8>> data, macoro::stop_token token = {}) { return SendRecvAwaiter(this, data[0], data.subspan(1), true, std::move(token)); };
+			SendRecvAwaiter recvv(span<span<u8>> data, macoro::stop_token token = {}) { return SendRecvAwaiter(this, data[0], data.subspan(1), false, std::move(token)); };
 		};
 
 
@@ -265,9 +301,11 @@ namespace coproto
 
 				mSock->mInboundBuffer_.push(data);
 
-				if (mSock->mInbound_ && (mSock->mInbound_->mData.size() <= mSock->mInboundBuffer_.size()))
+				if (mSock->mInbound_ && (mSock->mInbound_->mSize <= mSock->mInboundBuffer_.size()))
 				{
 					mSock->mInboundBuffer_.pop(mSock->mInbound_->mData);
+					for (auto& r : mSock->mInbound_->mRest)
+						mSock->mInboundBuffer_.pop(r);
 					mSock->mInbound_->mEc = code::success;
 					cb = mSock->mInbound_->mHandle;
 					mSock->mInbound_ = nullptr;
@@ -348,13 +386,17 @@ namespace coproto
 	};
 
 
-	inline BufferingSocket::SendRecvAwaiter::SendRecvAwaiter(SockImpl* ss, span<u8> dd, bool send, macoro::stop_token&& t)
+	inline BufferingSocket::SendRecvAwaiter::SendRecvAwaiter(SockImpl* ss, span<u8> dd, span<span<u8>> rest, bool send, macoro::stop_token&& t)
 		: mSock(ss)
 		, mData(dd)
+		, mRest(rest)
+		, mSize(dd.size())
 		, mType(send ? Type::send : Type::recv)
 		, mToken(t)
 	{
-		COPROTO_ASSERT(dd.size());
+		for (auto& r : mRest)
+			mSize += r.size();
+		COPROTO_ASSERT(mSize);
 		if (mToken.stop_possible())
 		{
 			//register the cancellation callback.
@@ -464,7 +506,7 @@ namespace coproto
 					// simply adding the data to our internal buffer.
 
 					//mSock->mLog.push_back("send " + hex(mData));
-					mSock->mOutboundBuffer_.push(mData);
+					mSock->mOutboundBuffer_.push(mData, mRest);
 					mEc = code::success;
 					c1 = h;
 
@@ -474,10 +516,12 @@ namespace coproto
 					// receive operations complete synchronously if we have 
 					// the requested data in our internal buffer. Otherwise
 					// we record the request as mSock->mInbound and suspend.
-					if (mSock->mInboundBuffer_.size() >= mData.size())
+					if (mSock->mInboundBuffer_.size() >= mSize)
 					{
 						//mSock->mLog.push_back("pop " + hex(mData));
 						mSock->mInboundBuffer_.pop(mData);
+						for (auto& r : mRest)
+							mSock->mInboundBuffer_.pop(r);
 						mEc = code::success;
 						c1 = h;
 					}
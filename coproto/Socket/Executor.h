@@ -14,6 +14,7 @@
 #include "coproto/Common/macoro.h"
 #include <vector>
 #include <mutex>
+#include <thread>
 
 namespace coproto
 {
@@ -21,7 +22,57 @@ namespace coproto
 	namespace internal
 	{
 		;
-		using Lock = std::unique_lock<std::recursive_mutex>;
+
+		// The mutex of a SockScheduler. A single threaded scheduler does 
+		// not lock. Debug builds (NDEBUG not defined) then check that it 
+		// is only used by the thread that created it. The mode is chosen
+		// at run time so that the scheduler is not a template. This costs
+		// a well predicted branch on each lock() and unlock(). The 
+		// ExecutionQueue is still acquired and released since it also 
+		// keeps completions from resuming each other recursively.
+		class SchedulerMutex
+		{
+		public:
+			void lock()
+			{
+				if (mSingleThreaded)
+				{
+#ifndef NDEBUG
+					COPROTO_ASSERT_MSG(mOwner == std::this_thread::get_id(),
+						"a single threaded socket was used by another thread.");
+#endif
+				}
+				else
+					mMutex.lock();
+			}
+
+			void unlock()
+			{
+				if (!mSingleThreaded)
+					mMutex.unlock();
+			}
+
+			// stop locking. Must be called before the mutex is used and 
+			// by the thread that will use it.
+			void setSingleThreaded()
+			{
+				mSingleThreaded = true;
+#ifndef NDEBUG
+				mOwner = std::this_thread::get_id();
+#endif
+			}
+
+			bool singleThreaded() const { return mSingleThreaded; }
+
+		private:
+			std::recursive_mutex mMutex;
+			bool mSingleThreaded = false;
+#ifndef NDEBUG
+			std::thread::id mOwner;
+#endif
+		};
+
+		using Lock = std::unique_lock<SchedulerMutex>;
 
 		// allows to schedule coro's on an type erased 
 		// executor. The call operator on this class
@@ -155,6 +206,7 @@ namespace coproto
 						mVec = mVecBacking;
 						mHead = mHead - mTail;
 						mTail = 0;
+						mask = mVec.size() - 1;
 					}
 				}
 
@@ -225,7 +277,7 @@ namespace coproto
 				CBQueue<unique_function<void()>> mFns;
 
 				// a mutex that the constructor should provide.
-				std::recursive_mutex* mMtx = nullptr;
+				SchedulerMutex* mMtx = nullptr;
 
 
 
@@ -235,7 +287,7 @@ namespace coproto
 
 		public:
 
-			void setMutex(std::recursive_mutex& mtx)
+			void setMutex(SchedulerMutex& mtx)
 			{
 				mState->mMtx = &mtx;
 			}
@@ -322,7 +374,7 @@ namespace coproto
 					{
 						if(mCBs.size() == 0 && mFns.size() == 0)
 						{
-							std::unique_lock<std::recursive_mutex> l(*mEx->mMtx);
+							Lock l(*mEx->mMtx);
 							std::swap(mEx->mCBs, mCBs);
 							std::swap(mEx->mFns, mFns);
 							if (mCBs.size() == 0 && mFns.size() == 0)
@@ -374,7 +426,7 @@ namespace coproto
 				}
 			};
 
-			Handle acquire(std::unique_lock<std::recursive_mutex>& l)
+			Handle acquire(Lock& l)
 			{
 				assert(mState->mMtx == nullptr || mState->mMtx == l.mutex());
 				return Handle(mState, l);
@@ -383,4 +435,9 @@ namespace coproto
 		};
 
 	}
+
+	namespace tests
+	{
+		void CBQueue_test();
+	}
 }
\ No newline at end of file
@@ -0,0 +1,649 @@
+#include "IoUringSocket.h"
+#ifdef COPROTO_HAS_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cassert>
+#include <cstring>
+#include <system_error>
+
+namespace coproto
+{
+	namespace
+	{
+		// user_data values that do not refer to an operation.
+		enum : u64
+		{
+			WakeTag = 0,
+			CancelTag = 1
+		};
+
+		// fill in the sqe for op, a cancel of op or a wake up.
+		void fillSqe(io_uring_sqe& sqe, detail::IoUringOp* op, u64 userData)
+		{
+			if (userData == WakeTag)
+				sqe.opcode = IORING_OP_NOP;
+			else if (userData == CancelTag)
+			{
+				sqe.opcode = IORING_OP_ASYNC_CANCEL;
+				sqe.addr = (u64)op;
+			}
+			else
+				op->prep(sqe);
+			sqe.user_data = userData;
+		}
+
+		int io_uring_setup(u32 entries, io_uring_params* p)
+		{
+			return (int)::syscall(__NR_io_uring_setup, entries, p);
+		}
+
+		int io_uring_enter(int fd, u32 toSubmit, u32 minComplete, u32 flags)
+		{
+			return (int)::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+		}
+
+		int io_uring_register(int fd, u32 opcode, const void* arg, u32 nrArgs)
+		{
+			return (int)::syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+		}
+
+		void throwLastError(const char* what)
+		{
+			throw std::system_error(errno, std::system_category(), what);
+		}
+	}
+
+	namespace detail
+	{
+		optional<IoUringContext> global_io_uring_context;
+		std::mutex global_io_uring_context_mutex;
+	}
+
+	IoUringContext& global_io_uring_context()
+	{
+		std::lock_guard<std::mutex> lock(detail::global_io_uring_context_mutex);
+		if (!detail::global_io_uring_context)
+			detail::global_io_uring_context.emplace();
+		return *detail::global_io_uring_context;
+	}
+
+	// the memory mapped submission and completion queues.
+	struct IoUringContext::Ring
+	{
+		int mFd = -1;
+		void* mSq = MAP_FAILED, * mCq = MAP_FAILED, * mSqesPtr = MAP_FAILED;
+		u64 mSqSize = 0, mCqSize = 0, mSqesSize = 0;
+
+		u32* mSqHead, * mSqTail, * mSqMask, * mSqArray;
+		u32 mSqEntries;
+		io_uring_sqe* mSqes;
+
+		u32* mCqHead, * mCqTail, * mCqMask;
+		io_uring_cqe* mCqes;
+
+		// the tail that has not yet been published.
+		u32 mLocalTail = 0;
+
+		Ring(u32 entries)
+		{
+			io_uring_params p;
+			std::memset(&p, 0, sizeof(p));
+			mFd = io_uring_setup(entries, &p);
+			if (mFd < 0)
+				throwLastError("io_uring_setup");
+
+			mSqSize = p.sq_off.array + p.sq_entries * sizeof(u32);
+			mCqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+			if (p.features & IORING_FEAT_SINGLE_MMAP)
+				mSqSize = mCqSize = std::max(mSqSize, mCqSize);
+
+			mSq = ::mmap(nullptr, mSqSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+			if (mSq == MAP_FAILED)
+				throwLastError("mmap");
+
+			if (p.features & IORING_FEAT_SINGLE_MMAP)
+				mCq = mSq;
+			else
+			{
+				mCq = ::mmap(nullptr, mCqSize, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+				if (mCq == MAP_FAILED)
+					throwLastError("mmap");
+			}
+
+			mSqesSize = p.sq_entries * sizeof(io_uring_sqe);
+			mSqesPtr = ::mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+			if (mSqesPtr == MAP_FAILED)
+				throwLastError("mmap");
+
+			auto sq = (u8*)mSq;
+			mSqHead = (u32*)(sq + p.sq_off.head);
+			mSqTail = (u32*)(sq + p.sq_off.tail);
+			mSqMask = (u32*)(sq + p.sq_off.ring_mask);
+			mSqArray = (u32*)(sq + p.sq_off.array);
+			mSqEntries = p.sq_entries;
+			mSqes = (io_uring_sqe*)mSqesPtr;
+			mLocalTail = *mSqTail;
+
+			auto cq = (u8*)mCq;
+			mCqHead = (u32*)(cq + p.cq_off.head);
+			mCqTail = (u32*)(cq + p.cq_off.tail);
+			mCqMask = (u32*)(cq + p.cq_off.ring_mask);
+			mCqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+		}
+
+		~Ring()
+		{
+			if (mSqesPtr != MAP_FAILED)
+				::munmap(mSqesPtr, mSqesSize);
+			if (mCq != MAP_FAILED && mCq != mSq)
+				::munmap(mCq, mCqSize);
+			if (mSq != MAP_FAILED)
+				::munmap(mSq, mSqSize);
+			if (mFd >= 0)
+				::close(mFd);
+		}
+
+		u32 sqSpace() const
+		{
+			return mSqEntries - (mLocalTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE));
+		}
+	};
+
+	IoUringContext::IoUringContext(u32 entries, bool reaperThread, u32 maxFiles)
+		: mRing(new Ring(entries))
+		, mReaper(reaperThread)
+	{
+		// a sparse fixed file table that sockets are installed into.
+		// If this fails, e.g. on an old kernel, the plain fds are used.
+		std::vector<int> files(maxFiles, -1);
+		if (maxFiles && io_uring_register(mRing->mFd, IORING_REGISTER_FILES, files.data(), maxFiles) == 0)
+		{
+			mFreeFiles.reserve(maxFiles);
+			for (u32 i = maxFiles; i; --i)
+				mFreeFiles.push_back(i - 1);
+		}
+
+		if (mReaper)
+			mThread = std::thread([this] { run(); });
+	}
+
+	IoUringContext::~IoUringContext()
+	{
+		if (mReaper)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mMtx);
+				mStop = true;
+				queueSqe(nullptr, WakeTag);
+				submit();
+			}
+			mThread.join();
+		}
+	}
+
+	void IoUringContext::registerBuffers(span<span<u8>> buffers)
+	{
+		std::vector<iovec> iov(buffers.size());
+		for (u64 i = 0; i < buffers.size(); ++i)
+		{
+			iov[i].iov_base = buffers[i].data();
+			iov[i].iov_len = buffers[i].size();
+		}
+		if (io_uring_register(mRing->mFd, IORING_REGISTER_BUFFERS, iov.data(), iov.size()))
+			throwLastError("io_uring_register");
+
+		std::lock_guard<std::mutex> lock(mMtx);
+		mBuffers.assign(buffers.begin(), buffers.end());
+	}
+
+	i32 IoUringContext::bufferIndex(span<u8> data) const
+	{
+		for (u64 i = 0; i < mBuffers.size(); ++i)
+		{
+			if (data.data() >= mBuffers[i].data() &&
+				data.data() + data.size() <= mBuffers[i].data() + mBuffers[i].size())
+				return (i32)i;
+		}
+		return -1;
+	}
+
+	u32 IoUringContext::installFile(int fd)
+	{
+		std::lock_guard<std::mutex> lock(mMtx);
+		if (mFreeFiles.empty())
+			return ~0u;
+
+		auto slot = mFreeFiles.back();
+		io_uring_files_update up;
+		std::memset(&up, 0, sizeof(up));
+		up.offset = slot;
+		up.fds = (u64)&fd;
+		if (io_uring_register(mRing->mFd, IORING_REGISTER_FILES_UPDATE, &up, 1) != 1)
+			return ~0u;
+
+		mFreeFiles.pop_back();
+		return slot;
+	}
+
+	void IoUringContext::removeFile(u32 slot)
+	{
+		if (slot == ~0u)
+			return;
+
+		int fd = -1;
+		io_uring_files_update up;
+		std::memset(&up, 0, sizeof(up));
+		up.offset = slot;
+		up.fds = (u64)&fd;
+		io_uring_register(mRing->mFd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+
+		std::lock_guard<std::mutex> lock(mMtx);
+		mFreeFiles.push_back(slot);
+	}
+
+	io_uring_sqe* IoUringContext::nextSqe()
+	{
+		// submitting frees the entries of the queued sqes. This fails 
+		// if the completion queue is full. 
+		if (mRing->sqSpace() == 0)
+			submit();
+		return freeSqe();
+	}
+
+	io_uring_sqe* IoUringContext::freeSqe()
+	{
+		auto& r = *mRing;
+		if (r.sqSpace() == 0)
+			return nullptr;
+
+		auto idx = r.mLocalTail & *r.mSqMask;
+		auto& sqe = r.mSqes[idx];
+		std::memset(&sqe, 0, sizeof(sqe));
+		r.mSqArray[idx] = idx;
+		++r.mLocalTail;
+		++mToSubmit;
+		return &sqe;
+	}
+
+	void IoUringContext::queueSqe(detail::IoUringOp* op, u64 userData)
+	{
+		// the sqes are not reordered with the backlog.
+		auto sqe = mBacklog.empty() ? nextSqe() : nullptr;
+		if (sqe)
+			fillSqe(*sqe, op, userData);
+		else
+			mBacklog.push_back({ op, userData });
+	}
+
+	void IoUringContext::push(detail::IoUringOp& op)
+	{
+		// a backlogged operation counts as in flight. It can 
+		// then be canceled like any other.
+		op.mInFlight = true;
+		op.mFd->mInFlight[op.mDirection] = &op;
+		queueSqe(&op, (u64)&op);
+	}
+
+	u64 IoUringContext::drainBacklog()
+	{
+		// an operation that was canceled while backlogged is followed 
+		// by its cancel and thus completes like any other.
+		u64 n = 0;
+		while (mBacklog.size())
+		{
+			auto sqe = freeSqe();
+			if (sqe == nullptr)
+				break;
+			auto b = mBacklog.front();
+			mBacklog.pop_front();
+			fillSqe(*sqe, b.mOp, b.mUserData);
+			++n;
+		}
+		return n;
+	}
+
+	void IoUringContext::submit()
+	{
+		mSubmitRetry = false;
+		do
+		{
+			// make the filled in sqes visible to the kernel.
+			__atomic_store_n(mRing->mSqTail, mRing->mLocalTail, __ATOMIC_RELEASE);
+			while (mToSubmit)
+			{
+				auto r = io_uring_enter(mRing->mFd, mToSubmit, 0, 0);
+				if (r < 0)
+				{
+					if (errno == EINTR)
+						continue;
+
+					// the completion queue is full. The reaper submits 
+					// the remainder once it has made room. EAGAIN means
+					// that the kernel is out of resources, the reaper 
+					// then retries after a short sleep.
+					if (errno == EAGAIN || errno == EBUSY)
+					{
+						mSubmitRetry = errno == EAGAIN;
+						return;
+					}
+					std::terminate();
+				}
+				mToSubmit -= r;
+			}
+
+			// the kernel has consumed the sqes. The backlog takes 
+			// their entries. Thus the backlog is only non-empty while
+			// the kernel does not accept sqes.
+		} while (drainBacklog());
+	}
+
+	bool IoUringContext::start(detail::IoUringOp& op)
+	{
+		std::lock_guard<std::mutex> lock(mMtx);
+		if (op.mCanceled || op.mFd->mClosed)
+		{
+			op.mEc = code::operation_aborted;
+			return true;
+		}
+
+		push(op);
+		if (mReaper)
+			submit();
+		return false;
+	}
+
+	void IoUringContext::cancel(detail::IoUringOp& op)
+	{
+		std::lock_guard<std::mutex> lock(mMtx);
+		op.mCanceled = true;
+		if (op.mInFlight)
+		{
+			// cancellation is not deferred to the next poll().
+			queueSqe(&op, CancelTag);
+			submit();
+		}
+	}
+
+	void IoUringContext::close(detail::IoUringFd& fd)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMtx);
+			fd.mClosed = true;
+			for (auto op : fd.mInFlight)
+			{
+				if (op)
+					queueSqe(op, CancelTag);
+			}
+			submit();
+		}
+
+		if (fd.mIsSocket)
+			::shutdown(fd.mFd, SHUT_RDWR);
+	}
+
+	u64 IoUringContext::reap(std::vector<detail::IoUringOp*>& completed)
+	{
+		auto& r = *mRing;
+		u64 n = 0;
+		std::lock_guard<std::mutex> lock(mMtx);
+
+		auto head = *r.mCqHead;
+		auto tail = __atomic_load_n(r.mCqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head)
+		{
+			auto cqe = r.mCqes[head & *r.mCqMask];
+			if (cqe.user_data == WakeTag || cqe.user_data == CancelTag)
+				continue;
+
+			++n;
+			auto op = (detail::IoUringOp*)cqe.user_data;
+			op->mInFlight = false;
+			op->mFd->mInFlight[op->mDirection] = nullptr;
+
+			auto done = op->onResult(cqe.res);
+			if (!done && (op->mCanceled || op->mFd->mClosed))
+			{
+				op->mEc = code::operation_aborted;
+				done = true;
+			}
+
+			if (done)
+			{
+				// errors caused by close() are reported as aborts.
+				if (op->mEc && op->mFd->mClosed)
+					op->mEc = code::operation_aborted;
+				completed.push_back(op);
+			}
+			else
+				push(*op);
+		}
+		__atomic_store_n(r.mCqHead, head, __ATOMIC_RELEASE);
+
+		// the completion queue now has room.
+		if (mReaper)
+			submit();
+		else
+			drainBacklog();
+		return n;
+	}
+
+	u64 IoUringContext::poll(bool wait)
+	{
+		assert(mReaper == false);
+
+		u32 toSubmit;
+		{
+			std::lock_guard<std::mutex> lock(mMtx);
+			__atomic_store_n(mRing->mSqTail, mRing->mLocalTail, __ATOMIC_RELEASE);
+			toSubmit = std::exchange(mToSubmit, 0);
+		}
+
+		// a single syscall for all of the queued operations.
+		auto r = io_uring_enter(mRing->mFd, toSubmit,
+			wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+		auto submitted = r < 0 ? 0 : std::min<u32>(r, toSubmit);
+		if (submitted != toSubmit)
+		{
+			std::lock_guard<std::mutex> lock(mMtx);
+			mToSubmit += toSubmit - submitted;
+		}
+
+		std::vector<detail::IoUringOp*> completed;
+		auto n = reap(completed);
+		for (auto op : completed)
+			op->mHandle.resume();
+		return n;
+	}
+
+	void IoUringContext::run()
+	{
+		std::vector<detail::IoUringOp*> completed;
+		bool retry = false;
+		while (true)
+		{
+			// the reaper blocks until there is a completion. sqes that
+			// are waiting for room are submitted by whoever makes room,
+			// see submit(). If the kernel refused them for lack of 
+			// completion queue entries, reaping makes room. If it is out 
+			// of resources, they are retried after a short sleep.
+			if (retry)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			auto r = io_uring_enter(mRing->mFd, 0, retry ? 0 : 1, IORING_ENTER_GETEVENTS);
+			if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				std::terminate();
+
+			reap(completed);
+			for (auto op : completed)
+				op->mHandle.resume();
+			completed.clear();
+
+			std::lock_guard<std::mutex> lock(mMtx);
+			if (mStop)
+				return;
+			retry = mSubmitRetry && mToSubmit;
+		}
+	}
+
+	namespace detail
+	{
+		IoUringFd::IoUringFd(int fd, IoUringContext& ctx)
+			: mFd(fd)
+			, mCtx(&ctx)
+		{
+			struct stat s;
+			mIsSocket = ::fstat(mFd, &s) == 0 && S_ISSOCK(s.st_mode);
+			mSlot = ctx.installFile(mFd);
+		}
+
+		IoUringFd::~IoUringFd()
+		{
+			mCtx->removeFile(mSlot);
+			::close(mFd);
+		}
+	}
+
+	IoUringSocket::IoUringSocket(int fd, IoUringContext& ctx)
+		: Socket(make_socket_tag{}, Sock(std::make_unique<detail::IoUringFd>(fd, ctx)))
+	{
+		mSock = (Sock*)Socket::mImpl->getSocket();
+	}
+
+	std::array<IoUringSocket, 2> IoUringSocket::makePair(IoUringContext& ctx)
+	{
+		// io_uring waits for readiness itself, the fds are left blocking.
+		int fds[2];
+		if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds))
+			throwLastError("socketpair");
+		return { IoUringSocket(fds[0], ctx), IoUringSocket(fds[1], ctx) };
+	}
+
+	IoUringSocket::Awaiter::Awaiter(Sock* s, span<u8> data, span<span<u8>> buffers, bool send, macoro::stop_token&& token, bool some)
+		: mData(data)
+		, mBuffers(buffers)
+		, mSend(send)
+		, mSome(some)
+		, mToken(std::move(token))
+	{
+		mFd = s->mFd.get();
+		mDirection = send;
+		if (mBuffers.size())
+		{
+			for (auto b : mBuffers)
+				mTotal += b.size();
+		}
+		else
+			mTotal = mData.size();
+	}
+
+	void IoUringSocket::Awaiter::prep(io_uring_sqe& sqe)
+	{
+		// the iovecs for the remaining data, at most 64 per sqe.
+		auto buffers = mBuffers.size() ? mBuffers : span<span<u8>>(&mData, 1);
+		u64 skip = mBt;
+		mIovCount = 0;
+		for (u64 i = 0; i < buffers.size() && mIovCount < mIov.size(); ++i)
+		{
+			if (skip >= buffers[i].size())
+			{
+				skip -= buffers[i].size();
+				continue;
+			}
+			mIov[mIovCount].iov_base = buffers[i].data() + skip;
+			mIov[mIovCount].iov_len = buffers[i].size() - skip;
+			++mIovCount;
+			skip = 0;
+		}
+
+		auto& fd = *mFd;
+		if (fd.mSlot != ~0u)
+		{
+			sqe.fd = fd.mSlot;
+			sqe.flags = IOSQE_FIXED_FILE;
+		}
+		else
+			sqe.fd = fd.mFd;
+
+		// writes to a socket go through sendmsg so that MSG_NOSIGNAL
+		// can be passed. Everything else can use a registered buffer.
+		i32 bufIdx = -1;
+		if (mIovCount == 1 && (!mSend || !fd.mIsSocket))
+			bufIdx = fd.mCtx->bufferIndex(span<u8>((u8*)mIov[0].iov_base, mIov[0].iov_len));
+
+		if (bufIdx != -1)
+		{
+			sqe.opcode = mSend ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe.addr = (u64)mIov[0].iov_base;
+			sqe.len = (u32)mIov[0].iov_len;
+			sqe.buf_index = (u16)bufIdx;
+			sqe.off = (u64)-1;
+		}
+		else if (fd.mIsSocket)
+		{
+			std::memset(&mMsg, 0, sizeof(mMsg));
+			mMsg.msg_iov = mIov.data();
+			mMsg.msg_iovlen = mIovCount;
+			sqe.opcode = mSend ? IORING_OP_SENDMSG : IORING_OP_RECVMSG;
+			sqe.addr = (u64)&mMsg;
+			sqe.len = 1;
+			sqe.msg_flags = mSend ? MSG_NOSIGNAL : (mSome ? 0 : MSG_WAITALL);
+		}
+		else
+		{
+			sqe.opcode = mSend ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe.addr = (u64)mIov.data();
+			sqe.len = (u32)mIovCount;
+			sqe.off = (u64)-1;
+		}
+	}
+
+	bool IoUringSocket::Awaiter::onResult(i32 res)
+	{
+		if (res < 0)
+		{
+			if (res == -ECANCELED || (res == -EINTR && mCanceled))
+				mEc = code::operation_aborted;
+			else if (res == -EAGAIN || res == -EINTR)
+				return false;
+			else if (res == -EPIPE || res == -ECONNRESET)
+				mEc = code::remoteClosed;
+			else
+				mEc = error_code(-res, std::system_category());
+			return true;
+		}
+
+		if (res == 0)
+		{
+			mEc = code::remoteClosed;
+			return true;
+		}
+
+		mBt += res;
+		return mBt == mTotal || mSome;
+	}
+
+	coroutine_handle<> IoUringSocket::Awaiter::await_suspend(coroutine_handle<> h)
+	{
+		mHandle = h;
+		if (mTotal == 0)
+			return h;
+
+		if (mToken.stop_possible())
+			mReg.emplace(mToken, [this] { mFd->mCtx->cancel(*this); });
+
+		// once submitted, the operation might be completed by another
+		// thread and this awaiter can not be touched.
+		if (mFd->mCtx->start(*this))
+			return h;
+		return macoro::noop_coroutine();
+	}
+}
+#endif
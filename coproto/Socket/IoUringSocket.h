@@ -0,0 +1,298 @@
+#pragma once
+// © 2022 Visa.
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "coproto/config.h"
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define COPROTO_HAS_IO_URING
+#endif
+#endif
+
+#ifdef COPROTO_HAS_IO_URING
+#include "coproto/Socket/Socket.h"
+#include "coproto/Common/Optional.h"
+#include "coproto/Common/macoro.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct io_uring_sqe;
+
+namespace coproto
+{
+	namespace detail
+	{
+		struct IoUringFd;
+
+		// An operation that is submitted to an IoUringContext. A
+		// partially completed operation is submitted again for
+		// the remainder.
+		struct IoUringOp
+		{
+			IoUringOp() = default;
+
+			// only valid before the operation has started.
+			IoUringOp(IoUringOp&& o)
+				: mEc(o.mEc)
+				, mFd(o.mFd)
+				, mDirection(o.mDirection)
+			{}
+			virtual ~IoUringOp() = default;
+
+			// fill in the sqe for the remaining part of the operation.
+			virtual void prep(io_uring_sqe& sqe) = 0;
+
+			// consume the result of a cqe. Returns true once the
+			// operation has completed, possibly with an error in mEc.
+			virtual bool onResult(i32 res) = 0;
+
+			coroutine_handle<> mHandle;
+			error_code mEc;
+			IoUringFd* mFd = nullptr;
+
+			// 0 for receives, 1 for sends.
+			u8 mDirection = 0;
+
+			// the following are protected by the context mutex.
+			bool mCanceled = false;
+			bool mInFlight = false;
+		};
+	}
+
+	// An io_uring instance. Operations are submitted as SQEs and
+	// completed by processing CQEs, either on a reaper thread or
+	// inline by calling poll(). Sockets are installed into a fixed
+	// file table so that the kernel does not need to look up the
+	// fd for each operation.
+	//
+	// When poll() is used, new operations are queued and the SQEs of
+	// all queued operations are submitted together by the next poll(),
+	// i.e. a single io_uring_enter for a whole batch of operations.
+	class IoUringContext
+	{
+	public:
+
+		// entries is the size of the submission queue. If reaperThread
+		// is false, the caller must drive completions with poll().
+		// Throws std::system_error if io_uring is not available.
+		IoUringContext(u32 entries = 256, bool reaperThread = true, u32 maxFiles = 256);
+		IoUringContext(const IoUringContext&) = delete;
+		~IoUringContext();
+
+		// register memory with the kernel. Receives whose buffer lies
+		// within a registered buffer use IORING_OP_READ_FIXED, as do
+		// writes to non-socket fds. Must be called before any operation
+		// is started. The memory must outlive the context.
+		void registerBuffers(span<span<u8>> buffers);
+
+		// submit the queued operations and process the available
+		// completions. If wait is set, blocks until there is at least one
+		// completion. Returns the number of completions processed. Must
+		// only be used if there is no reaper thread.
+		u64 poll(bool wait = false);
+
+		// internal interface used by the sockets.
+
+		// returns the index into the fixed file table or ~0 if it is full.
+		u32 installFile(int fd);
+		void removeFile(u32 slot);
+
+		// submit op. Returns true if op completed inline, e.g. because it
+		// was cancelled before it was started.
+		bool start(detail::IoUringOp& op);
+
+		// request that op be cancelled. If it is in flight an
+		// IORING_OP_ASYNC_CANCEL is submitted for it.
+		void cancel(detail::IoUringOp& op);
+
+		// cancel all in flight operations on fd. Operations that are
+		// started later complete with code::operation_aborted.
+		void close(detail::IoUringFd& fd);
+
+		// find the registered buffer that contains data.
+		i32 bufferIndex(span<u8> data) const;
+
+	private:
+		struct Ring;
+		std::unique_ptr<Ring> mRing;
+
+		std::mutex mMtx;
+		u32 mToSubmit = 0;
+		bool mStop = false;
+		bool mReaper;
+		std::vector<u32> mFreeFiles;
+		std::vector<span<u8>> mBuffers;
+		std::thread mThread;
+
+		// the sqes that did not fit into the submission queue, in order.
+		// mUserData is the user_data of the sqe. They are queued by the 
+		// next submit() that makes room, or by poll().
+		struct Backlogged
+		{
+			detail::IoUringOp* mOp;
+			u64 mUserData;
+		};
+		std::deque<Backlogged> mBacklog;
+
+		// the following require mMtx.
+
+		// returns null if the submission queue is full, even after 
+		// submitting. The caller must not wait for room while holding 
+		// mMtx as the reaper needs it to make room.
+		io_uring_sqe* nextSqe();
+
+		// returns null if the submission queue is full. Does not submit.
+		io_uring_sqe* freeSqe();
+
+		// true if the last submit() failed with EAGAIN, see run().
+		bool mSubmitRetry = false;
+
+		// fill in the next sqe with user data userData for op, see 
+		// mBacklog. The sqe is backlogged if there is no room.
+		void queueSqe(detail::IoUringOp* op, u64 userData);
+		void push(detail::IoUringOp& op);
+		void submit();
+
+		// queue the backlogged sqes that fit and return how many.
+		u64 drainBacklog();
+
+		u64 reap(std::vector<detail::IoUringOp*>& completed);
+		void run();
+	};
+
+	// returns a context with a reaper thread that is lazily created on first use.
+	IoUringContext& global_io_uring_context();
+
+	namespace detail
+	{
+		// the state of a fd that is used with an IoUringContext. The
+		// fd is owned and closed when this object is destroyed.
+		struct IoUringFd
+		{
+			IoUringFd(int fd, IoUringContext& ctx);
+			~IoUringFd();
+
+			int mFd = -1;
+			u32 mSlot = ~0u;
+			bool mIsSocket = false;
+			IoUringContext* mCtx = nullptr;
+
+			// protected by the context mutex.
+			bool mClosed = false;
+			IoUringOp* mInFlight[2] = {};
+		};
+	}
+
+	// A socket whose operations are performed by io_uring. It can
+	// wrap any stream fd, e.g. a connected TCP socket or one end of
+	// socketpair(...). The socket takes ownership of the fd.
+	struct IoUringSocket : public Socket
+	{
+		struct Sock;
+
+		IoUringSocket(int fd, IoUringContext& ctx = global_io_uring_context());
+
+		IoUringSocket() = default;
+		IoUringSocket(const IoUringSocket&) = default;
+		IoUringSocket(IoUringSocket&& o) :
+			Socket(std::move(o)),
+			mSock(std::exchange(o.mSock, nullptr))
+		{}
+
+		IoUringSocket& operator=(const IoUringSocket&) = default;
+		IoUringSocket& operator=(IoUringSocket&& o)
+		{
+			static_cast<Socket&>(*this) = std::move(static_cast<Socket&>(o)),
+			mSock = std::exchange(o.mSock, nullptr);
+			return *this;
+		}
+
+		// a connected pair from socketpair(AF_UNIX, ...).
+		static std::array<IoUringSocket, 2> makePair(IoUringContext& ctx = global_io_uring_context());
+
+		struct Awaiter : detail::IoUringOp
+		{
+			Awaiter(Sock* s, span<u8> data, span<span<u8>> buffers, bool send, macoro::stop_token&& token, bool some = false);
+
+			span<u8> mData;
+			span<span<u8>> mBuffers;
+			bool mSend, mSome;
+			u64 mBt = 0, mTotal = 0;
+			macoro::stop_token mToken;
+			macoro::optional_stop_callback mReg;
+
+			// referenced by the sqe until the operation completes.
+			std::array<iovec, 64> mIov;
+			u64 mIovCount = 0;
+			msghdr mMsg;
+
+			void prep(io_uring_sqe& sqe) override;
+			bool onResult(i32 res) override;
+
+			bool await_ready() { return false; }
+
+			coroutine_handle<> await_suspend(coroutine_handle<> h);
+#ifdef COPROTO_CPP20
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) {
+				return await_suspend(coroutine_handle<>(h)).std_cast();
+			}
+#endif
+			std::pair<error_code, u64> await_resume() { return { mEc, mBt }; }
+		};
+
+		struct Sock
+		{
+			std::unique_ptr<detail::IoUringFd> mFd;
+
+			Sock(std::unique_ptr<detail::IoUringFd> fd)
+				: mFd(std::move(fd))
+			{}
+			Sock(Sock&&) = default;
+
+			MACORO_NODISCARD
+			auto close()
+			{
+				struct Awaiter
+				{
+					detail::IoUringFd* mFd;
+					bool await_ready() const noexcept { return false; }
+					std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept
+					{
+						mFd->mCtx->close(*mFd);
+						return h;
+					}
+					void await_resume() const noexcept {}
+				};
+				return Awaiter{ mFd.get() };
+			}
+
+			Awaiter send(span<u8> data, macoro::stop_token token = {}) { return Awaiter(this, data, {}, true, std::move(token)); };
+			Awaiter recv(span<u8> data, macoro::stop_token token = {}) { return Awaiter(this, data, {}, false, std::move(token)); };
+
+			// optional scatter/gather interface. Up to 64 buffers are
+			// submitted as a single sqe.
+			Awaiter sendv(span<span<u8>> data, macoro::stop_token token = {}) { return Awaiter(this, {}, data, true, std::move(token)); };
+			Awaiter recvv(span<span<u8>> data, macoro::stop_token token = {}) { return Awaiter(this, {}, data, false, std::move(token)); };
+
+			// optional partial receive. Completes once some data has been read.
+			Awaiter recvSome(span<u8> data, macoro::stop_token token = {}) { return Awaiter(this, data, {}, false, std::move(token), true); };
+		};
+
+		Sock* mSock = nullptr;
+	};
+}
+
+#endif
@@ -9,6 +9,9 @@
 
 #include "coproto/Socket/Socket.h"
 #include "coproto/Common/macoro.h"
+#include <atomic>
+#include <deque>
+#include <mutex>
 
 namespace coproto
 {
@@ -37,11 +40,20 @@ namespace coproto
 	// is done to hide some implementation details and allow 
 	// LocalAsyncSocket to behave as a coproto::Socket.
 	//
+	// By default the socket is a rendezvous channel. A send only
+	// completes once it has been matched with a receive. Sockets 
+	// from makeBufferedPair() instead have a bounded ring buffer 
+	// per direction. A send completes once its data is in the ring
+	// and the two directions progress independently.
+	//
 	struct LocalAsyncSocket : public Socket
 	{
 		// The common state that a pair of LocalAsyncSocket will hold.
 		struct SharedState;
 
+		// The ring buffer of one direction in buffered mode.
+		struct Channel;
+
 		// The awaiter that is returned from send(...) and recv(...)
 		struct Awaiter;
 
@@ -70,20 +82,37 @@ namespace coproto
 
 			Awaiter(Sock* ss, span<u8> dd, bool send, macoro::stop_token&& t);
 
+			// A vectored operation that sends or receives all of the buffers in order.
+			Awaiter(Sock* ss, span<span<u8>> buffers, bool send, macoro::stop_token&& t);
+
+			// A receive operation that completes once some data has been received.
+			Awaiter(Sock* ss, span<u8> dd, macoro::stop_token&& t);
+
 			// A pointer to the socket that this io operation belongs to.
 			Sock* mSock;
 
 			// The data to be sent or received. This will shrink as we 
-			// make progress in sending or receiving data.
+			// make progress in sending or receiving data. For vectored
+			// operations this is the current buffer.
 			span<u8> mData;
 
+			// For vectored operations, the buffers that follow mData.
+			span<span<u8>> mRest;
+
 			// The total amount of data to be sent or received.
 			u64 mTotalSize;
+
+			// The amount of data that is yet to be sent or received.
+			u64 mRemaining;
 			enum Type { send, recv };
 
 			// The type of the operation (send or receive).
 			Type mType;
 
+			// If true, the receive operation completes as soon as 
+			// any data has been received.
+			bool mSome = false;
+
 			// An error code that is set once the operation has 
 			// completed successfully or with an error.
 			optional<error_code> mEc;
@@ -99,6 +128,10 @@ namespace coproto
 			// the stop callback.
 			macoro::optional_stop_callback mReg;
 
+			// Buffered mode: set by the stop callback. Protected by the 
+			// channel mutex.
+			bool mCanceled = false;
+
 			// We always return false. This means that await_suspend is always called.
 			bool await_ready() { return false; }
 
@@ -137,16 +170,55 @@ namespace coproto
 			// should be some other value.
 			std::pair<error_code, u64> await_resume() {
 				COPROTO_ASSERT(mEc);
-				auto bt = mTotalSize - mData.size();
+				auto bt = mTotalSize - mRemaining;
 				return { *mEc, bt };
 			}
 
+			// mark the next n bytes as transfered. mData will be moved
+			// to the next non-empty buffer once it has been consumed.
+			void advance(u64 n);
+
+			// copy n bytes from the buffers starting at (srcData, srcRest) into the 
+			// buffers starting at (dstData, dstRest). 
+			static void copy(
+				span<u8> srcData, span<span<u8>> srcRest, 
+				span<u8> dstData, span<span<u8>> dstRest, 
+				u64 n);
+
 			// helper functions
 			error_code& ec();
 			unique_function<error_code()>& errFn();
 			OpPair& outbound();
 			OpPair& inbound();
 
+			////////////////////////////////////////////////
+			// buffered mode
+			////////////////////////////////////////////////
+
+			// the channel that this operation writes to or reads from.
+			Channel& channel();
+
+			// Copy as much data as possible between this operation and
+			// the ring. Returns the number of bytes. Only one thread 
+			// may transfer for the send and receive of a channel at a time.
+			u64 transfer();
+
+			// true if the ring has space for a send or data for a receive.
+			bool canProgress();
+
+			// true if the operation has transfered all it needs.
+			bool done() const { return mRemaining == 0 || (mSome && mRemaining != mTotalSize); }
+
+			enum class Park { parked, retry, completed };
+
+			// Park the operation until the other side changes the ring.
+			// Returns retry if the ring has changed in the meantime and
+			// completed if the operation failed, e.g. it was canceled.
+			Park park();
+
+			// Drive this operation and, once there is progress, the parked 
+			// operation of the other side. Returns the handle to resume.
+			coroutine_handle<> runBuffered(coroutine_handle<> h);
 
 		};
 
@@ -188,6 +260,32 @@ namespace coproto
 			// that this operation should be canceled. See Awaiter for more details.
 			Awaiter recv(span<u8> data, macoro::stop_token token = {}) { return Awaiter(this, data, false, std::move(token)); };
 
+			////////////////////////////////////////////////
+			// Optional interface
+			////////////////////////////////////////////////
+
+			// Send all of the buffers as a single operation. A matching receive
+			// is filled directly from these buffers and therefore the header and 
+			// body of a message can be delivered with a single operation.
+			Awaiter sendv(span<span<u8>> buffers, macoro::stop_token token = {}) { return Awaiter(this, buffers, true, std::move(token)); };
+
+			// Receive into all of the buffers as a single operation.
+			Awaiter recvv(span<span<u8>> buffers, macoro::stop_token token = {}) { return Awaiter(this, buffers, false, std::move(token)); };
+
+			// Receive at most data.size() bytes. The operation completes once
+			// it has been matched with a send and returns the number of bytes
+			// that were copied.
+			Awaiter recvSome(span<u8> data, macoro::stop_token token = {}) { return Awaiter(this, data, std::move(token)); };
+
+			// Hand the vector to the other socket. The scheduler uses this for 
+			// move-sent std::vector<u8> messages. The vector is handed over
+			// before the message header is sent and the other side takes it
+			// with recvOwned() once the header arrives. No bytes are copied.
+			void sendOwned(std::vector<u8>&& data);
+
+			// Take the oldest vector that the other socket has handed over.
+			std::vector<u8> recvOwned();
+
 			////////////////////////////////////////////////
 			// internal implementation
 			////////////////////////////////////////////////
@@ -222,6 +320,38 @@ namespace coproto
 
 		};
 
+		struct Channel
+		{
+			// protects mParked, mCanceled of the operations and, 
+			// together with the other locks, the error state.
+			std::mutex mMtx;
+
+			// The ring buffer. mHead and mTail count the bytes that
+			// have been written and read. The capacity is a power of two.
+			std::unique_ptr<u8[]> mBuffer;
+			alignas(64) std::atomic<u64> mHead = 0;
+			alignas(64) std::atomic<u64> mTail = 0;
+
+			// The send and receive operations that are waiting for the
+			// ring to change. mWaiting mirrors mParked such that the 
+			// other side only needs the lock if an operation is parked.
+			alignas(64) std::array<Awaiter*, 2> mParked = {};
+			std::array<std::atomic<bool>, 2> mWaiting = {};
+
+			// take the parked operation of the given type, if any.
+			Awaiter* take(u64 type)
+			{
+				// pairs with the fence in Awaiter::park().
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (mWaiting[type].load(std::memory_order_relaxed) == false)
+					return nullptr;
+
+				std::lock_guard<std::mutex> lock(mMtx);
+				mWaiting[type].store(false, std::memory_order_relaxed);
+				return std::exchange(mParked[type], nullptr);
+			}
+		};
+
 		// the shared state that the two ends communicate by
 		struct SharedState
 		{
@@ -242,6 +372,17 @@ namespace coproto
 
 			// The two sockets.
 			std::array<Sock*, 2> mSocks;
+
+			// The size of the ring buffers or zero for a rendezvous socket.
+			u64 mCapacity = 0;
+
+			// Buffered mode: mChannels[i] holds the data that is sent to socket i.
+			std::array<Channel, 2> mChannels;
+
+			// mOwned[i] holds the vectors that are handed to socket i, see 
+			// Sock::sendOwned(...).
+			std::mutex mOwnedMtx;
+			std::array<std::deque<std::vector<u8>>, 2> mOwned;
 		};
 
 		// The pointer to the actual socket implementation. 
@@ -251,9 +392,42 @@ namespace coproto
 		// A helper function to make a pair of LocalAsyncSocket
 		// that can communicate with each other.
 		static std::array<LocalAsyncSocket, 2> makePair()
+		{
+			return makePair(false);
+		}
+
+		// make a pair of single threaded sockets, see single_threaded_tag.
+		static std::array<LocalAsyncSocket, 2> makePair(single_threaded_tag)
+		{
+			return makePair(true);
+		}
+
+		// make a pair of sockets that buffer up to bufferSize bytes 
+		// in each direction. bufferSize is rounded up to a power of two.
+		static std::array<LocalAsyncSocket, 2> makeBufferedPair(u64 bufferSize = 1 << 16)
+		{
+			return makePair(false, bufferSize);
+		}
+
+		// make a pair of single threaded buffered sockets.
+		static std::array<LocalAsyncSocket, 2> makeBufferedPair(single_threaded_tag, u64 bufferSize = 1 << 16)
+		{
+			return makePair(true, bufferSize);
+		}
+
+	private:
+		static std::array<LocalAsyncSocket, 2> makePair(bool singleThreaded, u64 bufferSize = 0)
 		{
 			std::array<LocalAsyncSocket, 2> pair;
 			auto state = std::make_shared<SharedState>();
+			if (bufferSize)
+			{
+				state->mCapacity = 64;
+				while (state->mCapacity < bufferSize)
+					state->mCapacity *= 2;
+				for (auto& ch : state->mChannels)
+					ch.mBuffer.reset(new u8[state->mCapacity]);
+			}
 			auto s0 = std::unique_ptr<Sock>(new Sock(0, state));
 			auto s1 = std::unique_ptr<Sock>(new Sock(1, state));
 
@@ -263,8 +437,16 @@ namespace coproto
 			state->mSocks[0] = pair[0].mSock;
 			state->mSocks[1] = pair[1].mSock;
 
-			*static_cast<Socket*>(&pair[0]) = Socket(make_socket_tag{}, std::move(s0));
-			*static_cast<Socket*>(&pair[1]) = Socket(make_socket_tag{}, std::move(s1));
+			if (singleThreaded)
+			{
+				*static_cast<Socket*>(&pair[0]) = Socket(make_socket_tag{}, single_threaded_tag{}, std::move(s0));
+				*static_cast<Socket*>(&pair[1]) = Socket(make_socket_tag{}, single_threaded_tag{}, std::move(s1));
+			}
+			else
+			{
+				*static_cast<Socket*>(&pair[0]) = Socket(make_socket_tag{}, std::move(s0));
+				*static_cast<Socket*>(&pair[1]) = Socket(make_socket_tag{}, std::move(s1));
+			}
 
 			return pair;
 		}
@@ -275,23 +457,284 @@ namespace coproto
 		: mSock(ss)
 		, mData(dd)
 		, mTotalSize(dd.size())
+		, mRemaining(dd.size())
 		, mType(send ? Type::send : Type::recv)
 		, mToken(t)
 	{
 		COPROTO_ASSERT(dd.size());
 	}
 
+	inline LocalAsyncSocket::Awaiter::Awaiter(Sock* ss, span<span<u8>> buffers, bool send, macoro::stop_token&& t)
+		: mSock(ss)
+		, mRest(buffers)
+		, mTotalSize(0)
+		, mType(send ? Type::send : Type::recv)
+		, mToken(t)
+	{
+		for (auto& b : buffers)
+			mTotalSize += b.size();
+		mRemaining = mTotalSize;
+		COPROTO_ASSERT(mTotalSize);
+
+		// move to the first non-empty buffer.
+		advance(0);
+	}
+
+	inline LocalAsyncSocket::Awaiter::Awaiter(Sock* ss, span<u8> dd, macoro::stop_token&& t)
+		: Awaiter(ss, dd, false, std::move(t))
+	{
+		mSome = true;
+	}
+
+	inline void LocalAsyncSocket::Awaiter::advance(u64 n)
+	{
+		COPROTO_ASSERT(n <= mRemaining);
+		mRemaining -= n;
+		while (true)
+		{
+			auto m = std::min<u64>(n, mData.size());
+			mData = mData.subspan(m);
+			n -= m;
+
+			if (mData.size() || mRest.size() == 0)
+				break;
+
+			mData = mRest[0];
+			mRest = mRest.subspan(1);
+		}
+		COPROTO_ASSERT(n == 0);
+	}
+
+	inline void LocalAsyncSocket::Awaiter::copy(
+		span<u8> srcData, span<span<u8>> srcRest,
+		span<u8> dstData, span<span<u8>> dstRest,
+		u64 n)
+	{
+		while (n)
+		{
+			while (srcData.size() == 0)
+			{
+				srcData = srcRest[0];
+				srcRest = srcRest.subspan(1);
+			}
+			while (dstData.size() == 0)
+			{
+				dstData = dstRest[0];
+				dstRest = dstRest.subspan(1);
+			}
+
+			auto m = std::min<u64>({ n, srcData.size(), dstData.size() });
+			memcpy(dstData.data(), srcData.data(), m);
+			srcData = srcData.subspan(m);
+			dstData = dstData.subspan(m);
+			n -= m;
+		}
+	}
+
 	inline error_code& LocalAsyncSocket::Awaiter::ec() { return mSock->ec(); }
 	inline unique_function<error_code()>& LocalAsyncSocket::Awaiter::errFn() { return mSock->errFn(); }
 	inline LocalAsyncSocket::OpPair& LocalAsyncSocket::Awaiter::outbound() { return mSock->outbound(); }
 	inline LocalAsyncSocket::OpPair& LocalAsyncSocket::Awaiter::inbound() { return mSock->inbound(); }
 
+	inline LocalAsyncSocket::Channel& LocalAsyncSocket::Awaiter::channel()
+	{
+		return mSock->mImpl->mChannels[mType == Type::send ? mSock->mIdx ^ 1 : mSock->mIdx];
+	}
+
+	inline u64 LocalAsyncSocket::Awaiter::transfer()
+	{
+		auto& ch = channel();
+		auto cap = mSock->mImpl->mCapacity;
+		auto buffer = ch.mBuffer.get();
+		u64 total = 0;
+		while (!done())
+		{
+			// the sender owns [head, tail + cap) and the receiver owns [tail, head).
+			u64 n, pos;
+			if (mType == Type::send)
+			{
+				auto head = ch.mHead.load(std::memory_order_relaxed);
+				auto tail = ch.mTail.load(std::memory_order_acquire);
+				n = std::min<u64>(cap - (head - tail), mData.size());
+				pos = head & (cap - 1);
+				auto m = std::min<u64>(n, cap - pos);
+				memcpy(buffer + pos, mData.data(), m);
+				memcpy(buffer, mData.data() + m, n - m);
+				ch.mHead.store(head + n, std::memory_order_release);
+			}
+			else
+			{
+				auto tail = ch.mTail.load(std::memory_order_relaxed);
+				auto head = ch.mHead.load(std::memory_order_acquire);
+				n = std::min<u64>(head - tail, mData.size());
+				pos = tail & (cap - 1);
+				auto m = std::min<u64>(n, cap - pos);
+				memcpy(mData.data(), buffer + pos, m);
+				memcpy(mData.data() + m, buffer, n - m);
+				ch.mTail.store(tail + n, std::memory_order_release);
+			}
+
+			if (n == 0)
+				break;
+			advance(n);
+			total += n;
+		}
+		return total;
+	}
+
+	inline bool LocalAsyncSocket::Awaiter::canProgress()
+	{
+		auto& ch = channel();
+		auto head = ch.mHead.load(std::memory_order_acquire);
+		auto tail = ch.mTail.load(std::memory_order_acquire);
+		if (mType == Type::send)
+			return head - tail != mSock->mImpl->mCapacity;
+		else
+			return head != tail;
+	}
+
+	inline LocalAsyncSocket::Awaiter::Park LocalAsyncSocket::Awaiter::park()
+	{
+		auto& ch = channel();
+		std::lock_guard<std::mutex> lock(ch.mMtx);
+		if (mCanceled)
+		{
+			mEc = code::operation_aborted;
+			return Park::completed;
+		}
+
+		// data that was sent before the remote closed can still be received.
+		if (ec() && !(mType == Type::recv && ec() == code::remoteClosed && canProgress()))
+		{
+			mEc = ec();
+			return Park::completed;
+		}
+
+		ch.mParked[mType] = this;
+		ch.mWaiting[mType].store(true, std::memory_order_relaxed);
+
+		// Either we see the change of the other side or it sees mWaiting.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (canProgress())
+		{
+			ch.mParked[mType] = nullptr;
+			ch.mWaiting[mType].store(false, std::memory_order_relaxed);
+			return Park::retry;
+		}
+		return Park::parked;
+	}
+
+	inline coroutine_handle<> LocalAsyncSocket::Awaiter::runBuffered(coroutine_handle<> h)
+	{
+		// The parked operation of the other side. Once taken, this
+		// thread transfers on its behalf.
+		Awaiter* other = nullptr;
+		Awaiter* self = this;
+		auto& ch = channel();
+
+		// the shared state must outlive the loop once self is parked.
+		std::shared_ptr<SharedState> keepAlive;
+
+		// the handles to resume once the loop is done.
+		coroutine_handle<> c0, c1;
+
+		while (self || other)
+		{
+			u64 n = 0;
+			if (self)
+				n += self->transfer();
+			if (other)
+				n += other->transfer();
+			else if (n && (other = ch.take(mType ^ 1)))
+			{
+				keepAlive = mSock->mImpl;
+				continue;
+			}
+
+			if (self && self->done())
+			{
+				self->mEc = code::success;
+				c0 = h;
+				self = nullptr;
+			}
+			if (other && other->done())
+			{
+				other->mEc = code::success;
+				c1 = other->mHandle;
+				if (other->mReg)
+					other->mReg.reset();
+				other = nullptr;
+			}
+
+			if (n == 0)
+			{
+				// no progress is possible until the other side changes 
+				// the ring. self must not be accessed once parked.
+				for (auto op : { &self, &other })
+				{
+					if (*op == nullptr)
+						continue;
+
+					auto r = (*op)->park();
+					if (r == Park::completed)
+					{
+						if (*op == this)
+							c0 = h;
+						else
+						{
+							c1 = (*op)->mHandle;
+							if ((*op)->mReg)
+								(*op)->mReg.reset();
+						}
+					}
+					if (r != Park::retry)
+						*op = nullptr;
+				}
+			}
+		}
+
+		if (c0 && c1)
+		{
+			c1.resume();
+			return c0;
+		}
+		if (c0)
+			return c0;
+		if (c1)
+			return c1;
+		return macoro::noop_coroutine();
+	}
+
+	inline void LocalAsyncSocket::Sock::sendOwned(std::vector<u8>&& data)
+	{
+		std::lock_guard<std::mutex> lock(mImpl->mOwnedMtx);
+		mImpl->mOwned[mIdx ^ 1].push_back(std::move(data));
+	}
+
+	inline std::vector<u8> LocalAsyncSocket::Sock::recvOwned()
+	{
+		std::lock_guard<std::mutex> lock(mImpl->mOwnedMtx);
+		auto& owned = mImpl->mOwned[mIdx];
+		if (owned.empty())
+			return {};
+
+		auto ret = std::move(owned.front());
+		owned.pop_front();
+		return ret;
+	}
+
 	inline void LocalAsyncSocket::Sock::close()
 	{
-		std::array<coroutine_handle<>, 4> cbs;
+		std::array<coroutine_handle<>, 8> cbs;
 
 		{
-			std::unique_lock<std::mutex> lock(mImpl->mMtx);
+			std::unique_lock<std::mutex> lock(mImpl->mMtx, std::defer_lock);
+			std::unique_lock<std::mutex> lock0(mImpl->mChannels[0].mMtx, std::defer_lock);
+			std::unique_lock<std::mutex> lock1(mImpl->mChannels[1].mMtx, std::defer_lock);
+			if (mImpl->mCapacity)
+				std::lock(lock, lock0, lock1);
+			else
+				lock.lock();
 			//outLog().emplace_back("close", std::this_thread::get_id(), 0);
 			//inLog().emplace_back("close", std::this_thread::get_id(), 0);
 
@@ -332,6 +775,36 @@ namespace coproto
 				op->mEc = code::closed;
 				cbs[3] = op->mHandle;
 			}
+
+			// buffered mode. The parked operations of this socket complete with 
+			// closed, those of the other socket with remoteClosed. A receive of 
+			// the other socket that can progress is left to the sender.
+			for (u64 t = 0; t < 2; ++t)
+			{
+				auto& in = mImpl->mChannels[mIdx].mParked[t];
+				auto& out = mImpl->mChannels[mIdx ^ 1].mParked[t];
+				if (in)
+				{
+					in->mEc = t == Awaiter::Type::recv ? code::closed : code::remoteClosed;
+					cbs[4 + t] = std::exchange(in, nullptr)->mHandle;
+					mImpl->mChannels[mIdx].mWaiting[t].store(false, std::memory_order_relaxed);
+				}
+				if (out && (t == Awaiter::Type::send || !out->canProgress()))
+				{
+					out->mEc = t == Awaiter::Type::send ? code::closed : code::remoteClosed;
+					cbs[6 + t] = std::exchange(out, nullptr)->mHandle;
+					mImpl->mChannels[mIdx ^ 1].mWaiting[t].store(false, std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// the vectors that were handed to this socket are no longer taken.
+		// The header of one might not have been sent.
+		std::deque<std::vector<u8>> owned;
+		{
+			std::lock_guard<std::mutex> lock(mImpl->mOwnedMtx);
+			owned = std::move(mImpl->mOwned[mIdx]);
+			mImpl->mOwned[mIdx].clear();
 		}
 
 		for (auto cb : cbs)
@@ -354,8 +827,11 @@ namespace coproto
 		// event that we complete the operation.
 		macoro::optional_stop_callback* r0 = nullptr, * r1 = nullptr;
 
-		// The source and destination buffers of the operation.
-		span<u8> src, dst;
+		// The source and destination buffers of the operation
+		// and the number of bytes to be copied.
+		span<u8> srcData, dstData;
+		span<span<u8>> srcRest, dstRest;
+		u64 numBytes = 0;
 
 		// First we need to check it the stop token can be used.
 		if (mToken.stop_possible())
@@ -366,6 +842,23 @@ namespace coproto
 				// This might be called synchronously if the operation has 
 				// already been canceled.
 				coroutine_handle<> cb;
+				if (mSock->mImpl->mCapacity)
+				{
+					// buffered mode. The operation might currently be driven 
+					// by another thread. In that case it completes with 
+					// operation_aborted once it would have to be parked.
+					auto& ch = channel();
+					std::unique_lock<std::mutex> lock(ch.mMtx);
+					mCanceled = true;
+					if (ch.mParked[mType] == this)
+					{
+						ch.mParked[mType] = nullptr;
+						ch.mWaiting[mType].store(false, std::memory_order_relaxed);
+						mEc = code::operation_aborted;
+						cb = mHandle;
+					}
+				}
+				else
 				{
 					std::unique_lock<std::mutex> lock(mSock->mImpl->mMtx);
 					if (!mEc)
@@ -396,6 +889,43 @@ namespace coproto
 		}
 
 
+		if (mSock->mImpl->mCapacity)
+		{
+			{
+				auto& state = *mSock->mImpl;
+				auto& ch = channel();
+				auto& other = &ch == &state.mChannels[0] ? state.mChannels[1] : state.mChannels[0];
+
+				// the error state is written while holding all of the locks.
+				std::unique_lock<std::mutex> lock(ch.mMtx, std::defer_lock);
+				std::unique_lock<std::mutex> lock0(state.mMtx, std::defer_lock);
+				std::unique_lock<std::mutex> lock1(other.mMtx, std::defer_lock);
+				if (errFn())
+					std::lock(lock, lock0, lock1);
+				else
+					lock.lock();
+
+				mHandle = h;
+				if (mCanceled)
+				{
+					mEc = code::operation_aborted;
+					return h;
+				}
+
+				if (!ec() && errFn())
+					ec() = errFn()();
+
+				// data that was sent before the remote closed can still be received.
+				if (ec() && !(mType == Type::recv && ec() == code::remoteClosed && canProgress()))
+				{
+					mEc = ec();
+					return h;
+				}
+			}
+
+			return runBuffered(h);
+		}
+
 		// Note that we might have just canceled our operation.
 		{
 
@@ -465,7 +995,7 @@ namespace coproto
 			// op is set when we can complete the operation.
 			// If so we will do some booking to extract
 			//
-			// * src,dst : the buffers
+			// * src,dst : the buffers and number of bytes to copy
 			// * c0,c1 : the callbacks
 			// * r0,r1 : the stop callbacks.
 			if (op)
@@ -479,16 +1009,18 @@ namespace coproto
 				COPROTO_ASSERT(mRecv->mType == Awaiter::Type::recv);
 				COPROTO_ASSERT(mSend->mType == Awaiter::Type::send);
 
-				auto min = std::min<u64>(mSend->mData.size(), mRecv->mData.size());
-				COPROTO_ASSERT(min);
+				numBytes = std::min<u64>(mSend->mRemaining, mRecv->mRemaining);
+				COPROTO_ASSERT(numBytes);
 
-				src = mSend->mData.subspan(0, min);
-				dst = mRecv->mData.subspan(0, min);
+				srcData = mSend->mData;
+				srcRest = mSend->mRest;
+				dstData = mRecv->mData;
+				dstRest = mRecv->mRest;
 
-				mSend->mData = mSend->mData.subspan(min);
-				mRecv->mData = mRecv->mData.subspan(min);
+				mSend->advance(numBytes);
+				mRecv->advance(numBytes);
 
-				if (mRecv->mData.size() == 0)
+				if (mRecv->mRemaining == 0 || mRecv->mSome)
 				{
 					mRecv->mEc = code::success;
 					assert(mRecv->mHandle);
@@ -498,7 +1030,7 @@ namespace coproto
 					mRecv = nullptr;
 				}
 
-				if (mSend->mData.size() == 0)
+				if (mSend->mRemaining == 0)
 				{
 					mSend->mEc = code::success;
 					c1 = mSend->mHandle;
@@ -529,7 +1061,7 @@ namespace coproto
 		if (op)
 		{
 
-			memcpy(dst.data(), src.data(), src.size());
+			Awaiter::copy(srcData, srcRest, dstData, dstRest, numBytes);
 
 			if (c0 && c1)
 			{
@@ -0,0 +1,719 @@
+#include "PosixSocket.h"
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+
+namespace coproto
+{
+	namespace
+	{
+		error_code lastError()
+		{
+			return error_code(errno, std::system_category());
+		}
+
+		void throwLastError(const char* what)
+		{
+			throw std::system_error(errno, std::system_category(), what);
+		}
+
+		void setNonBlocking(int fd)
+		{
+			auto flags = ::fcntl(fd, F_GETFL, 0);
+			if (flags == -1 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+				throwLastError("fcntl");
+		}
+
+		// resolve "host:port" or "host".
+		void resolve(const std::string& address, bool passive, sockaddr_storage& addr, socklen_t& len)
+		{
+			auto i = address.rfind(':');
+			std::string host = address, port;
+			if (i != std::string::npos)
+			{
+				host = address.substr(0, i);
+				port = address.substr(i + 1);
+			}
+
+			addrinfo hints;
+			std::memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+			addrinfo* res = nullptr;
+			auto r = ::getaddrinfo(
+				host.size() ? host.c_str() : nullptr,
+				port.size() ? port.c_str() : nullptr,
+				&hints, &res);
+			if (r)
+				throw std::runtime_error("failed to resolve " + address + ": " + ::gai_strerror(r) + " " COPROTO_LOCATION);
+
+			std::memcpy(&addr, res->ai_addr, res->ai_addrlen);
+			len = res->ai_addrlen;
+			::freeaddrinfo(res);
+		}
+	}
+
+	namespace detail
+	{
+		optional<PosixReactor> global_posix_reactor;
+		std::mutex global_posix_reactor_mutex;
+	}
+
+	PosixReactor& global_posix_reactor()
+	{
+		std::lock_guard<std::mutex> lock(detail::global_posix_reactor_mutex);
+		if (!detail::global_posix_reactor)
+			detail::global_posix_reactor.emplace();
+		return *detail::global_posix_reactor;
+	}
+
+	PosixReactor::PosixReactor()
+	{
+		mEpoll = ::epoll_create1(EPOLL_CLOEXEC);
+		if (mEpoll == -1)
+			throwLastError("epoll_create1");
+		mWake = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (mWake == -1)
+			throwLastError("eventfd");
+		mTimerFd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (mTimerFd == -1)
+			throwLastError("timerfd_create");
+
+		// the wake and timer fds are level triggered and
+		// identified by a pointer to their member.
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &mWake;
+		if (::epoll_ctl(mEpoll, EPOLL_CTL_ADD, mWake, &ev))
+			throwLastError("epoll_ctl");
+		ev.data.ptr = &mTimerFd;
+		if (::epoll_ctl(mEpoll, EPOLL_CTL_ADD, mTimerFd, &ev))
+			throwLastError("epoll_ctl");
+
+		mThread = std::thread([this] { run(); });
+	}
+
+	PosixReactor::~PosixReactor()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMtx);
+			mStop = true;
+		}
+		wake();
+		mThread.join();
+		mReleased.clear();
+		::close(mTimerFd);
+		::close(mWake);
+		::close(mEpoll);
+	}
+
+	void PosixReactor::add(int fd, u32 events, Handler* h)
+	{
+		epoll_event ev;
+		ev.events = events | EPOLLET;
+		ev.data.ptr = h;
+		if (::epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &ev))
+			throwLastError("epoll_ctl");
+	}
+
+	void PosixReactor::remove(int fd)
+	{
+		::epoll_ctl(mEpoll, EPOLL_CTL_DEL, fd, nullptr);
+	}
+
+	void PosixReactor::release(std::shared_ptr<Handler>&& h)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMtx);
+			mReleased.push_back(std::move(h));
+		}
+		wake();
+	}
+
+	void PosixReactor::wake()
+	{
+		u64 v = 1;
+		while (::write(mWake, &v, sizeof(v)) == -1 && errno == EINTR);
+	}
+
+	void PosixReactor::schedule(Timer& t, std::chrono::steady_clock::duration delay)
+	{
+		std::lock_guard<std::mutex> lock(mMtx);
+		assert(t.mScheduled == false);
+		t.mDeadline = std::chrono::steady_clock::now() + delay;
+		t.mIter = mTimers.emplace(t.mDeadline, &t);
+		t.mScheduled = true;
+		if (t.mIter == mTimers.begin())
+			armTimer();
+	}
+
+	bool PosixReactor::cancel(Timer& t)
+	{
+		std::lock_guard<std::mutex> lock(mMtx);
+		if (t.mScheduled == false)
+			return false;
+		mTimers.erase(t.mIter);
+		t.mScheduled = false;
+		return true;
+	}
+
+	// set the timerfd to the earliest deadline. Requires mMtx.
+	void PosixReactor::armTimer()
+	{
+		itimerspec spec;
+		std::memset(&spec, 0, sizeof(spec));
+		if (mTimers.size())
+		{
+			auto d = mTimers.begin()->first - std::chrono::steady_clock::now();
+			auto ns = std::max<i64>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+			spec.it_value.tv_sec = ns / 1000000000;
+			spec.it_value.tv_nsec = ns % 1000000000;
+		}
+		::timerfd_settime(mTimerFd, 0, &spec, nullptr);
+	}
+
+	void PosixReactor::fireTimers()
+	{
+		u64 v;
+		while (::read(mTimerFd, &v, sizeof(v)) == -1 && errno == EINTR);
+
+		std::vector<Timer*> expired;
+		{
+			std::lock_guard<std::mutex> lock(mMtx);
+			auto now = std::chrono::steady_clock::now();
+			while (mTimers.size() && mTimers.begin()->first <= now)
+			{
+				auto t = mTimers.begin()->second;
+				t->mScheduled = false;
+				expired.push_back(t);
+				mTimers.erase(mTimers.begin());
+			}
+			armTimer();
+		}
+
+		for (auto t : expired)
+			t->onTimer();
+	}
+
+	void PosixReactor::run()
+	{
+		std::array<epoll_event, 64> events;
+		std::vector<std::shared_ptr<Handler>> released;
+		while (true)
+		{
+			auto n = ::epoll_wait(mEpoll, events.data(), events.size(), -1);
+			if (n == -1 && errno != EINTR)
+				std::terminate();
+
+			for (i64 i = 0; i < n; ++i)
+			{
+				auto& ev = events[i];
+				if (ev.data.ptr == &mWake)
+				{
+					u64 v;
+					while (::read(mWake, &v, sizeof(v)) == -1 && errno == EINTR);
+				}
+				else if (ev.data.ptr == &mTimerFd)
+					fireTimers();
+				else
+					static_cast<Handler*>(ev.data.ptr)->onEvent(ev.events);
+			}
+
+			// the handlers removed before this point can no longer
+			// be referenced by an event that we have yet to process.
+			bool stop;
+			{
+				std::lock_guard<std::mutex> lock(mMtx);
+				std::swap(released, mReleased);
+				stop = mStop;
+			}
+			released.clear();
+			if (stop)
+				return;
+		}
+	}
+
+	namespace detail
+	{
+		PosixFd::PosixFd(int readFd, int writeFd, PosixReactor& r)
+			: mReadFd(readFd)
+			, mWriteFd(writeFd)
+			, mReactor(&r)
+		{
+			setNonBlocking(mReadFd);
+			if (mWriteFd != mReadFd)
+				setNonBlocking(mWriteFd);
+
+			struct stat s;
+			mIsSocket = ::fstat(mWriteFd, &s) == 0 && S_ISSOCK(s.st_mode);
+
+			if (mReadFd == mWriteFd)
+				r.add(mReadFd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, this);
+			else
+			{
+				r.add(mReadFd, EPOLLIN | EPOLLRDHUP, this);
+				r.add(mWriteFd, EPOLLOUT, this);
+			}
+		}
+
+		PosixFd::~PosixFd()
+		{
+			::close(mReadFd);
+			if (mWriteFd != mReadFd)
+				::close(mWriteFd);
+		}
+
+		void PosixFd::detach(std::shared_ptr<PosixFd>&& self)
+		{
+			auto& r = *self->mReactor;
+			r.remove(self->mReadFd);
+			if (self->mWriteFd != self->mReadFd)
+				r.remove(self->mWriteFd);
+			r.release(std::move(self));
+		}
+
+		bool PosixFd::progress(PosixOp& op, Direction d)
+		{
+			while (true)
+			{
+				if (op.mCanceled || mClosed)
+				{
+					op.mEc = code::operation_aborted;
+					return true;
+				}
+
+				// any event after this point will cause a retry.
+				auto seq = mEvents[d].load(std::memory_order_acquire);
+				if (op.tryIo(*this))
+				{
+					// errors caused by close() are reported as aborts.
+					if (op.mEc && mClosed)
+						op.mEc = code::operation_aborted;
+					return true;
+				}
+
+				std::lock_guard<std::mutex> lock(mMtx);
+				if (mClosed || op.mCanceled)
+				{
+					op.mEc = code::operation_aborted;
+					return true;
+				}
+
+				if (mEvents[d].load(std::memory_order_relaxed) == seq)
+				{
+					assert(mPending[d] == nullptr);
+					mPending[d] = &op;
+					return false;
+				}
+			}
+		}
+
+		void PosixFd::cancel(PosixOp& op, Direction d)
+		{
+			bool parked = false;
+			{
+				std::lock_guard<std::mutex> lock(mMtx);
+				op.mCanceled = true;
+				if (mPending[d] == &op)
+				{
+					mPending[d] = nullptr;
+					parked = true;
+				}
+			}
+
+			// resume outside the lock.
+			if (parked)
+			{
+				op.mEc = code::operation_aborted;
+				op.mHandle.resume();
+			}
+		}
+
+		void PosixFd::close()
+		{
+			PosixOp* ops[2];
+			{
+				std::lock_guard<std::mutex> lock(mMtx);
+				mClosed = true;
+				ops[0] = std::exchange(mPending[0], nullptr);
+				ops[1] = std::exchange(mPending[1], nullptr);
+			}
+
+			if (mIsSocket)
+				::shutdown(mReadFd, SHUT_RDWR);
+
+			for (auto op : ops)
+			{
+				if (op)
+				{
+					op->mEc = code::operation_aborted;
+					op->mHandle.resume();
+				}
+			}
+		}
+
+		void PosixFd::onEvent(u32 events)
+		{
+			if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				ready(Read);
+			if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+				ready(Write);
+		}
+
+		void PosixFd::ready(Direction d)
+		{
+			PosixOp* op;
+			{
+				std::lock_guard<std::mutex> lock(mMtx);
+				mEvents[d].fetch_add(1, std::memory_order_release);
+				op = std::exchange(mPending[d], nullptr);
+			}
+
+			if (op && progress(*op, d))
+				op->complete();
+		}
+	}
+
+	PosixSocket::PosixSocket(int readFd, int writeFd, PosixReactor& r)
+		: PosixSocket(std::make_shared<detail::PosixFd>(readFd, writeFd, r))
+	{}
+
+	PosixSocket::PosixSocket(std::shared_ptr<detail::PosixFd> fd)
+		: Socket(make_socket_tag{}, Sock(std::move(fd)))
+	{
+		mSock = (Sock*)Socket::mImpl->getSocket();
+	}
+
+	std::array<PosixSocket, 2> PosixSocket::makePair(PosixReactor& r)
+	{
+		int fds[2];
+		if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds))
+			throwLastError("socketpair");
+		return { PosixSocket(fds[0], r), PosixSocket(fds[1], r) };
+	}
+
+	PosixSocket::Awaiter::Awaiter(Sock* s, span<u8> data, span<span<u8>> buffers, bool send, macoro::stop_token&& token, bool some)
+		: mFd(s->mFd.get())
+		, mData(data)
+		, mBuffers(buffers)
+		, mSend(send)
+		, mSome(some)
+		, mToken(std::move(token))
+	{
+		if (mBuffers.size())
+		{
+			for (auto b : mBuffers)
+				mTotal += b.size();
+		}
+		else
+			mTotal = mData.size();
+	}
+
+	bool PosixSocket::Awaiter::tryIo(detail::PosixFd& fd)
+	{
+		auto buffers = mBuffers.size() ? mBuffers : span<span<u8>>(&mData, 1);
+		while (true)
+		{
+			// the iovecs for the remaining data, at most 64 per call.
+			std::array<iovec, 64> iov;
+			u64 count = 0, skip = mBt;
+			for (u64 i = 0; i < buffers.size() && count < iov.size(); ++i)
+			{
+				if (skip >= buffers[i].size())
+				{
+					skip -= buffers[i].size();
+					continue;
+				}
+				iov[count].iov_base = buffers[i].data() + skip;
+				iov[count].iov_len = buffers[i].size() - skip;
+				++count;
+				skip = 0;
+			}
+
+			ssize_t n;
+			if (mSend)
+			{
+				if (fd.mIsSocket)
+				{
+					msghdr msg;
+					std::memset(&msg, 0, sizeof(msg));
+					msg.msg_iov = iov.data();
+					msg.msg_iovlen = count;
+					n = ::sendmsg(fd.mWriteFd, &msg, MSG_NOSIGNAL);
+				}
+				else
+					n = ::writev(fd.mWriteFd, iov.data(), count);
+			}
+			else
+				n = ::readv(fd.mReadFd, iov.data(), count);
+
+			if (n > 0)
+			{
+				mBt += n;
+				if (mBt == mTotal || mSome)
+					return true;
+			}
+			else if (n == 0)
+			{
+				mEc = code::remoteClosed;
+				return true;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
+			else if (errno != EINTR)
+			{
+				mEc = errno == EPIPE || errno == ECONNRESET ?
+					code::remoteClosed : lastError();
+				return true;
+			}
+		}
+	}
+
+	coroutine_handle<> PosixSocket::Awaiter::await_suspend(coroutine_handle<> h)
+	{
+		mHandle = h;
+		if (mTotal == 0)
+			return h;
+
+		if (mToken.stop_possible())
+			mReg.emplace(mToken, [this] { mFd->cancel(*this, direction()); });
+
+		// once parked, the operation might be completed by another
+		// thread and this awaiter can not be touched.
+		if (mFd->progress(*this, direction()))
+			return h;
+		return macoro::noop_coroutine();
+	}
+
+	PosixAcceptor::PosixAcceptor(std::string address, PosixReactor& r, int numConnection)
+		: mReactor(r)
+	{
+		sockaddr_storage addr;
+		socklen_t len;
+		resolve(address, true, addr, len);
+
+		auto fd = ::socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+			throwLastError("socket");
+		int one = 1;
+		::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (::bind(fd, (sockaddr*)&addr, len) || ::listen(fd, numConnection))
+		{
+			auto e = errno;
+			::close(fd);
+			throw std::system_error(e, std::system_category(), "failed to listen on " + address);
+		}
+		mFd = std::make_shared<detail::PosixFd>(fd, fd, r);
+	}
+
+	PosixAcceptor::~PosixAcceptor()
+	{
+		if (mFd)
+			detail::PosixFd::detach(std::move(mFd));
+	}
+
+	bool PosixAcceptor::Awaiter::tryIo(detail::PosixFd& fd)
+	{
+		while (true)
+		{
+			mAccepted = ::accept4(fd.mReadFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (mAccepted != -1)
+				return true;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
+			if (errno != EINTR && errno != ECONNABORTED)
+			{
+				mEc = lastError();
+				return true;
+			}
+		}
+	}
+
+	coroutine_handle<> PosixAcceptor::Awaiter::await_suspend(coroutine_handle<> h)
+	{
+		mHandle = h;
+		auto fd = mAcceptor.mFd.get();
+		if (mToken.stop_possible())
+			mReg.emplace(mToken, [this, fd] { fd->cancel(*this, detail::PosixFd::Read); });
+
+		if (fd->progress(*this, detail::PosixFd::Read))
+			return h;
+		return macoro::noop_coroutine();
+	}
+
+	PosixSocket PosixAcceptor::Awaiter::await_resume()
+	{
+		mReg.reset();
+		if (mEc)
+		{
+			if (mAccepted != -1)
+				::close(mAccepted);
+			throw std::system_error(mEc);
+		}
+		int one = 1;
+		::setsockopt(mAccepted, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		return PosixSocket(mAccepted, mAcceptor.mReactor);
+	}
+
+	PosixConnect::PosixConnect(std::string address, PosixReactor& r, macoro::stop_token token, bool retryOnFailure)
+		: mReactor(r)
+		, mToken(std::move(token))
+		, mRetryOnFailure(retryOnFailure)
+	{
+		resolve(address, false, mAddr, mAddrLen);
+	}
+
+	PosixConnect::PosixConnect(PosixConnect&& o)
+		: mAddr(o.mAddr)
+		, mAddrLen(o.mAddrLen)
+		, mReactor(o.mReactor)
+		, mToken(std::move(o.mToken))
+		, mRetryOnFailure(o.mRetryOnFailure)
+		, mRetryDelay(o.mRetryDelay)
+	{
+		if (o.mHandle)
+		{
+			std::cout << "PosixConnect can not be moved after it has started. " << COPROTO_LOCATION << std::endl;
+			std::terminate();
+		}
+	}
+
+	PosixConnect::~PosixConnect()
+	{
+		if (mFd)
+			detail::PosixFd::detach(std::move(mFd));
+	}
+
+	bool PosixConnect::attempt()
+	{
+		auto fd = ::socket(mAddr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+		{
+			mEc = lastError();
+			return true;
+		}
+
+		auto r = ::connect(fd, (sockaddr*)&mAddr, mAddrLen);
+		if (r == -1 && errno != EINPROGRESS && errno != EINTR)
+		{
+			mEc = lastError();
+			::close(fd);
+			return true;
+		}
+
+		auto f = std::make_shared<detail::PosixFd>(fd, fd, mReactor);
+		{
+			std::lock_guard<std::mutex> lock(mMtx);
+			mFd = f;
+		}
+		return f->progress(*this, detail::PosixFd::Write);
+	}
+
+	bool PosixConnect::tryIo(detail::PosixFd& fd)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (::getsockopt(fd.mWriteFd, SOL_SOCKET, SO_ERROR, &err, &len))
+			err = errno;
+		if (err)
+		{
+			mEc = error_code(err, std::system_category());
+			return true;
+		}
+
+		// SO_ERROR is also zero while the connection is in progress.
+		sockaddr_storage peer;
+		len = sizeof(peer);
+		if (::getpeername(fd.mWriteFd, (sockaddr*)&peer, &len) == 0)
+			return true;
+		if (errno == ENOTCONN)
+			return false;
+		mEc = lastError();
+		return true;
+	}
+
+	void PosixConnect::complete()
+	{
+		if (mEc && mEc != code::operation_aborted && mRetryOnFailure)
+		{
+			std::shared_ptr<detail::PosixFd> f;
+			std::unique_lock<std::mutex> lock(mMtx);
+			f = std::move(mFd);
+			if (mCanceled)
+				mEc = code::operation_aborted;
+			else
+			{
+				mEc = {};
+				mReactor.schedule(*this, mRetryDelay);
+			}
+			lock.unlock();
+
+			if (f)
+				detail::PosixFd::detach(std::move(f));
+			if (!mEc)
+				return;
+		}
+
+		mHandle.resume();
+	}
+
+	void PosixConnect::onTimer()
+	{
+		if (attempt())
+			complete();
+	}
+
+	void PosixConnect::await_suspend(coroutine_handle<> h)
+	{
+		mHandle = h;
+		if (mToken.stop_possible())
+		{
+			mReg.emplace(mToken, [this] {
+				std::unique_lock<std::mutex> lock(mMtx);
+				mCanceled = true;
+				if (mReactor.cancel(*this))
+				{
+					// it was waiting to retry.
+					lock.unlock();
+					mEc = code::operation_aborted;
+					mHandle.resume();
+				}
+				else if (auto f = mFd)
+				{
+					lock.unlock();
+					f->cancel(*this, detail::PosixFd::Write);
+				}
+			});
+		}
+
+		if (attempt())
+			complete();
+	}
+
+	PosixSocket PosixConnect::await_resume()
+	{
+		mReg.reset();
+		if (mEc)
+			throw std::system_error(mEc);
+
+		int one = 1;
+		::setsockopt(mFd->mWriteFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		return PosixSocket(std::move(mFd));
+	}
+}
+#endif
@@ -0,0 +1,406 @@
+#pragma once
+// © 2022 Visa.
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "coproto/config.h"
+#ifdef __linux__
+#include "coproto/Socket/Socket.h"
+#include "coproto/Common/Optional.h"
+#include "coproto/Common/macoro.h"
+
+#include <sys/socket.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace coproto
+{
+	// An epoll based event loop that is run by a single thread. File
+	// descriptors are registered once in edge triggered mode and the
+	// operations that are waiting on them are continued by the reactor
+	// thread when the fd becomes ready. Sockets can be spread over
+	// several reactors to use several threads.
+	class PosixReactor
+	{
+	public:
+
+		// Something that is notified of the epoll events of the
+		// fds it has registered.
+		struct Handler
+		{
+			virtual ~Handler() = default;
+
+			// called by the reactor thread with the epoll events.
+			virtual void onEvent(u32 events) = 0;
+		};
+
+		// An entry in the timer queue. onTimer() is called by the
+		// reactor thread once the deadline has passed.
+		struct Timer
+		{
+			virtual ~Timer() = default;
+			virtual void onTimer() = 0;
+
+			std::chrono::steady_clock::time_point mDeadline;
+			std::multimap<std::chrono::steady_clock::time_point, Timer*>::iterator mIter;
+			bool mScheduled = false;
+		};
+
+		PosixReactor();
+		PosixReactor(const PosixReactor&) = delete;
+		~PosixReactor();
+
+		// register fd for the given epoll events. Edge triggering is
+		// always used. The handler must outlive the registration.
+		void add(int fd, u32 events, Handler* h);
+
+		// unregister fd. Events that were already collected by the
+		// reactor thread might still be delivered. Use release() to
+		// destroy the handler once this can no longer happen.
+		void remove(int fd);
+
+		// drop the reference to a handler on the reactor thread after
+		// all events that might refer to it have been processed.
+		void release(std::shared_ptr<Handler>&& h);
+
+		// call t.onTimer() from the reactor thread after delay.
+		void schedule(Timer& t, std::chrono::steady_clock::duration delay);
+
+		// remove t from the timer queue. Returns false if t is not
+		// scheduled, e.g. because it has already fired.
+		bool cancel(Timer& t);
+
+		bool isReactorThread() const { return std::this_thread::get_id() == mThread.get_id(); }
+
+	private:
+
+		void run();
+		void wake();
+		void armTimer();
+		void fireTimers();
+
+		int mEpoll = -1, mWake = -1, mTimerFd = -1;
+		std::mutex mMtx;
+		bool mStop = false;
+		std::vector<std::shared_ptr<Handler>> mReleased;
+		std::multimap<std::chrono::steady_clock::time_point, Timer*> mTimers;
+		std::thread mThread;
+	};
+
+	// returns a reactor that is lazily started on first use.
+	PosixReactor& global_posix_reactor();
+
+	namespace detail
+	{
+		struct PosixFd;
+
+		// An operation on a PosixFd. The operation is first attempted
+		// inline and then parked on the fd if it would block.
+		struct PosixOp
+		{
+			PosixOp() = default;
+
+			// only valid before the operation has started.
+			PosixOp(PosixOp&& o)
+				: mEc(o.mEc)
+			{}
+			virtual ~PosixOp() = default;
+
+			// perform as much of the operation as possible without
+			// blocking. Returns true once the operation has completed,
+			// possibly with an error in mEc.
+			virtual bool tryIo(PosixFd& fd) = 0;
+
+			// called once the parked operation has completed.
+			virtual void complete() { mHandle.resume(); }
+
+			coroutine_handle<> mHandle;
+			error_code mEc;
+
+			// set if cancellation was requested while the operation was
+			// not parked.
+			std::atomic<bool> mCanceled{ false };
+		};
+
+		// A pair of non-blocking fds that are read from and written to.
+		// For a socket these are the same fd. The fds are owned and
+		// closed when this object is destroyed.
+		//
+		// Each direction can have one parked operation. A parked operation
+		// is retried by the reactor thread each time the fd reports being
+		// ready in that direction. Because epoll is edge triggered, a
+		// counter of the readiness events is kept so that an event which
+		// arrives between a failed attempt and the operation being parked
+		// is not lost.
+		struct PosixFd : PosixReactor::Handler
+		{
+			enum Direction { Read = 0, Write = 1 };
+
+			PosixFd(int readFd, int writeFd, PosixReactor& r);
+			~PosixFd();
+
+			int mReadFd = -1, mWriteFd = -1;
+			bool mIsSocket = false;
+			PosixReactor* mReactor = nullptr;
+
+			std::mutex mMtx;
+			std::atomic<bool> mClosed{ false };
+			PosixOp* mPending[2] = {};
+			std::atomic<u64> mEvents[2] = {};
+
+			// attempt op and park it if it would block. Returns true if
+			// the operation has completed, in which case the caller must
+			// complete it.
+			bool progress(PosixOp& op, Direction d);
+
+			// cancel op. If it is parked it is completed inline with
+			// code::operation_aborted.
+			void cancel(PosixOp& op, Direction d);
+
+			// shutdown the fd and abort any parked operations.
+			// Operations started after this complete with
+			// code::operation_aborted once they would block.
+			void close();
+
+			// unregister from the reactor and hand over the last reference.
+			static void detach(std::shared_ptr<PosixFd>&& self);
+
+			void onEvent(u32 events) override;
+
+		private:
+			void ready(Direction d);
+		};
+	}
+
+	// A socket that performs non-blocking readv/writev on a file
+	// descriptor and waits on a PosixReactor when they would block.
+	// It can wrap any stream fd, e.g. a TCP or unix domain socket, the
+	// result of socketpair(...) or a pair of pipes. The socket takes
+	// ownership of the fds. Boost is not required.
+	struct PosixSocket : public Socket
+	{
+		struct Sock;
+
+		// wrap a connected stream socket, pipe, etc.
+		PosixSocket(int fd, PosixReactor& r = global_posix_reactor())
+			: PosixSocket(fd, fd, r)
+		{}
+
+		// read from readFd and write to writeFd, e.g. two pipes.
+		PosixSocket(int readFd, int writeFd, PosixReactor& r = global_posix_reactor());
+
+		PosixSocket(std::shared_ptr<detail::PosixFd> fd);
+
+		PosixSocket() = default;
+		PosixSocket(const PosixSocket&) = default;
+		PosixSocket(PosixSocket&& o) :
+			Socket(std::move(o)),
+			mSock(std::exchange(o.mSock, nullptr))
+		{}
+
+		PosixSocket& operator=(const PosixSocket&) = default;
+		PosixSocket& operator=(PosixSocket&& o)
+		{
+			static_cast<Socket&>(*this) = std::move(static_cast<Socket&>(o)),
+			mSock = std::exchange(o.mSock, nullptr);
+			return *this;
+		}
+
+		// a connected pair from socketpair(AF_UNIX, ...).
+		static std::array<PosixSocket, 2> makePair(PosixReactor& r = global_posix_reactor());
+
+		struct Awaiter : detail::PosixOp
+		{
+			Awaiter(Sock* s, span<u8> data, span<span<u8>> buffers, bool send, macoro::stop_token&& token, bool some = false);
+
+			detail::PosixFd* mFd;
+			span<u8> mData;
+			span<span<u8>> mBuffers;
+			bool mSend, mSome;
+			u64 mBt = 0, mTotal = 0;
+			macoro::stop_token mToken;
+			macoro::optional_stop_callback mReg;
+
+			detail::PosixFd::Direction direction() const {
+				return mSend ? detail::PosixFd::Write : detail::PosixFd::Read;
+			}
+
+			bool tryIo(detail::PosixFd& fd) override;
+
+			bool await_ready() { return false; }
+
+			coroutine_handle<> await_suspend(coroutine_handle<> h);
+#ifdef COPROTO_CPP20
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) {
+				return await_suspend(coroutine_handle<>(h)).std_cast();
+			}
+#endif
+			std::pair<error_code, u64> await_resume() { return { mEc, mBt }; }
+		};
+
+		struct Sock
+		{
+			std::shared_ptr<detail::PosixFd> mFd;
+
+			Sock(std::shared_ptr<detail::PosixFd> fd)
+				: mFd(std::move(fd))
+			{}
+			Sock(Sock&&) = default;
+			~Sock()
+			{
+				if (mFd)
+					detail::PosixFd::detach(std::move(mFd));
+			}
+
+			MACORO_NODISCARD
+			auto close()
+			{
+				struct Awaiter
+				{
+					detail::PosixFd* mFd;
+					bool await_ready() const noexcept { return false; }
+					std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept
+					{
+						mFd->close();
+						return h;
+					}
+					void await_resume() const noexcept {}
+				};
+				return Awaiter{ mFd.get() };
+			}
+
+			Awaiter send(span<u8> data, macoro::stop_token token = {}) { return Awaiter(this, data, {}, true, std::move(token)); };
+			Awaiter recv(span<u8> data, macoro::stop_token token = {}) { return Awaiter(this, data, {}, false, std::move(token)); };
+
+			// optional scatter/gather interface. The buffers are passed
+			// to a single writev/readv where possible.
+			Awaiter sendv(span<span<u8>> data, macoro::stop_token token = {}) { return Awaiter(this, {}, data, true, std::move(token)); };
+			Awaiter recvv(span<span<u8>> data, macoro::stop_token token = {}) { return Awaiter(this, {}, data, false, std::move(token)); };
+
+			// optional partial receive. Completes once some data has been read.
+			Awaiter recvSome(span<u8> data, macoro::stop_token token = {}) { return Awaiter(this, data, {}, false, std::move(token), true); };
+		};
+
+		Sock* mSock = nullptr;
+	};
+
+	// Listens on "host:port". Each co_await of accept() results
+	// in a connected PosixSocket. Errors are thrown as std::system_error.
+	struct PosixAcceptor
+	{
+		PosixAcceptor(
+			std::string address,
+			PosixReactor& r = global_posix_reactor(),
+			int numConnection = SOMAXCONN);
+		PosixAcceptor(PosixAcceptor&& o)
+			: mFd(std::move(o.mFd))
+			, mReactor(o.mReactor)
+		{}
+		PosixAcceptor(const PosixAcceptor&) = delete;
+		~PosixAcceptor();
+
+		std::shared_ptr<detail::PosixFd> mFd;
+		PosixReactor& mReactor;
+
+		struct Awaiter : detail::PosixOp
+		{
+			Awaiter(PosixAcceptor& a, macoro::stop_token token = {})
+				: mAcceptor(a)
+				, mToken(std::move(token))
+			{}
+
+			PosixAcceptor& mAcceptor;
+			int mAccepted = -1;
+			macoro::stop_token mToken;
+			macoro::optional_stop_callback mReg;
+
+			bool tryIo(detail::PosixFd& fd) override;
+
+			bool await_ready() { return false; }
+			coroutine_handle<> await_suspend(coroutine_handle<> h);
+#ifdef COPROTO_CPP20
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) {
+				return await_suspend(coroutine_handle<>(h)).std_cast();
+			}
+#endif
+			PosixSocket await_resume();
+		};
+
+		Awaiter accept(macoro::stop_token token = {}) { return Awaiter(*this, std::move(token)); }
+		Awaiter operator co_await() { return accept(); }
+	};
+
+	// Connects to "host:port". If mRetryOnFailure is set, a failed
+	// attempt is retried after mRetryDelay until it succeeds or
+	// the token is stopped. Errors are thrown as std::system_error.
+	struct PosixConnect : detail::PosixOp, PosixReactor::Timer
+	{
+		PosixConnect(
+			std::string address,
+			PosixReactor& r = global_posix_reactor(),
+			macoro::stop_token token = {},
+			bool retryOnFailure = true);
+		PosixConnect(const PosixConnect&) = delete;
+		PosixConnect(PosixConnect&& o);
+		~PosixConnect();
+
+		sockaddr_storage mAddr;
+		socklen_t mAddrLen = 0;
+		PosixReactor& mReactor;
+		macoro::stop_token mToken;
+		macoro::optional_stop_callback mReg;
+		bool mRetryOnFailure;
+		std::chrono::milliseconds mRetryDelay{ 1 };
+
+		// protects mFd and the timer against the stop callback.
+		std::mutex mMtx;
+		std::shared_ptr<detail::PosixFd> mFd;
+
+		// start a connection attempt. Returns true if it completed inline.
+		bool attempt();
+
+		bool tryIo(detail::PosixFd& fd) override;
+		void complete() override;
+		void onTimer() override;
+
+		bool await_ready() { return false; }
+		void await_suspend(coroutine_handle<> h);
+#ifdef COPROTO_CPP20
+		void await_suspend(std::coroutine_handle<> h) {
+			await_suspend(coroutine_handle<>(h));
+		}
+#endif
+		PosixSocket await_resume();
+	};
+
+	// blocking helper that either accepts one connection on
+	// address or connects to it.
+	inline PosixSocket posixConnect(std::string address, bool server, PosixReactor& r = global_posix_reactor())
+	{
+		if (server)
+		{
+			return macoro::sync_wait(
+				macoro::make_task(PosixAcceptor(address, r, 1))
+			);
+		}
+		else
+		{
+			return macoro::sync_wait(
+				macoro::make_task(PosixConnect(address, r))
+			);
+		}
+	}
+}
+
+#endif
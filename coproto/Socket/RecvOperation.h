@@ -8,7 +8,7 @@
 namespace coproto::internal
 {
 	struct SocketFork;
-	using SocketForkIter = std::list<SocketFork>::iterator;
+	class FlushEpochs;
 	u64& recvIndex(SocketFork*);
 	// an receive data operation.
 	struct RecvOperation
@@ -32,17 +32,19 @@ namespace coproto::internal
 		Status mStatus = Status::NotStarted;
 
 		optional<macoro::stop_callback> mReg;
-
-		std::vector<std::shared_ptr<FlushToken>> mFlushes;
 	public:
 
+		// the epochs of the socket and of the fork that this operation
+		// was started in, see FlushEpochs.
+		u64 mFlushEpoch = 0, mForkFlushEpoch = 0;
+
 		//u64 mIndex;
 
 		RecvOperation(
 			RecvBuffer& r,
 			coroutine_handle<void> ch,
-			SocketForkIter s)
-			: mSocketFork(&*s)
+			SocketFork* s)
+			: mSocketFork(s)
 			, mCH(ch)
 			, mRecvBuffer(r)
 			//, mIndex(recvIndex(mSocketFork)++)
@@ -60,11 +62,6 @@ namespace coproto::internal
 			}
 		}
 
-		void addFlush(std::shared_ptr<FlushToken>& t, Lock& l)
-		{
-			mFlushes.push_back(t);
-		}
-
 		SocketFork& fork()
 		{
 			return *mSocketFork;
@@ -132,6 +129,17 @@ namespace coproto::internal
 			return mRecvBuffer.asSpan(size);
 		}
 
+		span<span<u8>> asSpans(u64 size, span<u8>& single)
+		{
+			return mRecvBuffer.asSpans(size, single);
+		}
+
+		// see RecvBuffer::take(...).
+		bool take(std::vector<u8>& msg)
+		{
+			return mRecvBuffer.take(msg);
+		}
+
 		//void setError(std::exception_ptr ptr)
 		//{
 		//	mRecvBuffer.setError(std::move(ptr));
@@ -148,7 +156,7 @@ namespace coproto::internal
 		//	return mToken;
 		//}
 
-		void completeOn(ExecutionQueue::Handle& queue, Lock& l);
+		void completeOn(ExecutionQueue::Handle& queue, FlushEpochs& flushes, Lock& l);
 
 	//	// collect the callbacks associated with this operation.
 	//	// there is the completion handle and optionally flush operations.
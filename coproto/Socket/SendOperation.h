@@ -1,6 +1,7 @@
 #pragma once
 
 #include <list>
+#include <cstring>
 #include "coproto/Common/macoro.h"
 //#include "coproto/Proto/Buffers.h"
 #include "coproto/Socket/Executor.h"
@@ -15,7 +16,7 @@ namespace coproto::internal
 
 	struct SockScheduler;
 	struct SocketFork;
-	using SocketForkIter = std::list<SocketFork>::iterator;
+	class FlushEpochs;
 
 
 	struct SendOperation
@@ -35,14 +36,14 @@ namespace coproto::internal
 		// optional storage to keep the buffer alive
 		InlinePoly<SendBuffer, 8 * sizeof(u64)> mStorage;
 
-		// the data to be sent.
-		span<u8> mSendBuffer;
+		// the total number of bytes to be sent.
+		u64 mSize = 0;
 
 		// the current status of the operation
 		Status mStatus = Status::NotStarted;
 
 		// a pointer to the parent fork.
-		SocketForkIter mSocketFork;
+		SocketFork* mSocketFork;
 
 		// in intrusive linked list of the send operation in order.
 		SendOperation* mNext = nullptr;
@@ -50,30 +51,44 @@ namespace coproto::internal
 		// in intrusive linked list of the send operation in order.
 		SendOperation* mPrev = nullptr;
 
+		// true if the caller no longer waits for the outcome, see detach().
+		bool mDetached = false;
+
+		// true if the caller can cancel the operation, see cancelable().
+		bool mCancelable = false;
+
+		// the error of a detached operation. It is reported by the next 
+		// flush, see FlushEpochs::fail(...).
+		error_code mDetachedEC;
+
 		// an optional stop token assoicated with this operation.
 		//macoro::stop_token mToken;
 
 		// if mToken is set, then this will be the registation callback.
 		optional<macoro::stop_callback> mReg;
-
-		// flush operations that are waiting on this operation.
-		std::vector<std::shared_ptr<FlushToken>> mFlushes;
 	public:
 
+		// the epochs of the socket and of the fork that this operation
+		// was started in, see FlushEpochs.
+		u64 mFlushEpoch = 0, mForkFlushEpoch = 0;
+
 		SendOperation() = delete;
 		SendOperation(const SendOperation&) = delete;
 		SendOperation(SendOperation&&) = delete;
 
 		template<typename Buffer>
 		SendOperation(
-			SocketForkIter ss,
+			SocketFork* ss,
 			coroutine_handle<void> ch,
 			Buffer&& s)
 			: mCH(ch)
 			, mStorage(std::forward<Buffer>(s))
-			, mSendBuffer(mStorage->asSpan())
 			, mSocketFork(ss)
-		{}
+		{
+			span<u8> single;
+			for (auto b : mStorage->asSpans(single))
+				mSize += b.size();
+		}
 
 		template<typename Fn>
 		void setCancelation(
@@ -86,14 +101,23 @@ namespace coproto::internal
 			}
 		}
 
-		void addFlush(std::shared_ptr<FlushToken>& t, Lock& l)
+		SocketFork& fork()
 		{
-			mFlushes.push_back(t);
+			return *mSocketFork;
 		}
 
-		SocketFork& fork()
+		// true if the operation has a stop token that can be triggered. 
+		// Canceling it while it is written fails the write, so such an
+		// operation is written on its own, see NextSendOp::takeBatch(...).
+		// It is set before the operation is queued.
+		bool cancelable()
 		{
-			return *mSocketFork;
+			return mCancelable;
+		}
+
+		void setCancelable(bool c)
+		{
+			mCancelable = c;
 		}
 
 		Status status() 
@@ -123,6 +147,11 @@ namespace coproto::internal
 				next->mPrev = this;
 		}
 
+		void setPrev(SendOperation* prev)
+		{
+			mPrev = prev;
+		}
+
 		//[this] {
 
 		//	CBQueue<coroutine_handle<>> cb;
@@ -163,9 +192,50 @@ namespace coproto::internal
 		//		cancelSrc.request_stop();
 		//	}
 
-		span<u8> asSpan()
+		// the buffers that are sent as one message, see
+		// SendBuffer::asSpans(...).
+		span<span<u8>> asSpans(span<u8>& single)
+		{
+			return mStorage->asSpans(single);
+		}
+
+		// the total size of the message.
+		u64 size()
+		{
+			return mSize;
+		}
+
+		// copy the message into storage that the operation owns so that
+		// the caller can continue before it has been sent. Returns the 
+		// completion handle, which the caller must resume, or null if 
+		// the operation already owns its message.
+		coroutine_handle<void> detach()
+		{
+			COPROTO_ASSERT(mStatus == Status::NotStarted);
+			if (mStorage->owned())
+				return nullptr;
+
+			std::vector<u8> msg(mSize);
+			auto iter = msg.data();
+			span<u8> single;
+			for (auto b : mStorage->asSpans(single))
+			{
+				if (b.size())
+					std::memcpy(iter, b.data(), b.size());
+				iter += b.size();
+			}
+
+			// the caller no longer waits for the outcome.
+			mStorage.emplace<MvSendBuffer<std::vector<u8>>>(std::move(msg), nullptr);
+			mDetached = true;
+			return std::exchange(mCH, macoro::noop_coroutine());
+		}
+
+		// the vector that holds the message if the operation owns it,
+		// see SendBuffer::ownedVector().
+		std::vector<u8>* ownedVector()
 		{
-			return mStorage->asSpan();
+			return mStorage->ownedVector();
 		}
 
 		//void setError(std::exception_ptr ptr)
@@ -175,7 +245,10 @@ namespace coproto::internal
 
 		void setError(error_code ec)
 		{
-			mStorage->setError(ec);
+			if (mDetached)
+				mDetachedEC = ec;
+			else
+				mStorage->setError(ec);
 		}
 
 		//macoro::stop_token& cancellationToken()
@@ -183,7 +256,7 @@ namespace coproto::internal
 		//	return mToken;
 		//}
 
-		void completeOn(ExecutionQueue::Handle& queue, Lock& l);
+		void completeOn(ExecutionQueue::Handle& queue, FlushEpochs& flushes, Lock& l);
 
 		//// collect the callbacks associated with this operation.
 		//// there is the completion handle and optionally flush operations.
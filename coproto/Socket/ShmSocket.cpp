@@ -0,0 +1,573 @@
+#include "ShmSocket.h"
+#ifdef __linux__
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <system_error>
+
+namespace coproto
+{
+	namespace
+	{
+		constexpr u64 ShmMagic = 0x636f70726f746f32ull;
+		constexpr u64 MinSpin = 16, MaxSpin = 1 << 16;
+
+		// the longest that a worker sleeps before it checks on the peer.
+		constexpr std::chrono::milliseconds ShmHeartbeatInterval(100);
+
+		static_assert(sizeof(std::atomic<u32>) == sizeof(u32), "futex words must be plain u32");
+		static_assert(std::atomic<u64>::is_always_lock_free, "the rings require lock free atomics");
+
+		// the mapping is shared between processes so the
+		// non-private futex operations are used. Returns true if 
+		// the wait timed out.
+		bool futexWait(std::atomic<u32>& word, u32 expected, std::chrono::milliseconds timeout)
+		{
+			timespec ts;
+			ts.tv_sec = timeout.count() / 1000;
+			ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+			return ::syscall(SYS_futex, (u32*)&word, FUTEX_WAIT, expected, &ts, nullptr, 0) == -1 &&
+				errno == ETIMEDOUT;
+		}
+
+		void futexWake(std::atomic<u32>& word)
+		{
+			::syscall(SYS_futex, (u32*)&word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+		}
+
+		void cpuRelax()
+		{
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#elif defined(__aarch64__)
+			asm volatile("yield");
+#endif
+		}
+
+		void throwLastError(const char* what)
+		{
+			throw std::system_error(errno, std::system_category(), what);
+		}
+
+		u64 roundUpPow2(u64 v)
+		{
+			u64 r = 4096;
+			while (r < v)
+				r *= 2;
+			return r;
+		}
+	}
+
+	namespace detail
+	{
+		ShmState::ShmState(int fd, u64 party, bool init, u64 capacity)
+			: mParty(party)
+		{
+			if (party > 1)
+				throw std::runtime_error("party must be 0 or 1. " COPROTO_LOCATION);
+
+			auto dataOffset = (sizeof(ShmLayout) + 4095) & ~u64(4095);
+			if (init)
+			{
+				capacity = roundUpPow2(capacity);
+				mMapSize = dataOffset + 2 * capacity;
+				if (::ftruncate(fd, mMapSize))
+				{
+					auto e = errno;
+					::close(fd);
+					throw std::system_error(e, std::system_category(), "ftruncate");
+				}
+			}
+			else
+			{
+				struct stat s;
+				if (::fstat(fd, &s))
+				{
+					auto e = errno;
+					::close(fd);
+					throw std::system_error(e, std::system_category(), "fstat");
+				}
+				if ((u64)s.st_size < dataOffset)
+				{
+					// the other party has not resized it yet.
+					::close(fd);
+					throw std::system_error(EAGAIN, std::system_category(), "the shared memory is not initialized. " COPROTO_LOCATION);
+				}
+				mMapSize = s.st_size;
+			}
+
+			auto ptr = ::mmap(nullptr, mMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			::close(fd);
+			if (ptr == MAP_FAILED)
+				throwLastError("mmap");
+			mLayout = (ShmLayout*)ptr;
+
+			if (init)
+			{
+				new (mLayout) ShmLayout{};
+				mLayout->mCapacity = capacity;
+				mLayout->mDataOffset = dataOffset;
+				mCapacity = capacity;
+				mLayout->mMagic.store(ShmMagic, std::memory_order_release);
+			}
+			else
+			{
+				auto magic = mLayout->mMagic.load(std::memory_order_acquire);
+				if (magic == 0)
+				{
+					// the other party has not initialized it yet.
+					::munmap(mLayout, mMapSize);
+					throw std::system_error(EAGAIN, std::system_category(), "the shared memory is not initialized. " COPROTO_LOCATION);
+				}
+
+				// the layout is read once. The rings must be a power of
+				// two and lie within the mapping.
+				mCapacity = mLayout->mCapacity;
+				dataOffset = mLayout->mDataOffset;
+				if (magic != ShmMagic ||
+					mCapacity == 0 ||
+					(mCapacity & (mCapacity - 1)) ||
+					dataOffset < sizeof(ShmLayout) ||
+					dataOffset > mMapSize ||
+					mCapacity > (mMapSize - dataOffset) / 2)
+				{
+					::munmap(mLayout, mMapSize);
+					throw std::runtime_error("the shared memory is not a coproto socket. " COPROTO_LOCATION);
+				}
+			}
+
+			auto data = (u8*)mLayout + dataOffset;
+			mSendRing = &mLayout->mRings[party];
+			mRecvRing = &mLayout->mRings[party ^ 1];
+			mSendData = data + party * mCapacity;
+			mRecvData = data + (party ^ 1) * mCapacity;
+			mSelf = &mLayout->mParties[party];
+			mPeer = &mLayout->mParties[party ^ 1];
+			mPeerBeat = mPeer->mHeartbeat.load(std::memory_order_relaxed);
+			mPeerSeen = std::chrono::steady_clock::now();
+
+			mWorker = std::thread([this] { run(); });
+		}
+
+		ShmState::~ShmState()
+		{
+			close();
+			{
+				std::lock_guard<std::mutex> lock(mMtx);
+				mStop = true;
+			}
+			notifySelf();
+			mWorker.join();
+			::munmap(mLayout, mMapSize);
+		}
+
+		bool ShmState::corrupted() const
+		{
+			// the ring only uses mCapacity. A changed layout means
+			// that the peer has written to it.
+			return mLayout->mCapacity != mCapacity;
+		}
+
+		u64 ShmState::write(span<u8> data)
+		{
+			auto cap = mCapacity;
+			auto head = mSendRing->mHead.load(std::memory_order_relaxed);
+			auto tail = mSendRing->mTail.load(std::memory_order_acquire);
+
+			// the counters are in the shared mapping. If the peer has 
+			// corrupted them, the copy would overrun the ring.
+			if (head - tail > cap || corrupted())
+			{
+				mError = code::badCoprotoMessageHeader;
+				return 0;
+			}
+			auto n = std::min<u64>(cap - (head - tail), data.size());
+			auto pos = head & (cap - 1);
+			auto first = std::min<u64>(n, cap - pos);
+			std::memcpy(mSendData + pos, data.data(), first);
+			std::memcpy(mSendData, data.data() + first, n - first);
+			mSendRing->mHead.store(head + n, std::memory_order_release);
+			return n;
+		}
+
+		u64 ShmState::read(span<u8> data)
+		{
+			auto cap = mCapacity;
+			auto tail = mRecvRing->mTail.load(std::memory_order_relaxed);
+			auto head = mRecvRing->mHead.load(std::memory_order_acquire);
+			if (head - tail > cap || corrupted())
+			{
+				mError = code::badCoprotoMessageHeader;
+				return 0;
+			}
+			auto n = std::min<u64>(head - tail, data.size());
+			auto pos = tail & (cap - 1);
+			auto first = std::min<u64>(n, cap - pos);
+			std::memcpy(data.data(), mRecvData + pos, first);
+			std::memcpy(data.data() + first, mRecvData, n - first);
+			mRecvRing->mTail.store(tail + n, std::memory_order_release);
+			return n;
+		}
+
+		bool ShmState::peerStopped()
+		{
+			if (mRecvRing->mWriterClosed.load(std::memory_order_acquire) &&
+				mSendRing->mReaderClosed.load(std::memory_order_acquire))
+				return false;
+
+			auto now = std::chrono::steady_clock::now();
+			auto beat = mPeer->mHeartbeat.load(std::memory_order_relaxed);
+			if (beat != mPeerBeat)
+			{
+				mPeerBeat = beat;
+				mPeerSeen = now;
+				return false;
+			}
+			return now - mPeerSeen >= mPeerTimeout;
+		}
+
+		void ShmState::notifyPeer()
+		{
+			// pairs with the fence in run() before the peer goes to sleep.
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (mPeer->mSleeping.load(std::memory_order_relaxed))
+			{
+				mPeer->mDoorbell.fetch_add(1);
+				futexWake(mPeer->mDoorbell);
+			}
+		}
+
+		void ShmState::notifySelf()
+		{
+			mSelf->mDoorbell.fetch_add(1);
+			if (mSelf->mSleeping.load())
+				futexWake(mSelf->mDoorbell);
+		}
+
+		u64 ShmState::progressToken() const
+		{
+			// each term only increases.
+			return
+				mRecvRing->mHead.load(std::memory_order_acquire) +
+				mSendRing->mTail.load(std::memory_order_acquire) +
+				mRecvRing->mWriterClosed.load(std::memory_order_acquire) +
+				mSendRing->mReaderClosed.load(std::memory_order_acquire);
+		}
+
+		void ShmState::close()
+		{
+			std::array<ShmIo*, 2> pending;
+			{
+				std::lock_guard<std::mutex> lock(mMtx);
+				if (mClosed)
+					return;
+				mClosed = true;
+				pending = std::exchange(mPending, {});
+				mSendRing->mWriterClosed.store(1, std::memory_order_release);
+				mRecvRing->mReaderClosed.store(1, std::memory_order_release);
+			}
+
+			// the peer is woken even if it is spinning.
+			mPeer->mDoorbell.fetch_add(1);
+			futexWake(mPeer->mDoorbell);
+
+			for (auto op : pending)
+			{
+				if (op)
+				{
+					op->mEc = code::operation_aborted;
+					op->mHandle.resume();
+				}
+			}
+		}
+
+		void ShmState::run()
+		{
+			bool timedOut = false;
+			while (true)
+			{
+				// tells the peer that we are still running.
+				mSelf->mHeartbeat.fetch_add(1, std::memory_order_relaxed);
+
+				// any doorbell or ring change after this point
+				// will prevent us from sleeping.
+				auto seq = mSelf->mDoorbell.load(std::memory_order_acquire);
+				auto token = progressToken();
+
+				std::array<ShmIo*, 2> done = {};
+				bool waiting = false;
+				std::chrono::milliseconds sleepFor;
+				{
+					std::lock_guard<std::mutex> lock(mMtx);
+					if (mStop)
+						return;
+
+					// a peer that has stopped, e.g. crashed, will not 
+					// wake us. The pending operations fail.
+					if (std::exchange(timedOut, false) && !mError && peerStopped())
+						mError = code::remoteClosed;
+					sleepFor = std::min(ShmHeartbeatInterval, mPeerTimeout);
+
+					for (u64 i = 0; i < 2; ++i)
+					{
+						if (mPending[i] && mPending[i]->tryIo())
+							done[i] = std::exchange(mPending[i], nullptr);
+					}
+					waiting = mPending[0] || mPending[1];
+				}
+
+				if (done[0] || done[1])
+				{
+					for (auto op : done)
+						if (op)
+							op->mHandle.resume();
+					continue;
+				}
+
+				if (waiting)
+				{
+					// the other party is often about to make progress.
+					bool progressed = false;
+					for (u64 i = 0; i < mSpin && !progressed; ++i)
+					{
+						cpuRelax();
+						progressed =
+							mSelf->mDoorbell.load(std::memory_order_relaxed) != seq ||
+							progressToken() != token;
+					}
+
+					if (progressed)
+					{
+						mSpin = std::min(mSpin * 2, MaxSpin);
+						continue;
+					}
+					mSpin = std::max(mSpin / 2, MinSpin);
+				}
+
+				mSelf->mSleeping.store(1);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (progressToken() == token)
+					timedOut = futexWait(mSelf->mDoorbell, seq, sleepFor);
+				mSelf->mSleeping.store(0);
+			}
+		}
+
+		ShmIo::ShmIo(ShmState* s, span<u8> data, span<span<u8>> buffers, bool send, bool some)
+			: mState(s)
+			, mData(data)
+			, mBuffers(buffers)
+			, mSend(send)
+			, mSome(some)
+		{
+			if (mBuffers.size())
+			{
+				for (auto b : mBuffers)
+					mTotal += b.size();
+			}
+			else
+				mTotal = mData.size();
+		}
+
+		bool ShmIo::tryIo()
+		{
+			auto& s = *mState;
+			auto buffers = mBuffers.size() ? mBuffers : span<span<u8>>(&mData, 1);
+
+			if (s.mError)
+			{
+				mEc = s.mError;
+				return true;
+			}
+
+			// nobody will read what is sent.
+			if (mSend && s.mSendRing->mReaderClosed.load(std::memory_order_acquire))
+			{
+				mEc = code::remoteClosed;
+				return true;
+			}
+
+			u64 moved = 0;
+			while (mBt != mTotal)
+			{
+				if (mBufOffset == buffers[mBufIdx].size())
+				{
+					++mBufIdx;
+					mBufOffset = 0;
+					continue;
+				}
+
+				auto b = buffers[mBufIdx].subspan(mBufOffset);
+				auto n = mSend ? s.write(b) : s.read(b);
+				if (n == 0)
+					break;
+
+				mBt += n;
+				mBufOffset += n;
+				moved += n;
+			}
+
+			if (moved)
+				s.notifyPeer();
+
+			if (s.mError)
+			{
+				mEc = s.mError;
+				return true;
+			}
+
+			if (mBt == mTotal || (mSome && mBt))
+				return true;
+
+			if (!mSend && s.mRecvRing->mWriterClosed.load(std::memory_order_acquire))
+			{
+				// the data written before the close is still received.
+				if (s.mRecvRing->mHead.load(std::memory_order_acquire) ==
+					s.mRecvRing->mTail.load(std::memory_order_relaxed))
+				{
+					mEc = code::remoteClosed;
+					return true;
+				}
+				return tryIo();
+			}
+
+			return false;
+		}
+	}
+
+	ShmSocket::ShmSocket(std::unique_ptr<detail::ShmState> s)
+		: Socket(make_socket_tag{}, Sock(std::move(s)))
+	{
+		mSock = (Sock*)Socket::mImpl->getSocket();
+	}
+
+	ShmSocket::ShmSocket(int fd, u64 party, bool init, u64 capacity)
+		: ShmSocket(std::make_unique<detail::ShmState>(fd, party, init, capacity))
+	{}
+
+	std::array<ShmSocket, 2> ShmSocket::makePair(u64 capacity)
+	{
+		auto fd = (int)::syscall(SYS_memfd_create, "coproto-shm", MFD_CLOEXEC);
+		if (fd == -1)
+			throwLastError("memfd_create");
+		auto fd1 = ::dup(fd);
+		if (fd1 == -1)
+		{
+			::close(fd);
+			throwLastError("dup");
+		}
+
+		// each party has its own mapping, as it would in two processes.
+		ShmSocket s0(fd, 0, true, capacity);
+		ShmSocket s1(fd1, 1, false);
+		return { std::move(s0), std::move(s1) };
+	}
+
+	ShmSocket ShmSocket::create(std::string name, u64 capacity)
+	{
+		auto fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+		if (fd == -1)
+			throw std::system_error(errno, std::system_category(), "shm_open " + name);
+		try {
+			return ShmSocket(fd, 0, true, capacity);
+		}
+		catch (...)
+		{
+			::shm_unlink(name.c_str());
+			throw;
+		}
+	}
+
+	ShmSocket ShmSocket::open(std::string name)
+	{
+		auto fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0600);
+		if (fd == -1)
+			throw std::system_error(errno, std::system_category(), "shm_open " + name);
+		ShmSocket s(fd, 1, false);
+		::shm_unlink(name.c_str());
+		return s;
+	}
+
+	ShmSocket shmConnect(std::string name, bool server, u64 capacity, macoro::stop_token token)
+	{
+		if (server)
+			return ShmSocket::create(name, capacity);
+
+		while (true)
+		{
+			try {
+				return ShmSocket::open(name);
+			}
+			catch (std::system_error& e)
+			{
+				// the server has not created or initialized it yet.
+				// Other errors are reported.
+				if (e.code() != std::errc::no_such_file_or_directory &&
+					e.code() != std::errc::resource_unavailable_try_again)
+					throw;
+			}
+
+			if (token.stop_requested())
+				throw std::system_error(code::operation_aborted);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	ShmSocket::Awaiter::Awaiter(Sock* s, span<u8> data, span<span<u8>> buffers, bool send, macoro::stop_token&& token, bool some)
+		: detail::ShmIo(s->mState.get(), data, buffers, send, some)
+		, mToken(std::move(token))
+	{}
+
+	coroutine_handle<> ShmSocket::Awaiter::await_suspend(coroutine_handle<> h)
+	{
+		mHandle = h;
+		if (mTotal == 0)
+			return h;
+
+		auto& s = *mState;
+		if (mToken.stop_possible())
+		{
+			mReg.emplace(mToken, [this] {
+				auto& s = *mState;
+				bool parked;
+				{
+					std::lock_guard<std::mutex> lock(s.mMtx);
+					mCanceled = true;
+					parked = s.mPending[mSend] == this;
+					if (parked)
+						s.mPending[mSend] = nullptr;
+				}
+				if (parked)
+				{
+					mEc = code::operation_aborted;
+					mHandle.resume();
+				}
+			});
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(s.mMtx);
+			if (mCanceled || s.mClosed)
+			{
+				mEc = code::operation_aborted;
+				return h;
+			}
+			if (tryIo())
+				return h;
+			s.mPending[mSend] = this;
+		}
+
+		// once parked, the operation might be completed by
+		// the worker and this awaiter can not be touched.
+		s.notifySelf();
+		return macoro::noop_coroutine();
+	}
+}
+#endif
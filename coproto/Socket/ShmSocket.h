@@ -0,0 +1,276 @@
+#pragma once
+// © 2022 Visa.
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include "coproto/config.h"
+#ifdef __linux__
+#include "coproto/Socket/Socket.h"
+#include "coproto/Common/macoro.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace coproto
+{
+	namespace detail
+	{
+		// One direction of a ShmSocket. A single producer single
+		// consumer byte ring that lives in the shared mapping. mHead and
+		// mTail are byte counters that only increase; the position in
+		// the ring is the counter modulo the capacity.
+		struct ShmRing
+		{
+			alignas(64) std::atomic<u64> mHead;
+			alignas(64) std::atomic<u64> mTail;
+
+			// set by the writer and the reader when they close.
+			alignas(64) std::atomic<u32> mWriterClosed;
+			std::atomic<u32> mReaderClosed;
+		};
+
+		// the per party futex words. mDoorbell is incremented and woken
+		// whenever the party might be able to make progress and
+		// mSleeping is set. mHeartbeat is incremented by the worker of
+		// the party, at least once per ShmHeartbeatInterval.
+		struct ShmParty
+		{
+			alignas(64) std::atomic<u32> mDoorbell;
+			std::atomic<u32> mSleeping;
+			std::atomic<u64> mHeartbeat;
+		};
+
+		// the start of the shared mapping. The two rings'
+		// data follows at mDataOffset.
+		struct ShmLayout
+		{
+			std::atomic<u64> mMagic;
+			u64 mCapacity;
+			u64 mDataOffset;
+			ShmRing mRings[2];
+			ShmParty mParties[2];
+		};
+
+		struct ShmIo;
+
+		// The process local state of one end of a ShmSocket. Operations
+		// are first attempted inline. An operation that can not complete
+		// is parked and finished by a worker thread which spins for a
+		// while before it sleeps on the futex.
+		struct ShmState
+		{
+			// map fd as party 0 or 1. If init is set the layout is
+			// initialized. fd is closed once it has been mapped.
+			ShmState(int fd, u64 party, bool init, u64 capacity);
+			~ShmState();
+
+			ShmLayout* mLayout = nullptr;
+			u64 mMapSize = 0;
+
+			// the capacity of each ring. It is validated and copied from
+			// the layout once, as the peer can write to the mapping.
+			u64 mCapacity = 0;
+			u64 mParty = 0;
+			u8* mSendData = nullptr, * mRecvData = nullptr;
+			ShmRing* mSendRing = nullptr, * mRecvRing = nullptr;
+			ShmParty* mSelf = nullptr, * mPeer = nullptr;
+
+			std::mutex mMtx;
+			bool mClosed = false;
+			bool mStop = false;
+
+			// set if the peer has corrupted the rings or has stopped 
+			// running. All operations fail with it.
+			error_code mError;
+
+			// the peer is considered to have stopped if its heartbeat 
+			// does not change for this long and it has not closed. 
+			// Requires mMtx.
+			std::chrono::milliseconds mPeerTimeout = std::chrono::seconds(10);
+
+			// the last heartbeat of the peer and when it was seen.
+			u64 mPeerBeat = 0;
+			std::chrono::steady_clock::time_point mPeerSeen;
+
+			// the parked receive and send operation.
+			std::array<ShmIo*, 2> mPending = {};
+
+			// the number of spins before sleeping. Adjusted depending
+			// on whether spinning succeeded.
+			u64 mSpin = 1024;
+
+			std::thread mWorker;
+
+			// copy as much as possible from/to the ring. Returns the number 
+			// of bytes. If the counters of the ring are invalid, mError is 
+			// set and zero is returned.
+			u64 write(span<u8> data);
+			u64 read(span<u8> data);
+
+			// returns true if the shared capacity no longer is mCapacity.
+			bool corrupted() const;
+
+			// returns true if the peer has not closed and its heartbeat 
+			// has not changed for mPeerTimeout.
+			bool peerStopped();
+
+			// wake the peer if it is sleeping.
+			void notifyPeer();
+
+			// ring the doorbell of the worker and wake it if it is sleeping.
+			void notifySelf();
+
+			// changes whenever a parked operation might be able to progress.
+			u64 progressToken() const;
+
+			void close();
+			void run();
+		};
+
+		// an operation that moves data into or out of a ring.
+		struct ShmIo
+		{
+			ShmIo(ShmState* s, span<u8> data, span<span<u8>> buffers, bool send, bool some);
+
+			ShmState* mState;
+			span<u8> mData;
+			span<span<u8>> mBuffers;
+			bool mSend, mSome;
+			u64 mBt = 0, mTotal = 0;
+
+			// the position of mBt within the buffers.
+			u64 mBufIdx = 0, mBufOffset = 0;
+
+			coroutine_handle<> mHandle;
+			error_code mEc;
+
+			// protected by the state mutex.
+			bool mCanceled = false;
+
+			// move as much data as possible. Returns true once the
+			// operation has completed. Requires the state mutex.
+			bool tryIo();
+		};
+	}
+
+	// A socket for two parties on the same host, possibly in different
+	// processes. Each direction is a lock free single producer single
+	// consumer byte ring in a shared memory mapping. Data is copied
+	// from the send buffers directly into the ring and from the ring
+	// directly into the receive buffers. A party that has to wait spins
+	// for a while and then sleeps on a futex in the mapping, which the
+	// other party wakes.
+	struct ShmSocket : public Socket
+	{
+		struct Sock;
+
+		// a connected pair backed by a memfd.
+		static std::array<ShmSocket, 2> makePair(u64 capacity = 1 << 20);
+
+		// create the named shared memory object (see shm_open) as
+		// party 0. capacity is the size of each ring and is rounded up
+		// to a power of two.
+		static ShmSocket create(std::string name, u64 capacity = 1 << 20);
+
+		// open the named shared memory object as party 1. The name is
+		// unlinked once both parties have mapped it. Throws if it
+		// does not exist.
+		static ShmSocket open(std::string name);
+
+		// wrap a memfd or shared memory fd, e.g. one that was inherited
+		// by a child process. Party 0 must pass init = true before party 1
+		// uses the fd.
+		ShmSocket(int fd, u64 party, bool init, u64 capacity = 1 << 20);
+
+		ShmSocket() = default;
+		ShmSocket(const ShmSocket&) = default;
+		ShmSocket(ShmSocket&& o) :
+			Socket(std::move(o)),
+			mSock(std::exchange(o.mSock, nullptr))
+		{}
+
+		ShmSocket& operator=(const ShmSocket&) = default;
+		ShmSocket& operator=(ShmSocket&& o)
+		{
+			static_cast<Socket&>(*this) = std::move(static_cast<Socket&>(o)),
+			mSock = std::exchange(o.mSock, nullptr);
+			return *this;
+		}
+
+		struct Awaiter : detail::ShmIo
+		{
+			Awaiter(Sock* s, span<u8> data, span<span<u8>> buffers, bool send, macoro::stop_token&& token, bool some = false);
+
+			macoro::stop_token mToken;
+			macoro::optional_stop_callback mReg;
+
+			bool await_ready() { return false; }
+
+			coroutine_handle<> await_suspend(coroutine_handle<> h);
+#ifdef COPROTO_CPP20
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) {
+				return await_suspend(coroutine_handle<>(h)).std_cast();
+			}
+#endif
+			std::pair<error_code, u64> await_resume() { return { mEc, mBt }; }
+		};
+
+		struct Sock
+		{
+			std::unique_ptr<detail::ShmState> mState;
+
+			Sock(std::unique_ptr<detail::ShmState> s)
+				: mState(std::move(s))
+			{}
+			Sock(Sock&&) = default;
+
+			MACORO_NODISCARD
+			auto close()
+			{
+				struct Awaiter
+				{
+					detail::ShmState* mState;
+					bool await_ready() const noexcept { return false; }
+					std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept
+					{
+						mState->close();
+						return h;
+					}
+					void await_resume() const noexcept {}
+				};
+				return Awaiter{ mState.get() };
+			}
+
+			Awaiter send(span<u8> data, macoro::stop_token token = {}) { return Awaiter(this, data, {}, true, std::move(token)); };
+			Awaiter recv(span<u8> data, macoro::stop_token token = {}) { return Awaiter(this, data, {}, false, std::move(token)); };
+
+			// optional scatter/gather interface.
+			Awaiter sendv(span<span<u8>> data, macoro::stop_token token = {}) { return Awaiter(this, {}, data, true, std::move(token)); };
+			Awaiter recvv(span<span<u8>> data, macoro::stop_token token = {}) { return Awaiter(this, {}, data, false, std::move(token)); };
+
+			// optional partial receive. Completes once some data has been read.
+			Awaiter recvSome(span<u8> data, macoro::stop_token token = {}) { return Awaiter(this, data, {}, false, std::move(token), true); };
+		};
+
+		Sock* mSock = nullptr;
+
+	private:
+		ShmSocket(std::unique_ptr<detail::ShmState> s);
+	};
+
+	// blocking helper. The server creates name, the client opens it
+	// and retries until it exists and is initialized, or until the
+	// token is stopped. Other errors are thrown as is.
+	ShmSocket shmConnect(std::string name, bool server, u64 capacity = 1 << 20, macoro::stop_token token = {});
+}
+
+#endif
@@ -14,6 +14,7 @@
 #include "coproto/Common/TypeTraits.h"
 #include "coproto/Common/Function.h"
 #include "coproto/Common/macoro.h"
+#include "coproto/Common/Buffer.h"
 
 #include "coproto/Proto/SessionID.h"
 #include "coproto/Socket/SocketScheduler.h"
@@ -29,6 +30,27 @@ namespace coproto
 	struct make_socket_tag
 	{};
 
+	// constructs a Socket that does not lock, see Socket(...).
+	struct single_threaded_tag
+	{};
+
+	class SendStream;
+	class RecvStream;
+	class Cork;
+	class ScopedFork;
+
+	namespace internal
+	{
+		// true if any of the types is a stop_token or timeout. Used to
+		// tell the multi-container send/recv apart from the overloads
+		// that take a cancellation argument.
+		template<typename... Ts>
+		struct is_token : std::integral_constant<bool, (... || (
+			std::is_same<std::decay_t<Ts>, macoro::stop_token>::value ||
+			std::is_same<std::decay_t<Ts>, macoro::timeout>::value))>
+		{};
+	}
+
 
 	// Socket represents a type erased socket-like object. It has three main functions
 	// 
@@ -47,6 +69,10 @@ namespace coproto
 	//   socket. This is used as a mechanism to perform several protocols on one socket
 	//   while ensuring that each protocol only receives their own messages.
 	// 
+	// * std::vector<Socket> fork(u64 n)
+	// 
+	//   Creates n forks at once. This is cheaper than calling fork() n times.
+	// 
 	// For additional usage, see the tutorial.
 	// 
 	// 
@@ -84,6 +110,27 @@ namespace coproto
 	// 
 	//   This is basically the same as send(...) but should receive data.
 	//
+	// Optionally, SocketImpl can also implement scatter/gather versions of these functions:
+	//
+	// * SendAwaiter SocketImpl::sendv(span<span<u8>> buffers, macoro::stop_token token = {})
+	//
+	//   Send all of the buffers, in order, as a single operation. The awaiter should
+	//   behave as the one returned by send(...) where the number of bytes returned is the
+	//   total across all of the buffers. `buffers` will remain valid until the operation
+	//   completes. When provided, Socket will send the message header and body
+	//   with one call to sendv(...) instead of making a call to send(...) for each.
+	//
+	// * RecvAwaiter SocketImpl::recvv(span<span<u8>> buffers, macoro::stop_token token = {})
+	//
+	//   The same as sendv(...) but should fill each of the buffers in order.
+	//
+	// * RecvAwaiter SocketImpl::recvSome(span<u8> buffer, macoro::stop_token token = {})
+	//
+	//   Receive at most buffer.size() bytes. Unlike recv(...), the operation should
+	//   complete once any data is available and return the number of bytes received.
+	//   When provided, Socket::setReadAhead(...) can be used to process several
+	//   messages with a single read.
+	//
 	// For example implementations see the socket tutorial or LocalAsyncSocket, AsioSocket or BufferingSocket.
 	//
 	class Socket
@@ -98,6 +145,10 @@ namespace coproto
 		// the user defined SocketImpl.
 		std::shared_ptr<internal::SockScheduler> mImpl;
 
+		// The state of this fork within mImpl. Operations use it directly
+		// instead of looking up mId.
+		internal::SocketForkRef mFork;
+
 		Socket() = default;
 		Socket(const Socket& s) = default;
 		Socket(Socket&& s) = default;
@@ -109,6 +160,7 @@ namespace coproto
 		Socket(make_socket_tag, SocketImpl&& s, SessionID sid = SessionID::root())
 			: mId(sid)
 			, mImpl(std::make_shared<internal::SockScheduler>(std::forward<SocketImpl>(s), mId))
+			, mFork(mImpl->getLocalSocketFork(mId))
 		{}
 
 
@@ -117,6 +169,21 @@ namespace coproto
 		Socket(make_socket_tag, std::unique_ptr<SocketImpl>&& s, SessionID sid = SessionID::root())
 			: mId(sid)
 			, mImpl(std::make_shared<internal::SockScheduler>(std::move(s), mId))
+			, mFork(mImpl->getLocalSocketFork(mId))
+		{}
+
+		// Construct a socket that does not use a mutex. The socket and all of its 
+		// forks must only be used by the thread that constructs it, e.g. when the 
+		// protocol is run with sync_wait and inline scheduling. A socket that is 
+		// driven by a worker thread must therefore be constructed on that thread.
+		// Debug builds (NDEBUG not defined) check this.
+		// Completions are still run through the scheduler's execution queue, which 
+		// avoids deep recursion when operations complete each other.
+		template<typename SocketImpl>
+		Socket(make_socket_tag, single_threaded_tag, SocketImpl&& s, SessionID sid = SessionID::root())
+			: mId(sid)
+			, mImpl(std::make_shared<internal::SockScheduler>(std::forward<SocketImpl>(s), mId, true))
+			, mFork(mImpl->getLocalSocketFork(mId))
 		{}
 
 
@@ -140,7 +207,7 @@ namespace coproto
 		template<typename Container>
 		auto send(Container& t, macoro::stop_token token = {})
 		{
-			return internal::RefSendAwaiter<Container>(mImpl.get(), mId, t, std::move(token));
+			return internal::RefSendAwaiter<Container>(mImpl.get(), mFork, t, std::move(token));
 		}
 
 		// Send the Container `t`. A stop_token can be provided to request that the send be 
@@ -152,7 +219,17 @@ namespace coproto
 		template<typename Container>
 		auto send(Container&& t, macoro::stop_token token = {})
 		{
-			return internal::MoveSendAwaiter<Container>(mImpl.get(), mId, std::forward<Container>(t), std::move(token));
+			return internal::MoveSendAwaiter<Container>(mImpl.get(), mFork, std::forward<Container>(t), std::move(token));
+		}
+
+		// Send the containers `c0, c1, ...` as a single message which is their concatenation.
+		// The containers are not copied. Like send(Container&), the return value must be 
+		// awaited and completes once the data has been sent.
+		template<typename C0, typename C1, typename... Cs, 
+			typename = std::enable_if_t<!internal::is_token<C1, Cs...>::value>>
+		auto send(C0& c0, C1& c1, Cs&... cs)
+		{
+			return internal::MultiRefSendAwaiter<C0, C1, Cs...>(mImpl.get(), mFork, {}, c0, c1, cs...);
 		}
 
 		// Receive the next message into the container `r` with a timeout `to`. After the timeout 
@@ -168,7 +245,7 @@ namespace coproto
 		template<typename Container>
 		auto recv(Container& t, macoro::stop_token token = {})
 		{
-			return internal::RefRecvAwaiter<Container, false>(mImpl.get(), mId, t, std::move(token));
+			return internal::RefRecvAwaiter<Container, false>(mImpl.get(), mFork, t, std::move(token));
 		}
 
 		// Receive the next message into the container `r`. An optional stop_token can be provided
@@ -176,16 +253,30 @@ namespace coproto
 		template<typename Container>
 		auto recv(Container&& t, macoro::stop_token token = {})
 		{
-			return internal::MoveRecvAwaiter<Container, false>(mImpl.get(), mId, std::forward<Container>(t), std::move(token));
+			return internal::MoveRecvAwaiter<Container, false>(mImpl.get(), mFork, std::forward<Container>(t), std::move(token));
+		}
+
+		// Receive the next message into the containers `c0, c1, ...`. The first bytes of the
+		// message are written to c0, the next to c1, and so on. The containers are not resized;
+		// the size of the message must equal their total size. 
+		template<typename C0, typename C1, typename... Cs,
+			typename = std::enable_if_t<!internal::is_token<C1, Cs...>::value>>
+		auto recv(C0& c0, C1& c1, Cs&... cs)
+		{
+			return internal::MultiRefRecvAwaiter<C0, C1, Cs...>(mImpl.get(), mFork, {}, c0, c1, cs...);
 		}
 
 		// Receive the next message and store the message in a class of type Container. An optional 
 		// stop_token can be provided to cancel the operation. The return value must be awaited for 
-		// the data to be received. 
+		// the data to be received. For Container = BufferLease, the memory is taken from a pool that 
+		// is owned by the socket and is not initialized before the message is written to it.
 		template<typename Container>
 		auto recv(macoro::stop_token token = {})
 		{
-			return internal::MoveRecvAwaiter<Container, true>(mImpl.get(), mId, std::move(token));
+			if constexpr (std::is_same<Container, BufferLease>::value)
+				return internal::MoveRecvAwaiter<Container, true>(mImpl.get(), mFork, BufferLease(mImpl->leasePool()), std::move(token));
+			else
+				return internal::MoveRecvAwaiter<Container, true>(mImpl.get(), mFork, std::move(token));
 		}
 
 		// Receive the next message into the container `r` with a timeout `to`. After the timeout 
@@ -203,7 +294,7 @@ namespace coproto
 		template<typename Container>
 		auto recvResize(Container& t, macoro::stop_token token = {})
 		{
-			return internal::RefRecvAwaiter<Container, true>(mImpl.get(), mId, t, std::move(token));
+			return internal::RefRecvAwaiter<Container, true>(mImpl.get(), mFork, t, std::move(token));
 		}
 
 		// returns the number of bytes sent.
@@ -236,7 +327,14 @@ namespace coproto
 		// before the socket is destroyed.
 		internal::Flush flush()
 		{
-			return internal::Flush(mImpl.get());
+			return internal::Flush(mImpl.get(), mFork, false);
+		}
+
+		// returns an awaitable that completes when the current operations
+		// of this fork complete. Operations of other forks are not waited on.
+		internal::Flush flushFork()
+		{
+			return internal::Flush(mImpl.get(), mFork, true);
 		}
 
 		// Returns a new socket that can be used semi-independently.
@@ -247,10 +345,46 @@ namespace coproto
 		Socket fork()
 		{
 			Socket ret = *this;
-			ret.mId = mImpl->fork(mId);
+			ret.mFork = mImpl->fork(mFork);
+			ret.mId = ret.mFork->mSessionID;
+			return ret;
+		}
+
+		// Returns n new sockets, see fork(). The forks are created with a 
+		// single lock of the scheduler and the other party learns about 
+		// all of them from one meta message instead of one per fork. Both
+		// parties must call fork(n) with the same n. The forks are not the
+		// same as those returned by n calls to fork().
+		std::vector<Socket> fork(u64 n)
+		{
+			std::vector<Socket> ret(n);
+			auto forks = mImpl->fork(mFork, n);
+			for (u64 i = 0; i < n; ++i)
+			{
+				ret[i].mImpl = mImpl;
+				ret[i].mFork = forks[i];
+				ret[i].mId = forks[i]->mSessionID;
+			}
 			return ret;
 		}
 
+		// Close this fork once it is no longer needed. Operations that have 
+		// already been started complete as usual. Once they have and the other
+		// party has closed the fork as well, its ids and storage are reused by
+		// later forks. Both parties should call closeFork() after their last 
+		// operation on the fork. Later operations on this socket, or on any 
+		// copies of it, fail with code::closed. If we have sent on the fork, 
+		// the other party is told along with the next message that is sent 
+		// on the socket.
+		void closeFork()
+		{
+			mImpl->closeFork(std::exchange(mFork, nullptr));
+		}
+
+		// Returns a new fork that is closed when the returned object is 
+		// destroyed, see fork() and closeFork().
+		ScopedFork scopedFork();
+
 		// return the underlaying socket.
 		void* getNative() { return mImpl->getSocket(); }
 
@@ -282,15 +416,347 @@ namespace coproto
 		template<typename Scheduler>
 		void setExecutor(Scheduler& scheduler)
 		{
-			mImpl->setExecutor(scheduler, mId);
+			mImpl->setExecutor(scheduler, mFork);
+		}
+
+		// When the underlaying socket supports vectored sends (sendv),
+		// messages that are queued while a write is in progress are
+		// combined into a single write. This sets the maximum number of
+		// bytes (headers included) and buffers of such a write. A write
+		// always contains at least one message. The limit applies to
+		// the underlaying socket and therefore all of its forks.
+		void setSendBatchLimit(u64 maxBytes, u64 maxBuffers)
+		{
+			mImpl->setSendBatchLimit(maxBytes, maxBuffers);
+		}
+
+		// When the underlaying socket supports partial receives (recvSome),
+		// the socket can read ahead into an internal buffer of bufferSize
+		// bytes. Several headers and small messages can then be processed
+		// with a single read. Messages larger than half the buffer are
+		// still received directly into the user's buffer. A bufferSize of
+		// zero disables read ahead, which is the default. Applies to the
+		// underlaying socket and therefore all of its forks.
+		void setReadAhead(u64 bufferSize)
+		{
+			mImpl->setReadAhead(bufferSize);
+		}
+
+		// Bound the memory used by queued sends. Once more than highWater
+		// bytes are queued on the socket, awaiting a move-send, i.e.
+		// send(std::move(t)), suspends the caller until the queue drains
+		// to lowWater bytes. Zero, the default, means unbounded. This
+		// applies to the socket as a whole, see setForkSendBufferLimit(...)
+		// for a per fork limit.
+		void setSendBufferLimit(u64 highWater, u64 lowWater)
+		{
+			mImpl->setSendBufferLimit(highWater, lowWater);
+		}
+
+		// The same as setSendBufferLimit(...) but only counts the bytes
+		// queued on this fork. Both limits are enforced if set.
+		void setForkSendBufferLimit(u64 highWater, u64 lowWater)
+		{
+			mImpl->setSendBufferLimit(highWater, lowWater, mFork);
 		}
 
+		// By default, if a message arrives on a fork that has no pending
+		// recv, no more data is read from the socket until that fork
+		// posts a recv. This allows each fork to instead stash up to
+		// bytesPerFork bytes of such messages. Later recv operations on
+		// that fork then complete immediately from the stash. A chunked
+		// message, see setSendChunkSize(...), is only stashed if all of 
+		// it fits. Zero, the default, disables stashing. Applies to all 
+		// forks of the socket.
+		void setRecvStashLimit(u64 bytesPerFork)
+		{
+			mImpl->setRecvStashLimit(bytesPerFork);
+		}
+
+		// Derive the ids of the forks of the root from their child index 
+		// instead of telling the other party about each new fork. Both 
+		// parties must call this before the socket is used. Like their
+		// session ids, the slot of a fork of the root is given by the 
+		// number of fork() and fork(n) calls of the root before it. These
+		// calls must therefore be made in the same order by both parties.
+		// The forks of other sockets may be interleaved with them in any 
+		// order. Messages that arrive for a fork of the root before it 
+		// has been created wait for it, or are stashed, see 
+		// setRecvStashLimit(...).
+		// 
+		// Only fork() of the root is free. The forks of other forks and 
+		// those of fork(n), also of the root, are still told to the other
+		// party with one meta message per fork or per fork(n).
+		void enableDeterministicForks()
+		{
+			mImpl->enableDeterministicForks();
+		}
+
+		// Set the send priority of this fork. The pending messages of the 
+		// forks with the same priority are sent in order. The priorities 
+		// take turns with deficit round robin. Per turn, the forks of 
+		// priority p may send (p + 1) times as many bytes as those of 
+		// priority zero. A busy fork therefore can not starve the forks 
+		// of a lower priority and the messages of a fork with a higher 
+		// priority wait for at most one turn of each of the others. A
+		// message that is already being sent is not interrupted, see 
+		// setSendChunkSize(...) to bound this delay. The default 
+		// priority is zero.
+		void setPriority(u32 priority)
+		{
+			mImpl->setPriority(priority, mFork);
+		}
+
+		// Send messages larger than chunkSize as several chunks. Chunks of
+		// different messages are interleaved with each other and with the
+		// smaller messages of other forks. This way a large message does not
+		// delay the other forks. A canceled chunked send is aborted at the 
+		// next chunk and the matching recv fails with code::remoteCancel. 
+		// Messages of different forks can then arrive out of order. If the
+		// receiver awaits its forks one after another, it should enable 
+		// setRecvStashLimit(...). Zero, the default, disables chunking.
+		// Applies to all forks of the socket.
+		void setSendChunkSize(u64 chunkSize)
+		{
+			mImpl->setSendChunkSize(chunkSize);
+		}
+
+		// Hold back the sending of messages. Sends are still queued but 
+		// nothing is written to the socket until the matching uncork(). 
+		// Everything that was queued is then written together, subject to
+		// setSendBatchLimit(...). This allows a protocol to write once per
+		// round. Calls can be nested. Applies to all forks of the socket.
+		// flush() does not complete while corked. Sends by reference 
+		// complete once their message has been copied and move-sends do 
+		// not wait for the send buffer limits, see setSendBufferLimit(...).
+		// If such a reference send later fails, the next flush() of its 
+		// fork and of the socket throws the error.
+		void cork()
+		{
+			mImpl->cork();
+		}
+
+		// Undo a call to cork(), see above.
+		void uncork()
+		{
+			mImpl->uncork();
+		}
+
+		// Cork the socket until the returned object is destroyed, see cork().
+		Cork batch();
+
+		// Start sending a stream of data whose total size does not need
+		// to be known in advance and may exceed 4 GiB. The data is written
+		// with SendStream::write(...) and the stream is ended with 
+		// SendStream::finish(). The other party must call recvStream() at 
+		// the same point of the protocol. Other messages must not be sent 
+		// on this fork until the stream is finished.
+		SendStream sendStream();
+
+		// Start receiving a stream that was sent with sendStream(). The 
+		// chunks are read with RecvStream::read(...) as they arrive.
+		RecvStream recvStream();
 	};
 
+	// The sending half of a stream, see Socket::sendStream(). Each write is 
+	// sent as a message. An empty message ends the stream. Writes larger 
+	// than MaxChunkSize are split. 
+	class SendStream
+	{
+	public:
+		// the largest message that write(...) sends.
+		static constexpr u64 MaxChunkSize = 1ull << 30;
+
+		SendStream(Socket s)
+			: mSock(std::move(s))
+		{}
+
+		// Send data as the next part of the stream. data can be 
+		// reused once the returned task completes.
+		task<> write(span<const u8> data, macoro::stop_token token = {})
+		{
+			COPROTO_ASSERT(mFinished == false);
+			while (data.size())
+			{
+				auto chunk = data.subspan(0, std::min<u64>(data.size(), MaxChunkSize));
+				data = data.subspan(chunk.size());
+
+				co_await mSock.send(chunk, token);
+				mSize += chunk.size();
+			}
+		}
+
+		// End the stream. 
+		task<> finish(macoro::stop_token token = {})
+		{
+			COPROTO_ASSERT(mFinished == false);
+			mFinished = true;
+			co_await internal::EmptySendAwaiter(mSock.mImpl.get(), mSock.mFork, std::move(token));
+		}
+
+		// the number of bytes that have been written.
+		u64 size() const { return mSize; }
+
+	private:
+		Socket mSock;
+		u64 mSize = 0;
+		bool mFinished = false;
+	};
+
+	// The receiving half of a stream, see Socket::recvStream().
+	class RecvStream
+	{
+	public:
+		RecvStream(Socket s)
+			: mSock(std::move(s))
+		{}
+
+		// Receive the next chunk of the stream into chunk, which is 
+		// resized to the size that the sender wrote. Returns false 
+		// and leaves chunk empty once the stream has finished.
+		template<typename Container>
+		task<bool> read(Container& chunk, macoro::stop_token token = {})
+		{
+			static_assert(sizeof(typename Container::value_type) == 1,
+				"RecvStream::read(...) requires a container of bytes.");
+
+			if (mFinished)
+			{
+				chunk.clear();
+				co_return false;
+			}
+
+			co_await mSock.recvResize(chunk, token);
+			if (chunk.size() == 0)
+			{
+				mFinished = true;
+				co_return false;
+			}
+
+			mSize += chunk.size();
+			co_return true;
+		}
+
+		// the number of bytes that have been received.
+		u64 size() const { return mSize; }
+
+		// true once the end of the stream has been received.
+		bool finished() const { return mFinished; }
+
+	private:
+		Socket mSock;
+		u64 mSize = 0;
+		bool mFinished = false;
+	};
+
+	// Keeps a socket corked for its lifetime, see Socket::batch().
+	class Cork
+	{
+	public:
+		Cork(std::shared_ptr<internal::SockScheduler> sched)
+			: mSched(std::move(sched))
+		{
+			mSched->cork();
+		}
+
+		Cork(const Cork&) = delete;
+		Cork& operator=(const Cork&) = delete;
+		Cork(Cork&&) = default;
+		Cork& operator=(Cork&& o)
+		{
+			if (this != &o)
+			{
+				uncork();
+				mSched = std::move(o.mSched);
+			}
+			return *this;
+		}
+
+		~Cork() { uncork(); }
+
+		// uncork the socket before the destructor.
+		void uncork()
+		{
+			if (mSched)
+				std::exchange(mSched, nullptr)->uncork();
+		}
+
+	private:
+		std::shared_ptr<internal::SockScheduler> mSched;
+	};
+
+	// A fork that is closed when it is destroyed, see Socket::scopedFork().
+	class ScopedFork
+	{
+	public:
+		ScopedFork() = default;
+		explicit ScopedFork(Socket&& fork)
+			: mFork(std::move(fork))
+		{}
+
+		ScopedFork(const ScopedFork&) = delete;
+		ScopedFork& operator=(const ScopedFork&) = delete;
+		ScopedFork(ScopedFork&&) = default;
+		ScopedFork& operator=(ScopedFork&& o)
+		{
+			if (this != &o)
+			{
+				close();
+				mFork = std::move(o.mFork);
+			}
+			return *this;
+		}
+
+		~ScopedFork() { close(); }
+
+		Socket& operator*() { return mFork; }
+		Socket* operator->() { return &mFork; }
+
+		// close the fork before the destructor.
+		void close()
+		{
+			if (mFork.mImpl)
+			{
+				mFork.closeFork();
+				mFork = Socket();
+			}
+		}
+
+	private:
+		Socket mFork;
+	};
+
+	inline Cork Socket::batch()
+	{
+		return Cork(mImpl);
+	}
+
+	inline ScopedFork Socket::scopedFork()
+	{
+		return ScopedFork(fork());
+	}
+
+	inline SendStream Socket::sendStream()
+	{
+		return SendStream(*this);
+	}
+
+	inline RecvStream Socket::recvStream()
+	{
+		return RecvStream(*this);
+	}
+
 	template<typename T>
 	Socket makeSocket(T&& t)
 	{
 		return Socket(make_socket_tag{}, std::forward<T>(t));
 	}
+
+	// make a socket that must only be used by the calling thread.
+	template<typename T>
+	Socket makeSocket(single_threaded_tag, T&& t)
+	{
+		return Socket(make_socket_tag{}, single_threaded_tag{}, std::forward<T>(t));
+	}
 }
 
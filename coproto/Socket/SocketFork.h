@@ -4,12 +4,148 @@
 #include "coproto/Proto/SessionID.h"
 #include "coproto/Socket/RecvOperation.h"
 #include "coproto/Socket/SendOperation.h"
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
 
 namespace coproto::internal
 {
 	struct SockScheduler;
 
+	// tracks the pending operations so that a flush can wait for the 
+	// operations that were started before it. Operations join the 
+	// current epoch. A flush moves on to a new epoch and is resumed once
+	// all earlier epochs have no pending operations. The earlier epochs 
+	// are kept in a ring that is reused, so a flush does not allocate.
+	class FlushEpochs
+	{
+	public:
+		// an operation has started. Returns its epoch.
+		u64 start()
+		{
+			++mCurrent.mPending;
+			return mEnd;
+		}
+
+		// the operation of `epoch` has completed. The flushes that are 
+		// done are resumed on their executor. The error is reported by 
+		// the first of them.
+		void complete(u64 epoch, ExecutionQueue::Handle& queue, Lock& l)
+		{
+			auto& e = at(epoch);
+			COPROTO_ASSERT(e.mPending);
+			--e.mPending;
+
+			while (mBegin != mEnd && at(mBegin).mPending == 0)
+			{
+				auto& front = at(mBegin);
+				for (auto t = std::exchange(front.mWaiters, nullptr); t; t = t->mNext)
+				{
+					t->mEC = std::exchange(mEC, {});
+					queue.push_back(std::exchange(t->mHandle, nullptr), t->mExecutor, l);
+				}
+				++mBegin;
+			}
+		}
+
+		// an operation whose caller no longer waits for it has failed,
+		// see SendOperation::detach(). The first such error is reported 
+		// by the flushes that are resumed next.
+		void fail(error_code ec)
+		{
+			if (!mEC)
+				mEC = ec;
+		}
+
+		// returns false if no operation is pending. Otherwise token is 
+		// resumed once the pending operations have completed.
+		bool wait(FlushToken& token, Lock&)
+		{
+			if (mBegin == mEnd && mCurrent.mPending == 0)
+			{
+				token.mEC = std::exchange(mEC, {});
+				return false;
+			}
+
+			if (mEnd - mBegin + 1 > mRing.size())
+			{
+				std::vector<Epoch> ring(std::max<u64>(4, 2 * mRing.size()));
+				for (auto e = mBegin; e != mEnd; ++e)
+					ring[e & (ring.size() - 1)] = at(e);
+				mRing = std::move(ring);
+			}
+
+			token.mNext = mCurrent.mWaiters;
+			mCurrent.mWaiters = &token;
+			mRing[mEnd & (mRing.size() - 1)] = std::exchange(mCurrent, {});
+			++mEnd;
+			return true;
+		}
+
+	private:
+		struct Epoch
+		{
+			u64 mPending = 0;
+			FlushToken* mWaiters = nullptr;
+		};
+
+		// the current epoch, mEnd, and the earlier epochs [mBegin, mEnd)
+		// that still have pending operations. These are stored in mRing 
+		// whose size is a power of two.
+		Epoch mCurrent;
+		u64 mBegin = 0, mEnd = 0;
+		std::vector<Epoch> mRing;
+
+		// the error that the next flush reports, see fail(...).
+		error_code mEC;
+
+		Epoch& at(u64 epoch)
+		{
+			COPROTO_ASSERT(epoch >= mBegin && epoch <= mEnd);
+			return epoch == mEnd ? mCurrent : mRing[epoch & (mRing.size() - 1)];
+		}
+	};
+
+	// a range of forks that were created together, see 
+	// SockScheduler::fork(parent, n). The forks have the local ids
+	// [mLocalBase, mLocalBase + mSize) and the session ids 
+	// mBaseId.derive(i). The remote party is told about all of 
+	// them with a single NewSocketForkRange meta message.
+	struct SocketForkRange
+	{
+		SessionID mBaseId;
+		u32 mLocalBase = 0, mSize = 0;
+
+		// set once the range has been given to a send frame. 
+		bool mAnnounced = false;
+	};
+
+	// the pending sends of the forks that have the same priority. The
+	// operations are kept in the order that they were sent and are 
+	// linked with SendOperation::next(). The classes take turns with 
+	// deficit round robin, see NextSendOp::takeBatch(...). A class with
+	// priority p may send (p + 1) times as many bytes per turn as one 
+	// with priority zero.
+	struct SendClass
+	{
+		SendClass(u32 priority)
+			: mPriority(priority)
+		{}
+
+		u32 mPriority;
 
+		// the first and last pending operation.
+		SendOperation* mBegin = nullptr;
+		SendOperation* mLast = nullptr;
+
+		// the number of bytes that the class may still send in its
+		// current turn.
+		u64 mDeficit = 0;
+
+		// true if the class is in SockScheduler::mActiveSendClasses.
+		bool mActive = false;
+	};
 
 	// the state associated with a fork of the socket.
 	// each fork will have a session id, a 128 unique ID.
@@ -32,6 +168,21 @@ namespace coproto::internal
 		// the local and remote is that is used when sending data.
 		u32 mLocalId = -1, mRemoteId = -1;
 
+		// the index of the fork in SockScheduler::mSocketForks_ and the
+		// generation of that slot, see SocketForkRef.
+		u32 mIndex = -1, mGeneration = 0;
+
+		// the progress of closing the fork, see SockScheduler::closeFork(...).
+		// Closing: waiting for the pending operations to complete.
+		// CloseQueued: the CloseFork meta message is queued or being sent.
+		// Closed: the remote party has been told, if needed.
+		enum class CloseState : u8 { Open, Closing, CloseQueued, Closed };
+		CloseState mCloseState = CloseState::Open;
+
+		// set once the remote party has closed the fork and released
+		// its id, mRemoteId.
+		bool mRemoteClosed = false;
+
 		//u64 mRecvIdx = 0;
 
 		// a flag indicating that this fork has send the local id
@@ -41,12 +192,70 @@ namespace coproto::internal
 		// send messages with our smaller local id.
 		bool mInitiated = false;
 
+		// the range that this fork was created in, if any. 
+		std::shared_ptr<SocketForkRange> mRange;
+
+		// returns true if the remote party has been or will be told 
+		// about this fork, either by its first message or by the 
+		// announcement of its range.
+		bool announced() const
+		{
+			return mInitiated || (mRange && mRange->mAnnounced);
+		}
+
 		// an optional executor.
 		ExecutorRef mExecutor;
 
 		// a name that can be set for debugging. Not typically used.
 		std::string mName;
 
+		// the pending operations of this fork, see Socket::flushFork().
+		FlushEpochs mFlushEpochs;
+
+		// the number of bytes that are queued to be sent on this fork.
+		u64 mQueuedSendBytes = 0;
+
+		// the per fork limits on mQueuedSendBytes. See SockScheduler::mSendHighWater.
+		u64 mSendHighWater = 0, mSendLowWater = 0;
+
+		// the priority of the fork and its class. Forks with a higher 
+		// priority get a larger share of the socket, see SendClass. The 
+		// class is null for the default priority.
+		u32 mSendPriority = 0;
+		SendClass* mSendClass = nullptr;
+
+		// the class that the pending sends of this fork are queued in and
+		// their number. Later sends join the same class, even if the 
+		// priority has changed since, so that they are sent in order.
+		SendClass* mPendingSendClass = nullptr;
+		u64 mNumPendingSends = 0;
+
+		// messages that arrived before a matching recv was posted. 
+		// They are handed to the next recv operations in order.
+		std::deque<std::vector<u8>> mStash;
+
+		// the total size of the stashed messages, including a message
+		// that is currently being received into the stash.
+		u64 mStashBytes = 0;
+
+		// the send operation of this fork that is being sent in chunks, if any.
+		// Later sends on this fork wait until it completes. mChunkedSendOffset
+		// is the number of bytes that have been sent.
+		SendOperation* mChunkedSend = nullptr;
+		u64 mChunkedSendOffset = 0;
+
+		// the size of the chunked message that is being received on this fork,
+		// or zero. mChunkedRecv is the operation that the chunks are received
+		// into, once the first chunk has arrived. mChunkedRecvOffset is the 
+		// number of bytes that have been received. If the first chunk arrived
+		// before a recv was posted, the chunks are instead received into 
+		// mChunkedStash which is moved to mStash once complete.
+		u64 mChunkedRecvSize = 0;
+		RecvOperation* mChunkedRecv = nullptr;
+		std::vector<span<u8>> mChunkedRecvBuffers;
+		u64 mChunkedRecvOffset = 0;
+		std::vector<u8> mChunkedStash;
+
 	private:
 		// the queue of recv operations assoicated with this fork.
 		Queue<RecvOperation> mRecvOps;
@@ -55,18 +264,26 @@ namespace coproto::internal
 		Queue<SendOperation> mSendOps;
 	public:
 
+		// add a send operation. It joins the current epoch of 
+		// flushes, the epochs of the socket, and of this fork.
 		template<typename... Args>
-		SendOperation& emplace_send(Lock&, Args&&... args)
+		SendOperation& emplace_send(Lock&, FlushEpochs& flushes, Args&&... args)
 		{
 			mSendOps.emplace_back(std::forward<Args>(args)...);
-			return mSendOps.back();
+			auto& op = mSendOps.back();
+			op.mFlushEpoch = flushes.start();
+			op.mForkFlushEpoch = mFlushEpochs.start();
+			return op;
 		}
 
 		template<typename... Args>
-		RecvOperation& emplace_recv(Lock&, Args&&... args)
+		RecvOperation& emplace_recv(Lock&, FlushEpochs& flushes, Args&&... args)
 		{
 			mRecvOps.emplace_back(std::forward<Args>(args)...);
-			return mRecvOps.back();
+			auto& op = mRecvOps.back();
+			op.mFlushEpoch = flushes.start();
+			op.mForkFlushEpoch = mFlushEpochs.start();
+			return op;
 		}
 
 		template<typename... Args>
@@ -117,39 +334,308 @@ namespace coproto::internal
 			return mRecvOps.back();
 		}
 	};
-	
+
+	// a reference to a fork, as held by Socket. The slot of a fork is 
+	// reused once it has been closed and released, so a copy of a Socket
+	// that outlives its fork could otherwise operate on an unrelated one.
+	// The generation of the slot tells them apart. The reference must be
+	// resolved with SocketForkTable::get(...) before the fork is used.
+	struct SocketForkRef
+	{
+		SocketForkRef() = default;
+
+		// fork must not have been released.
+		SocketForkRef(SocketFork* fork)
+			: mFork(fork)
+			, mIndex(fork ? fork->mIndex : 0)
+			, mGeneration(fork ? fork->mGeneration : 0)
+		{}
+
+		SocketFork* mFork = nullptr;
+		u32 mIndex = 0, mGeneration = 0;
+
+		operator SocketFork* () const { return mFork; }
+		SocketFork* operator->() const { return mFork; }
+	};
+
+	// the forks of a socket. The forks are stored in fixed size pages
+	// so that their address never changes and the fork at a given 
+	// index is found with two loads. The slots of erased forks are 
+	// reused. A SessionID is mapped to its fork index with an open 
+	// addressing hash table. The remote ids are small integers that the
+	// other party reuses and are mapped to the fork index with pages 
+	// that are allocated as they are first used.
+	class SocketForkTable
+	{
+	public:
+		static constexpr u32 npos = ~u32(0);
+
+		SocketForkTable() = default;
+		SocketForkTable(const SocketForkTable&) = delete;
+		SocketForkTable& operator=(const SocketForkTable&) = delete;
+
+		~SocketForkTable()
+		{
+			for (auto& fork : *this)
+				fork.~SocketFork();
+			for (auto page : mPages)
+				::operator delete(page);
+		}
+
+		// the number of forks.
+		u32 size() const { return mNumForks; }
+
+		// the number of forks that can be stored without allocating.
+		u64 capacity() const { return u64(mPages.size()) << PageBits; }
+
+		SocketFork& operator[](u32 idx)
+		{
+			COPROTO_ASSERT(idx < mEnd && !mIsFree[idx]);
+			return mPages[idx >> PageBits][idx & PageMask];
+		}
+
+		// returns the fork that ref refers to or null if it has been
+		// released. Its slot might since have been reused.
+		SocketFork* get(const SocketForkRef& ref)
+		{
+			if (!ref.mFork || ref.mIndex >= mEnd || mIsFree[ref.mIndex] ||
+				mGenerations[ref.mIndex] != ref.mGeneration)
+				return nullptr;
+			return &(*this)[ref.mIndex];
+		}
+
+		// add a new fork with session id `id`. There must not already 
+		// be a fork with this id.
+		SocketFork& emplace(const SessionID& id)
+		{
+			COPROTO_ASSERT(find(id) == nullptr);
+			u32 idx;
+			if (mFree.size())
+			{
+				idx = mFree.back();
+				mFree.pop_back();
+			}
+			else
+			{
+				if ((mEnd & PageMask) == 0)
+					mPages.push_back(static_cast<SocketFork*>(
+						::operator new(sizeof(SocketFork) << PageBits)));
+				idx = mEnd++;
+				mIsFree.push_back(true);
+				mGenerations.push_back(0);
+			}
+
+			auto fork = new (&mPages[idx >> PageBits][idx & PageMask]) SocketFork(id);
+			fork->mIndex = idx;
+			fork->mGeneration = mGenerations[idx];
+			mIsFree[idx] = false;
+			++mNumForks;
+
+			if (2 * mNumForks > mIndex.size())
+				rehash(std::max<u64>(16, 2 * mIndex.size()));
+			else
+				insertIndex(id, idx);
+			return *fork;
+		}
+
+		// make room in the index for `size` forks.
+		void reserve(u64 size)
+		{
+			if (2 * size > mIndex.size())
+			{
+				u64 n = 16;
+				while (n < 2 * size)
+					n *= 2;
+				rehash(n);
+			}
+		}
+
+		// destroy `fork` and free its slot. Its remote id must 
+		// already have been erased.
+		void erase(SocketFork& fork)
+		{
+			auto idx = fork.mIndex;
+			eraseIndex(fork.mSessionID, idx);
+			fork.~SocketFork();
+			mIsFree[idx] = true;
+			++mGenerations[idx];
+			mFree.push_back(idx);
+			--mNumForks;
+		}
+
+		// change the session id of `fork` to `id`. There must not 
+		// already be a fork with this id.
+		void rekey(SocketFork& fork, const SessionID& id)
+		{
+			COPROTO_ASSERT(find(id) == nullptr);
+			eraseIndex(fork.mSessionID, fork.mIndex);
+			fork.mSessionID = id;
+			insertIndex(id, fork.mIndex);
+		}
+
+		// returns the fork with session id `id`, or nullptr.
+		SocketFork* find(const SessionID& id)
+		{
+			if (mIndex.size() == 0)
+				return nullptr;
+
+			auto mask = mIndex.size() - 1;
+			for (auto i = id.hash() & mask; mIndex[i] != npos; i = (i + 1) & mask)
+			{
+				auto& fork = (*this)[mIndex[i]];
+				if (fork.mSessionID == id)
+					return &fork;
+			}
+			return nullptr;
+		}
+
+		// returns the fork that the remote party refers to as `remoteId`,
+		// or nullptr.
+		SocketFork* findRemote(u32 remoteId)
+		{
+			auto page = remoteId >> RemotePageBits;
+			if (page >= mRemotePages.size() || !mRemotePages[page])
+				return nullptr;
+			auto idx = mRemotePages[page][remoteId & RemotePageMask];
+			return idx == npos ? nullptr : &(*this)[idx];
+		}
+
+		// record that the remote party refers to `fork` as `remoteId`.
+		void setRemote(u32 remoteId, SocketFork& fork)
+		{
+			COPROTO_ASSERT(findRemote(remoteId) == nullptr);
+			auto page = remoteId >> RemotePageBits;
+			if (page >= mRemotePages.size())
+				mRemotePages.resize(page + 1);
+			if (!mRemotePages[page])
+			{
+				mRemotePages[page].reset(new u32[RemotePageSize]);
+				std::fill(mRemotePages[page].get(), mRemotePages[page].get() + RemotePageSize, npos);
+			}
+			mRemotePages[page][remoteId & RemotePageMask] = fork.mIndex;
+		}
+
+		// the remote party no longer uses `remoteId`. It may reuse it 
+		// for another fork.
+		void eraseRemote(u32 remoteId)
+		{
+			COPROTO_ASSERT(findRemote(remoteId) != nullptr);
+			mRemotePages[remoteId >> RemotePageBits][remoteId & RemotePageMask] = npos;
+		}
+
+		// iterates over the forks, skipping free slots.
+		struct iterator
+		{
+			SocketForkTable* mTable;
+			u32 mIdx;
+			SocketFork& operator*() const { return (*mTable)[mIdx]; }
+			SocketFork* operator->() const { return &(*mTable)[mIdx]; }
+			iterator& operator++() { mIdx = mTable->nextUsed(mIdx + 1); return *this; }
+			bool operator==(const iterator& o) const { return mIdx == o.mIdx; }
+			bool operator!=(const iterator& o) const { return mIdx != o.mIdx; }
+		};
+
+		iterator begin() { return { this, nextUsed(0) }; }
+		iterator end() { return { this, mEnd }; }
+
+	private:
+		static constexpr u32 PageBits = 6;
+		static constexpr u32 PageMask = (1u << PageBits) - 1;
+		static constexpr u32 RemotePageBits = 12;
+		static constexpr u32 RemotePageSize = 1u << RemotePageBits;
+		static constexpr u32 RemotePageMask = RemotePageSize - 1;
+
+		// the pages of forks, each holds 1 << PageBits forks.
+		std::vector<SocketFork*> mPages;
+
+		// the number of slots that have been used and the number
+		// of these that currently hold a fork.
+		u32 mEnd = 0, mNumForks = 0;
+
+		// the slots of erased forks.
+		std::vector<u32> mFree;
+		std::vector<bool> mIsFree;
+
+		// the number of times that each slot has been freed.
+		std::vector<u32> mGenerations;
+
+		// linear probing table of fork indices, npos if empty. 
+		// Its size is a power of two and at least twice mNumForks.
+		std::vector<u32> mIndex;
+
+		// remote id -> fork index, npos if unknown.
+		std::vector<std::unique_ptr<u32[]>> mRemotePages;
+
+		u32 nextUsed(u32 idx) const
+		{
+			while (idx < mEnd && mIsFree[idx])
+				++idx;
+			return idx;
+		}
+
+		void insertIndex(const SessionID& id, u32 idx)
+		{
+			auto mask = mIndex.size() - 1;
+			auto i = id.hash() & mask;
+			while (mIndex[i] != npos)
+				i = (i + 1) & mask;
+			mIndex[i] = idx;
+		}
+
+		void eraseIndex(const SessionID& id, u32 idx)
+		{
+			auto mask = mIndex.size() - 1;
+			auto i = id.hash() & mask;
+			while (mIndex[i] != idx)
+				i = (i + 1) & mask;
+
+			// move later entries of the probe sequence into the hole 
+			// unless that would place them before their home slot.
+			for (auto j = (i + 1) & mask; mIndex[j] != npos; j = (j + 1) & mask)
+			{
+				auto home = (*this)[mIndex[j]].mSessionID.hash() & mask;
+				if (((j - home) & mask) >= ((j - i) & mask))
+				{
+					mIndex[i] = mIndex[j];
+					i = j;
+				}
+			}
+			mIndex[i] = npos;
+		}
+
+		void rehash(u64 size)
+		{
+			mIndex.assign(size, npos);
+			for (auto& fork : *this)
+				insertIndex(fork.mSessionID, fork.mIndex);
+		}
+	};
+
 	//inline
 	//	u64& recvIndex(SocketFork* s)
 	//{
 	//	return s->mRecvIdx;
 	//}
 
-	inline void SendOperation::completeOn(ExecutionQueue::Handle& queue, Lock& l)
+	inline void SendOperation::completeOn(ExecutionQueue::Handle& queue, FlushEpochs& flushes, Lock& l)
 	{
 		assert(mCH);
-		queue.push_back(std::exchange(mCH, nullptr), mSocketFork->mExecutor, l);
-		for (auto& f : mFlushes)
+		if (mDetachedEC)
 		{
-			if (f.use_count() == 1)
-			{
-				queue.push_back(std::exchange(f->mHandle, nullptr), mSocketFork->mExecutor, l);
-			}
+			flushes.fail(mDetachedEC);
+			mSocketFork->mFlushEpochs.fail(mDetachedEC);
 		}
-		mFlushes.clear();
+		queue.push_back(std::exchange(mCH, nullptr), mSocketFork->mExecutor, l);
+		flushes.complete(mFlushEpoch, queue, l);
+		mSocketFork->mFlushEpochs.complete(mForkFlushEpoch, queue, l);
 	}
 
-	inline void RecvOperation::completeOn(ExecutionQueue::Handle& queue, Lock& l)
+	inline void RecvOperation::completeOn(ExecutionQueue::Handle& queue, FlushEpochs& flushes, Lock& l)
 	{
 		assert(mCH);
 		queue.push_back(std::exchange(mCH, nullptr), mSocketFork->mExecutor, l);
-		for (auto& f : mFlushes)
-		{
-			if (f.use_count() == 1)
-			{
-				queue.push_back(std::exchange(f->mHandle, nullptr), mSocketFork->mExecutor, l);
-			}
-		}
-		mFlushes.clear();
+		flushes.complete(mFlushEpoch, queue, l);
+		mSocketFork->mFlushEpochs.complete(mForkFlushEpoch, queue, l);
 	}
 
 	//using SocketForkIter = std::list<SocketFork>::iterator;
@@ -12,50 +12,53 @@
 namespace coproto {
 	namespace internal
 	{
-		coroutine_handle<void> SockScheduler::recv(SessionID id, RecvBuffer* data, coroutine_handle<void> ch, macoro::stop_token&& token)
+		coroutine_handle<void> SockScheduler::recv(SocketForkRef ref, RecvBuffer* data, coroutine_handle<void> ch, macoro::stop_token&& token)
 		{
 			ExecutionQueue::Handle exQueue;
+
+			// Recvs that can not be canceled are pushed onto mRecvIntake 
+			// without taking the mutex. Only the producer that finds the 
+			// intake empty takes it. A single threaded scheduler does not 
+			// lock so it skips this.
+			if (!mMutex.singleThreaded() && !token.stop_possible())
 			{
-				Lock l = Lock(mMutex);
-				exQueue = mExQueue.acquire(l);
+				auto sub = RecvSubmission::acquire();
+				sub->mFork = ref;
+				sub->mBuffer = data;
+				sub->mCallback = ch;
+				auto head = mRecvIntake.load(std::memory_order_relaxed);
+				do {
+					sub->mNext = head;
+				} while (!mRecvIntake.compare_exchange_weak(head, sub,
+					std::memory_order_release, std::memory_order_relaxed));
 
-				auto fork = getLocalSocketFork(id, l);
+				if (head)
+					return macoro::noop_coroutine();
 
-				if (mEC)
 				{
-					data->setError(mEC);
-					exQueue.push_back(ch, fork->mExecutor, l);
+					Lock l = Lock(mMutex);
+					exQueue = mExQueue.acquire(l);
+					drainRecvIntake(exQueue, l);
 				}
-				else
-				{
-					++mNumRecvs;
-					auto& op = fork->emplace_recv(l, *data, ch, fork);
+				return exQueue.runReturnLast();
+			}
 
-					// if this is only recv op, we need to resume the recv task
-					if (mAnyRecvOp)
-					{
-						COPROTO_ASSERT(mRecvStatus == Status::Idle);
-						mRecvStatus = Status::InUse;
-						op.setStatus(RecvOperation::Status::InProgress);
-						exQueue.push_back(mAnyRecvOp->getHandle(code::success, mAnyRecvOp), fork->mExecutor, l);
-					}
+			{
+				Lock l = Lock(mMutex);
+				exQueue = mExQueue.acquire(l);
 
-					// if the recv task was wanting this specific recv op,
-					// we need to resume it.
-					if (mGetRequestedRecvSocketFork &&  
-						fork->mRemoteId == mGetRequestedRecvSocketFork->forkID())
-					{
-						COPROTO_ASSERT(mRecvStatus == Status::RequestedRecvOp);
-						mRecvStatus = Status::InUse;
-						op.setStatus(RecvOperation::Status::InProgress);
-						exQueue.push_back(mGetRequestedRecvSocketFork->getHandle(macoro::Ok(&op), mGetRequestedRecvSocketFork), fork->mExecutor, l);
-					}
+				// earlier submissions must be posted first.
+				drainRecvIntake(exQueue, l);
 
-					// install the cancelation handle. This must be 
-					// done after the operation has [possible] started 
-					// to ensure that we cancel it correctly. In particular, 
-					// cancel might be called from some other thread at any time.
-					op.setCancelation(std::move(token), [this, opPtr = &op]() {
+				auto opPtr = postRecv(ref, data, ch, exQueue, l);
+
+				// install the cancelation handle. This must be 
+				// done after the operation has [possible] started 
+				// to ensure that we cancel it correctly. In particular, 
+				// cancel might be called from some other thread at any time.
+				if (opPtr)
+				{
+					opPtr->setCancelation(std::move(token), [this, opPtr]() {
 						macoro::stop_source cancelSrc;
 						ExecutionQueue::Handle exQueue;
 						{
@@ -66,8 +69,10 @@ namespace coproto {
 								// we will skip this operation
 								--mNumRecvs;
 								opPtr->setError(code::operation_aborted);
-								opPtr->completeOn(exQueue, l);
-								opPtr->fork().erase_recv(l, opPtr);
+								opPtr->completeOn(exQueue, mFlushEpochs, l);
+								auto& fork = opPtr->fork();
+								fork.erase_recv(l, opPtr);
+								tryReleaseFork(fork, exQueue, l);
 							}
 							else
 							{
@@ -89,87 +94,766 @@ namespace coproto {
 			return exQueue.runReturnLast();
 		}
 
-		SessionID SockScheduler::fork(SessionID s)
+		RecvOperation* SockScheduler::postRecv(const SocketForkRef& ref, RecvBuffer* data, 
+			coroutine_handle<void> ch, ExecutionQueue::Handle& exQueue, Lock& l)
 		{
+			auto fork = openFork(ref, l);
+			if (mEC || !fork)
+			{
+				data->setError(mEC ? mEC : code::closed);
+				exQueue.push_back(ch, fork ? fork->mExecutor : ExecutorRef{}, l);
+				return nullptr;
+			}
+			
+			if (fork->mStash.size() && fork->size_recv(l) == 0)
+			{
+				// the message has already arrived and been stashed.
+				popStash(*fork, *data, exQueue, l);
+				exQueue.push_back(ch, fork->mExecutor, l);
+				return nullptr;
+			}
+
+			++mNumRecvs;
+			auto& op = fork->emplace_recv(l, mFlushEpochs, *data, ch, fork);
+
+			// if this is only recv op, we need to resume the recv task
+			if (mAnyRecvOp)
+			{
+				COPROTO_ASSERT(mRecvStatus == Status::Idle);
+				mRecvStatus = Status::InUse;
+				op.setStatus(RecvOperation::Status::InProgress);
+				exQueue.push_back(mAnyRecvOp->getHandle(code::success, mAnyRecvOp), fork->mExecutor, l);
+			}
+
+			// if the recv task was wanting this specific recv op,
+			// we need to resume it.
+			if (mGetRequestedRecvSocketFork &&  
+				fork->mRemoteId == mGetRequestedRecvSocketFork->forkID())
+			{
+				COPROTO_ASSERT(mRecvStatus == Status::RequestedRecvOp);
+				mRecvStatus = Status::InUse;
+				op.setStatus(RecvOperation::Status::InProgress);
+				exQueue.push_back(mGetRequestedRecvSocketFork->getHandle(macoro::Ok(&op), mGetRequestedRecvSocketFork), fork->mExecutor, l);
+			}
+			return &op;
+		}
+
+		void SockScheduler::drainRecvIntake(ExecutionQueue::Handle& queue, Lock& l)
+		{
+			auto sub = mRecvIntake.exchange(nullptr, std::memory_order_acquire);
+
+			// the intake is a stack. Reverse it to get the submission order.
+			RecvSubmission* list = nullptr;
+			while (sub)
+				list = std::exchange(sub, std::exchange(sub->mNext, list));
+
+			while (list)
+			{
+				auto sub = std::exchange(list, list->mNext);
+				postRecv(sub->mFork, sub->mBuffer, sub->mCallback, queue, l);
+				RecvSubmission::release(sub);
+			}
+		}
+
+		coroutine_handle<> SockScheduler::waitForSendCapacity(
+			SocketForkRef ref, SendCapacityWaiter& w,
+			coroutine_handle<> h, macoro::stop_token&& token)
+		{
+			if (mSendLimited.load(std::memory_order_relaxed) == false)
+				return h;
+
 			Lock l(mMutex);
-			auto slot = getLocalSocketFork(s, l);
-			auto s2 = slot->mSessionID.derive();
-			initLocalSocketFork(s2, slot->mExecutor, l);
-			return s2;
+			auto fork = openFork(ref, l);
+			if (!fork)
+				return h;
+
+			bool exceeded =
+				(mSendHighWater && mQueuedSendBytes > mSendHighWater) ||
+				(fork->mSendHighWater && fork->mQueuedSendBytes > fork->mSendHighWater);
+
+			// the queue does not drain while corked.
+			if (mEC || !exceeded || mCorked)
+				return h;
+
+			// a stopped token aborts without waiting.
+			if (token.stop_requested())
+			{
+				w.mEC = code::operation_aborted;
+				return h;
+			}
+
+			w.mFork = fork;
+			w.mHandle = h;
+			mSendWaiters.push_back(&w);
+
+			if (token.stop_possible())
+			{
+				// the callback runs inline if the token is stopped while it is 
+				// registered. It then only sets w.mEC and h is returned below.
+				// Otherwise it must wait for the mutex and thus for mRegistering
+				// to be cleared.
+				w.mRegistering = true;
+				w.mReg.emplace(std::move(token), [this, &w] {
+					ExecutionQueue::Handle queue;
+					{
+						Lock l(mMutex);
+						auto iter = std::find(mSendWaiters.begin(), mSendWaiters.end(), &w);
+						if (iter == mSendWaiters.end())
+							return;
+
+						mSendWaiters.erase(iter);
+						w.mEC = code::operation_aborted;
+						if (w.mRegistering)
+							return;
+
+						queue = mExQueue.acquire(l);
+						queue.push_back(w.mHandle, w.mFork->mExecutor, l);
+					}
+					queue.run();
+					});
+				w.mRegistering = false;
+
+				if (w.mEC)
+					return h;
+			}
+
+			return macoro::noop_coroutine();
 		}
 
-		void SockScheduler::initLocalSocketFork(const SessionID& id, const ExecutorRef& ex, Lock& _)
+		void SockScheduler::releaseSendBytes(SendOperation& op, ExecutionQueue::Handle& queue, Lock& l)
 		{
-			auto iter = mIdSocketForkMapping_.find(id);
-			if (iter == mIdSocketForkMapping_.end())
+			auto& fork = op.fork();
+			auto size = op.size();
+			COPROTO_ASSERT(mQueuedSendBytes >= size && fork.mQueuedSendBytes >= size);
+			mQueuedSendBytes -= size;
+			fork.mQueuedSendBytes -= size;
+
+			if (mSendWaiters.empty() || 
+				(mSendHighWater && mQueuedSendBytes > mSendLowWater))
+				return;
+
+			for (u64 i = 0; i < mSendWaiters.size();)
 			{
-				// We have initialized the slot before receiving any messages.
-				mSocketForks_.emplace_back(id);
-				auto slot = --mSocketForks_.end();
-				iter = mIdSocketForkMapping_.insert({ id, slot }).first;
+				auto& f = *mSendWaiters[i]->mFork;
+				if (f.mSendHighWater && f.mQueuedSendBytes > f.mSendLowWater)
+				{
+					++i;
+				}
+				else
+				{
+					queue.push_back(mSendWaiters[i]->mHandle, f.mExecutor, l);
+					mSendWaiters.erase(mSendWaiters.begin() + i);
+				}
+			}
+		}
+
+		void SockScheduler::completeStash()
+		{
+			ExecutionQueue::Handle queue;
+			{
+				Lock l(mMutex);
+				queue = mExQueue.acquire(l);
+
+				COPROTO_ASSERT(mStashFork);
+				auto& fork = *std::exchange(mStashFork, nullptr);
+				if (fork.mChunkedStash.empty())
+				{
+					COPROTO_ASSERT(mStashBuffer.size() == mStashSize);
+					fork.mStash.push_back(std::move(mStashBuffer));
+				}
+				else if (fork.mChunkedRecvOffset == fork.mChunkedRecvSize)
+				{
+					// the last chunk of a stashed message has arrived.
+					RECV_LOG("recv-chunked-stash-done");
+					fork.mStash.push_back(std::move(fork.mChunkedStash));
+					fork.mChunkedStash.clear();
+					fork.mChunkedRecvSize = 0;
+				}
+
+				// recv operations might have been posted while the
+				// message was being received. These get the stashed
+				// messages first.
+				while (!mEC && fork.mStash.size() && fork.size_recv(l))
+				{
+					auto& op = fork.front_recv(l);
+					COPROTO_ASSERT(op.status() == RecvOperation::Status::NotStarted);
+					popStash(fork, op, queue, l);
+					op.completeOn(queue, mFlushEpochs, l);
+					fork.pop_front_recv(l);
+					--mNumRecvs;
+				}
+				tryReleaseFork(fork, queue, l);
 			}
+			queue.run();
+		}
+
+		error_code SockScheduler::recvControlBlock(ControlBlock& ctrl)
+		{
+			error_code ec;
+			ExecutionQueue::Handle queue;
+			{
+				Lock l(mMutex);
+				queue = mExQueue.acquire(l);
+
+				SocketFork* forkPtr = nullptr;
+				if (ctrl.getType() == ControlBlock::Type::NewSocketForkRange)
+				{
+					// the slots are created once their base id arrives.
+					auto size = ctrl.getSize();
+					if (mRecvForkRangeSize || size == 0 ||
+						size >= ControlBlock::ExtendedSlotId - u64(ctrl.getSlotId()))
+						ec = code::badCoprotoMessageHeader;
+					else
+					{
+						RECV_LOG("recv-fork-range");
+						mRecvForkRangeBase = ctrl.getSlotId();
+						mRecvForkRangeSize = static_cast<u32>(size);
+					}
+				}
+				else if ((forkPtr = findRemoteFork(ctrl.getSlotId(), l)) == nullptr)
+					ec = code::badCoprotoMessageHeader;
+				else
+				{
+					auto& fork = *forkPtr;
+					switch (ctrl.getType())
+					{
+					case ControlBlock::Type::ChunkedMessage:
+						if (fork.mChunkedRecvSize || ctrl.getSize() == 0)
+							ec = code::badCoprotoMessageHeader;
+						else
+						{
+							RECV_LOG("recv-chunked-message");
+							fork.mChunkedRecvSize = ctrl.getSize();
+						}
+						break;
+					case ControlBlock::Type::AbortMessage:
+						if (fork.mChunkedStash.size())
+						{
+							// the partially stashed message is dropped.
+							RECV_LOG("recv-abort-stashed-message");
+							fork.mStashBytes -= fork.mChunkedRecvSize;
+							bufferPool().release(std::move(fork.mChunkedStash));
+							fork.mChunkedStash.clear();
+							fork.mChunkedRecvSize = 0;
+							tryReleaseFork(fork, queue, l);
+						}
+						else if (fork.mChunkedRecv == nullptr)
+							ec = code::badCoprotoMessageHeader;
+						else
+						{
+							// the sender canceled the message after sending 
+							// some of it. Fail the matching recv.
+							RECV_LOG("recv-abort-message");
+							auto& op = *fork.mChunkedRecv;
+							COPROTO_ASSERT(&fork.front_recv(l) == &op);
+							op.setError(code::remoteCancel);
+							op.completeOn(queue, mFlushEpochs, l);
+							fork.pop_front_recv(l);
+							--mNumRecvs;
+
+							fork.mChunkedRecvSize = 0;
+							fork.mChunkedRecv = nullptr;
+							fork.mChunkedRecvBuffers.clear();
+							tryReleaseFork(fork, queue, l);
+						}
+						break;
+					case ControlBlock::Type::CloseFork:
+						if (fork.mChunkedRecvSize)
+							ec = code::badCoprotoMessageHeader;
+						else
+						{
+							// the other party can now reuse the slot id.
+							RECV_LOG("recv-close-fork");
+							fork.mRemoteClosed = true;
+							if (mDeterministicForks == false || deterministicSlot(ctrl.getSlotId()) == false)
+								mSocketForks_.eraseRemote(ctrl.getSlotId());
+							tryReleaseFork(fork, queue, l);
+						}
+						break;
+					case ControlBlock::Type::EmptyMessage:
+						// the receive task handles it as a message of size zero.
+						if (mRecvOwnedSize || fork.mChunkedRecvSize)
+							ec = code::badCoprotoMessageHeader;
+						else
+							RECV_LOG("recv-empty-message");
+						break;
+					case ControlBlock::Type::OwnedMessage:
+						if (mOwnedSend == false || mRecvOwnedSize || 
+							fork.mChunkedRecvSize || ctrl.getSize() == 0)
+							ec = code::badCoprotoMessageHeader;
+						else
+						{
+							// the header of the message follows.
+							RECV_LOG("recv-owned-message");
+							mRecvOwnedSize = ctrl.getSize();
+						}
+						break;
+					default:
+						ec = code::badCoprotoMessageHeader;
+						break;
+					}
+				}
+			}
+			queue.run();
+			return ec;
+		}
+
+		void SockScheduler::uncork()
+		{
+			ExecutionQueue::Handle queue;
+			{
+				Lock l(mMutex);
+				queue = mExQueue.acquire(l);
+				COPROTO_ASSERT(mCorked);
+				--mCorked;
+
+				// if the send task is busy it will pick up the 
+				// queued messages once the current batch completes.
+				drainSendIntake(queue, l);
+				startSend(queue, l);
+			}
+			queue.run();
+		}
+
+		void SockScheduler::drainSendIntake(ExecutionQueue::Handle& queue, Lock& l)
+		{
+			auto sub = mSendIntake.exchange(nullptr, std::memory_order_acquire);
+
+			// the intake is a stack. Reverse it to get the submission order.
+			SendSubmission* list = nullptr;
+			while (sub)
+				list = std::exchange(sub, std::exchange(sub->mNext, list));
+
+			while (list)
+			{
+				auto sub = std::exchange(list, list->mNext);
+				auto fork = openFork(sub->mFork, l);
+
+				if (mEC || !fork)
+				{
+					// the scheduler failed after the submission checked 
+					// mFailed, or the fork was closed. The caller of a 
+					// move-send was forgotten so the error is reported by
+					// the next flush.
+					auto ec = mEC ? mEC : code::closed;
+					if (sub->mBuffer->owned())
+					{
+						mFlushEpochs.fail(ec);
+						if (fork)
+							fork->mFlushEpochs.fail(ec);
+					}
+					else
+						sub->mBuffer->setError(ec);
+					queue.push_back(sub->mCallback, fork ? fork->mExecutor : ExecutorRef{}, l);
+				}
+				else
+				{
+					auto opPtr = &fork->emplace_send(l, mFlushEpochs,
+						fork, sub->mCallback, std::move(sub->mBuffer));
+					enqueueSend(opPtr, queue, l);
+				}
+				sub->mBuffer.destruct();
+				SendSubmission::release(sub);
+			}
+		}
+
+		void SockScheduler::enqueueSend(SendOperation* op, ExecutionQueue::Handle& queue, Lock& l)
+		{
+			// nothing is sent until uncork(). The caller might be the one
+			// to uncork so it can not wait for the message to be sent.
+			if (mCorked)
+			{
+				if (auto ch = op->detach())
+					queue.push_back(ch, op->fork().mExecutor, l);
+			}
+
+			auto size = op->size();
+			op->fork().mQueuedSendBytes += size;
+			mQueuedSendBytes += size;
+			insertSend(op);
+		}
+
+		void SockScheduler::startSend(ExecutionQueue::Handle& queue, Lock& l)
+		{
+			if (mNextSendOp && !mCorked && hasPendingSends())
+			{
+				COPROTO_ASSERT(mSendStatus == Status::Idle);
+				mSendStatus = Status::InUse;
+
+				auto batch = mNextSendOp->takeBatch(l);
+				queue.push_back(mNextSendOp->getHandle(macoro::Ok(batch), mNextSendOp), {}, l);
+			}
+		}
+
+		SendClass& SockScheduler::sendClass(u32 priority)
+		{
+			if (priority == 0)
+				return mDefaultSendClass;
+			for (auto& cls : mSendClasses)
+				if (cls->mPriority == priority)
+					return *cls;
+			mSendClasses.emplace_back(new SendClass(priority));
+			return *mSendClasses.back();
+		}
+
+		void SockScheduler::insertSend(SendOperation* op)
+		{
+			// an earlier operation of the same fork is never overtaken, 
+			// even if the priority has changed since.
+			auto& fork = op->fork();
+			if (fork.mNumPendingSends++ == 0)
+				fork.mPendingSendClass = fork.mSendClass ? fork.mSendClass : &mDefaultSendClass;
+			auto& cls = *fork.mPendingSendClass;
+
+			op->setNext(nullptr);
+			if (cls.mLast)
+				cls.mLast->setNext(op);
 			else
 			{
-				// We have already received a message for this slot.
-				// assign its local id.
-				COPROTO_ASSERT(~iter->second->mLocalId == 0);
+				op->setPrev(nullptr);
+				cls.mBegin = op;
 			}
+			cls.mLast = op;
 
-			iter->second->mLocalId = mNextLocalSocketFork++;
-			iter->second->mExecutor = ex;
+			if (cls.mActive == false)
+			{
+				cls.mActive = true;
+				mActiveSendClasses.push_back(&cls);
+			}
 		}
 
-		SocketForkIter SockScheduler::getLocalSocketFork(const SessionID& id, Lock& _)
+		void SockScheduler::eraseSend(SendOperation* op)
 		{
-			auto iter = mIdSocketForkMapping_.find(id);
-			COPROTO_ASSERT(iter != mIdSocketForkMapping_.end() && iter->second->mLocalId != 0);
-			return iter->second;
+			auto& fork = op->fork();
+			auto& cls = *fork.mPendingSendClass;
+			COPROTO_ASSERT(fork.mNumPendingSends);
+			if (--fork.mNumPendingSends == 0)
+				fork.mPendingSendClass = nullptr;
+
+			auto prev = op->prev();
+			auto next = op->next();
+			if (prev)
+				prev->setNext(next);
+			else
+			{
+				COPROTO_ASSERT(cls.mBegin == op);
+				cls.mBegin = next;
+				if (next)
+					next->setPrev(nullptr);
+			}
+			if (cls.mLast == op)
+				cls.mLast = prev;
+
+			op->setNext(nullptr);
+			op->setPrev(nullptr);
+
+			// a class without pending operations leaves the rotation and
+			// its unused deficit is dropped.
+			if (cls.mBegin == nullptr)
+			{
+				auto iter = std::find(mActiveSendClasses.begin(), mActiveSendClasses.end(), &cls);
+				COPROTO_ASSERT(iter != mActiveSendClasses.end());
+				if (iter == mActiveSendClasses.begin())
+					mSendTurn = false;
+				mActiveSendClasses.erase(iter);
+				cls.mActive = false;
+				cls.mDeficit = 0;
+			}
 		}
 
-		error_code SockScheduler::initRemoteSocketFork(u32 slotId, SessionID id, Lock& _)
+		SocketFork* SockScheduler::fork(SocketForkRef ref)
 		{
-			if (slotId == ~u32(0))
-				return code::badCoprotoMessageHeader;
+			ExecutionQueue::Handle queue;
+			SocketFork* ret;
+			{
+				Lock l(mMutex);
+				auto s = mSocketForks_.get(ref);
+				if (!s)
+					throw std::system_error(code::closed, "the socket fork has been closed. " COPROTO_LOCATION);
+
+				// in deterministic mode, the slot of a fork of the root is
+				// given by its child index. Both parties know it. The other
+				// forks take slots below these.
+				auto childIdx = s->mSessionID.mChildIdx;
+				bool deterministic = mDeterministicForks && 
+					s == mSocketForks_.get(mRootFork) &&
+					childIdx < ControlBlock::ExtendedSlotId - DeterministicSlotBase;
+				if (mDeterministicForks && !deterministic &&
+					mFreeLocalSocketForks.empty() &&
+					mNextLocalSocketFork >= DeterministicSlotBase)
+					throw std::overflow_error("too many socket forks. " COPROTO_LOCATION);
+
+				queue = mExQueue.acquire(l);
+				auto s2 = s->mSessionID.derive();
+				if (deterministic)
+				{
+					ret = initLocalSocketFork(s2, s->mExecutor, l,
+						DeterministicSlotBase + static_cast<u32>(childIdx));
+					ret->mInitiated = true;
+					ret->mRemoteId = ret->mLocalId;
+				}
+				else
+					ret = initLocalSocketFork(s2, s->mExecutor, l);
+			}
+			queue.run();
+			return ret;
+		}
+
+		std::vector<SocketFork*> SockScheduler::fork(SocketForkRef ref, u64 n)
+		{
+			std::vector<SocketFork*> ret(n);
+			if (n == 0)
+				return ret;
 
-			auto iter = mIdSocketForkMapping_.find(id);
-			SocketForkIter slot;
-			if (iter == mIdSocketForkMapping_.end())
+			ExecutionQueue::Handle queue;
+			{
+				Lock l(mMutex);
+				auto s = mSocketForks_.get(ref);
+				if (!s)
+					throw std::system_error(code::closed, "the socket fork has been closed. " COPROTO_LOCATION);
+				auto end = mDeterministicForks ? DeterministicSlotBase : ControlBlock::ExtendedSlotId;
+				if (n >= end - u64(mNextLocalSocketFork))
+					throw std::overflow_error("too many socket forks. " COPROTO_LOCATION);
+				queue = mExQueue.acquire(l);
+
+				// the range takes fresh local ids so that they are consecutive.
+				auto range = std::make_shared<SocketForkRange>();
+				range->mBaseId = s->mSessionID.derive();
+				range->mLocalBase = mNextLocalSocketFork;
+				range->mSize = static_cast<u32>(n);
+				mNextLocalSocketFork += range->mSize;
+
+				mSocketForks_.reserve(mSocketForks_.size() + n);
+				for (u64 i = 0; i < n; ++i)
+				{
+					ret[i] = initLocalSocketFork(range->mBaseId.derive(i), s->mExecutor, l,
+						range->mLocalBase + static_cast<u32>(i));
+					ret[i]->mRange = range;
+				}
+			}
+			queue.run();
+			return ret;
+		}
+
+		void SockScheduler::closeFork(SocketForkRef ref)
+		{
+			ExecutionQueue::Handle queue;
+			{
+				Lock l(mMutex);
+				queue = mExQueue.acquire(l);
+
+				// operations that are still in the intakes belong to their fork.
+				drainSendIntake(queue, l);
+				drainRecvIntake(queue, l);
+
+				// a copy of the socket might already have closed it.
+				if (auto fork = openFork(ref, l))
+				{
+					fork->mCloseState = SocketFork::CloseState::Closing;
+					tryReleaseFork(*fork, queue, l);
+				}
+			}
+			queue.run();
+		}
+
+		void SockScheduler::tryReleaseFork(SocketFork& fork, ExecutionQueue::Handle& queue, Lock& l)
+		{
+			using CloseState = SocketFork::CloseState;
+
+			// a fork that has been closed gets no more recvs. Messages
+			// that the other party sent on it are dropped.
+			if (fork.mCloseState != CloseState::Open && fork.size_recv(l) == 0)
 			{
-				mSocketForks_.emplace_back(id);
-				slot = --mSocketForks_.end();
-				iter = mIdSocketForkMapping_.insert({ id, slot }).first;
+				for (auto& msg : fork.mStash)
+				{
+					fork.mStashBytes -= msg.size();
+					bufferPool().release(std::move(msg));
+				}
+				fork.mStash.clear();
+			}
 
+			if (fork.mCloseState == CloseState::Open ||
+				fork.mCloseState == CloseState::CloseQueued ||
+				fork.size_send(l) ||
+				fork.size_recv(l) ||
+				fork.mChunkedStash.size() ||
+				mStashFork == &fork)
+				return;
+
+			if (fork.mCloseState == CloseState::Closing)
+			{
+				// if we have sent on the fork, the other party must be told
+				// that the slot id is no longer used. The send task calls
+				// this again once the message is sent. The forks of a range
+				// are always told as the range might be announced later. If
+				// not yet announced, the CloseFork message announces it.
+				if ((fork.announced() || fork.mRange) && !mEC)
+				{
+					fork.mCloseState = CloseState::CloseQueued;
+					mForkCloses.push_back(&fork);
+					return;
+				}
+				fork.mCloseState = CloseState::Closed;
+			}
+
+			// wait for the other party to close it as well. Once the 
+			// socket has failed, it will not.
+			if (fork.mRemoteId != ~u32(0) && fork.mRemoteClosed == false)
+			{
+				if (!mEC)
+					return;
+				if (mSocketForks_.findRemote(fork.mRemoteId) == &fork)
+					mSocketForks_.eraseRemote(fork.mRemoteId);
+			}
+
+			// the slots of deterministic forks are given by their child 
+			// index and are not reused.
+			if (fork.mLocalId != ~u32(0) && !(mDeterministicForks && deterministicSlot(fork.mLocalId)))
+				mFreeLocalSocketForks.push_back(fork.mLocalId);
+			mSocketForks_.erase(fork);
+		}
+
+		SocketFork* SockScheduler::initLocalSocketFork(const SessionID& id, const ExecutorRef& ex, Lock& _, u32 localId)
+		{
+			auto slot = mSocketForks_.find(id);
+			if (slot == nullptr)
+			{
+				// We have initialized the slot before receiving any messages.
+				slot = &mSocketForks_.emplace(id);
+			}
+			else
+			{
+				// We have already received a message for this slot.
+				// assign its local id.
+				COPROTO_ASSERT(~slot->mLocalId == 0);
+			}
+
+			if (localId != ~u32(0))
+				slot->mLocalId = localId;
+			else if (mFreeLocalSocketForks.size())
+			{
+				slot->mLocalId = mFreeLocalSocketForks.back();
+				mFreeLocalSocketForks.pop_back();
 			}
 			else
-				slot = iter->second;
+				slot->mLocalId = mNextLocalSocketFork++;
+			slot->mExecutor = ex;
+			return slot;
+		}
+
+		SocketFork* SockScheduler::getLocalSocketFork(const SessionID& id, Lock& _)
+		{
+			auto slot = mSocketForks_.find(id);
+			COPROTO_ASSERT(slot != nullptr && slot->mLocalId != 0);
+			return slot;
+		}
 
-			if (slot->mRemoteId != ~u32(0))
+		error_code SockScheduler::initRemoteSocketFork(u32 slotId, SessionID id, Lock& l)
+		{
+			// the deterministic slots are never announced.
+			if (slotId == ~u32(0) || (mDeterministicForks && deterministicSlot(slotId)))
+				return code::badCoprotoMessageHeader;
+
+			auto slot = mSocketForks_.find(id);
+			if (slot == nullptr)
+				slot = &mSocketForks_.emplace(id);
+
+			if (slot->mRemoteId != ~u32(0) || mSocketForks_.findRemote(slotId))
 				return code::badCoprotoMessageHeader;
 
 			COPROTO_ASSERT(slot->mSessionID == id);
-			COPROTO_ASSERT(mRemoteSocketForkMapping_.find(slotId) == mRemoteSocketForkMapping_.end());
 			slot->mRemoteId = slotId;
-			mRemoteSocketForkMapping_.insert({ slotId, slot });
+			mSocketForks_.setRemote(slotId, *slot);
 
 			return {};
 		}
 
-		coroutine_handle<> SockScheduler::flush(coroutine_handle<> h)
+		SocketFork* SockScheduler::findRemoteFork(u32 slotId, Lock& _)
+		{
+			if (mDeterministicForks == false || deterministicSlot(slotId) == false)
+				return mSocketForks_.findRemote(slotId);
+
+			// the slot gives the child index of the fork of the root. If 
+			// we have not created it yet, the fork is created so that its
+			// messages can wait for it. If we have, it must still exist.
+			auto root = mSocketForks_.get(mRootFork);
+			if (root == nullptr)
+				return nullptr;
+			auto childIdx = slotId - DeterministicSlotBase;
+			auto id = root->mSessionID.derive(childIdx);
+			auto fork = mSocketForks_.find(id);
+			if (fork == nullptr && childIdx >= root->mSessionID.mChildIdx)
+			{
+				fork = &mSocketForks_.emplace(id);
+				fork->mRemoteId = slotId;
+			}
+			if (fork && fork->mRemoteId != slotId)
+				return nullptr;
+			return fork;
+		}
+
+		void SockScheduler::enableDeterministicForks()
 		{
 			Lock l(mMutex);
-			if (mNumRecvs == 0 && mSendBufferBegin == nullptr)
-				return h;
+			auto& root = *mSocketForks_.begin();
+			if (mSocketForks_.size() != 1 || root.mInitiated || root.mRemoteId != ~u32(0))
+				throw std::runtime_error("enableDeterministicForks() must be called before the socket is used. " COPROTO_LOCATION);
+
+			mDeterministicForks = true;
+			mRootFork = &root;
+			root.mInitiated = true;
+			root.mRemoteId = root.mLocalId;
+			mSocketForks_.setRemote(root.mRemoteId, root);
+		}
+
+		error_code SockScheduler::initRemoteSocketForkRange(u32 slotId, SessionID baseId, Lock& l)
+		{
+			auto size = std::exchange(mRecvForkRangeSize, 0);
+			if (slotId != mRecvForkRangeBase)
+				return code::badCoprotoMessageHeader;
 
-			auto f = std::make_shared<FlushToken>(h);
+			mSocketForks_.reserve(mSocketForks_.size() + size);
+			for (u32 i = 0; i < size; ++i)
+			{
+				auto ec = initRemoteSocketFork(slotId + i, baseId.derive(i), l);
+				if (ec)
+					return ec;
+			}
+			return {};
+		}
 
-			for (auto& slot : mSocketForks_)
+		coroutine_handle<> SockScheduler::flush(FlushToken& token, SocketForkRef ref, bool forkOnly)
+		{
+			ExecutionQueue::Handle queue;
+			bool wait;
 			{
-				if (slot.size_recv(l))
-					slot.back_recv(l).addFlush(f, l);
-				if (slot.size_send(l))
-					slot.back_send(l).addFlush(f, l); 
+				Lock l(mMutex);
+				queue = mExQueue.acquire(l);
+
+				// submissions that are still in the intakes are flushed too.
+				// Their producer will start the send task.
+				drainSendIntake(queue, l);
+				drainRecvIntake(queue, l);
+
+				auto fork = mSocketForks_.get(ref);
+				if (forkOnly && !fork)
+				{
+					// the fork has been released so nothing of it is pending.
+					token.mEC = code::closed;
+					wait = false;
+				}
+				else
+				{
+					if (fork)
+						token.mExecutor = fork->mExecutor;
+					auto& flushes = forkOnly ? fork->mFlushEpochs : mFlushEpochs;
+					wait = flushes.wait(token, l);
+				}
 			}
+			queue.run();
 
+			if (!wait)
+				return std::exchange(token.mHandle, nullptr);
 			return macoro::noop_coroutine();
 		}
 
@@ -179,11 +863,15 @@ namespace coproto {
 			error_code ec,
 			Lock& l)
 		{
+			// the send task is idle, e.g. corked, while sends are 
+			// queued. It will exit without failing them so we do.
+			bool sendIdle = false;
 
 			if (!mEC)
 			{
 				COPROTO_ASSERT(ec);
 				mEC = ec;
+				mFailed.store(true, std::memory_order_relaxed);
 				if (mRecvStatus == Status::InUse)
 					mRecvCancelSrc.request_stop();
 				if (mSendStatus == Status::InUse)
@@ -210,28 +898,61 @@ namespace coproto {
 				if (mNextSendOp)
 				{
 					queue.push_back(mNextSendOp->getHandle(macoro::Err(error_code(code::cancel)), mNextSendOp), {}, l);
+					sendIdle = true;
 				}
 			}
 
-			if (c == Caller::Sender)
+			// the sender reports no error if it only observed mEC.
+			if (!ec)
+				ec = mEC;
+
+			if (c == Caller::Sender || sendIdle)
 			{
 				mSendStatus = Status::Closed;
-				auto iter = mSendBufferBegin;
-				mSendBufferBegin = nullptr;
-				mSendBufferLast = nullptr;
 				SEND_LOG("close");
 
-				while (iter)
+				// mEC is set so the submissions fail directly.
+				drainSendIntake(queue, l);
+
+				// chunked operations are at the front of their fork 
+				// and therefore are completed first.
+				for (auto op : mChunkedSends)
 				{
-					auto& op = *iter;
+					auto& fork = op->fork();
+					assert(op == &fork.front_send(l) && op == fork.mChunkedSend);
+					op->setError(std::exchange(ec, code::cancel));
+					op->completeOn(queue, mFlushEpochs, l);
+					fork.mChunkedSend = nullptr;
+					fork.mChunkedSendOffset = 0;
+					releaseSendBytes(*op, queue, l);
+					fork.pop_front_send(l);
+				}
+				mChunkedSends.clear();
+
+				// the closed forks can no longer tell the other party.
+				for (auto fork : mForkCloses)
+					fork->mCloseState = SocketFork::CloseState::Closed;
+				mForkCloses.clear();
+
+				// the pending operations of a fork are all in one class.
+				while (mActiveSendClasses.size())
+				{
+					auto& op = *mActiveSendClasses.front()->mBegin;
 					assert(op.status() == SendOperation::Status::NotStarted);
 					assert(&op == &op.fork().front_send(l));
 
 					op.setError(std::exchange(ec, code::cancel));
-					op.completeOn(queue, l);
-					iter = op.next();
+					op.completeOn(queue, mFlushEpochs, l);
+					eraseSend(&op);
+					releaseSendBytes(op, queue, l);
 					op.fork().pop_front_send(l);
 				}
+
+				// no more data will be sent. Resume anyone 
+				// that is waiting for the queue to drain.
+				for (auto w : mSendWaiters)
+					queue.push_back(w->mHandle, w->mFork->mExecutor, l);
+				mSendWaiters.clear();
 			}
 			else
 			{
@@ -242,13 +963,40 @@ namespace coproto {
 			{
 				RECV_LOG("close");
 				mRecvStatus = Status::Closed;
+
+				// mEC is set so the submissions fail directly.
+				drainRecvIntake(queue, l);
+
+				// the message that was being received into the stash
+				// is dropped. Chunked ones are dropped below.
+				if (mStashFork)
+				{
+					auto& fork = *std::exchange(mStashFork, nullptr);
+					if (fork.mChunkedStash.empty())
+					{
+						fork.mStashBytes -= mStashSize;
+						bufferPool().release(std::move(mStashBuffer));
+						mStashBuffer.clear();
+					}
+					tryReleaseFork(fork, queue, l);
+				}
+
 				for (auto& fork : mSocketForks_)
 				{
+					if (fork.mChunkedStash.size())
+					{
+						fork.mStashBytes -= fork.mChunkedRecvSize;
+						bufferPool().release(std::move(fork.mChunkedStash));
+						fork.mChunkedStash.clear();
+					}
+					fork.mChunkedRecvSize = 0;
+					fork.mChunkedRecv = nullptr;
+					fork.mChunkedRecvBuffers.clear();
 					while (fork.size_recv(l))
 					{
 						auto& op = fork.front_recv(l);
 						op.setError(std::exchange(ec, code::cancel));
-						op.completeOn(queue, l);
+						op.completeOn(queue, mFlushEpochs, l);
 						fork.pop_front_recv(l);
 					}
 				}
@@ -258,6 +1006,20 @@ namespace coproto {
 			{
 				RECV_LOG("try-close");
 			}
+
+			// once the send task has stopped, the forks that have been
+			// closed no longer wait for their CloseFork message or for 
+			// the other party. The others are released as their last 
+			// operation completes.
+			if (mSendStatus == Status::Closed)
+			{
+				std::vector<SocketFork*> closed;
+				for (auto& fork : mSocketForks_)
+					if (fork.mCloseState != SocketFork::CloseState::Open)
+						closed.push_back(&fork);
+				for (auto fork : closed)
+					tryReleaseFork(*fork, queue, l);
+			}
 		}
 
 		void SockScheduler::close()
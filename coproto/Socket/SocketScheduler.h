@@ -14,6 +14,7 @@
 #include "coproto/Common/error_code.h"
 #include "coproto/Common/Function.h"
 #include "coproto/Common/Queue.h"
+#include "coproto/Common/BufferPool.h"
 
 #include "coproto/Proto/SessionID.h"
 #include "coproto/Proto/Operation.h"
@@ -30,6 +31,7 @@
 #include "macoro/result.h"
 #include "coproto/Common/Exceptions.h"
 #include <cstring>
+#include <deque>
 
 #ifdef COPROTO_SOCK_LOGGING
 #define RECV_LOG(X) if(mLogging) mRecvLog.push_back(X)
@@ -58,76 +60,519 @@ namespace coproto
 			u32 mForkId;
 		};
 
-		// a struct meant to encode various meta data.
-		// right now the only thing its is used for is
-		// sending the SessionId -> remoteID mapping.
+		// the total size of the buffers.
+		inline u64 totalSize(span<span<u8>> buffers)
+		{
+			u64 size = 0;
+			for (auto& b : buffers)
+				size += b.size();
+			return size;
+		}
+
+		// append the bytes [offset, offset + length) of the 
+		// concatenation of buffers to out.
+		inline void sliceSpans(span<span<u8>> buffers, u64 offset, u64 length, std::vector<span<u8>>& out)
+		{
+			for (auto b : buffers)
+			{
+				if (length == 0)
+					break;
+				if (offset >= b.size())
+				{
+					offset -= b.size();
+					continue;
+				}
+
+				auto n = std::min<u64>(b.size() - offset, length);
+				out.push_back(b.subspan(offset, n));
+				offset = 0;
+				length -= n;
+			}
+		}
+
+		// a struct meant to encode various meta data. A meta message
+		// [0, slot-id] is followed by the SessionId of the new slot. 
+		// A meta message [0, ExtendedSlotId] is followed by a typed 
+		// control block, [type:8, pad:24, slot-id:32, size:64].
+		// A NewSocketForkRange control block is followed by the meta 
+		// message [0, slot-id][base-id] which gives the SessionId of 
+		// slot-id + i as base-id.derive(i) for i < size.
 		struct ControlBlock
 		{
+			// the slot id of meta messages that carry a typed control block.
+			static constexpr u32 ExtendedSlotId = ~u32(0);
+
 			// the data to be sent.
 			std::array<u8, 16> data;
 			enum class Type : u8
 			{
-				NewSocketFork = 1
+				NewSocketFork = 1,
+
+				// the next size bytes on slot-id are sent as several data 
+				// messages (chunks) which can be interleaved with other slots.
+				ChunkedMessage = 2,
+
+				// the current chunked message on slot-id was canceled.
+				AbortMessage = 3,
+
+				// the fork of slot-id was closed. The sender will not use 
+				// slot-id again until it is reused for a new fork.
+				CloseFork = 4,
+
+				// the slots [slot-id, slot-id + size) are the forks of a 
+				// range. The next meta message gives their base id.
+				NewSocketForkRange = 5,
+
+				// the next message on slot-id has size bytes and its body 
+				// is not sent. The body was handed over with Sock::sendOwned(...)
+				// and is taken with Sock::recvOwned().
+				OwnedMessage = 6,
+
+				// the next message on slot-id is empty. No data message 
+				// follows, see SendStream::finish().
+				EmptyMessage = 7
 			};
 
-			Type getType() { return Type::NewSocketFork; }
+			// only valid for typed control blocks.
+			Type getType() { return Type(data[0]); }
 			SessionID getSessionID() {
 				SessionID ret;
 				std::memcpy(ret.mVal, data.data(), 16);
 				return ret;
 			}
+			u32 getSlotId() {
+				u32 ret;
+				std::memcpy(&ret, data.data() + 4, sizeof(ret));
+				return ret;
+			}
+			u64 getSize() {
+				u64 ret;
+				std::memcpy(&ret, data.data() + 8, sizeof(ret));
+				return ret;
+			}
 
-			void setType(Type t) {};
+			void setType(Type t) { data = {}; data[0] = u8(t); };
 			void setSessionID(const SessionID& id) {
 				std::memcpy(data.data(), id.mVal, 16);
 			}
+			void setSlotId(u32 id) {
+				std::memcpy(data.data() + 4, &id, sizeof(id));
+			}
+			void setSize(u64 size) {
+				std::memcpy(data.data() + 8, &size, sizeof(size));
+			}
+		};
+
+
+		// detects if the SocketImpl has the optional vectored send function
+		//
+		//   SendAwaiter sendv(span<span<u8>> buffers, macoro::stop_token token)
+		//
+		// which sends all of the buffers as a single operation.
+		template<typename Sock, typename = void>
+		struct has_sendv_member_func : false_type
+		{};
+
+		template<typename Sock>
+		struct has_sendv_member_func<Sock, void_t<
+			decltype(std::declval<Sock&>().sendv(
+				std::declval<span<span<u8>>>(),
+				std::declval<macoro::stop_token>()))
+			>> : true_type
+		{};
+
+		// detects if the SocketImpl has the optional vectored receive function
+		//
+		//   RecvAwaiter recvv(span<span<u8>> buffers, macoro::stop_token token)
+		//
+		// which fills all of the buffers as a single operation.
+		template<typename Sock, typename = void>
+		struct has_recvv_member_func : false_type
+		{};
+
+		template<typename Sock>
+		struct has_recvv_member_func<Sock, void_t<
+			decltype(std::declval<Sock&>().recvv(
+				std::declval<span<span<u8>>>(),
+				std::declval<macoro::stop_token>()))
+			>> : true_type
+		{};
+
+		// detects if the SocketImpl has the optional partial receive function
+		//
+		//   RecvAwaiter recvSome(span<u8> buffer, macoro::stop_token token)
+		//
+		// which completes once at least one byte has been received. The number 
+		// of bytes received is returned and can be less than buffer.size().
+		template<typename Sock, typename = void>
+		struct has_recvSome_member_func : false_type
+		{};
+
+		template<typename Sock>
+		struct has_recvSome_member_func<Sock, void_t<
+			decltype(std::declval<Sock&>().recvSome(
+				std::declval<span<u8>>(),
+				std::declval<macoro::stop_token>()))
+			>> : true_type
+		{};
+
+		// detects if the SocketImpl has the optional ownership handoff functions
+		//
+		//   void sendOwned(std::vector<u8>&& data)
+		//   std::vector<u8> recvOwned()
+		//
+		// which pass a vector to the other socket without copying it. This is 
+		// only possible if both parties live in the same process. The vectors
+		// are received in the order that they are sent. A vector is handed 
+		// over before its header is sent. If that fails, close() of the 
+		// receiving socket must release it.
+		template<typename Sock, typename = void>
+		struct has_owned_member_func : false_type
+		{};
+
+		template<typename Sock>
+		struct has_owned_member_func<Sock, void_t<
+			decltype(std::declval<Sock&>().sendOwned(std::declval<std::vector<u8>>())),
+			decltype(std::declval<std::vector<u8>&>() = std::declval<Sock&>().recvOwned())
+			>> : true_type
+		{};
+
+		// A buffer that the receive task reads ahead into. The bytes in
+		// [mBegin, mEnd) of mData have been received but not yet processed.
+		struct ReadAheadBuffer
+		{
+			std::vector<u8> mData;
+			u64 mBegin = 0, mEnd = 0;
+
+			// the number of buffered bytes.
+			u64 size() const { return mEnd - mBegin; }
+
+			// the maximum number of bytes that can be buffered.
+			u64 capacity() const { return mData.size(); }
+
+			// copy up to dst.size() buffered bytes into dst. Returns 
+			// the number of bytes that were copied.
+			u64 read(span<u8> dst)
+			{
+				auto n = std::min<u64>(dst.size(), size());
+				if (n)
+					std::memcpy(dst.data(), mData.data() + mBegin, n);
+				mBegin += n;
+				if (mBegin == mEnd)
+					mBegin = mEnd = 0;
+				return n;
+			}
+
+			// returns the unused part of the buffer. Any buffered 
+			// bytes are first moved to the front.
+			span<u8> free()
+			{
+				if (mBegin)
+				{
+					std::memmove(mData.data(), mData.data() + mBegin, size());
+					mEnd -= mBegin;
+					mBegin = 0;
+				}
+				return span<u8>(mData.data() + mEnd, mData.size() - mEnd);
+			}
+
+			// mark the next n unused bytes as buffered.
+			void commit(u64 n)
+			{
+				COPROTO_ASSERT(mEnd + n <= mData.size());
+				mEnd += n;
+			}
+		};
+
+		// the bytes that are sent before the body of a message. This 
+		// consists of the optional meta messages followed by the header
+		// of the data message, if any.
+		struct SendPrefix
+		{
+			// the largest prefix is [range meta][new-slot meta][chunked/owned meta][header].
+			std::array<u8, 4 * sizeof(Header) + 3 * sizeof(ControlBlock)> mData;
+
+			// the number of bytes in mData that are used.
+			u64 mSize = 0;
+
+			template<typename T>
+			void push_back(const T& t)
+			{
+				COPROTO_ASSERT(mSize + sizeof(T) <= mData.size());
+				std::memcpy(mData.data() + mSize, &t, sizeof(T));
+				mSize += sizeof(T);
+			}
+
+			// push the meta message [0, slot-id][ctrl].
+			void push_back(u32 slotId, const ControlBlock& ctrl)
+			{
+				push_back(Header{ 0, slotId });
+				push_back(ctrl);
+			}
+
+			span<u8> asSpan() { return span<u8>(mData.data(), mSize); }
+		};
+
+		// the caller of a move-send that waits for the queued bytes to
+		// drop, see SockScheduler::waitForSendCapacity(...). It lives in
+		// the awaiter. If its stop token is triggered, the caller is 
+		// resumed with operation_aborted.
+		struct SendCapacityWaiter
+		{
+			SocketFork* mFork = nullptr;
+			coroutine_handle<> mHandle;
+			optional<macoro::stop_callback> mReg;
+			error_code mEC;
+
+			// true while mReg is being registered, see waitForSendCapacity(...).
+			bool mRegistering = false;
+		};
+
+		// submissions are reused through a small thread local free 
+		// list. A submission that is released on another thread, e.g.
+		// the one that drained the intake, is returned to the list of 
+		// the thread that allocated it through a lock free stack. A 
+		// thread that keeps submitting therefore does not allocate once
+		// warmed up. T must have a T* mNext.
+		template<typename T>
+		struct SubmissionPool
+		{
+			static T* acquire()
+			{
+				auto& c = cache();
+				if (!c.mHead)
+				{
+					// take the submissions that other threads released.
+					c.mHead = c.mReturned.exchange(nullptr, std::memory_order_acquire);
+					for (auto s = c.mHead; s; s = s->mNext)
+						++c.mSize;
+				}
+
+				if (c.mHead)
+				{
+					--c.mSize;
+					return std::exchange(c.mHead, c.mHead->mNext);
+				}
+
+				auto s = new T;
+				COPROTO_REG_NEW(s, "Submission");
+				s->mOwner = &c;
+				c.mRefs.fetch_add(1, std::memory_order_relaxed);
+				return s;
+			}
+
+			static void release(T* s)
+			{
+				auto& c = cache();
+				auto owner = s->mOwner;
+				if (owner != &c)
+				{
+					auto head = owner->mReturned.load(std::memory_order_relaxed);
+					do {
+						// the owning thread has exited.
+						if (head == Cache::closed())
+							return owner->destroy(s);
+						s->mNext = head;
+					} while (!owner->mReturned.compare_exchange_weak(head, s,
+						std::memory_order_release, std::memory_order_relaxed));
+				}
+				else if (c.mSize < Cache::mMaxSize)
+				{
+					++c.mSize;
+					s->mNext = std::exchange(c.mHead, s);
+				}
+				else
+					c.destroy(s);
+			}
+
+		private:
+			struct Cache
+			{
+				static constexpr u64 mMaxSize = 64;
+
+				// the free submissions of the owning thread.
+				T* mHead = nullptr;
+				u64 mSize = 0;
+
+				// the submissions that other threads released. Set to 
+				// closed() once the owning thread has exited.
+				std::atomic<T*> mReturned{ nullptr };
+
+				// the number of submissions that were allocated by this 
+				// cache and still exist, plus one while the owning thread
+				// runs. The cache is deleted once it reaches zero.
+				std::atomic<u64> mRefs{ 1 };
+
+				static T* closed()
+				{
+					return reinterpret_cast<T*>(std::uintptr_t(1));
+				}
+
+				void destroy(T* s)
+				{
+					COPROTO_REG_DEL(s);
+					delete s;
+					drop(1);
+				}
+
+				void drop(u64 n)
+				{
+					if (mRefs.fetch_sub(n, std::memory_order_acq_rel) == n)
+						delete this;
+				}
+			};
+
+			// the cache of the submissions that a thread allocated. It 
+			// outlives the thread while other threads hold some of them.
+			struct Holder
+			{
+				Cache* mCache = new Cache;
+
+				~Holder()
+				{
+					auto c = mCache;
+					auto returned = c->mReturned.exchange(Cache::closed(), std::memory_order_acquire);
+					u64 n = 1;
+					for (auto list : { c->mHead, returned })
+					{
+						while (list)
+						{
+							auto s = std::exchange(list, list->mNext);
+							COPROTO_REG_DEL(s);
+							delete s;
+							++n;
+						}
+					}
+					c->drop(n);
+				}
+			};
+
+			Cache* mOwner = nullptr;
+
+			static Cache& cache()
+			{
+				thread_local Holder h;
+				return *h.mCache;
+			}
+		};
+
+		// a send that was submitted without taking the scheduler's 
+		// mutex. SockScheduler::drainSendIntake(...) turns it into a
+		// SendOperation of its fork. The buffer must have been moved
+		// out before it is released.
+		struct SendSubmission : SubmissionPool<SendSubmission>
+		{
+			SocketForkRef mFork;
+			coroutine_handle<void> mCallback;
+			InlinePoly<SendBuffer, 8 * sizeof(u64)> mBuffer;
+			SendSubmission* mNext = nullptr;
+		};
+
+		// a recv that was submitted without taking the scheduler's 
+		// mutex, see SockScheduler::drainRecvIntake(...).
+		struct RecvSubmission : SubmissionPool<RecvSubmission>
+		{
+			SocketForkRef mFork;
+			RecvBuffer* mBuffer = nullptr;
+			coroutine_handle<void> mCallback;
+			RecvSubmission* mNext = nullptr;
+		};
+
+		// a part of a send operation that is written to the socket.
+		struct SendFrame
+		{
+			enum class Type : u8
+			{
+				// the whole message.
+				Message,
+
+				// the bytes [mOffset, mOffset + mLength) of a chunked message. 
+				// If mOffset is zero, the chunked meta message is sent first.
+				Chunk,
+
+				// the abort meta message for a partially sent chunked message.
+				Abort,
+
+				// the CloseFork meta message of mFork. mOp is null.
+				Close,
+
+				// the whole message whose body is handed to the other 
+				// party with Sock::sendOwned(...). Only the headers are
+				// sent and mLength is zero.
+				Owned
+			};
+
+			Type mType;
+			SendOperation* mOp;
+			u64 mOffset = 0, mLength = 0;
+			SocketFork* mFork = nullptr;
+
+			// the frame is the first of its fork range to be sent and 
+			// is preceded by the announcement of the range.
+			bool mAnnounceRange = false;
 		};
 
+		// the frames that are written to the underlaying socket 
+		// as one operation. The frames are stored in 
+		// SockScheduler::mSendFrames.
+		struct SendBatch
+		{
+			// the number of frames in the batch.
+			u64 mSize = 0;
+		};
 
-		// an awaiter used to get tne next message to be sent.
+		// an awaiter used to get tne next batch of messages to be sent.
 		struct NextSendOp
 		{
 			NextSendOp(
-				SendOperation* prevOp,
+				SendBatch prev,
 				error_code prevEc,
 				SockScheduler& ss)
-				: mPrevOp(prevOp)
+				: mPrev(prev)
 				, mPrevEc(prevEc)
 				, mSched(ss) {}
 
 		private:
-			SendOperation* mPrevOp;
+			SendBatch mPrev;
 			error_code mPrevEc;
 			SockScheduler& mSched;
 			std::coroutine_handle<> mHandle;
-			macoro::result<SendOperation*, macoro::error_code> mRes;
+			macoro::result<SendBatch, macoro::error_code> mRes;
 
 		public:
 
 			std::coroutine_handle<> getHandle(
-				macoro::result<SendOperation*, macoro::error_code> r,
+				macoro::result<SendBatch, macoro::error_code> r,
 				NextSendOp*& self);
 
 			void completePrev(Lock& lock, ExecutionQueue::Handle& queue);
 
+			// select the frames that should be sent next, subject to the 
+			// batch limits, and store them in mSched.mSendFrames.
+			SendBatch takeBatch(Lock& lock);
+
 			bool await_ready();
 
 			std::coroutine_handle<> await_suspend(std::coroutine_handle<> h);
 
-			macoro::result<SendOperation*, macoro::error_code> await_resume();
+			macoro::result<SendBatch, macoro::error_code> await_resume();
 		};
 
 
 		struct GetRequestedRecvSocketFork
 		{
-			GetRequestedRecvSocketFork(SockScheduler& ss, u32 remoteForkId)
+			GetRequestedRecvSocketFork(SockScheduler& ss, u32 remoteForkId, u32 size)
 				: mSched(ss)
 				, mRemoteForkId(remoteForkId)
+				, mSize(size)
 			{}
 		private:
 			macoro::result<RecvOperation*, std::error_code> mRes;
 			SockScheduler& mSched;
 			u32 mRemoteForkId;
+
+			// the size of the message that has arrived.
+			u32 mSize;
 			std::coroutine_handle<> mHandle;
 
 		public:
@@ -250,11 +695,11 @@ namespace coproto
 		//   * zero is always value 0 and 32 bits long. This allows meta message to be 
 		//     distinguished from data messages, which always start with a non-zero message.
 		//   * slot-id is a 32 bit value to identify the slot-id that this meta message corresponds to.
-		//   * meta-data is the data associated with this meta message. Currently there is only
-		//     one option for this. In particular, the only meta message currently supported is 
-		//     to create a new slot. This is done by sending a new/unused value for slot-id and the have
+		//   * meta-data is the data associated with this meta message. The main meta message 
+		//     is to create a new slot. This is done by sending a new/unused value for slot-id and the have
 		//     meta-data be the 128-bit session ID corresponding to this slot/fork. Note that each party
-		//     may associate a different slot-id with the same session ID. 
+		//     may associate a different slot-id with the same session ID. If slot-id is ~0, meta-data
+		//     is a typed ControlBlock instead, e.g. the start of a chunked message, see below.
 		// 
 		//     Each fork/slot is associated with a unique/random-ish session ID. Instead of sending the 128 bit
 		//     session ID with each message, we associate the session ID with a 32 bit slot-id.
@@ -279,15 +724,33 @@ namespace coproto
 		// an async send still pending. As a workaround, we allow the user to "flush" the 
 		// socket which will suspend the user until all messages have been sent.
 		// 
+		// Optionally, messages larger than mSendChunkSize are sent in chunks. A ChunkedMessage
+		// meta message announces the slot and total size. Then the message is sent as several
+		// data messages on that slot. The send task round robins between the chunked messages 
+		// and adds the other pending messages in between. This way a large message does not 
+		// delay the messages of the other forks. The receiver writes the chunks directly into 
+		// the buffer of the recv operation. While a fork has a chunked message in progress, its 
+		// later sends wait. Note that the messages of different forks can then arrive out of 
+		// order. A receiver that awaits its forks one after another should therefore enable 
+		// the recv stash.
+		// 
 		// Another complications is that the user can cancel send/recv operations.
 		// In the event that one message is canceled, the user is still allowed to
 		// send and receive messages on the socket. However, in the event that a message
 		// is half sent we are forced to send the whole message because the receiver is 
-		// expecting the whole message. One could partially fix this by breaking messages up  
-		// into small chunks but the implementation does not do this. Instead, if the user
-		// requests a cancel on a send, the operation is immediately canceled (assuming the 
-		// underlaying socket cooperates). Later, if the message was half sent and the user
-		// want to send some other message, the first message must be completed first.
+		// expecting the whole message. If the user requests a cancel on a send, the operation 
+		// is immediately canceled (assuming the underlaying socket cooperates). Later, if the 
+		// message was half sent and the user want to send some other message, the first message 
+		// must be completed first. The exception are chunked messages. These are aborted at the 
+		// next chunk boundary by sending an AbortMessage meta message. The matching recv then 
+		// fails with code::remoteCancel.
+		// 
+		// A fork can be closed once it is no longer needed. After its pending operations
+		// complete, a CloseFork meta message tells the other party that its slot-id is no
+		// longer used. It is sent along with the next batch of messages. The fork is released
+		// once both parties have closed it. Its slot-id and storage are then reused by later
+		// forks. The slot-id is only reused after the meta message has been sent and so the 
+		// other party sees the close before the slot-id is announced again.
 		// 
 		struct SockScheduler
 		{
@@ -304,9 +767,9 @@ namespace coproto
 			enum class Caller { Sender, Recver, Extern };
 
 			NextSendOp* mNextSendOp = nullptr;
-			NextSendOp completeOpAndGetNextSend(SendOperation* op, error_code ec)
+			NextSendOp completeOpAndGetNextSend(SendBatch batch, error_code ec)
 			{
-				return { op, ec, *this };
+				return { batch, ec, *this };
 			}
 
 			AnyRecvOp* mAnyRecvOp = nullptr;
@@ -316,11 +779,50 @@ namespace coproto
 
 
 			GetRequestedRecvSocketFork* mGetRequestedRecvSocketFork = nullptr;
-			auto getRequestedRecvSocketFork(u32 forkId)
+			auto getRequestedRecvSocketFork(u32 forkId, u32 size)
+			{
+				return GetRequestedRecvSocketFork(*this, forkId, size);
+			}
+
+			// the maximum number of bytes that each fork can stash. Messages 
+			// that arrive before a matching recv is posted are stashed if they 
+			// fit. Otherwise the receive task waits for the recv. Zero disables
+			// stashing.
+			u64 mStashLimit = 0;
+
+			// the memory that is used to stash messages and by 
+			// recv<BufferLease>(). It is created on first use. Once
+			// created, it can be used without holding mMutex.
+			std::once_flag mBufferPoolOnce;
+			std::shared_ptr<BufferPool> mBufferPool;
+			BufferPool& bufferPool()
 			{
-				return GetRequestedRecvSocketFork(*this, forkId);
+				std::call_once(mBufferPoolOnce, [this] {
+					mBufferPool = std::make_shared<BufferPool>();
+					});
+				return *mBufferPool;
 			}
 
+			// the fork and buffer of the message that the receive
+			// task is currently stashing, if any. mStashSize is the
+			// size of the message, which counts towards the 
+			// mStashBytes of the fork.
+			SocketFork* mStashFork = nullptr;
+			std::vector<u8> mStashBuffer;
+			u64 mStashSize = 0;
+
+			// hand the oldest stashed message of fork to the receive 
+			// operation/buffer `dest`. 
+			template<typename RecvDest>
+			void popStash(SocketFork& fork, RecvDest& dest, ExecutionQueue::Handle& queue, Lock& l);
+
+			// called by the receive task once mStashBuffer, or the next chunk 
+			// of the fork's mChunkedStash, has been received.
+			void completeStash();
+
+			// called by the receive task when a typed control block arrives.
+			error_code recvControlBlock(ControlBlock& ctrl);
+
 			// a flag indicating if close() has been awaited.
 			bool mClosed = false;
 
@@ -330,24 +832,225 @@ namespace coproto
 			// storage used to store the socket.
 			AnyNoCopy mSockStorage;
 
-			// The list of forks.
-			std::list<SocketFork> mSocketForks_;
+			// The forks, indexed by SessionID and by their remote id.
+			SocketForkTable mSocketForks_;
 
 			// the index of the next local fork id.
 			u32 mNextLocalSocketFork = 1;
 
-			// maps SessionID to slot index.
-			std::unordered_map<SessionID, SocketForkIter> mIdSocketForkMapping_;
+			// the local ids of released forks. These are used before 
+			// mNextLocalSocketFork.
+			std::vector<u32> mFreeLocalSocketForks;
+
+			// if set, the forks of the root take the slot 
+			// DeterministicSlotBase plus their child index. Both parties
+			// know this slot and no meta message is sent for them. See
+			// enableDeterministicForks().
+			bool mDeterministicForks = false;
+
+			// the start of the slots of the forks of the root in 
+			// deterministic mode. The other forks take slots below it.
+			static constexpr u32 DeterministicSlotBase = 1u << 31;
+
+			static bool deterministicSlot(u32 slotId)
+			{
+				return slotId >= DeterministicSlotBase && slotId != ControlBlock::ExtendedSlotId;
+			}
+
+			// the root fork, whose forks are deterministic.
+			SocketForkRef mRootFork;
+
+			// returns the fork with remote id `slotId`, or nullptr. In 
+			// deterministic mode, the fork of a deterministic slot is 
+			// created if the slot has not been forked locally yet. 
+			SocketFork* findRemoteFork(u32 slotId, Lock& l);
+
+			void enableDeterministicForks();
+
+			// the closed forks whose CloseFork meta message has not been 
+			// sent yet. These are sent along with the next batch of messages
+			// so that they never keep the send task busy on their own, e.g.
+			// while flush() is waiting.
+			std::deque<SocketFork*> mForkCloses;
+
+			// release fork if it has been closed, has no pending operations
+			// and the remote party has closed it as well. The CloseFork meta 
+			// message is queued once the pending operations complete.
+			void tryReleaseFork(SocketFork& fork, ExecutionQueue::Handle& queue, Lock& l);
+
+			// a mutex used to guard member variables. Does not lock
+			// if the scheduler is single threaded.
+			SchedulerMutex mMutex;
+
+			// the send operations that have not been started, grouped by 
+			// the priority of their fork. mDefaultSendClass holds those of
+			// priority zero and mSendClasses the others. The classes with 
+			// pending operations are in mActiveSendClasses. The front class 
+			// is the one whose turn it is. mSendTurn is set once it has 
+			// been given its quantum for the turn.
+			SendClass mDefaultSendClass{ 0 };
+			std::vector<std::unique_ptr<SendClass>> mSendClasses;
+			std::deque<SendClass*> mActiveSendClasses;
+			bool mSendTurn = false;
+
+			// the number of bytes that a class of priority zero may send per
+			// turn. A message costs its size, including the header, but at 
+			// most the quantum of its class. A larger message therefore uses
+			// up a turn and should be chunked to be shared fairly, see 
+			// mSendChunkSize.
+			u64 mSendQuantum = 1 << 14;
+
+			// the number of bytes that cls may send per turn.
+			u64 sendQuantum(const SendClass& cls) const
+			{
+				return (u64(cls.mPriority) + 1) * mSendQuantum;
+			}
+
+			// returns the class of the given priority.
+			SendClass& sendClass(u32 priority);
+
+			// true if there are sends that have not been completely sent.
+			bool hasPendingSends() const
+			{
+				return mActiveSendClasses.size() || mChunkedSends.size();
+			}
+
+			// add op to the end of the pending send operations of its class.
+			void insertSend(SendOperation* op);
+
+			// remove op from the pending send operations.
+			void eraseSend(SendOperation* op);
+
+			// sends that were submitted without taking mMutex, most recent 
+			// first. The producer that finds the intake empty takes mMutex
+			// and drains it. The others only push. See send(...).
+			std::atomic<SendSubmission*> mSendIntake = nullptr;
+
+			// move the submissions of mSendIntake to their forks in the 
+			// order that they were submitted.
+			void drainSendIntake(ExecutionQueue::Handle& queue, Lock& l);
+
+			// recvs that were submitted without taking mMutex, most recent 
+			// first. Drained by the producer that finds the intake empty 
+			// and by the receive task whenever it looks for a recv. See 
+			// recv(...).
+			std::atomic<RecvSubmission*> mRecvIntake = nullptr;
+
+			// post the submissions of mRecvIntake in the order that they
+			// were submitted.
+			void drainRecvIntake(ExecutionQueue::Handle& queue, Lock& l);
+
+			// complete the recv from the stash or add it to its fork. 
+			// Returns the operation if it has been added.
+			RecvOperation* postRecv(const SocketForkRef& ref, RecvBuffer* data, 
+				coroutine_handle<void> ch, ExecutionQueue::Handle& queue, Lock& l);
 
-			// maps their slot index to SessionID
-			std::unordered_map<u32, SocketForkIter> mRemoteSocketForkMapping_;
+			// add a new operation to the pending send operations. While 
+			// corked, the caller of a reference send is resumed once the 
+			// message has been copied, see SendOperation::detach().
+			void enqueueSend(SendOperation* op, ExecutionQueue::Handle& queue, Lock& l);
 
-			// a mutex used to guard member variables.
-			std::recursive_mutex mMutex;
+			// hand the next batch to the send task if it is idle.
+			void startSend(ExecutionQueue::Handle& queue, Lock& l);
 
-			// an intrusive linked list of send buffers.
-			SendOperation* mSendBufferBegin = nullptr;
-			SendOperation* mSendBufferLast = nullptr;
+			// messages larger than this are sent in chunks of this size. 
+			// Zero disables chunking.
+			u64 mSendChunkSize = 0;
+
+			// the operations that are being sent in chunks. The send task 
+			// sends one chunk of the front operation and then rotates.
+			std::deque<SendOperation*> mChunkedSends;
+
+			// true if the last batch had no room for a chunk. The next 
+			// batch then starts with one.
+			bool mChunkTurn = false;
+
+			// true if the socket supports sendv(...). Only then
+			// are several messages combined into one write.
+			bool mVectoredSend = false;
+
+			// true if the socket supports sendOwned(...) and recvOwned(). 
+			// Move-sent vectors are then handed to the other party.
+			bool mOwnedSend = false;
+
+			// returns true if a move-sent vector of the given size is handed
+			// to the other party. The header of such a message holds the 
+			// size as a u32. Larger vectors take the chunked path instead.
+			bool isOwnedSend(u64 size) const
+			{
+				return mOwnedSend && size < std::numeric_limits<u32>::max();
+			}
+
+			// the size of the next message if its body is received 
+			// with recvOwned(), see ControlBlock::Type::OwnedMessage.
+			u64 mRecvOwnedSize = 0;
+
+			// the maximum number of bytes (headers included) and buffers
+			// that are combined into a single vectored write. A batch
+			// always contains at least one message.
+			u64 mSendBatchMaxBytes = 1 << 20;
+			u64 mSendBatchMaxBuffers = 64;
+
+			// the number of outstanding cork() calls. While non-zero,
+			// sends are queued but the send task does not start a 
+			// new batch.
+			u64 mCorked = 0;
+
+			// the number of bytes that are queued to be sent, including 
+			// the batch that is currently being sent.
+			u64 mQueuedSendBytes = 0;
+
+			// if mQueuedSendBytes exceeds mSendHighWater, move-sends suspend 
+			// the caller until it drops to mSendLowWater. Zero means unbounded.
+			// Forks can additionally set their own limits.
+			u64 mSendHighWater = 0, mSendLowWater = 0;
+
+			// true if any send buffer limit has been set. Allows move-sends
+			// to skip the check otherwise. It is only set under the mutex and
+			// the limits are checked under it, so readers load it relaxed.
+			std::atomic<bool> mSendLimited = false;
+
+			// set once mEC has been set. A failed scheduler reports the error
+			// to the caller of a send, so send(...) then takes the mutex 
+			// rather than forgetting the caller and pushing onto mSendIntake.
+			std::atomic<bool> mFailed = false;
+
+			// the callers of move-sends that are waiting for the queued
+			// bytes to drop.
+			std::vector<SendCapacityWaiter*> mSendWaiters;
+
+			// returns h if the high water marks have not been exceeded. Otherwise 
+			// h is resumed once the queue drains below the low water marks, or
+			// with w.mEC set once token is stopped.
+			coroutine_handle<> waitForSendCapacity(SocketForkRef ref, SendCapacityWaiter& w,
+				coroutine_handle<> h, macoro::stop_token&& token);
+
+			// must be called when op is removed from the send queue. Resumes
+			// the move-sends that were waiting for the queue to drain.
+			void releaseSendBytes(SendOperation& op, ExecutionQueue::Handle& queue, Lock& l);
+
+			// the frames of the current batch. Set by takeBatch(...) while
+			// the send task is idle.
+			std::vector<SendFrame> mSendFrames;
+
+			// storage for the headers and buffers of the current batch. 
+			// These are only accessed by the send task and are reused
+			// between batches.
+			std::vector<SendPrefix> mSendPrefixes;
+			std::vector<span<u8>> mSendBuffers;
+
+			// the size of the read ahead buffer. Zero if read ahead is disabled.
+			// Only used if the socket supports recvSome(...). The receive task
+			// picks up a new size eventually, so it is loaded relaxed.
+			std::atomic<u64> mReadAheadSize = 0;
+
+			// the data that the receive task has read ahead. Only accessed 
+			// by the receive task.
+			ReadAheadBuffer mReadAhead;
+
+			// the buffers that the current message is received into. Only
+			// accessed by the receive task.
+			std::vector<span<u8>> mRecvBuffers;
 
 			// the current overall error code.
 			error_code mEC;
@@ -396,14 +1099,16 @@ namespace coproto
 			template<typename SocketImpl>
 			void init(SocketImpl* sock, SessionID sid);
 
+			// if singleThreaded is set, the scheduler does not lock and 
+			// must only be used by the thread that constructs it.
 			template<typename SocketImpl>
-			SockScheduler(SocketImpl&& s, SessionID sid);
+			SockScheduler(SocketImpl&& s, SessionID sid, bool singleThreaded = false);
 
 			template<typename SocketImpl>
-			SockScheduler(SocketImpl& s, SessionID sid);
+			SockScheduler(SocketImpl& s, SessionID sid, bool singleThreaded = false);
 
 			template<typename SocketImpl>
-			SockScheduler(std::unique_ptr<SocketImpl>&& s, SessionID sid);
+			SockScheduler(std::unique_ptr<SocketImpl>&& s, SessionID sid, bool singleThreaded = false);
 
 
 			~SockScheduler()
@@ -429,22 +1134,66 @@ namespace coproto
 			template<typename Sock>
 			macoro::task<> receiveDataTask(Sock* socket);
 
-			SocketForkIter getLocalSocketFork(const SessionID& id, Lock& _);
+			// used by the receive task to recvSome(...) from sock until 
+			// mReadAhead holds at least n bytes.
+			template<typename Sock>
+			macoro::task<error_code> fillReadAhead(Sock* sock, u64 n);
+
+			SocketFork* getLocalSocketFork(const SessionID& id, Lock& _);
+
+			// returns the local fork with session id `id`. Sockets hold
+			// on to the result so that their operations do not look up
+			// the fork by SessionID.
+			SocketFork* getLocalSocketFork(const SessionID& id)
+			{
+				Lock l(mMutex);
+				return getLocalSocketFork(id, l);
+			}
+
+			// creates or finds the fork `id` and gives it a local id. If 
+			// localId is npos, the id is taken from mFreeLocalSocketForks 
+			// or mNextLocalSocketFork.
+			SocketFork* initLocalSocketFork(const SessionID& id, const ExecutorRef& ex, Lock& _, u32 localId = ~u32(0));
 
-			void initLocalSocketFork(const SessionID& id, const ExecutorRef& ex, Lock& _);
+			// handles the NewSocketFork meta message.
 			error_code initRemoteSocketFork(u32 slotId, SessionID id, Lock& _);
 
-			SessionID fork(SessionID s);
+			// the NewSocketForkRange control block that has been received. 
+			// Its forks are created once the following meta message gives
+			// their base id. Only used by the receive task.
+			u32 mRecvForkRangeBase = 0, mRecvForkRangeSize = 0;
+			error_code initRemoteSocketForkRange(u32 slotId, SessionID baseId, Lock& _);
+
+			// returns the fork that ref refers to or null if it has been 
+			// closed. Operations on a closed fork fail with code::closed.
+			SocketFork* openFork(const SocketForkRef& ref, Lock&)
+			{
+				auto fork = mSocketForks_.get(ref);
+				if (fork && fork->mCloseState != SocketFork::CloseState::Open)
+					return nullptr;
+				return fork;
+			}
+
+			// returns a new fork of s. Throws if s has been closed.
+			SocketFork* fork(SocketForkRef s);
+
+			// returns n forks of s. These have the consecutive local ids 
+			// and are announced together, see SocketForkRange.
+			std::vector<SocketFork*> fork(SocketForkRef s, u64 n);
+
+			// close the fork. Pending operations complete as usual. Does 
+			// nothing if it has already been closed. See Socket::closeFork().
+			void closeFork(SocketForkRef ref);
 
 			template<typename Buffer>
 			MACORO_NODISCARD coroutine_handle<void> send(
-				SessionID id,
+				SocketForkRef ref,
 				Buffer&& buffer,
 				coroutine_handle<void> callback,
 				macoro::stop_token&& token);
 
 			MACORO_NODISCARD
-				coroutine_handle<void> recv(SessionID id, RecvBuffer* data, coroutine_handle<void> ch, macoro::stop_token&& token);
+				coroutine_handle<void> recv(SocketForkRef ref, RecvBuffer* data, coroutine_handle<void> ch, macoro::stop_token&& token);
 
 
 			void cancel(
@@ -455,7 +1204,14 @@ namespace coproto
 
 			void close();
 
-			coroutine_handle<> flush(coroutine_handle<>h);
+			// the pending operations of all forks, see flush(...).
+			FlushEpochs mFlushEpochs;
+
+			// resume token.mHandle on the executor of fork once the 
+			// operations that are currently pending have completed. Only 
+			// the operations of fork are considered if forkOnly is set. 
+			// Returns the handle to resume.
+			coroutine_handle<> flush(FlushToken& token, SocketForkRef ref, bool forkOnly);
 
 			bool mLogging = false;
 			void enableLogging()
@@ -471,12 +1227,85 @@ namespace coproto
 			}
 
 			template<typename Scheduler>
-			void setExecutor(Scheduler& scheduler, SessionID id)
+			void setExecutor(Scheduler& scheduler, SocketForkRef ref)
+			{
+				Lock lock(mMutex);
+				if (auto fork = openFork(ref, lock))
+					fork->mExecutor = ExecutorRef(scheduler);
+			}
+
+			void setSendBatchLimit(u64 maxBytes, u64 maxBuffers)
+			{
+				Lock lock(mMutex);
+				mSendBatchMaxBytes = maxBytes;
+				mSendBatchMaxBuffers = maxBuffers;
+			}
+
+			void setReadAhead(u64 bufferSize)
+			{
+				// the buffer must be able to hold a meta message.
+				if (bufferSize)
+					bufferSize = std::max<u64>(bufferSize, 2 * (sizeof(Header) + sizeof(ControlBlock)));
+				mReadAheadSize.store(bufferSize, std::memory_order_relaxed);
+			}
+
+			void setSendBufferLimit(u64 highWater, u64 lowWater)
+			{
+				COPROTO_ASSERT(lowWater <= highWater);
+				Lock lock(mMutex);
+				mSendHighWater = highWater;
+				mSendLowWater = lowWater;
+				mSendLimited = true;
+			}
+
+			void setSendBufferLimit(u64 highWater, u64 lowWater, SocketForkRef ref)
+			{
+				COPROTO_ASSERT(lowWater <= highWater);
+				Lock lock(mMutex);
+				auto fork = openFork(ref, lock);
+				if (!fork)
+					return;
+				fork->mSendHighWater = highWater;
+				fork->mSendLowWater = lowWater;
+				mSendLimited = true;
+			}
+
+			void setRecvStashLimit(u64 bytesPerFork)
+			{
+				Lock lock(mMutex);
+				mStashLimit = bytesPerFork;
+			}
+
+			// the pool of recv<BufferLease>(). Does not lock mMutex.
+			std::shared_ptr<BufferPool> leasePool()
+			{
+				bufferPool();
+				return mBufferPool;
+			}
+
+			void setPriority(u32 priority, SocketForkRef ref)
+			{
+				Lock lock(mMutex);
+				auto fork = openFork(ref, lock);
+				if (!fork)
+					return;
+				fork->mSendPriority = priority;
+				fork->mSendClass = priority ? &sendClass(priority) : nullptr;
+			}
+
+			void setSendChunkSize(u64 chunkSize)
+			{
+				Lock lock(mMutex);
+				mSendChunkSize = std::min<u64>(chunkSize, std::numeric_limits<u32>::max());
+			}
+
+			void cork()
 			{
 				Lock lock(mMutex);
-				auto iter = getLocalSocketFork(id, lock);
-				iter->mExecutor = ExecutorRef(scheduler);
+				++mCorked;
 			}
+
+			void uncork();
 		};
 
 
@@ -494,6 +1323,8 @@ namespace coproto
 
 			mRecvToken = mRecvCancelSrc.get_token();
 			mSendToken = mSendCancelSrc.get_token();
+			mVectoredSend = has_sendv_member_func<SocketImpl>::value;
+			mOwnedSend = has_owned_member_func<SocketImpl>::value;
 			Lock l;
 			initLocalSocketFork(sid, {}, l);
 
@@ -506,21 +1337,27 @@ namespace coproto
 		}
 
 		template<typename SocketImpl>
-		SockScheduler::SockScheduler(SocketImpl&& s, SessionID sid)
+		SockScheduler::SockScheduler(SocketImpl&& s, SessionID sid, bool singleThreaded)
 		{
+			if (singleThreaded)
+				mMutex.setSingleThreaded();
 			auto ss = mSockStorage.emplace(std::move(s));
 			init(ss, sid);
 		}
 
 		template<typename SocketImpl>
-		SockScheduler::SockScheduler(SocketImpl& s, SessionID sid)
+		SockScheduler::SockScheduler(SocketImpl& s, SessionID sid, bool singleThreaded)
 		{
+			if (singleThreaded)
+				mMutex.setSingleThreaded();
 			init(&s, sid);
 		}
 
 		template<typename SocketImpl>
-		SockScheduler::SockScheduler(std::unique_ptr<SocketImpl>&& s, SessionID sid)
+		SockScheduler::SockScheduler(std::unique_ptr<SocketImpl>&& s, SessionID sid, bool singleThreaded)
 		{
+			if (singleThreaded)
+				mMutex.setSingleThreaded();
 			auto ss = mSockStorage.emplace(std::move(s));
 			init(ss->get(), sid);
 		}
@@ -529,13 +1366,15 @@ namespace coproto
 
 		template<typename Buffer>
 		MACORO_NODISCARD coroutine_handle<void> SockScheduler::send(
-			SessionID id,
+			SocketForkRef ref,
 			Buffer&& buffer,
 			coroutine_handle<void> callback,
 			macoro::stop_token&& token)
 		{
 			assert(callback);
-			if (buffer.asSpan().size() == 0)
+			span<u8> single;
+			if (totalSize(buffer.asSpans(single)) == 0 &&
+				!std::is_same<std::remove_cvref_t<Buffer>, EmptySendBuffer>::value)
 			{
 				buffer.setError(code::sendLengthZeroMsg);
 				return callback;
@@ -543,43 +1382,66 @@ namespace coproto
 
 			ExecutionQueue::Handle exQueue;
 
+			// the caller of a move-send does not wait for the message to 
+			// be sent, see MoveSendAwaiter. Errors after it has been queued
+			// can not be reported to it.
+			auto forget = [&] {
+				if (buffer.owned())
+					buffer.mExPtr = nullptr;
+				};
+
+			// Sends that can not be canceled and are not subject to send 
+			// buffer limits are pushed onto mSendIntake without taking the 
+			// mutex. Only the producer that finds the intake empty takes it.
+			// A single threaded scheduler does not lock so it skips this.
+			if (!mMutex.singleThreaded() && !token.stop_possible() &&
+				!mSendLimited.load(std::memory_order_relaxed) &&
+				!mFailed.load(std::memory_order_relaxed))
+			{
+				forget();
+				auto sub = SendSubmission::acquire();
+				sub->mFork = ref;
+				sub->mCallback = callback;
+				sub->mBuffer.template emplace<std::remove_reference_t<Buffer>>(std::forward<Buffer>(buffer));
+				auto head = mSendIntake.load(std::memory_order_relaxed);
+				do {
+					sub->mNext = head;
+				} while (!mSendIntake.compare_exchange_weak(head, sub,
+					std::memory_order_release, std::memory_order_relaxed));
+
+				if (head)
+					return macoro::noop_coroutine();
+
+				{
+					Lock l = Lock(mMutex);
+					exQueue = mExQueue.acquire(l);
+					drainSendIntake(exQueue, l);
+					startSend(exQueue, l);
+				}
+				return exQueue.runReturnLast();
+			}
+
 			{
 				Lock l = Lock(mMutex);
 				exQueue = mExQueue.acquire(l);
-				auto fork = getLocalSocketFork(id, l);
 
-				if (mEC)
+				// earlier submissions must be queued first.
+				drainSendIntake(exQueue, l);
+
+				auto fork = openFork(ref, l);
+				if (mEC || !fork)
 				{
-					buffer.setError(mEC);
-					exQueue.push_back(callback, fork->mExecutor, l);
+					buffer.setError(mEC ? mEC : code::closed);
+					exQueue.push_back(callback, fork ? fork->mExecutor : ExecutorRef{}, l);
 				}
 				else
 				{
-					auto opPtr = &fork->emplace_send(l,
+					forget();
+					auto opPtr = &fork->emplace_send(l, mFlushEpochs,
 						fork, callback, std::move(buffer));
-
-					if (mNextSendOp)
-					{
-						COPROTO_ASSERT(mSendStatus == Status::Idle);
-						mSendStatus = Status::InUse;
-						opPtr->setStatus(SendOperation::Status::InProgress);
-
-						assert(mSendBufferBegin == nullptr);
-						assert(mSendBufferLast == nullptr);
-
-						exQueue.push_back(mNextSendOp->getHandle(macoro::Ok(opPtr), mNextSendOp), {}, l);
-
-						mSendBufferBegin = opPtr;
-						mSendBufferLast = opPtr;
-					}
-					else
-					{
-						assert(mNextSendOp == nullptr);
-						assert(mSendBufferLast != nullptr);
-
-						mSendBufferLast->setNext(opPtr);
-						mSendBufferLast = opPtr;
-					}
+					opPtr->setCancelable(token.stop_possible());
+					enqueueSend(opPtr, exQueue, l);
+					startSend(exQueue, l);
 
 					opPtr->setCancelation(std::move(token), [this, opPtr] {
 						macoro::stop_source cancelSrc;
@@ -591,10 +1453,18 @@ namespace coproto
 							{
 								// we will skip this operation and calls its cb
 								opPtr->setError(code::operation_aborted);
-								opPtr->completeOn(exQueue, l);
-								assert(opPtr->prev());
-								opPtr->prev()->setNext(opPtr->next());
-								opPtr->fork().erase_send(l, opPtr);
+								opPtr->completeOn(exQueue, mFlushEpochs, l);
+								eraseSend(opPtr);
+								releaseSendBytes(*opPtr, exQueue, l);
+								auto& fork = opPtr->fork();
+								fork.erase_send(l, opPtr);
+								tryReleaseFork(fork, exQueue, l);
+							}
+							else if (opPtr->fork().mChunkedSend == opPtr)
+							{
+								// a chunked message is aborted by the send 
+								// task at the next chunk boundary.
+								opPtr->setStatus(SendOperation::Status::Canceling);
 							}
 							else
 							{
@@ -666,9 +1536,12 @@ namespace coproto
 				auto lock = Lock(mSched.mMutex);
 				queue = mSched.mExQueue.acquire(lock);
 
+				// the recv for this message might still be in the intake.
+				mSched.drainRecvIntake(queue, lock);
+
 				// make sure the fork ID they sent exist.
-				auto iter = mSched.mRemoteSocketForkMapping_.find(mRemoteForkId);
-				if (iter == mSched.mRemoteSocketForkMapping_.end())
+				auto forkPtr = mSched.findRemoteFork(mRemoteForkId, lock);
+				if (forkPtr == nullptr)
 				{
 					mSched.cancel(queue, SockScheduler::Caller::Recver, code::badCoprotoMessageHeader, lock);
 				}
@@ -682,10 +1555,54 @@ namespace coproto
 				{
 
 					// get the fork and set the return value.
-					auto& fork = *iter->second;
+					auto& fork = *forkPtr;
+
+					// a chunked message is stashed as a whole.
+					auto stashSize = fork.mChunkedRecvSize ? fork.mChunkedRecvSize : mSize;
 
-					// check of we have a matching recv
-					if (fork.size_recv(lock) == 0)
+					// check of we have a matching recv.
+					if (fork.mChunkedStash.size())
+					{
+						// the next chunk of a message that is being stashed.
+						// recvs that were posted since then wait for it.
+						RECV_LOG("getRequestedRecvSocketFork::stash-chunk");
+						COPROTO_ASSERT(mSched.mStashFork == nullptr);
+						mSched.mStashFork = &fork;
+						mRes = macoro::Ok(nullptr);
+						queue.push_back(h, {}, lock);
+					}
+					else if (fork.size_recv(lock) == 0 && (
+						fork.mCloseState != SocketFork::CloseState::Open || (
+						mSched.mStashLimit &&
+						fork.mStashBytes + stashSize <= mSched.mStashLimit)))
+					{
+						// no recv has been posted but there is room
+						// in the stash. The message will be received
+						// into the stash and handed to a later recv.
+						// A fork that has been closed gets no more recvs.
+						// Its messages are received into the stash and 
+						// dropped, see tryReleaseFork(...).
+						RECV_LOG("getRequestedRecvSocketFork::stash");
+						COPROTO_ASSERT(mSched.mStashFork == nullptr);
+						fork.mStashBytes += stashSize;
+						mSched.mStashFork = &fork;
+
+						// a handed over message is stashed as is.
+						if (fork.mChunkedRecvSize)
+						{
+							fork.mChunkedStash = mSched.bufferPool().acquire(stashSize);
+							fork.mChunkedRecvOffset = 0;
+						}
+						else
+						{
+							mSched.mStashSize = mSize;
+							if (mSched.mRecvOwnedSize == 0)
+								mSched.mStashBuffer = mSched.bufferPool().acquire(mSize);
+						}
+						mRes = macoro::Ok(nullptr);
+						queue.push_back(h, {}, lock);
+					}
+					else if (fork.size_recv(lock) == 0)
 					{
 						// ok, data has arrived but we dont have anywhere 
 						// to store it. We will store the continuation
@@ -711,10 +1628,44 @@ namespace coproto
 
 		inline macoro::result<RecvOperation*, std::error_code> GetRequestedRecvSocketFork::await_resume()
 		{
-			assert(mRes.has_error() || mRes.value());
+			assert(mRes.has_error() || mRes.value() || mSched.mStashFork);
 			return std::move(mRes);
 		}
 
+		template<typename RecvDest>
+		void SockScheduler::popStash(SocketFork& fork, RecvDest& dest, ExecutionQueue::Handle& queue, Lock& l)
+		{
+			COPROTO_ASSERT(fork.mStash.size());
+			auto& msg = fork.mStash.front();
+			auto size = msg.size();
+
+			// a vector destination takes the stashed message as is.
+			if (dest.take(msg) == false)
+			{
+				span<u8> single;
+				auto buffers = dest.asSpans(size, single);
+				if (totalSize(buffers) != size)
+				{
+					// the same as if the message was received directly.
+					// asSpans(...) has set the error of dest.
+					cancel(queue, Caller::Extern, code::badBufferSize, l);
+				}
+				else
+				{
+					u64 offset = 0;
+					for (auto b : buffers)
+					{
+						std::memcpy(b.data(), msg.data() + offset, b.size());
+						offset += b.size();
+					}
+				}
+			}
+
+			fork.mStashBytes -= size;
+			bufferPool().release(std::move(msg));
+			fork.mStash.pop_front();
+		}
+
 
 		inline std::coroutine_handle<> AnyRecvOp::getHandle(error_code r, AnyRecvOp*& self)
 		{
@@ -746,9 +1697,10 @@ namespace coproto
 			{
 				op.setError(std::exchange(mPrevEc, code::cancel));
 			}
-			op.completeOn(queue, lock);
+			op.completeOn(queue, mSched.mFlushEpochs, lock);
 			fork.pop_front_recv(lock);
 			--mSched.mNumRecvs;
+			mSched.tryReleaseFork(fork, queue, lock);
 		}
 
 		inline std::coroutine_handle<> AnyRecvOp::await_suspend(std::coroutine_handle<>h)
@@ -760,6 +1712,7 @@ namespace coproto
 
 				if (mPrevOp)
 					completePrev(lock, queue);
+				mSched.drainRecvIntake(queue, lock);
 
 				if (mPrevEc || mSched.mEC)
 				{
@@ -799,6 +1752,23 @@ namespace coproto
 
 
 
+		template<typename Sock>
+		macoro::task<error_code> SockScheduler::fillReadAhead(Sock* sock, u64 n)
+		{
+			COPROTO_ASSERT(n <= mReadAhead.capacity());
+			while (mReadAhead.size() < n)
+			{
+				auto [ec, bt] = co_await sock->recvSome(mReadAhead.free(), mRecvToken);
+				mBytesReceived += bt;
+				if (!ec && bt == 0)
+					ec = code::ioError;
+				if (ec)
+					co_return ec;
+				mReadAhead.commit(bt);
+			}
+			co_return error_code{};
+		}
+
 		template<typename Sock>
 		macoro::task<void> SockScheduler::receiveDataTask(Sock* sock)
 		{
@@ -822,6 +1792,18 @@ namespace coproto
 
 				RECV_LOG("new-recv");
 
+				// If enabled, we read as much as is available into mReadAhead 
+				// and then parse the headers and small messages from it. The 
+				// read ahead size is only changed while the buffer is empty.
+				bool readAhead = false;
+				if constexpr (has_recvSome_member_func<Sock>::value)
+				{
+					auto readAheadSize = mReadAheadSize.load(std::memory_order_relaxed);
+					if (mReadAhead.size() == 0 && mReadAhead.capacity() != readAheadSize)
+						mReadAhead.mData.resize(readAheadSize);
+					readAhead = mReadAhead.capacity() != 0;
+				}
+
 				Header header;
 
 				// the first thing we need to do is get a receive header.
@@ -832,10 +1814,23 @@ namespace coproto
 				{
 					// recev the header
 					RECV_LOG("recving-header");
-					std::tie(ec, bt) = co_await sock->recv(asSpan(header), mRecvToken);
-					mBytesReceived += bt;
-					if (checkRecv(ec, bt, sizeof(header)))
-						goto Next;
+					if constexpr (has_recvSome_member_func<Sock>::value)
+					{
+						if (readAhead)
+						{
+							if (mReadAhead.size() < sizeof(header) &&
+								(ec = co_await fillReadAhead(sock, sizeof(header))))
+								goto Next;
+							mReadAhead.read(asSpan(header));
+						}
+					}
+					if (readAhead == false)
+					{
+						std::tie(ec, bt) = co_await sock->recv(asSpan(header), mRecvToken);
+						mBytesReceived += bt;
+						if (checkRecv(ec, bt, sizeof(header)))
+							goto Next;
+					}
 
 					// the message size will be zero if its meta-data
 					if (header.mSize == 0)
@@ -843,15 +1838,45 @@ namespace coproto
 						RECV_LOG("recving-header-meta");
 
 						ControlBlock metadata;
-						std::tie(ec, bt) = co_await sock->recv(asSpan(metadata), mRecvToken);
-						mBytesReceived += bt;
-						if (checkRecv(ec, bt, sizeof(metadata)))
-							goto Next;
+						if constexpr (has_recvSome_member_func<Sock>::value)
+						{
+							if (readAhead)
+							{
+								if (mReadAhead.size() < sizeof(metadata) &&
+									(ec = co_await fillReadAhead(sock, sizeof(metadata))))
+									goto Next;
+								mReadAhead.read(asSpan(metadata));
+							}
+						}
+						if (readAhead == false)
+						{
+							std::tie(ec, bt) = co_await sock->recv(asSpan(metadata), mRecvToken);
+							mBytesReceived += bt;
+							if (checkRecv(ec, bt, sizeof(metadata)))
+								goto Next;
+						}
+
+						if (header.mForkId == ControlBlock::ExtendedSlotId)
+						{
+							ec = recvControlBlock(metadata);
 
-						auto slotId = header.mForkId;
-						auto sid = metadata.getSessionID();
-						auto lock = Lock(mMutex);
-						ec = initRemoteSocketFork(slotId, sid, lock);
+							// an empty message is then received like any other.
+							if (!ec && metadata.getType() == ControlBlock::Type::EmptyMessage)
+							{
+								header.mForkId = metadata.getSlotId();
+								break;
+							}
+						}
+						else
+						{
+							auto slotId = header.mForkId;
+							auto sid = metadata.getSessionID();
+							auto lock = Lock(mMutex);
+							if (mRecvForkRangeSize)
+								ec = initRemoteSocketForkRange(slotId, sid, lock);
+							else
+								ec = initRemoteSocketFork(slotId, sid, lock);
+						}
 						if (ec)
 							goto Next;
 					}
@@ -862,29 +1887,185 @@ namespace coproto
 				}
 
 				RECV_LOG("getRequestedRecvSocketFork-enter");
-				auto opRes = co_await getRequestedRecvSocketFork(header.mForkId);
+				auto opRes = co_await getRequestedRecvSocketFork(header.mForkId, header.mSize);
 				if (opRes.has_error())
 				{
 					ec = opRes.error();
 					goto Next;
 				}
 
+				// op is null if the message should be stashed.
 				op = opRes.value();
-				span<u8> buffer = op->asSpan(header.mSize);
+				mRecvBuffers.clear();
 
-				if (buffer.size() != header.mSize)
+				if constexpr (has_owned_member_func<Sock>::value)
 				{
-					ec = code::badBufferSize;
-					goto Next;
+					if (mRecvOwnedSize)
+					{
+						// the body was handed over by the other party. It becomes
+						// the stash or the destination vector. Otherwise, e.g.
+						// for a span, it is copied.
+						RECV_LOG("recv-owned");
+						auto msg = sock->recvOwned();
+						mBytesReceived += msg.size();
+						if (std::exchange(mRecvOwnedSize, 0) != header.mSize ||
+							msg.size() != header.mSize)
+						{
+							ec = code::badCoprotoMessageHeader;
+							goto Next;
+						}
+
+						if (op == nullptr)
+						{
+							mStashBuffer = std::move(msg);
+							completeStash();
+						}
+						else if (op->take(msg) == false)
+						{
+							span<u8> single;
+							auto buffers = op->asSpans(header.mSize, single);
+							if (totalSize(buffers) != header.mSize)
+							{
+								ec = code::badBufferSize;
+								goto Next;
+							}
+
+							u64 offset = 0;
+							for (auto b : buffers)
+							{
+								std::memcpy(b.data(), msg.data() + offset, b.size());
+								offset += b.size();
+							}
+						}
+
+						RECV_LOG("recv-done");
+						continue;
+					}
 				}
+				if (op && op->fork().mChunkedRecvSize)
+				{
+					// the message is the next chunk of a chunked message.
+					auto& fork = op->fork();
+					if (fork.mChunkedRecv == nullptr)
+					{
+						span<u8> single;
+						auto buffers = op->asSpans(fork.mChunkedRecvSize, single);
+						fork.mChunkedRecv = op;
+						fork.mChunkedRecvBuffers.assign(buffers.begin(), buffers.end());
+						fork.mChunkedRecvOffset = 0;
+						if (totalSize(buffers) != fork.mChunkedRecvSize)
+						{
+							ec = code::badBufferSize;
+							goto Next;
+						}
+					}
+					COPROTO_ASSERT(fork.mChunkedRecv == op);
 
+					if (fork.mChunkedRecvOffset + header.mSize > fork.mChunkedRecvSize)
+					{
+						ec = code::badCoprotoMessageHeader;
+						goto Next;
+					}
+					sliceSpans(fork.mChunkedRecvBuffers, fork.mChunkedRecvOffset, header.mSize, mRecvBuffers);
+					fork.mChunkedRecvOffset += header.mSize;
+				}
+				else if (op == nullptr && mStashFork->mChunkedStash.size())
+				{
+					// the next chunk of a message that is being stashed.
+					auto& fork = *mStashFork;
+					if (fork.mChunkedRecvOffset + header.mSize > fork.mChunkedRecvSize)
+					{
+						ec = code::badCoprotoMessageHeader;
+						goto Next;
+					}
+					mRecvBuffers.push_back(span<u8>(fork.mChunkedStash).subspan(fork.mChunkedRecvOffset, header.mSize));
+					fork.mChunkedRecvOffset += header.mSize;
+				}
+				else
+				{
+					span<u8> single;
+					auto buffers = op ? op->asSpans(header.mSize, single) : span<span<u8>>();
+					if (op == nullptr)
+						mRecvBuffers.push_back(mStashBuffer);
+					else
+						mRecvBuffers.assign(buffers.begin(), buffers.end());
 
-				RECV_LOG("recving-body");
-				std::tie(ec, bt) = co_await sock->recv(buffer, mRecvToken);
-				mBytesReceived += bt;
+					if (totalSize(mRecvBuffers) != header.mSize)
+					{
+						ec = code::badBufferSize;
+						goto Next;
+					}
+				}
 
-				if (checkRecv(ec, bt, buffer.size()))
-					goto Next;
+				// a message can be received into several buffers. If the socket
+				// supports scatter/gather and nothing has been read ahead, they
+				// are all filled using a single operation.
+				if constexpr (has_recvv_member_func<Sock>::value)
+				{
+					if (mRecvBuffers.size() > 1 && mReadAhead.size() == 0)
+					{
+						RECV_LOG("recving-body-vectored");
+						std::tie(ec, bt) = co_await sock->recvv(mRecvBuffers, mRecvToken);
+						mBytesReceived += bt;
+
+						if (checkRecv(ec, bt, header.mSize))
+							goto Next;
+						mRecvBuffers.clear();
+					}
+				}
+
+				for (auto buffer : mRecvBuffers)
+				{
+					if constexpr (has_recvSome_member_func<Sock>::value)
+					{
+						if (readAhead)
+						{
+							// first take what has already been read.
+							buffer = buffer.subspan(mReadAhead.read(buffer));
+
+							// small messages are read into mReadAhead along with
+							// whatever follows them and then copied. Large messages
+							// are received directly into the user's buffer.
+							if (buffer.size() && buffer.size() <= mReadAhead.capacity() / 2)
+							{
+								RECV_LOG("recving-body-read-ahead");
+								if (mReadAhead.size() < buffer.size() &&
+									(ec = co_await fillReadAhead(sock, buffer.size())))
+									goto Next;
+								buffer = buffer.subspan(mReadAhead.read(buffer));
+							}
+						}
+					}
+
+					if (buffer.size())
+					{
+						RECV_LOG("recving-body");
+						std::tie(ec, bt) = co_await sock->recv(buffer, mRecvToken);
+						mBytesReceived += bt;
+
+						if (checkRecv(ec, bt, buffer.size()))
+							goto Next;
+					}
+				}
+
+				if (op == nullptr)
+					completeStash();
+				else if (op->fork().mChunkedRecv == op)
+				{
+					auto& fork = op->fork();
+					if (fork.mChunkedRecvOffset == fork.mChunkedRecvSize)
+					{
+						RECV_LOG("recv-chunked-done");
+						fork.mChunkedRecvSize = 0;
+						fork.mChunkedRecv = nullptr;
+						fork.mChunkedRecvBuffers.clear();
+					}
+					else
+					{
+						// op is completed by a later chunk.
+						op = nullptr;
+					}
+				}
 
 				RECV_LOG("recv-done");
 
@@ -907,12 +2088,12 @@ namespace coproto
 
 
 		inline std::coroutine_handle<> NextSendOp::getHandle(
-			macoro::result<SendOperation*, macoro::error_code> r,
+			macoro::result<SendBatch, macoro::error_code> r,
 			NextSendOp*& self)
 		{
 			COPROTO_ASSERT(this == self);
 			self = nullptr;
-			COPROTO_ASSERT(r.has_error() || r.value());
+			COPROTO_ASSERT(r.has_error() || r.value().mSize);
 			mRes = std::move(r);
 			return std::exchange(mHandle, nullptr);
 		}
@@ -920,24 +2101,256 @@ namespace coproto
 
 		inline void NextSendOp::completePrev(Lock& lock, ExecutionQueue::Handle& queue)
 		{
-			COPROTO_ASSERT(mPrevOp);
-			auto& op = *mPrevOp;
-			if (mPrevEc)
+			COPROTO_ASSERT(mPrev.mSize && mPrev.mSize == mSched.mSendFrames.size());
+
+			// the frames in the batch are complete in order. If the write 
+			// failed, the first operation gets the error and the rest are 
+			// canceled. Chunked operations that still have chunks left are
+			// failed by cancel(...).
+			for (auto& frame : mSched.mSendFrames)
 			{
-				op.setError(std::exchange(mPrevEc, code::cancel));
+				if (frame.mType == SendFrame::Type::Close)
+				{
+					frame.mFork->mCloseState = SocketFork::CloseState::Closed;
+					mSched.tryReleaseFork(*frame.mFork, queue, lock);
+					continue;
+				}
+
+				auto& op = *frame.mOp;
+				auto& fork = op.fork();
+				bool done = true;
+				if (frame.mType == SendFrame::Type::Chunk)
+				{
+					fork.mChunkedSendOffset = frame.mOffset + frame.mLength;
+					done = fork.mChunkedSendOffset == op.size();
+					if (!done)
+						continue;
+				}
+
+				if (mPrevEc)
+					op.setError(std::exchange(mPrevEc, code::cancel));
+				else if (frame.mType == SendFrame::Type::Abort)
+					op.setError(code::operation_aborted);
+
+				op.completeOn(queue, mSched.mFlushEpochs, lock);
+
+				if (fork.mChunkedSend == &op)
+				{
+					fork.mChunkedSend = nullptr;
+					fork.mChunkedSendOffset = 0;
+				}
+
+				assert(&fork.front_send(lock) == &op);
+				mSched.releaseSendBytes(op, queue, lock);
+				fork.pop_front_send(lock);
+				mSched.tryReleaseFork(fork, queue, lock);
 			}
-			op.completeOn(queue, lock);
-			auto next = op.next();
-			op.setNext(nullptr);
+			mSched.mSendFrames.clear();
+		}
 
-			assert(&op.fork().front_send(lock) == &op);
-			assert(mSched.mSendBufferBegin == &op);
+		inline SendBatch NextSendOp::takeBatch(Lock& lock)
+		{
+			auto& frames = mSched.mSendFrames;
+			COPROTO_ASSERT(frames.empty());
+
+			// the number of buffers that the frame [offset, offset + length) 
+			// of op adds to mSendBuffers, i.e. the prefix and the parts of 
+			// the body, see makeSendTask(...).
+			auto numBuffers = [](SendOperation* op, u64 offset, u64 length) {
+				u64 n = 1;
+				span<u8> single;
+				for (auto b : op->asSpans(single))
+				{
+					if (length == 0)
+						break;
+					if (offset >= b.size())
+					{
+						offset -= b.size();
+						continue;
+					}
+					length -= std::min<u64>(b.size() - offset, length);
+					offset = 0;
+					++n;
+				}
+				return n;
+				};
 
-			mSched.mSendBufferBegin = next;
-			if (next == nullptr)
-				mSched.mSendBufferLast = nullptr;
+			// without sendv(...), each batch is a single frame. Canceling
+			// an operation that is being written fails the whole write. A
+			// cancelable operation is therefore only batched on its own.
+			u64 bytes = 0, buffers = 0;
+			bool alone = false;
+			auto maxBuffers = mSched.mVectoredSend ? mSched.mSendBatchMaxBuffers : 0;
+			auto fits = [&](u64 size, u64 n) {
+				return frames.empty() || (
+					!alone &&
+					bytes + size <= mSched.mSendBatchMaxBytes &&
+					buffers + n <= maxBuffers);
+				};
+			auto push = [&](SendFrame f, u64 n) {
+				bytes += f.mLength + sizeof(Header);
+				buffers += n;
+				auto fork = f.mOp ? &f.mOp->fork() : f.mFork;
+				if (fork && f.mType != SendFrame::Type::Abort)
+				{
+					auto& range = fork->mRange;
+					if (range && range->mAnnounced == false)
+						f.mAnnounceRange = range->mAnnounced = true;
+				}
+				frames.push_back(f);
+				};
+
+			// add the next chunk of the front chunked operation and rotate. 
+			// A canceled operation is aborted instead. If none of it has been 
+			// sent the abort frame is empty.
+			auto pushChunk = [&]() {
+				auto op = mSched.mChunkedSends.front();
+				auto offset = op->fork().mChunkedSendOffset;
+				auto length = std::min<u64>(op->size() - offset, mSched.mSendChunkSize);
+				mSched.mChunkedSends.pop_front();
+
+				if (op->status() == SendOperation::Status::Canceling)
+					push({ SendFrame::Type::Abort, op, offset, 0 }, 1);
+				else
+				{
+					push({ SendFrame::Type::Chunk, op, offset, length }, numBuffers(op, offset, length));
+					if (offset + length != op->size())
+						mSched.mChunkedSends.push_back(op);
+				}
+				};
+
+			// the batch starts with the CloseFork meta messages. The messages
+			// of these forks have already been sent. These are only sent along
+			// with other messages so that the other party reads them, see 
+			// mForkCloses.
+			if (mSched.hasPendingSends())
+			{
+				while (mSched.mForkCloses.size() && fits(0, 1))
+				{
+					push({ SendFrame::Type::Close, nullptr, 0, 0, mSched.mForkCloses.front() }, 1);
+					mSched.mForkCloses.pop_front();
+				}
+			}
+
+			// if the last batch was full, start with a chunk so that 
+			// the chunked messages make progress.
+			bool chunked = false;
+			if (mSched.mChunkedSends.size() && mSched.mChunkTurn)
+			{
+				mSched.mChunkTurn = false;
+				chunked = true;
+				pushChunk();
+			}
+
+			// the classes take turns. At the start of its turn, a class is
+			// given its quantum. It then sends its operations in order until
+			// the next one costs more than it has left. Operations of a fork
+			// whose chunked message is in progress are skipped. If the batch
+			// is full, the turn continues with the next batch. The loop ends
+			// once each class has had a turn without sending anything.
+			bool full = false;
+			u64 idle = 0;
+			while (!full && idle < mSched.mActiveSendClasses.size())
+			{
+				auto& cls = *mSched.mActiveSendClasses.front();
+				auto quantum = mSched.sendQuantum(cls);
+				if (mSched.mSendTurn == false)
+				{
+					mSched.mSendTurn = true;
+					cls.mDeficit += quantum;
+				}
+
+				bool progress = false;
+				auto op = cls.mBegin;
+				while (op)
+				{
+					COPROTO_ASSERT(op->status() == SendOperation::Status::NotStarted);
+					auto next = op->next();
+					auto& fork = op->fork();
+					auto size = op->size();
+					auto cost = std::min<u64>(size + sizeof(Header), quantum);
+
+					if (fork.mChunkedSend)
+					{
+						// wait for the chunked message of this fork.
+						op = next;
+						continue;
+					}
+
+					if (cost > cls.mDeficit)
+						break;
 
-			op.fork().pop_front_send(lock);
+					if (op->ownedVector() && mSched.isOwnedSend(size))
+					{
+						// the body is not written to the socket and 
+						// therefore the message is never chunked.
+						if (!fits(0, 1) || (op->cancelable() && frames.size()))
+						{
+							full = true;
+							break;
+						}
+						op->setStatus(SendOperation::Status::InProgress);
+						cls.mDeficit -= cost;
+						mSched.eraseSend(op);
+						push({ SendFrame::Type::Owned, op, 0, 0 }, 1);
+						alone = op->cancelable();
+					}
+					else if (mSched.mSendChunkSize && size > mSched.mSendChunkSize)
+					{
+						// a canceled chunked message is aborted at the 
+						// next chunk and so can share the batch.
+						op->setStatus(SendOperation::Status::InProgress);
+						cls.mDeficit -= cost;
+						mSched.eraseSend(op);
+						fork.mChunkedSend = op;
+						fork.mChunkedSendOffset = 0;
+						mSched.mChunkedSends.push_back(op);
+					}
+					else if (fits(size, numBuffers(op, 0, size)) &&
+						!(op->cancelable() && frames.size()))
+					{
+						op->setStatus(SendOperation::Status::InProgress);
+						cls.mDeficit -= cost;
+						mSched.eraseSend(op);
+						push({ SendFrame::Type::Message, op, 0, size }, numBuffers(op, 0, size));
+						alone = op->cancelable();
+					}
+					else
+					{
+						full = true;
+						break;
+					}
+
+					progress = true;
+					op = next;
+				}
+
+				if (full)
+					break;
+
+				// the turn of the class is over. If it has sent all of its
+				// operations, eraseSend(...) has removed it already.
+				if (cls.mActive)
+				{
+					mSched.mActiveSendClasses.pop_front();
+					mSched.mActiveSendClasses.push_back(&cls);
+				}
+				mSched.mSendTurn = false;
+				idle = progress ? 0 : idle + 1;
+			}
+
+			if (mSched.mChunkedSends.size() && !chunked)
+			{
+				auto op = mSched.mChunkedSends.front();
+				auto offset = op->fork().mChunkedSendOffset;
+				auto size = std::min<u64>(op->size() - offset, mSched.mSendChunkSize);
+				if (fits(size, numBuffers(op, offset, size)))
+					pushChunk();
+				else
+					mSched.mChunkTurn = true;
+			}
+
+			return { frames.size() };
 		}
 
 		inline bool NextSendOp::await_ready() { return false; }
@@ -947,22 +2360,20 @@ namespace coproto
 			{
 				auto lock = Lock(mSched.mMutex);
 				queue = mSched.mExQueue.acquire(lock);
-				if (mPrevOp)
+				if (mPrev.mSize)
 					completePrev(lock, queue);
+				mSched.drainSendIntake(queue, lock);
 				if (mPrevEc || mSched.mEC)
 				{
-					COPROTO_ASSERT(mSched.mSendBufferBegin == nullptr || mSched.mSendBufferBegin->status() == SendOperation::Status::NotStarted);
 					mSched.cancel(queue, SockScheduler::Caller::Sender, mPrevEc, lock);
 					mRes = macoro::Err(code::closed);
 					queue.push_back(h, {}, lock);
 				}
 				else
 				{
-					if (mSched.mSendBufferBegin)
+					if (!mSched.mCorked && mSched.hasPendingSends())
 					{
-						COPROTO_ASSERT(mSched.mSendBufferBegin->status() == SendOperation::Status::NotStarted);
-						mSched.mSendBufferBegin->setStatus(SendOperation::Status::InProgress);
-						mRes = macoro::Ok(mSched.mSendBufferBegin);
+						mRes = macoro::Ok(takeBatch(lock));
 						queue.push_back(h, {}, lock);
 					}
 					else
@@ -977,14 +2388,15 @@ namespace coproto
 			return queue.runReturnLast().std_cast();
 		}
 
-		inline macoro::result<SendOperation*, macoro::error_code> NextSendOp::await_resume()
+		inline macoro::result<SendBatch, macoro::error_code> NextSendOp::await_resume()
 		{
-			COPROTO_ASSERT(mRes.has_error() || mRes.value());
+			COPROTO_ASSERT(mRes.has_error() || mRes.value().mSize);
 			return mRes;
 		}
 
 
 
+
 		template<typename Sock>
 		macoro::task<void> SockScheduler::makeSendTask(Sock* sock)
 		{
@@ -994,70 +2406,180 @@ namespace coproto
 				return ec;
 				};
 
-			SendOperation* op = nullptr;
+			SendBatch batch;
 			error_code ec;
 			u64 bt;
 			while (true)
 			{
-				auto opRes = co_await completeOpAndGetNextSend(
-					std::exchange(op, nullptr),
+				auto batchRes = co_await completeOpAndGetNextSend(
+					std::exchange(batch, {}),
 					std::exchange(ec, {}));
 
-				if (opRes.has_error())
+				if (batchRes.has_error())
 					break;
 				SEND_LOG("new-send");
 
-				op = opRes.value();
-				auto& fork = op->fork();
-				auto data = op->asSpan();
-
-				COPROTO_ASSERT(op->status() != SendOperation::Status::NotStarted);
-				COPROTO_ASSERT(data.size() != 0);
-				COPROTO_ASSERT(data.size() < std::numeric_limits<u32>::max());
-				COPROTO_ASSERT(fork.mLocalId != ~u32(0));
+				batch = batchRes.value();
 
-				if (fork.mInitiated == false)
+				// each frame is sent as [meta...][header][body]. The meta 
+				// messages initialize the slot, start or abort a chunked message.
+				mSendPrefixes.resize(batch.mSize);
+				mSendBuffers.clear();
+				u64 total = 0, ownedBytes = 0;
+				for (u64 i = 0; i < batch.mSize; ++i)
 				{
-					SEND_LOG("meta");
-
-					struct SendControlBlock
+					auto& frame = mSendFrames[i];
+					auto& prefix = mSendPrefixes[i];
+					prefix.mSize = 0;
+
+					// the forks of a range are announced together. This can
+					// happen with the close of one of them.
+					auto announceRange = [&](SocketFork& fork) {
+						auto& range = *fork.mRange;
+						ControlBlock ctrl;
+						ctrl.setType(ControlBlock::Type::NewSocketForkRange);
+						ctrl.setSlotId(range.mLocalBase);
+						ctrl.setSize(range.mSize);
+						prefix.push_back(ControlBlock::ExtendedSlotId, ctrl);
+						ctrl.setSessionID(range.mBaseId);
+						prefix.push_back(range.mLocalBase, ctrl);
+						};
+
+					// the first message on a fork must be proceeded
+					// by a meta message that initializes the slot. 
+					auto initFork = [&](SocketFork& fork) {
+						fork.mInitiated = true;
+						ControlBlock ctrl;
+						ctrl.setType(ControlBlock::Type::NewSocketFork);
+						ctrl.setSessionID(fork.mSessionID);
+						prefix.push_back(fork.mLocalId, ctrl);
+						};
+
+					if (frame.mType == SendFrame::Type::Close)
 					{
-						Header mHeader;
-						ControlBlock mCtrlBlk;
-					};
+						// a fork that has not been sent on is initialized by 
+						// its close.
+						if (frame.mAnnounceRange)
+							announceRange(*frame.mFork);
+						else if (frame.mFork->mInitiated == false && !frame.mFork->mRange)
+							initFork(*frame.mFork);
+
+						ControlBlock ctrl;
+						ctrl.setType(ControlBlock::Type::CloseFork);
+						ctrl.setSlotId(frame.mFork->mLocalId);
+						prefix.push_back(ControlBlock::ExtendedSlotId, ctrl);
+						mSendBuffers.push_back(prefix.asSpan());
+						total += prefix.mSize;
+						continue;
+					}
 
-					fork.mInitiated = true;
-					SendControlBlock meta;
-					meta.mHeader.mSize = 0;
-					meta.mHeader.mForkId = fork.mLocalId;
-					meta.mCtrlBlk.setType(ControlBlock::Type::NewSocketFork);
-					meta.mCtrlBlk.setSessionID(fork.mSessionID);
+					auto& fork = frame.mOp->fork();
 
-					std::tie(ec, bt) = co_await sock->send(asSpan(meta), mSendToken);
-					SEND_LOG("meta-sent");
+					COPROTO_ASSERT(frame.mOp->status() != SendOperation::Status::NotStarted);
+					COPROTO_ASSERT(fork.mLocalId != ~u32(0));
 
-					mBytesSent += bt;
-					if (checkSend(ec, bt, sizeof(meta)))
+					// an abort before the first chunk sends nothing.
+					if (frame.mType == SendFrame::Type::Abort && frame.mOffset == 0)
 						continue;
-				}
 
-				Header header;
-				header.mForkId = fork.mLocalId;
-				header.mSize = static_cast<u32>(data.size());
-				SEND_LOG("sending-header");
+					// the forks of a range are initialized together.
+					ControlBlock ctrl;
+					if (frame.mAnnounceRange)
+					{
+						announceRange(fork);
+						fork.mInitiated = true;
+					}
+					else if (fork.mInitiated == false && !fork.mRange)
+						initFork(fork);
 
-				std::tie(ec, bt) = co_await sock->send(asSpan(header), mSendToken);
-				mBytesSent += bt;
-				if (checkSend(ec, bt, sizeof(header)))
-					continue;
+					if (frame.mType == SendFrame::Type::Abort)
+					{
+						ctrl.setType(ControlBlock::Type::AbortMessage);
+						ctrl.setSlotId(fork.mLocalId);
+						prefix.push_back(ControlBlock::ExtendedSlotId, ctrl);
+						mSendBuffers.push_back(prefix.asSpan());
+					}
+					else
+					{
+						if (frame.mType == SendFrame::Type::Chunk && frame.mOffset == 0)
+						{
+							ctrl.setType(ControlBlock::Type::ChunkedMessage);
+							ctrl.setSlotId(fork.mLocalId);
+							ctrl.setSize(frame.mOp->size());
+							prefix.push_back(ControlBlock::ExtendedSlotId, ctrl);
+						}
 
-				SEND_LOG("sending-body");
-				std::tie(ec, bt) = co_await sock->send(data, mSendToken);
-				mBytesSent += bt;
+						if (frame.mOp->size() == 0)
+						{
+							// the body of an empty message is implied.
+							ctrl.setType(ControlBlock::Type::EmptyMessage);
+							ctrl.setSlotId(fork.mLocalId);
+							prefix.push_back(ControlBlock::ExtendedSlotId, ctrl);
+							mSendBuffers.push_back(prefix.asSpan());
+						}
+						else if (frame.mType == SendFrame::Type::Owned)
+						{
+							// the vector is handed over before the header is 
+							// sent and thus is available once the header arrives.
+							// Its bytes are counted once the header is sent. If
+							// that fails, the socket releases it on close.
+							auto size = frame.mOp->size();
+							COPROTO_ASSERT(size < std::numeric_limits<u32>::max());
+							ctrl.setType(ControlBlock::Type::OwnedMessage);
+							ctrl.setSlotId(fork.mLocalId);
+							ctrl.setSize(size);
+							prefix.push_back(ControlBlock::ExtendedSlotId, ctrl);
+							prefix.push_back(Header{ static_cast<u32>(size), fork.mLocalId });
+							mSendBuffers.push_back(prefix.asSpan());
+
+							if constexpr (has_owned_member_func<Sock>::value)
+								sock->sendOwned(std::move(*frame.mOp->ownedVector()));
+							ownedBytes += size;
+						}
+						else
+						{
+							COPROTO_ASSERT(frame.mLength < std::numeric_limits<u32>::max());
+							prefix.push_back(Header{ static_cast<u32>(frame.mLength), fork.mLocalId });
+							mSendBuffers.push_back(prefix.asSpan());
 
-				if (checkSend(ec, bt, data.size()))
-					continue;
+							// the body might consist of several buffers.
+							span<u8> single;
+							sliceSpans(frame.mOp->asSpans(single), frame.mOffset, frame.mLength, mSendBuffers);
+						}
+					}
+					total += prefix.mSize + frame.mLength;
+				}
+
+				if (total == 0)
+				{
+					SEND_LOG("send-empty");
+				}
+				else if constexpr (has_sendv_member_func<Sock>::value)
+				{
+					// the socket supports scatter/gather. All frames in 
+					// the batch are sent using a single operation.
+					SEND_LOG("sending-vectored");
+					std::tie(ec, bt) = co_await sock->sendv(mSendBuffers, mSendToken);
+					mBytesSent += bt;
+
+					if (checkSend(ec, bt, total))
+						continue;
+				}
+				else
+				{
+					for (auto& buffer : mSendBuffers)
+					{
+						SEND_LOG("sending");
+						std::tie(ec, bt) = co_await sock->send(buffer, mSendToken);
+						mBytesSent += bt;
+						if (checkSend(ec, bt, buffer.size()))
+							break;
+					}
+					if (ec)
+						continue;
+				}
 
+				mBytesSent += ownedBytes;
 				SEND_LOG("send-done");
 			}
 
@@ -0,0 +1,212 @@
+#include "SendBenchmark.h"
+#include "coproto/coproto.h"
+#include "coproto/Common/CLP.h"
+#include "coproto/Socket/LocalAsyncSock.h"
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+using namespace coproto;
+
+void sendBenchmark(const CLP& cmd)
+{
+	auto maxThreads = cmd.getOr<u64>("t", 32);
+	auto numMsgs = cmd.getOr<u64>("n", 10000);
+	auto size = cmd.getOr<u64>("size", 16);
+
+	for (auto recvHeavy : { false, true })
+	{
+		std::cout << (recvHeavy ? "recv-heavy" : "send-heavy") << std::endl;
+		std::cout << std::setw(8) << "threads"
+			<< std::setw(16) << "submit msg/s"
+			<< std::setw(16) << "total msg/s" << std::endl;
+
+		for (u64 numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+		{
+			auto s = LocalAsyncSocket::makePair();
+			std::vector<Socket> f0(numThreads), f1(numThreads);
+			for (u64 i = 0; i < numThreads; ++i)
+			{
+				f0[i] = s[0].fork();
+				f1[i] = s[1].fork();
+			}
+
+			// send-heavy: each fork has a sending and a receiving thread. 
+			// The senders only submit move-sends, so their time is dominated
+			// by the submission path of the scheduler. 
+			// recv-heavy: one thread sends to all forks and each fork has a 
+			// receiving thread. The receivers then contend on the recv
+			// submission path. Submit is the time of the senders.
+			std::atomic<bool> go = false;
+			std::atomic<u64> sending = recvHeavy ? 1 : numThreads;
+			std::chrono::steady_clock::time_point submitted;
+			std::vector<std::thread> thrds;
+			for (u64 i = 0; i < numThreads; ++i)
+			{
+				if (recvHeavy == false || i == 0)
+				{
+					thrds.emplace_back([&, i] {
+						while (!go);
+						for (u64 j = 0; j < numMsgs; ++j)
+						{
+							if (recvHeavy)
+							{
+								for (auto& f : f0)
+									macoro::sync_wait(f.send(std::vector<u8>(size)));
+							}
+							else
+								macoro::sync_wait(f0[i].send(std::vector<u8>(size)));
+						}
+						if (--sending == 0)
+							submitted = std::chrono::steady_clock::now();
+						});
+				}
+				thrds.emplace_back([&, i] {
+					std::vector<u8> msg(size);
+					while (!go);
+					for (u64 j = 0; j < numMsgs; ++j)
+						macoro::sync_wait(f1[i].recv(msg));
+					});
+			}
+
+			auto begin = std::chrono::steady_clock::now();
+			go = true;
+			for (auto& t : thrds)
+				t.join();
+			auto end = std::chrono::steady_clock::now();
+
+			auto rate = [&](std::chrono::steady_clock::time_point t) {
+				auto sec = std::chrono::duration<double>(t - begin).count();
+				return u64(numThreads * numMsgs / sec);
+			};
+			std::cout << std::setw(8) << numThreads
+				<< std::setw(16) << rate(submitted)
+				<< std::setw(16) << rate(end) << std::endl;
+
+			macoro::sync_wait(s[0].flush());
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+	}
+}
+
+namespace
+{
+	double pingPong(std::array<LocalAsyncSocket, 2> s, u64 rounds)
+	{
+		// with inline scheduling each party resumes the other on its 
+		// own stack. Awaiting every round separately unwinds the stack.
+		auto ping = [](Socket& sock) -> macoro::task<> {
+			u64 v = 0;
+			co_await sock.send(std::move(v));
+			co_await sock.recv(v);
+		};
+		auto pong = [](Socket& sock) -> macoro::task<> {
+			u64 v;
+			co_await sock.recv(v);
+			co_await sock.send(std::move(v));
+		};
+
+		auto begin = std::chrono::steady_clock::now();
+		for (u64 i = 0; i < rounds; ++i)
+			macoro::sync_wait(macoro::when_all_ready(ping(s[0]), pong(s[1])));
+		auto end = std::chrono::steady_clock::now();
+
+		macoro::sync_wait(s[0].flush());
+		macoro::sync_wait(s[0].close());
+		macoro::sync_wait(s[1].close());
+		return std::chrono::duration<double, std::nano>(end - begin).count() / rounds;
+	}
+}
+
+void pingPongBenchmark(const CLP& cmd)
+{
+	auto rounds = cmd.getOr<u64>("n", 10000);
+	std::cout << "ping-pong round trip, locking:         " << 
+		pingPong(LocalAsyncSocket::makePair(), rounds) << " ns" << std::endl;
+	std::cout << "ping-pong round trip, single threaded: " << 
+		pingPong(LocalAsyncSocket::makePair(single_threaded_tag{}), rounds) << " ns" << std::endl;
+}
+
+namespace
+{
+	double stream(std::array<LocalAsyncSocket, 2> s, u64 numPairs, u64 numMsgs, u64 size)
+	{
+		// each fork pair carries messages in one direction. Both parties
+		// send on numPairs pairs and receive on numPairs others. Every 
+		// sender and receiver has its own thread.
+		auto send = [](Socket& sock, u64 numMsgs, u64 size) -> macoro::task<> {
+			std::vector<u8> msg(size);
+			for (u64 i = 0; i < numMsgs; ++i)
+				co_await sock.send(msg);
+			co_await sock.flushFork();
+		};
+		auto recv = [](Socket& sock, u64 numMsgs, u64 size) -> macoro::task<> {
+			std::vector<u8> msg(size);
+			for (u64 i = 0; i < numMsgs; ++i)
+				co_await sock.recv(msg);
+		};
+
+		std::vector<Socket> f0(2 * numPairs), f1(2 * numPairs);
+		for (u64 i = 0; i < f0.size(); ++i)
+		{
+			f0[i] = s[0].fork();
+			f1[i] = s[1].fork();
+		}
+
+		std::atomic<bool> go = false;
+		std::vector<std::thread> thrds;
+		for (u64 i = 0; i < numPairs; ++i)
+		{
+			auto a = 2 * i, b = 2 * i + 1;
+			thrds.emplace_back([&, a] { while (!go); macoro::sync_wait(send(f0[a], numMsgs, size)); });
+			thrds.emplace_back([&, a] { while (!go); macoro::sync_wait(recv(f1[a], numMsgs, size)); });
+			thrds.emplace_back([&, b] { while (!go); macoro::sync_wait(send(f1[b], numMsgs, size)); });
+			thrds.emplace_back([&, b] { while (!go); macoro::sync_wait(recv(f0[b], numMsgs, size)); });
+		}
+
+		auto begin = std::chrono::steady_clock::now();
+		go = true;
+		for (auto& t : thrds)
+			t.join();
+		auto end = std::chrono::steady_clock::now();
+
+		macoro::sync_wait(s[0].close());
+		macoro::sync_wait(s[1].close());
+		return std::chrono::duration<double>(end - begin).count();
+	}
+}
+
+void localSocketBenchmark(const CLP& cmd)
+{
+	auto maxThreads = cmd.getOr<u64>("t", 32);
+	auto numMsgs = cmd.getOr<u64>("n", 10000);
+	auto size = cmd.getOr<u64>("size", 16);
+	auto bufferSize = cmd.getOr<u64>("buffer", 1 << 16);
+
+	for (auto buffered : { false, true })
+	{
+		std::cout << (buffered ? "buffered" : "rendezvous") << std::endl;
+		std::cout << std::setw(8) << "pairs"
+			<< std::setw(8) << "threads"
+			<< std::setw(16) << "msg/s"
+			<< std::setw(16) << "MB/s" << std::endl;
+
+		// each pair of forks in each direction has a sending and a 
+		// receiving thread.
+		for (u64 numPairs = 1; 4 * numPairs <= std::max<u64>(maxThreads, 4); numPairs *= 2)
+		{
+			auto sec = stream(buffered ?
+				LocalAsyncSocket::makeBufferedPair(bufferSize) :
+				LocalAsyncSocket::makePair(), numPairs, numMsgs, size);
+			auto msgs = 2 * numPairs * numMsgs;
+			std::cout << std::setw(8) << numPairs
+				<< std::setw(8) << 4 * numPairs
+				<< std::setw(16) << u64(msgs / sec)
+				<< std::setw(16) << u64(msgs * size / sec / (1 << 20)) << std::endl;
+		}
+	}
+}
@@ -0,0 +1,27 @@
+#pragma once
+// © 2022 Visa.
+// Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+namespace coproto { class CLP; }
+
+// Measures how send and recv submissions scale with the number of 
+// threads that send or receive on forks of one socket. Run with 
+// -bench. Options: -t max threads, -n messages per fork, -size 
+// message bytes.
+void sendBenchmark(const coproto::CLP& cmd);
+
+// Measures the round trip latency of a ping-pong protocol on one 
+// thread, with and without single_threaded_tag. Option: -n rounds.
+void pingPongBenchmark(const coproto::CLP& cmd);
+
+// Measures how the throughput of a rendezvous and a buffered 
+// LocalAsyncSocket scales when both parties stream messages to each 
+// other on 1, 2, 4, ... fork pairs per direction, each with a sending
+// and a receiving thread. Options: -t max threads, -n messages per 
+// fork, -size message bytes, -buffer ring bytes.
+void localSocketBenchmark(const coproto::CLP& cmd);
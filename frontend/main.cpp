@@ -8,6 +8,7 @@
 #include "cpp20Tutorial.h"
 #include "cpp14Tutorial.h"
 #include "SocketTutorial.h"
+#include "SendBenchmark.h"
 
 #include "coproto/Common/CLP.h"
 
@@ -20,7 +21,13 @@ int main(int argc, char** argv)
 {
 	coproto::CLP cmd(argc, argv);
 
-	if (cmd.isSet("u") == false)
+	if (cmd.isSet("bench"))
+	{
+		sendBenchmark(cmd);
+		pingPongBenchmark(cmd);
+		localSocketBenchmark(cmd);
+	}
+	else if (cmd.isSet("u") == false)
 	{
 		cpp14Tutorial();
 		cpp20Tutorial();
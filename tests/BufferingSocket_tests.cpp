@@ -528,5 +528,58 @@ namespace coproto
 				f.join();
 			}
 		}
+
+		void BufferingSocket_sendvRecvv_test()
+		{
+			std::array<BufferingSocket, 2> s;
+
+			std::vector<u8> b0(3), b1(8), b2(13);
+			std::vector<u8> exp;
+			for (auto b : { &b0, &b1, &b2 })
+			{
+				for (auto& v : *b)
+					v = static_cast<u8>(exp.size() + 1);
+				exp.insert(exp.end(), b->begin(), b->end());
+			}
+
+			std::array<span<u8>, 3> sb{ { b0, b1, b2 } };
+			auto r = macoro::sync_wait(s[0].mSock->sendv(sb));
+			if (r.first || r.second != exp.size())
+				throw MACORO_RTE_LOC;
+
+			// the buffers should be sent as a single message.
+			if (s[0].mSock->mOutboundBuffer_.mData.size() != 1)
+				throw MACORO_RTE_LOC;
+
+			auto out = s[0].getOutbound();
+			if (!out || *out != exp)
+				throw MACORO_RTE_LOC;
+
+			std::vector<u8> r0(5), r1(19);
+			std::array<span<u8>, 2> rb{ { r0, r1 } };
+			bool done = false;
+			auto task_ = [&]() -> task<void> {
+				MC_BEGIN(task<>, &);
+				MC_AWAIT_SET(r, s[1].mSock->recvv(rb));
+				done = true;
+				MC_END();
+			};
+
+			auto t = macoro::make_blocking(task_());
+
+			// the receive should not complete until all of the data has arrived.
+			s[1].processInbound(span<u8>(out->data(), 10));
+			if (done)
+				throw MACORO_RTE_LOC;
+			s[1].processInbound(span<u8>(out->data() + 10, out->size() - 10));
+			t.get();
+
+			if (!done || r.first || r.second != exp.size())
+				throw MACORO_RTE_LOC;
+
+			r0.insert(r0.end(), r1.begin(), r1.end());
+			if (r0 != exp)
+				throw MACORO_RTE_LOC;
+		}
 	}
 }
@@ -18,6 +18,7 @@ namespace coproto
 		void BufferingSocket_cancellation_test();
 		void BufferingSocket_parCancellation_test();
 		void BufferingSocket_close_test();
+		void BufferingSocket_sendvRecvv_test();
 
 	}
 }
\ No newline at end of file
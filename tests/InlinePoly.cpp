@@ -6,12 +6,21 @@
 #include <unordered_map>
 #include <mutex>
 #include <cassert>
+#include <cstdlib>
+#include <new>
 namespace coproto
 {
 
 
+	std::string hexPtr(void* p)
+	{
+		std::stringstream ss;
+		ss << std::hex << u64(p);
+		return ss.str();
+	}
+
 #ifdef ALLOC_TEST
-	//inline std::atomic<int> gNewDel_ = 0;
+	i64 gNewDel_ = 0;
 	std::unordered_map<void*, std::string> gNewMap;
 	std::mutex gMtx;
 	u64 mNewIdx = 0;
@@ -51,14 +60,9 @@ namespace coproto
 
 		return ss.str();
 	}
-#endif
 
-	std::string hexPtr(void* p)
-	{
-		std::stringstream ss;
-		ss << std::hex << u64(p);
-		return ss.str();
-	}
+	std::atomic<u64> gNumAllocs(0);
+#endif
 
 
 	namespace tests
@@ -264,4 +268,25 @@ namespace coproto
 		}
 	}
 
-}
\ No newline at end of file
+}
+#ifdef ALLOC_TEST
+// count every allocation so that allocation tests also see 
+// the ones that are not registered with COPROTO_REG_NEW.
+void* operator new(std::size_t n)
+{
+	++coproto::gNumAllocs;
+	if (auto p = std::malloc(n ? n : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+#endif
@@ -0,0 +1,150 @@
+#include "IoUringSocket_tests.h"
+#include "coproto/Socket/IoUringSocket.h"
+#include "Tests.h"
+#include "eval.h"
+#include <future>
+#include <thread>
+
+namespace coproto
+{
+	namespace tests
+	{
+#ifdef COPROTO_HAS_IO_URING
+		namespace
+		{
+			// the kernel or the sandbox might not allow io_uring.
+			void makeContext(optional<IoUringContext>& ctx, bool reaperThread = true, u32 entries = 256)
+			{
+				try {
+					ctx.emplace(entries, reaperThread);
+				}
+				catch (std::system_error&)
+				{
+					throw UnitTestSkipped("io_uring is not available");
+				}
+			}
+		}
+
+		void IoUringSocket_sendRecv_test()
+		{
+			optional<IoUringContext> ctx;
+			makeContext(ctx);
+			socketSendRecvTest([&] { return IoUringSocket::makePair(*ctx); });
+		}
+
+		void IoUringSocket_largeSendRecv_test()
+		{
+			optional<IoUringContext> ctx;
+			makeContext(ctx);
+			socketLargeSendRecvTest([&] { return IoUringSocket::makePair(*ctx); });
+		}
+
+		void IoUringSocket_registeredBuffer_test()
+		{
+			optional<IoUringContext> ctx;
+			makeContext(ctx);
+
+			std::vector<u8> reg(1 << 16);
+			std::array<span<u8>, 1> regs{ reg };
+			ctx->registerBuffers(regs);
+
+			// the receive uses IORING_OP_READ_FIXED.
+			auto s = IoUringSocket::makePair(*ctx);
+			std::vector<u8> sb(4000);
+			for (u64 i = 0; i < sb.size(); ++i)
+				sb[i] = i * 7;
+
+			auto rb = span<u8>(reg.data() + 100, sb.size());
+			for (u64 t = 0; t < 4; ++t)
+			{
+				auto r = macoro::sync_wait(macoro::when_all_ready(
+					s[0].mSock->send(sb),
+					s[1].mSock->recv(rb)));
+				if (std::get<0>(r).result().first || std::get<1>(r).result().first)
+					throw MACORO_RTE_LOC;
+				if (!std::equal(sb.begin(), sb.end(), rb.begin()))
+					throw MACORO_RTE_LOC;
+				std::fill(rb.begin(), rb.end(), 0);
+			}
+		}
+
+		void IoUringSocket_poll_test()
+		{
+			// completions are processed by this thread.
+			optional<IoUringContext> ctx;
+			makeContext(ctx, false);
+			auto s = IoUringSocket::makePair(*ctx);
+
+			std::array<Socket, 2> ss{ s[0], s[1] };
+			bool done0 = false, done1 = false;
+			auto proto = [](Socket& s, bool party, bool& done) -> task<void> {
+				MC_BEGIN(task<>, &s, party, &done);
+				MC_AWAIT(echoProto(s, party));
+				done = true;
+				MC_END();
+			};
+			auto p0 = macoro::make_blocking(proto(ss[0], 0, done0));
+			auto p1 = macoro::make_blocking(proto(ss[1], 1, done1));
+
+			// drive the io until both sides have completed.
+			auto end = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+			while (!done0 || !done1)
+			{
+				ctx->poll();
+				if (std::chrono::steady_clock::now() > end)
+					throw MACORO_RTE_LOC;
+			}
+			p0.get();
+			p1.get();
+		}
+
+		void IoUringSocket_smallRing_test()
+		{
+			// many more operations than the rings have entries. The 
+			// completion queue overflows and sqes wait in the backlog.
+			optional<IoUringContext> ctx;
+			makeContext(ctx, true, 4);
+
+			u64 numPairs = 16;
+			std::vector<std::array<IoUringSocket, 2>> s;
+			std::vector<macoro::blocking_task<task<void>>> protos;
+			protos.reserve(2 * numPairs);
+			for (u64 i = 0; i < numPairs; ++i)
+				s.push_back(IoUringSocket::makePair(*ctx));
+			for (auto& p : s)
+			{
+				protos.push_back(macoro::make_blocking(echoProto(p[0], 0)));
+				protos.push_back(macoro::make_blocking(echoProto(p[1], 1)));
+			}
+
+			for (auto& p : protos)
+				p.get();
+		}
+
+		void IoUringSocket_cancellation_test()
+		{
+			optional<IoUringContext> ctx;
+			makeContext(ctx);
+			socketCancellationTest([&] { return IoUringSocket::makePair(*ctx); });
+		}
+
+		void IoUringSocket_close_test()
+		{
+			optional<IoUringContext> ctx;
+			makeContext(ctx);
+			socketCloseTest([&] { return IoUringSocket::makePair(*ctx); });
+		}
+#else
+		namespace {
+			void skip() { throw UnitTestSkipped("io_uring is not available"); }
+		}
+		void IoUringSocket_sendRecv_test() { skip(); }
+		void IoUringSocket_largeSendRecv_test() { skip(); }
+		void IoUringSocket_registeredBuffer_test() { skip(); }
+		void IoUringSocket_poll_test() { skip(); }
+		void IoUringSocket_smallRing_test() { skip(); }
+		void IoUringSocket_cancellation_test() { skip(); }
+		void IoUringSocket_close_test() { skip(); }
+#endif
+	}
+}
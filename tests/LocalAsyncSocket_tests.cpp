@@ -48,7 +48,43 @@ void coproto::tests::LocalAsyncSocket_sendRecv_test()
 	//COPROTO_ASSERT(h1 == t1.handle());
 }
 
+namespace coproto
+{
+	namespace tests
+	{
+		static std::array<LocalAsyncSocket, 2> makePair(bool buffered)
+		{
+			return buffered ?
+				LocalAsyncSocket::makeBufferedPair(64) :
+				LocalAsyncSocket::makePair();
+		}
+
+		static void parSendRecv(bool buffered);
+		static void close(bool buffered);
+	}
+}
+
 void coproto::tests::LocalAsyncSocket_parSendRecv_test()
+{
+	parSendRecv(false);
+}
+
+void coproto::tests::LocalAsyncSocket_buffered_parSendRecv_test()
+{
+	parSendRecv(true);
+}
+
+void coproto::tests::LocalAsyncSocket_close_test()
+{
+	close(false);
+}
+
+void coproto::tests::LocalAsyncSocket_buffered_close_test()
+{
+	close(true);
+}
+
+void coproto::tests::parSendRecv(bool buffered)
 {
 	u64 trials = 1000;
 	u64 numOps = 20;
@@ -65,7 +101,7 @@ void coproto::tests::LocalAsyncSocket_parSendRecv_test()
 	for (u64 tt = 0; tt < trials; ++tt)
 	{
 
-		auto s = LocalAsyncSocket::makePair();
+		auto s = makePair(buffered);
 
 		auto f1 = [&](u64 idx) {
 			MC_BEGIN(task<void>, &ex, idx, &numOps, &s,
@@ -240,9 +276,8 @@ void coproto::tests::LocalAsyncSocket_cancellation_test()
 	}
 }
 
-void coproto::tests::LocalAsyncSocket_close_test()
+void coproto::tests::close(bool buffered)
 {
-
 	u64 trials = 2000;
 	macoro::thread_pool ex[4];
 	auto work0 = ex[0].make_work();
@@ -257,7 +292,7 @@ void coproto::tests::LocalAsyncSocket_close_test()
 	for (u64 tt = 0; tt < trials; ++tt)
 	{
 
-		auto s = LocalAsyncSocket::makePair();
+		auto s = makePair(buffered);
 		auto promise = std::promise<void>{};
 		auto fut = promise.get_future().share();
 		std::array<std::promise<void>, 4> proms;
@@ -328,3 +363,276 @@ void coproto::tests::LocalAsyncSocket_close_test()
 	}
 
 }
+
+void coproto::tests::LocalAsyncSocket_sendvRecvv_test()
+{
+	auto s = LocalAsyncSocket::makePair();
+
+	std::vector<u8> b0(3), b1(8), b2(13);
+	std::vector<u8> exp;
+	for (auto b : { &b0, &b1, &b2 })
+	{
+		for (auto& v : *b)
+			v = static_cast<u8>(exp.size() + 1);
+		exp.insert(exp.end(), b->begin(), b->end());
+	}
+
+	std::array<span<u8>, 3> sb{ { b0, b1, b2 } };
+	std::pair<error_code, u64> sr, rr0, rr1;
+
+	{
+		// vectored send and receive with a different split.
+		std::vector<u8> r0(5), r1(19);
+		std::array<span<u8>, 2> rb{ { r0, r1 } };
+
+		auto task_ = [&](bool sender) -> task<void> {
+			MC_BEGIN(task<>, &, sender);
+			if (sender)
+				MC_AWAIT_SET(sr, s[0].mSock->sendv(sb));
+			else
+				MC_AWAIT_SET(rr0, s[1].mSock->recvv(rb));
+			MC_END();
+			};
+
+		macoro::sync_wait(macoro::when_all_ready(task_(true), task_(false)));
+
+		if (sr.first || sr.second != exp.size())
+			throw MACORO_RTE_LOC;
+		if (rr0.first || rr0.second != exp.size())
+			throw MACORO_RTE_LOC;
+
+		r0.insert(r0.end(), r1.begin(), r1.end());
+		if (r0 != exp)
+			throw MACORO_RTE_LOC;
+	}
+
+	{
+		// vectored send matched by several regular receives.
+		std::vector<u8> r0(2), r1(exp.size() - 2);
+
+		auto task_ = [&](bool sender) -> task<void> {
+			MC_BEGIN(task<>, &, sender);
+			if (sender)
+				MC_AWAIT_SET(sr, s[0].mSock->sendv(sb));
+			else
+			{
+				MC_AWAIT_SET(rr0, s[1].mSock->recv(r0));
+				MC_AWAIT_SET(rr1, s[1].mSock->recv(r1));
+			}
+			MC_END();
+			};
+
+		macoro::sync_wait(macoro::when_all_ready(task_(true), task_(false)));
+
+		if (sr.first || sr.second != exp.size())
+			throw MACORO_RTE_LOC;
+		if (rr0.first || rr0.second != r0.size() || rr1.first || rr1.second != r1.size())
+			throw MACORO_RTE_LOC;
+
+		r0.insert(r0.end(), r1.begin(), r1.end());
+		if (r0 != exp)
+			throw MACORO_RTE_LOC;
+	}
+}
+
+void coproto::tests::LocalAsyncSocket_buffered_sendRecv_test()
+{
+	auto s = LocalAsyncSocket::makeBufferedPair(64);
+
+	// a send completes without a receive.
+	std::vector<u8> sb(10), rb(10);
+	sb[3] = 4;
+	auto r = macoro::sync_wait(s[0].mSock->send(sb));
+	if (r.first || r.second != sb.size())
+		throw MACORO_RTE_LOC;
+	r = macoro::sync_wait(s[1].mSock->recv(rb));
+	if (r.first || r.second != rb.size() || rb != sb)
+		throw MACORO_RTE_LOC;
+
+	// a partial receive takes what is buffered.
+	macoro::sync_wait(s[1].mSock->send(span<u8>(sb.data(), 5)));
+	r = macoro::sync_wait(s[0].mSock->recvSome(rb));
+	if (r.first || r.second != 5)
+		throw MACORO_RTE_LOC;
+
+	// many times the buffer size, on two threads.
+	std::vector<u8> lsb(1 << 20), lrb(lsb.size());
+	for (u64 i = 0; i < lsb.size(); ++i)
+		lsb[i] = static_cast<u8>(i * 31);
+	std::array<span<u8>, 2> sbs{ {
+		span<u8>(lsb.data(), 777),
+		span<u8>(lsb.data() + 777, lsb.size() - 777) } };
+	std::array<span<u8>, 2> rbs{ {
+		span<u8>(lrb.data(), 12345),
+		span<u8>(lrb.data() + 12345, lrb.size() - 12345) } };
+	auto fut = std::async([&] { return macoro::sync_wait(s[0].mSock->sendv(sbs)); });
+	auto r1 = macoro::sync_wait(s[1].mSock->recvv(rbs));
+	auto r0 = fut.get();
+	if (r0.first || r1.first || r0.second != lsb.size() || r1.second != lsb.size() || lsb != lrb)
+		throw MACORO_RTE_LOC;
+
+	// a protocol where both parties send before they receive. The
+	// sends are move-sends so that they do not wait for the data to be
+	// buffered, which would deadlock once the messages are larger than
+	// the buffer.
+	auto proto = [](Socket& sock) -> task<> {
+		for (u64 i = 0; i < 100; ++i)
+		{
+			std::vector<u64> v(i + 1, i), w;
+			co_await sock.send(std::vector<u64>(v));
+			co_await sock.recvResize(w);
+			if (v != w)
+				throw MACORO_RTE_LOC;
+		}
+		co_await sock.flush();
+	};
+	auto p0 = std::async([&] { macoro::sync_wait(proto(s[0])); });
+	macoro::sync_wait(proto(s[1]));
+	p0.get();
+
+	// buffered data is received after the remote closed.
+	macoro::sync_wait(s[0].mSock->send(sb));
+	s[0].mSock->close();
+	r = macoro::sync_wait(s[1].mSock->recv(rb));
+	if (r.first || rb != sb)
+		throw MACORO_RTE_LOC;
+	r = macoro::sync_wait(s[1].mSock->recv(rb));
+	if (r.first != code::remoteClosed)
+		throw MACORO_RTE_LOC;
+}
+
+void coproto::tests::LocalAsyncSocket_buffered_cancellation_test()
+{
+	auto s = LocalAsyncSocket::makeBufferedPair(64);
+
+	// a receive that has nothing to receive.
+	{
+		macoro::stop_source src;
+		std::vector<u8> rb(10);
+		auto fut = std::async([&] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			src.request_stop();
+			});
+		auto r = macoro::sync_wait(s[0].mSock->recv(rb, src.get_token()));
+		fut.get();
+		if (r.first != code::operation_aborted || r.second)
+			throw MACORO_RTE_LOC;
+	}
+
+	// a send that fills the buffer.
+	std::vector<u8> sb(1000);
+	for (u64 i = 0; i < sb.size(); ++i)
+		sb[i] = static_cast<u8>(i);
+	{
+		macoro::stop_source src;
+		auto fut = std::async([&] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			src.request_stop();
+			});
+		auto r = macoro::sync_wait(s[0].mSock->send(sb, src.get_token()));
+		fut.get();
+		if (r.first != code::operation_aborted || r.second != 64)
+			throw MACORO_RTE_LOC;
+	}
+
+	// the buffered part of the send is still received.
+	{
+		std::vector<u8> rb(64);
+		auto r = macoro::sync_wait(s[1].mSock->recv(rb));
+		if (r.first || !std::equal(rb.begin(), rb.end(), sb.begin()))
+			throw MACORO_RTE_LOC;
+	}
+
+	// already stopped.
+	{
+		macoro::stop_source src;
+		src.request_stop();
+		std::vector<u8> rb(10);
+		auto r = macoro::sync_wait(s[1].mSock->recv(rb, src.get_token()));
+		if (r.first != code::operation_aborted)
+			throw MACORO_RTE_LOC;
+	}
+}
+
+void coproto::tests::LocalAsyncSocket_ownedHandoff_test()
+{
+	for (auto buffered : { false, true })
+	{
+		auto s = makePair(buffered);
+		s[1].setRecvStashLimit(1 << 20);
+		std::array<Socket, 2> a{ s[0].fork(), s[1].fork() };
+		std::array<Socket, 2> b{ s[0].fork(), s[1].fork() };
+
+		std::vector<u8> v(1000), exp;
+		for (u64 i = 0; i < v.size(); ++i)
+			v[i] = static_cast<u8>(i * 7);
+		exp = v;
+
+		// a posted recv takes the vector of the sender.
+		auto ptr = v.data();
+		auto r = macoro::sync_wait(macoro::when_all_ready(
+			a[0].send(std::move(v)),
+			a[1].recv<std::vector<u8>>()));
+		std::get<0>(r).result();
+		auto w = std::get<1>(r).result();
+		if (w != exp || w.data() != ptr)
+			throw MACORO_RTE_LOC;
+
+		// the message on a is stashed and then handed to recvResize.
+		ptr = w.data();
+		macoro::sync_wait(a[0].send(std::move(w)));
+		macoro::sync_wait(b[0].send(std::vector<u8>(8, 2)));
+		std::vector<u8> rb;
+		macoro::sync_wait(b[1].recvResize(rb));
+		if (rb != std::vector<u8>(8, 2))
+			throw MACORO_RTE_LOC;
+		macoro::sync_wait(a[1].recvResize(rb));
+		if (rb != exp || rb.data() != ptr)
+			throw MACORO_RTE_LOC;
+
+		// other destinations get a copy.
+		std::vector<u8> fixed(exp.size());
+		std::array<u8, 10> arr;
+		macoro::sync_wait(a[0].send(std::move(rb)));
+		macoro::sync_wait(a[0].send(std::vector<u8>(exp.begin(), exp.begin() + arr.size())));
+		macoro::sync_wait(a[1].recv(fixed));
+		macoro::sync_wait(a[1].recv(arr));
+		if (fixed != exp || !std::equal(arr.begin(), arr.end(), exp.begin()))
+			throw MACORO_RTE_LOC;
+
+		// the body does not use the socket and is never chunked.
+		s[0].setSendChunkSize(100);
+		v = exp;
+		ptr = v.data();
+		macoro::sync_wait(a[0].send(std::move(v)));
+		w = macoro::sync_wait(a[1].recv<std::vector<u8>>());
+		if (w != exp || w.data() != ptr)
+			throw MACORO_RTE_LOC;
+
+		// vectors whose size does not fit the u32 header are not
+		// handed over and thus can still be sent in chunks.
+		u64 u32Max = std::numeric_limits<u32>::max();
+		if (!s[0].mImpl->isOwnedSend(u32Max - 1) ||
+			s[0].mImpl->isOwnedSend(u32Max) ||
+			s[0].mImpl->isOwnedSend(u32Max * 2))
+			throw MACORO_RTE_LOC;
+
+		// the wrong size fails as usual.
+		macoro::sync_wait(a[0].send(std::vector<u8>(3)));
+		bool threw = false;
+		try { macoro::sync_wait(a[1].recv(arr)); }
+		catch (BadReceiveBufferSize&) { threw = true; }
+		if (!threw)
+			throw MACORO_RTE_LOC;
+
+		if (s[1].bytesReceived() != s[0].bytesSent())
+			throw MACORO_RTE_LOC;
+
+		// a vector whose header was not sent is released on close.
+		s[0].mSock->sendOwned(std::vector<u8>(5));
+		macoro::sync_wait(s[0].close());
+		macoro::sync_wait(s[1].close());
+		if (s[1].mSock->mImpl->mOwned[1].size())
+			throw MACORO_RTE_LOC;
+	}
+}
@@ -17,6 +17,12 @@ namespace coproto
 		void LocalAsyncSocket_parSendRecv_test();
 		void LocalAsyncSocket_cancellation_test();
 		void LocalAsyncSocket_close_test();
+		void LocalAsyncSocket_sendvRecvv_test();
+		void LocalAsyncSocket_buffered_sendRecv_test();
+		void LocalAsyncSocket_buffered_parSendRecv_test();
+		void LocalAsyncSocket_buffered_cancellation_test();
+		void LocalAsyncSocket_buffered_close_test();
+		void LocalAsyncSocket_ownedHandoff_test();
 	}
 }
 
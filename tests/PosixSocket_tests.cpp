@@ -0,0 +1,152 @@
+#include "PosixSocket_tests.h"
+#include "coproto/Socket/PosixSocket.h"
+#include "Tests.h"
+#include "eval.h"
+#include <future>
+#include <thread>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+namespace coproto
+{
+	namespace tests
+	{
+#ifdef __linux__
+		void PosixSocket_Accept_test()
+		{
+			PosixReactor reactor;
+			std::string address("localhost:1212");
+
+			auto r = macoro::sync_wait(macoro::when_all_ready(
+				macoro::make_task(PosixAcceptor(address, reactor)),
+				macoro::make_task(PosixConnect(address, reactor))
+			));
+
+			std::array<Socket, 2> s{ std::get<0>(r).result(), std::get<1>(r).result() };
+
+			auto p = macoro::sync_wait(macoro::when_all_ready(
+				echoProto(s[0], 0),
+				echoProto(s[1], 1)
+			));
+			std::get<0>(p).result();
+			std::get<1>(p).result();
+		}
+
+		void PosixSocket_Accept_sCancel_test()
+		{
+			PosixReactor reactor;
+			PosixAcceptor a("localhost:1212", reactor);
+
+			macoro::stop_source src;
+			auto token = src.get_token();
+			std::thread thrd([&] {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				src.request_stop();
+				});
+
+			bool threw = false;
+			try {
+				auto s = macoro::sync_wait(macoro::make_task(a.accept(token)));
+			}
+			catch (std::system_error& e)
+			{
+				threw = e.code() == code::operation_aborted;
+			}
+			thrd.join();
+
+			if (!threw)
+				throw MACORO_RTE_LOC;
+		}
+
+		void PosixSocket_Accept_cCancel_test()
+		{
+			// nothing is listening. The connect retries
+			// until it is cancelled.
+			PosixReactor reactor;
+			macoro::stop_source src;
+			auto token = src.get_token();
+			std::thread thrd([&] {
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				src.request_stop();
+				});
+
+			bool threw = false;
+			try {
+				auto s = macoro::sync_wait(macoro::make_task(PosixConnect("localhost:1212", reactor, token)));
+			}
+			catch (std::system_error& e)
+			{
+				threw = e.code() == code::operation_aborted;
+			}
+			thrd.join();
+
+			if (!threw)
+				throw MACORO_RTE_LOC;
+
+			// without retry the connect fails immediately.
+			threw = false;
+			try {
+				auto s = macoro::sync_wait(macoro::make_task(PosixConnect("localhost:1212", reactor, {}, false)));
+			}
+			catch (std::system_error& e)
+			{
+				threw = e.code() == std::errc::connection_refused;
+			}
+			if (!threw)
+				throw MACORO_RTE_LOC;
+		}
+
+		void PosixSocket_sendRecv_test()
+		{
+			socketSendRecvTest([] { return PosixSocket::makePair(); });
+		}
+
+		void PosixSocket_largeSendRecv_test()
+		{
+			socketLargeSendRecvTest([] { return PosixSocket::makePair(); });
+		}
+
+		void PosixSocket_pipe_test()
+		{
+			int p0[2], p1[2];
+			if (::pipe(p0) || ::pipe(p1))
+				throw MACORO_RTE_LOC;
+
+			std::array<Socket, 2> s{
+				PosixSocket(p0[0], p1[1]),
+				PosixSocket(p1[0], p0[1]) };
+
+			auto p = macoro::sync_wait(macoro::when_all_ready(
+				echoProto(s[0], 0),
+				echoProto(s[1], 1)
+			));
+			std::get<0>(p).result();
+			std::get<1>(p).result();
+		}
+
+		void PosixSocket_cancellation_test()
+		{
+			socketCancellationTest([] { return PosixSocket::makePair(); });
+		}
+
+		void PosixSocket_close_test()
+		{
+			socketCloseTest([] { return PosixSocket::makePair(); });
+		}
+#else
+		namespace {
+			void skip() { throw UnitTestSkipped("Linux is required"); }
+		}
+		void PosixSocket_Accept_test() { skip(); }
+		void PosixSocket_Accept_sCancel_test() { skip(); }
+		void PosixSocket_Accept_cCancel_test() { skip(); }
+		void PosixSocket_sendRecv_test() { skip(); }
+		void PosixSocket_largeSendRecv_test() { skip(); }
+		void PosixSocket_pipe_test() { skip(); }
+		void PosixSocket_cancellation_test() { skip(); }
+		void PosixSocket_close_test() { skip(); }
+#endif
+	}
+}
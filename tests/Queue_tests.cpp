@@ -1,4 +1,5 @@
 #include "coproto/Common/Queue.h"
+#include "coproto/Socket/Executor.h"
 
 #include <list>
 #include <set>
@@ -144,6 +145,38 @@ namespace coproto
 			}
 		}
 
+		void CBQueue_test()
+		{
+			// grow the queue while it wraps around so that the
+			// items must be moved in order. Then grow it again.
+			internal::CBQueue<u64> q;
+			std::list<u64> l;
+			u64 next = 0;
+			auto push = [&](u64 n) {
+				for (u64 i = 0; i < n; ++i)
+				{
+					q.push_back(next);
+					l.push_back(next++);
+				}
+			};
+			auto pop = [&](u64 n) {
+				for (u64 i = 0; i < n; ++i)
+				{
+					if (q.size() != l.size() || q.pop_front() != l.front())
+						throw COPROTO_RTE;
+					l.pop_front();
+				}
+			};
 
+			push(5);
+			pop(3);
+			push(6);
+			push(1);
+			pop(4);
+			push(100);
+			pop(l.size());
+			if (q.size() || q)
+				throw COPROTO_RTE;
+		}
 	}
 }
@@ -0,0 +1,213 @@
+#include "ShmSocket_tests.h"
+#include "coproto/Socket/ShmSocket.h"
+#include "Tests.h"
+#include "eval.h"
+#include <future>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+namespace coproto
+{
+	namespace tests
+	{
+#ifdef __linux__
+		void ShmSocket_sendRecv_test()
+		{
+			socketSendRecvTest([] { return ShmSocket::makePair(); });
+		}
+
+		void ShmSocket_largeSendRecv_test()
+		{
+			// the message is many times larger than the ring.
+			socketLargeSendRecvTest([] { return ShmSocket::makePair(1 << 12); });
+		}
+
+		void ShmSocket_named_test()
+		{
+			auto name = "/coproto_shm_test_" + std::to_string(::getpid());
+
+			auto fut = std::async([&] {
+				auto c = shmConnect(name, false);
+				macoro::sync_wait(echoProto(c, 1));
+				});
+
+			auto srv = shmConnect(name, true, 1 << 14);
+			macoro::sync_wait(echoProto(srv, 0));
+			fut.get();
+
+			// open unlinked the name.
+			bool threw = false;
+			try { ShmSocket::open(name); }
+			catch (std::system_error&) { threw = true; }
+			if (!threw)
+				throw MACORO_RTE_LOC;
+
+			// a client that waits for a missing server can be stopped.
+			{
+				macoro::stop_source src;
+				auto fut = std::async([&] {
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+					src.request_stop();
+					});
+				error_code ec;
+				try { shmConnect(name, false, 1 << 20, src.get_token()); }
+				catch (std::system_error& e) { ec = e.code(); }
+				fut.get();
+				if (ec != code::operation_aborted)
+					throw MACORO_RTE_LOC;
+			}
+
+			// memory that is not a socket is reported instead of retried.
+			{
+				auto fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+				if (fd == -1)
+					throw MACORO_RTE_LOC;
+				std::vector<u8> junk(1 << 14, 0xff);
+				auto n = ::write(fd, junk.data(), junk.size());
+				::close(fd);
+
+				threw = false;
+				try { shmConnect(name, false); }
+				catch (std::system_error&) {}
+				catch (std::runtime_error&) { threw = true; }
+				::shm_unlink(name.c_str());
+				if (n != (i64)junk.size() || !threw)
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		void ShmSocket_sleep_test()
+		{
+			auto s = ShmSocket::makePair();
+
+			// the receiver's worker sleeps on the futex
+			// before the sender sends.
+			for (u64 t = 0; t < 10; ++t)
+			{
+				std::vector<u8> sb(100), rb(100);
+				sb[t] = 1;
+				auto fut = std::async([&] {
+					std::this_thread::sleep_for(std::chrono::milliseconds(5 + t));
+					return macoro::sync_wait(s[0].mSock->send(sb));
+					});
+				auto r = macoro::sync_wait(s[1].mSock->recv(rb));
+				if (fut.get().first || r.first || r.second != rb.size() || sb != rb)
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		void ShmSocket_cancellation_test()
+		{
+			socketCancellationTest([] { return ShmSocket::makePair(1 << 12); });
+
+			// a stopped send has filled the ring.
+			auto s = ShmSocket::makePair(1 << 12);
+			macoro::stop_source src;
+			std::vector<u8> sb(1 << 16);
+			auto fut = std::async([&] {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				src.request_stop();
+				});
+			auto r = macoro::sync_wait(s[0].mSock->send(sb, src.get_token()));
+			fut.get();
+			if (r.first != code::operation_aborted || r.second != 1 << 12)
+				throw MACORO_RTE_LOC;
+		}
+
+		void ShmSocket_close_test()
+		{
+			socketCloseTest([] { return ShmSocket::makePair(1 << 12); });
+
+			// sends to a closed peer fail as well.
+			auto s = ShmSocket::makePair(1 << 12);
+			std::vector<u8> sb(5);
+			macoro::sync_wait(s[0].mSock->close());
+			auto r = macoro::sync_wait(s[1].mSock->send(sb));
+			if (r.first != code::remoteClosed)
+				throw MACORO_RTE_LOC;
+		}
+
+		void ShmSocket_peerFailure_test()
+		{
+			// counters that the peer has corrupted fail the socket 
+			// instead of overrunning the ring.
+			{
+				auto s = ShmSocket::makePair(1 << 12);
+				auto& st = *s[0].mSock->mState;
+				st.mRecvRing->mHead.store(st.mLayout->mCapacity + 1);
+				std::vector<u8> b(5);
+				auto r = macoro::sync_wait(s[0].mSock->recv(b));
+				if (r.first != code::badCoprotoMessageHeader || r.second)
+					throw MACORO_RTE_LOC;
+				r = macoro::sync_wait(s[0].mSock->send(b));
+				if (r.first != code::badCoprotoMessageHeader)
+					throw MACORO_RTE_LOC;
+			}
+			{
+				auto s = ShmSocket::makePair(1 << 12);
+				auto& st = *s[0].mSock->mState;
+				st.mSendRing->mTail.store(5);
+				std::vector<u8> b(5);
+				auto r = macoro::sync_wait(s[0].mSock->send(b));
+				if (r.first != code::badCoprotoMessageHeader || r.second)
+					throw MACORO_RTE_LOC;
+			}
+
+			// as is a changed capacity. A mapping whose capacity is not
+			// valid can not be opened.
+			{
+				auto s = ShmSocket::makePair(1 << 12);
+				auto& st = *s[0].mSock->mState;
+				st.mLayout->mCapacity = st.mCapacity * 2;
+				std::vector<u8> b(5);
+				auto r = macoro::sync_wait(s[0].mSock->send(b));
+				if (r.first != code::badCoprotoMessageHeader || r.second)
+					throw MACORO_RTE_LOC;
+			}
+			for (u64 cap : { u64(0), u64(3000), u64(1) << 40 })
+			{
+				auto fd = ::memfd_create("coproto-shm-test", MFD_CLOEXEC);
+				auto fd1 = ::dup(fd);
+				if (fd == -1 || fd1 == -1)
+					throw MACORO_RTE_LOC;
+				ShmSocket s0(fd, 0, true, 1 << 12);
+				s0.mSock->mState->mLayout->mCapacity = cap;
+				bool threw = false;
+				try { ShmSocket s1(fd1, 1, false); }
+				catch (std::runtime_error&) { threw = true; }
+				if (!threw)
+					throw MACORO_RTE_LOC;
+			}
+
+			// a peer whose worker has stopped, e.g. crashed, fails the
+			// pending operations once its heartbeat times out. 
+			{
+				auto s = ShmSocket::makePair(1 << 12);
+				{
+					std::lock_guard<std::mutex> l(s[0].mSock->mState->mMtx);
+					s[0].mSock->mState->mPeerTimeout = std::chrono::milliseconds(200);
+				}
+				std::vector<u8> b(5);
+				std::unique_lock<std::mutex> l(s[1].mSock->mState->mMtx);
+				auto r = macoro::sync_wait(s[0].mSock->recv(b));
+				l.unlock();
+				if (r.first != code::remoteClosed)
+					throw MACORO_RTE_LOC;
+			}
+		}
+#else
+		namespace {
+			void skip() { throw UnitTestSkipped("ShmSocket requires linux"); }
+		}
+		void ShmSocket_sendRecv_test() { skip(); }
+		void ShmSocket_largeSendRecv_test() { skip(); }
+		void ShmSocket_named_test() { skip(); }
+		void ShmSocket_sleep_test() { skip(); }
+		void ShmSocket_cancellation_test() { skip(); }
+		void ShmSocket_close_test() { skip(); }
+		void ShmSocket_peerFailure_test() { skip(); }
+#endif
+	}
+}
@@ -2,6 +2,9 @@
 #include "coproto/Socket/LocalAsyncSock.h"
 #include "coproto/Socket/BufferingSocket.h"
 #include <vector>
+#include <array>
+#include <thread>
+#include <algorithm>
 #include "macoro/thread_pool.h"
 #include "tests/Tests.h"
 
@@ -47,7 +50,7 @@ namespace coproto
 			for (u64 i = 0; i < sendBuff.size(); ++i)
 				sendBuff[i] = i;
 
-			internal::RefSendAwaiter<std::vector<u8>> p(sImpl.get(), sender.mId, sendBuff, {});
+			internal::RefSendAwaiter<std::vector<u8>> p(sImpl.get(), sender.mFork, sendBuff, {});
 			bool sendDone = false;
 			auto sendTask = [](bool& sendDone) -> task<void>
 			{
@@ -57,7 +60,7 @@ namespace coproto
 				MC_END();
 			}(sendDone);
 
-			sImpl->send(sender.mId, p.getBuffer(), sendTask.handle(), {}).resume();
+			sImpl->send(sender.mFork, p.getBuffer(), sendTask.handle(), {}).resume();
 			if (sendDone)
 				throw MACORO_RTE_LOC;
 
@@ -122,7 +125,7 @@ namespace coproto
 			std::vector<u8> sendBuff;
 			std::vector<u8> recvBuffer;
 
-			internal::RefRecvAwaiter<std::vector<u8>, true> p(sImpl.get(), sender.mId, recvBuffer, {});
+			internal::RefRecvAwaiter<std::vector<u8>, true> p(sImpl.get(), sender.mFork, recvBuffer, {});
 			bool sendDone = false;
 			auto sendTask = [](bool& done) -> task<void>
 			{
@@ -141,7 +144,7 @@ namespace coproto
 				MC_END();
 			}(recvDone);
 
-			sImpl->recv(sender.mId, p.getBuffer(), recvTask.handle(), {}).resume();
+			sImpl->recv(sender.mFork, p.getBuffer(), recvTask.handle(), {}).resume();
 			if (sendDone)
 				throw MACORO_RTE_LOC;
 
@@ -210,13 +213,13 @@ namespace coproto
 
 			sImpl->enableLogging();
 
-			internal::RefSendAwaiter<std::vector<u8>> p0(sImpl.get(), sender.mId, sendBuff, {});
-			sImpl->send(sender.mId, p0.getBuffer(), sendTask0.handle(), src0.get_token()).resume();
+			internal::RefSendAwaiter<std::vector<u8>> p0(sImpl.get(), sender.mFork, sendBuff, {});
+			sImpl->send(sender.mFork, p0.getBuffer(), sendTask0.handle(), src0.get_token()).resume();
 			if (sendDone0)
 				throw MACORO_RTE_LOC;
 
-			internal::RefSendAwaiter<std::vector<u8>> p1(sImpl.get(), sender.mId, sendBuff, {});
-			sImpl->send(sender.mId, p1.getBuffer(), sendTask1.handle(), src1.get_token()).resume();
+			internal::RefSendAwaiter<std::vector<u8>> p1(sImpl.get(), sender.mFork, sendBuff, {});
+			sImpl->send(sender.mFork, p1.getBuffer(), sendTask1.handle(), src1.get_token()).resume();
 			if (sendDone1)
 				throw MACORO_RTE_LOC;
 
@@ -271,8 +274,8 @@ namespace coproto
 			for (u64 i = 0; i < recvBuff.size(); ++i)
 				recvBuff[i] = i;
 
-			internal::RefRecvAwaiter<std::vector<u8>> p0(sImpl.get(), recver.mId, recvBuff, {});
-			internal::RefRecvAwaiter<std::vector<u8>> p1(sImpl.get(), recver.mId, recvBuff, {});
+			internal::RefRecvAwaiter<std::vector<u8>> p0(sImpl.get(), recver.mFork, recvBuff, {});
+			internal::RefRecvAwaiter<std::vector<u8>> p1(sImpl.get(), recver.mFork, recvBuff, {});
 			auto tt = [](bool& done) -> task<void>
 			{
 				MC_BEGIN(task<>, &done);
@@ -290,10 +293,10 @@ namespace coproto
 			auto token0 = src0.get_token();
 			auto token1 = src1.get_token();
 
-			sImpl->recv(recver.mId, p0.getBuffer(), recvTask0.handle(), std::move(token0)).resume();
+			sImpl->recv(recver.mFork, p0.getBuffer(), recvTask0.handle(), std::move(token0)).resume();
 			if (recvDone0)
 				throw MACORO_RTE_LOC;
-			sImpl->recv(recver.mId, p1.getBuffer(), recvTask1.handle(), std::move(token1)).resume();
+			sImpl->recv(recver.mFork, p1.getBuffer(), recvTask1.handle(), std::move(token1)).resume();
 			if (recvDone1)
 				throw MACORO_RTE_LOC;
 
@@ -365,8 +368,8 @@ namespace coproto
 					sendBuff1[i] = i * 2;
 				}
 
-				internal::RefSendAwaiter<std::vector<u8>> p0(sImpl.get(), sender.mId, sendBuff0, {});
-				internal::RefSendAwaiter<std::vector<u8>> p1(sImpl.get(), sender.mId, sendBuff1, {});
+				internal::RefSendAwaiter<std::vector<u8>> p0(sImpl.get(), sender.mFork, sendBuff0, {});
+				internal::RefSendAwaiter<std::vector<u8>> p1(sImpl.get(), sender.mFork, sendBuff1, {});
 				auto tt = [](bool& done) -> task<void>
 				{
 					MC_BEGIN(task<>, &done);
@@ -386,10 +389,10 @@ namespace coproto
 				auto token0 = src0.get_token();
 				auto token1 = src1.get_token();
 
-				sImpl->send(sender.mId, p0.getBuffer(), sendTask0.handle(), std::move(token0)).resume();
+				sImpl->send(sender.mFork, p0.getBuffer(), sendTask0.handle(), std::move(token0)).resume();
 				if (sendDone0)
 					throw MACORO_RTE_LOC;
-				sImpl->send(sender.mId, p1.getBuffer(), sendTask1.handle(), std::move(token1)).resume();
+				sImpl->send(sender.mFork, p1.getBuffer(), sendTask1.handle(), std::move(token1)).resume();
 				if (sendDone1)
 					throw MACORO_RTE_LOC;
 
@@ -490,8 +493,8 @@ namespace coproto
 			//	macoro::stop_source src;
 			//	auto token = src.get_token();
 
-			//	internal::RefRecvAwaiter<std::vector<u8>, true> p0(sImpl.get(), sender.mId, recvBuffer0, {});
-			//	internal::RefRecvAwaiter<std::vector<u8>, true> p1(sImpl.get(), sender.mId, recvBuffer1, {});
+			//	internal::RefRecvAwaiter<std::vector<u8>, true> p0(sImpl.get(), sender.mFork, recvBuffer0, {});
+			//	internal::RefRecvAwaiter<std::vector<u8>, true> p1(sImpl.get(), sender.mFork, recvBuffer1, {});
 			//	auto tt = [](bool& done) -> task<void>
 			//	{
 			//		MC_BEGIN(task<>, &done);
@@ -509,8 +512,8 @@ namespace coproto
 			//	bool recvDone1 = false;
 			//	auto recvTask1 = tt(recvDone1);
 
-			//	sImpl->recv(sender.mId, p0.getBuffer(), recvTask0.handle(), std::move(token)).resume();
-			//	sImpl->recv(sender.mId, p1.getBuffer(), recvTask1.handle(), {}).resume();
+			//	sImpl->recv(sender.mFork, p0.getBuffer(), recvTask0.handle(), std::move(token)).resume();
+			//	sImpl->recv(sender.mFork, p1.getBuffer(), recvTask1.handle(), {}).resume();
 			//	if (recvDone0)
 			//		throw MACORO_RTE_LOC;
 
@@ -597,8 +600,8 @@ namespace coproto
 						sendBuff1[i] = i * 2;
 					}
 
-					internal::RefSendAwaiter<std::vector<u8>> p0(s[0].mImpl.get(), s[0].mId, sendBuff0, {});
-					internal::RefSendAwaiter<std::vector<u8>> p1(s[0].mImpl.get(), s[0].mId, sendBuff1, {});
+					internal::RefSendAwaiter<std::vector<u8>> p0(s[0].mImpl.get(), s[0].mFork, sendBuff0, {});
+					internal::RefSendAwaiter<std::vector<u8>> p1(s[0].mImpl.get(), s[0].mFork, sendBuff1, {});
 					auto tt = [](bool& done) -> task<void>
 					{
 						MC_BEGIN(task<>, &done);
@@ -616,10 +619,10 @@ namespace coproto
 
 					macoro::stop_source src0, src1;
 
-					s[0].mImpl->send(s[0].mId, p0.getBuffer(), sendTask0.handle(), src0.get_token()).resume();
+					s[0].mImpl->send(s[0].mFork, p0.getBuffer(), sendTask0.handle(), src0.get_token()).resume();
 					if (sendDone0)
 						throw MACORO_RTE_LOC;
-					s[0].mImpl->send(s[0].mId, p1.getBuffer(), sendTask1.handle(), src0.get_token()).resume();
+					s[0].mImpl->send(s[0].mFork, p1.getBuffer(), sendTask1.handle(), src0.get_token()).resume();
 					if (sendDone1)
 						throw MACORO_RTE_LOC;
 
@@ -698,8 +701,8 @@ namespace coproto
 					}
 
 					macoro::stop_source src0, src1;
-					internal::RefRecvAwaiter<std::vector<u8>> p0(s[0].mImpl.get(), s[0].mId, sendBuff0, src0.get_token());
-					internal::RefRecvAwaiter<std::vector<u8>> p1(s[0].mImpl.get(), s[0].mId, sendBuff1, src0.get_token());
+					internal::RefRecvAwaiter<std::vector<u8>> p0(s[0].mImpl.get(), s[0].mFork, sendBuff0, src0.get_token());
+					internal::RefRecvAwaiter<std::vector<u8>> p1(s[0].mImpl.get(), s[0].mFork, sendBuff1, src0.get_token());
 					auto tt = [](bool& done) -> task<void>
 					{
 						MC_BEGIN(task<>, &done);
@@ -715,10 +718,10 @@ namespace coproto
 					bool sendDone0 = false;
 					auto sendTask0 = tt(sendDone0);
 
-					s[0].mImpl->recv(s[0].mId, p0.getBuffer(), recvTask0.handle(), std::move(p0.mToken)).resume();
+					s[0].mImpl->recv(s[0].mFork, p0.getBuffer(), recvTask0.handle(), std::move(p0.mToken)).resume();
 					if (recvDone0)
 						throw MACORO_RTE_LOC;
-					s[0].mImpl->recv(s[0].mId, p1.getBuffer(), recvTask1.handle(), std::move(p1.mToken)).resume();
+					s[0].mImpl->recv(s[0].mFork, p1.getBuffer(), recvTask1.handle(), std::move(p1.mToken)).resume();
 					if (recvDone1)
 						throw MACORO_RTE_LOC;
 
@@ -1162,5 +1165,1886 @@ namespace coproto
 
 		}
 
+		void SocketScheduler_vectoredSend_test()
+		{
+			// BufferingSocket supports sendv. Each message, including the 
+			// header and fork initialization, should be sent in one operation.
+			std::array<BufferingSocket, 2> s;
+			auto& out = s[0].mSock->mOutboundBuffer_;
+
+			std::vector<u8> msg(14);
+			macoro::sync_wait(s[0].send(msg));
+
+			if (out.mData.size() != 1 ||
+				out.size() != sizeof(internal::Header) * 2 + sizeof(internal::ControlBlock) + msg.size())
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].send(msg));
+			if (out.mData.size() != 2 ||
+				out.mData.back().size() != sizeof(internal::Header) + msg.size())
+				throw MACORO_RTE_LOC;
+
+			std::vector<u8> r0(msg.size()), r1(msg.size());
+			auto t = macoro::make_blocking(
+				macoro::when_all_ready(s[1].recv(r0), s[1].recv(r1)));
+			BufferingSocket::exchangeMessages(s[0], s[1]);
+
+			auto r = t.get();
+			std::get<0>(r).result();
+			std::get<1>(r).result();
+
+			if (r0 != msg || r1 != msg)
+				throw MACORO_RTE_LOC;
+		}
+
+		namespace
+		{
+			// forwards to a LocalAsyncSocket::Sock and counts the 
+			// number of vectored sends and receives.
+			struct CountingSock
+			{
+				struct Counts
+				{
+					u64 mSendv = 0, mRecv = 0;
+
+					// the most buffers passed to a single sendv(...).
+					u64 mMaxBuffers = 0;
+				};
+
+				LocalAsyncSocket::Sock* mSock;
+				Counts* mCounts;
+
+				void close() { mSock->close(); }
+				auto send(span<u8> data, macoro::stop_token token = {}) { return mSock->send(data, std::move(token)); }
+				auto recv(span<u8> data, macoro::stop_token token = {})
+				{
+					++mCounts->mRecv;
+					return mSock->recv(data, std::move(token));
+				}
+				auto sendv(span<span<u8>> data, macoro::stop_token token = {})
+				{
+					++mCounts->mSendv;
+					mCounts->mMaxBuffers = std::max<u64>(mCounts->mMaxBuffers, data.size());
+					return mSock->sendv(data, std::move(token));
+				}
+				auto recvSome(span<u8> data, macoro::stop_token token = {})
+				{
+					++mCounts->mRecv;
+					return mSock->recvSome(data, std::move(token));
+				}
+			};
+		}
+
+		void SocketScheduler_batchSend_test()
+		{
+			// messages that are queued while a write is pending 
+			// should be combined into a single write.
+			auto state = std::make_shared<LocalAsyncSocket::SharedState>();
+			auto s0 = std::make_unique<LocalAsyncSocket::Sock>(0, state);
+			auto s1 = std::make_unique<LocalAsyncSocket::Sock>(1, state);
+			state->mSocks[0] = s0.get();
+			state->mSocks[1] = s1.get();
+
+			CountingSock::Counts counts;
+			auto& numSendv = counts.mSendv;
+			std::array<Socket, 2> s;
+			s[0] = makeSocket(CountingSock{ s0.get(), &counts });
+			s[1] = makeSocket(std::move(s1));
+
+			u64 numForks = 4, numMsgs = 64, batchMsgs = 7;
+			s[0].setSendBatchLimit(~0ull, batchMsgs * 2);
+			std::vector<Socket> f0(numForks), f1(numForks);
+			for (u64 i = 0; i < numForks; ++i)
+			{
+				f0[i] = s[0].fork();
+				f1[i] = s[1].fork();
+			}
+
+			// the first send will block until the other party 
+			// receives. The remaining sends are queued.
+			for (u64 i = 0; i < numMsgs; ++i)
+			{
+				std::vector<u64> msg(i + 1);
+				for (u64 j = 0; j < msg.size(); ++j)
+					msg[j] = i * 1000 + j;
+				macoro::sync_wait(f0[i % numForks].send(std::move(msg)));
+			}
+
+			if (numSendv != 1)
+				throw MACORO_RTE_LOC;
+
+			for (u64 i = 0; i < numMsgs; ++i)
+			{
+				std::vector<u64> msg(i + 1);
+				macoro::sync_wait(f1[i % numForks].recv(msg));
+				for (u64 j = 0; j < msg.size(); ++j)
+					if (msg[j] != i * 1000 + j)
+						throw MACORO_RTE_LOC;
+			}
+
+			macoro::sync_wait(s[0].flush());
+
+			// one write for the first message and then the 
+			// rest in batches of at most batchMsgs.
+			if (numSendv != 1 + (numMsgs - 1 + batchMsgs - 1) / batchMsgs)
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_batchBufferLimit_test()
+		{
+			// a gather send adds one buffer per container to the write. 
+			// The batch limit should count these. A cancelable send is 
+			// written on its own so that canceling it does not fail the 
+			// messages it would have been batched with.
+			auto state = std::make_shared<LocalAsyncSocket::SharedState>();
+			auto s0 = std::make_unique<LocalAsyncSocket::Sock>(0, state);
+			auto s1 = std::make_unique<LocalAsyncSocket::Sock>(1, state);
+			state->mSocks[0] = s0.get();
+			state->mSocks[1] = s1.get();
+
+			CountingSock::Counts counts;
+			std::array<Socket, 2> s;
+			s[0] = makeSocket(CountingSock{ s0.get(), &counts });
+			s[1] = makeSocket(std::move(s1));
+
+			// a gather send of three containers has four buffers, 
+			// the prefix and the containers.
+			s[0].setSendBatchLimit(~0ull, 4);
+			std::vector<u8> a(10, 1), b(20, 2), c(30, 3);
+			auto t = macoro::make_blocking(macoro::when_all_ready(
+				s[0].send(a, b, c), s[0].send(a, b, c), s[0].send(a, b, c)));
+
+			for (u64 i = 0; i < 3; ++i)
+			{
+				std::vector<u8> r;
+				macoro::sync_wait(s[1].recvResize(r));
+				if (r.size() != a.size() + b.size() + c.size() || r.back() != 3)
+					throw MACORO_RTE_LOC;
+			}
+			auto r = t.get();
+			std::get<0>(r).result();
+			std::get<1>(r).result();
+			std::get<2>(r).result();
+
+			if (counts.mMaxBuffers > 4 || counts.mSendv != 3)
+				throw MACORO_RTE_LOC;
+
+			// the first write blocks and the others are queued.
+			s[0].setSendBatchLimit(~0ull, 64);
+			macoro::stop_source src;
+			error_code ec;
+			macoro::sync_wait(s[0].send(std::vector<u8>(a)));
+			macoro::sync_wait(s[0].send(std::vector<u8>(b)));
+			auto sender = [&]() -> macoro::task<> {
+				try {
+					co_await s[0].send(c, src.get_token());
+				}
+				catch (std::system_error& e)
+				{
+					ec = e.code();
+				}
+			};
+			auto st = macoro::make_blocking(sender());
+
+			// b is now being written, without c.
+			std::vector<u8> ra(a.size()), rb(b.size()), rc(c.size());
+			macoro::sync_wait(s[1].recv(ra));
+			src.request_stop();
+			st.get();
+			if (ec != code::operation_aborted)
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[1].recv(rb));
+			macoro::sync_wait(s[0].send(c));
+			macoro::sync_wait(s[1].recv(rc));
+			if (ra != a || rb != b || rc != c)
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_readAhead_test()
+		{
+			// with read ahead enabled, many small messages should 
+			// be received with few reads.
+			auto state = std::make_shared<LocalAsyncSocket::SharedState>();
+			auto s0 = std::make_unique<LocalAsyncSocket::Sock>(0, state);
+			auto s1 = std::make_unique<LocalAsyncSocket::Sock>(1, state);
+			state->mSocks[0] = s0.get();
+			state->mSocks[1] = s1.get();
+
+			CountingSock::Counts counts;
+			std::array<Socket, 2> s;
+			s[0] = makeSocket(std::move(s0));
+			s[1] = makeSocket(CountingSock{ s1.get(), &counts });
+
+			u64 bufferSize = 1 << 12;
+			s[1].setReadAhead(bufferSize);
+
+			u64 numForks = 4, numMsgs = 64, largeIdx = 10;
+			std::vector<Socket> f0(numForks), f1(numForks);
+			for (u64 i = 0; i < numForks; ++i)
+			{
+				f0[i] = s[0].fork();
+				f1[i] = s[1].fork();
+			}
+
+			// one of the messages is larger than the read ahead buffer
+			// and is received directly into the user's buffer.
+			auto msgSize = [&](u64 i) { return i == largeIdx ? bufferSize : i + 1; };
+			for (u64 i = 0; i < numMsgs; ++i)
+			{
+				std::vector<u64> msg(msgSize(i));
+				for (u64 j = 0; j < msg.size(); ++j)
+					msg[j] = i * 10000 + j;
+				macoro::sync_wait(f0[i % numForks].send(std::move(msg)));
+			}
+
+			for (u64 i = 0; i < numMsgs; ++i)
+			{
+				std::vector<u64> msg(msgSize(i));
+				macoro::sync_wait(f1[i % numForks].recv(msg));
+				for (u64 j = 0; j < msg.size(); ++j)
+					if (msg[j] != i * 10000 + j)
+						throw MACORO_RTE_LOC;
+			}
+
+			macoro::sync_wait(s[0].flush());
+
+			if (s[1].bytesReceived() != s[0].bytesSent())
+				throw MACORO_RTE_LOC;
+
+			// without read ahead, each message requires at least two reads.
+			if (counts.mRecv >= numMsgs)
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_recvStash_test()
+		{
+			// a message for a fork without a pending recv 
+			// should not block the other forks.
+			auto s = LocalAsyncSocket::makePair();
+			s[1].setRecvStashLimit(1000);
+
+			std::array<Socket, 2> a{ s[0].fork(), s[1].fork() };
+			std::array<Socket, 2> b{ s[0].fork(), s[1].fork() };
+
+			auto makeMsg = [](u64 size, u8 v) { return std::vector<u8>(size, v); };
+
+			macoro::sync_wait(a[0].send(makeMsg(80, 1)));
+			macoro::sync_wait(b[0].send(makeMsg(8, 2)));
+
+			// the message on a is stashed.
+			std::vector<u8> r0(80), r1(80), r2(8);
+			macoro::sync_wait(b[1].recv(r2));
+			if (r2 != makeMsg(8, 2))
+				throw MACORO_RTE_LOC;
+
+			// and is received from the stash.
+			macoro::sync_wait(a[1].recv(r0));
+			if (r0 != makeMsg(80, 1))
+				throw MACORO_RTE_LOC;
+
+			// the second message on a does not fit in the
+			// stash. b must wait for the recv on a.
+			s[1].setRecvStashLimit(100);
+			macoro::sync_wait(a[0].send(makeMsg(80, 3)));
+			macoro::sync_wait(a[0].send(makeMsg(80, 4)));
+			macoro::sync_wait(b[0].send(makeMsg(8, 5)));
+
+			auto t = macoro::make_blocking(macoro::when_all_ready(
+				b[1].recv(r2), a[1].recv(r0), a[1].recv(r1)));
+			auto r = t.get();
+			std::get<0>(r).result();
+			std::get<1>(r).result();
+			std::get<2>(r).result();
+
+			if (r0 != makeMsg(80, 3) ||
+				r1 != makeMsg(80, 4) ||
+				r2 != makeMsg(8, 5))
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].flush());
+			if (s[1].bytesReceived() != s[0].bytesSent())
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+
+			// a failure while a message is received into the stash 
+			// gives its bytes and buffer back.
+			BufferingSocket sock;
+			sock.setRecvStashLimit(1000);
+			auto f = sock.fork();
+
+			std::vector<u8> buffer;
+			auto root = SessionID::root();
+			push(u32(0), buffer);
+			push(u32(0), buffer);
+			push(root.mVal[0], buffer);
+			push(root.mVal[1], buffer);
+			push(u32(10), buffer);
+			push(u32(0), buffer);
+			buffer.resize(buffer.size() + 5);
+
+			auto task = macoro::make_blocking(f.recv(r2));
+			sock.processInbound(buffer);
+			if (sock.mFork->mStashBytes != 10)
+				throw MACORO_RTE_LOC;
+
+			sock.setError(code::ioError);
+			bool threw = false;
+			try { task.get(); }
+			catch (std::system_error&) { threw = true; }
+			if (!threw || 
+				sock.mFork->mStashBytes != 0 || 
+				sock.mImpl->mStashBuffer.size() ||
+				sock.mImpl->mBufferPool->size() != 1)
+				throw MACORO_RTE_LOC;
+
+			// a reused buffer keeps its contents.
+			BufferPool pool;
+			auto v = pool.acquire(10);
+			v[7] = 42;
+			pool.release(std::move(v));
+			v = pool.acquire(8);
+			if (v.size() != 8 || v[7] != 42)
+				throw MACORO_RTE_LOC;
+		}
+
+		void SocketScheduler_sendBackpressure_test()
+		{
+			// move-sends should suspend once the high water mark is 
+			// exceeded and resume once the queue has drained.
+			for (auto perFork : { false, true })
+			{
+				auto s = LocalAsyncSocket::makePair();
+				std::array<Socket, 2> f{ s[0].fork(), s[1].fork() };
+
+				u64 msgSize = 40, highWater = 100, lowWater = 50, numMsgs = 10;
+				if (perFork)
+					f[0].setForkSendBufferLimit(highWater, lowWater);
+				else
+					s[0].setSendBufferLimit(highWater, lowWater);
+
+				u64 numSent = 0;
+				auto sender = [&]() -> macoro::task<> {
+					for (u64 i = 0; i < numMsgs; ++i)
+					{
+						co_await f[0].send(std::vector<u8>(msgSize, i));
+						++numSent;
+					}
+				};
+				auto t = macoro::make_blocking(sender());
+
+				// the third message exceeds the limit.
+				u64 maxQueued = highWater / msgSize;
+				if (numSent != maxQueued)
+					throw MACORO_RTE_LOC;
+
+				for (u64 i = 0; i < numMsgs; ++i)
+				{
+					std::vector<u8> msg(msgSize);
+					macoro::sync_wait(f[1].recv(msg));
+					if (msg != std::vector<u8>(msgSize, i))
+						throw MACORO_RTE_LOC;
+
+					if (numSent > i + 1 + maxQueued)
+						throw MACORO_RTE_LOC;
+				}
+
+				t.get();
+				if (numSent != numMsgs)
+					throw MACORO_RTE_LOC;
+
+				macoro::sync_wait(s[0].flush());
+				macoro::sync_wait(s[0].close());
+				macoro::sync_wait(s[1].close());
+			}
+
+			{
+				// a move-send that waits for the queue to drain is resumed
+				// with operation_aborted once its stop token is triggered.
+				auto s = LocalAsyncSocket::makePair();
+				u64 msgSize = 40, highWater = 100, lowWater = 50, maxQueued = 2;
+				s[0].setSendBufferLimit(highWater, lowWater);
+
+				macoro::stop_source src;
+				error_code ec;
+				u64 numSent = 0;
+				auto sender = [&]() -> macoro::task<> {
+					try {
+						for (u64 i = 0; i <= maxQueued; ++i)
+						{
+							auto token = i == maxQueued ? src.get_token() : macoro::stop_token{};
+							co_await s[0].send(std::vector<u8>(msgSize, i), std::move(token));
+							++numSent;
+						}
+					}
+					catch (std::system_error& e)
+					{
+						ec = e.code();
+					}
+				};
+				auto t = macoro::make_blocking(sender());
+				if (numSent != maxQueued || ec)
+					throw MACORO_RTE_LOC;
+
+				src.request_stop();
+				t.get();
+				if (numSent != maxQueued || ec != code::operation_aborted)
+					throw MACORO_RTE_LOC;
+
+				macoro::sync_wait(s[0].close());
+				macoro::sync_wait(s[1].close());
+			}
+
+			{
+				// a token that is already stopped aborts the wait 
+				// without suspending the sender.
+				auto s = LocalAsyncSocket::makePair();
+				u64 msgSize = 40, highWater = 100, lowWater = 50, maxQueued = 2;
+				s[0].setSendBufferLimit(highWater, lowWater);
+				for (u64 i = 0; i < maxQueued; ++i)
+					macoro::sync_wait(s[0].send(std::vector<u8>(msgSize, i)));
+
+				macoro::stop_source src;
+				src.request_stop();
+				error_code ec;
+				try {
+					macoro::sync_wait(s[0].send(std::vector<u8>(msgSize, 2), src.get_token()));
+				}
+				catch (std::system_error& e)
+				{
+					ec = e.code();
+				}
+				if (ec != code::operation_aborted)
+					throw MACORO_RTE_LOC;
+
+				// the queued messages still arrive.
+				for (u64 i = 0; i < maxQueued; ++i)
+				{
+					std::vector<u8> msg(msgSize);
+					macoro::sync_wait(s[1].recv(msg));
+					if (msg != std::vector<u8>(msgSize, i))
+						throw MACORO_RTE_LOC;
+				}
+
+				macoro::sync_wait(s[0].close());
+				macoro::sync_wait(s[1].close());
+			}
+		}
+
+		void SocketScheduler_chunkedSend_test()
+		{
+			// a large message should be sent in chunks so 
+			// that the small messages of other forks are not 
+			// delayed until it has been sent.
+			auto s = LocalAsyncSocket::makePair();
+			u64 chunkSize = 100, bigSize = 1000, numSmall = 3;
+			s[0].setSendChunkSize(chunkSize);
+
+			std::array<Socket, 2> a{ s[0].fork(), s[1].fork() };
+			std::array<Socket, 2> b{ s[0].fork(), s[1].fork() };
+
+			std::vector<u8> big(bigSize);
+			for (u64 i = 0; i < big.size(); ++i)
+				big[i] = static_cast<u8>(i);
+
+			// a std::vector<u8> would be handed over without being
+			// chunked, see LocalAsyncSocket_ownedHandoff_test.
+			macoro::sync_wait(a[0].send(std::vector<i8>(big.begin(), big.end())));
+			for (u64 i = 0; i < numSmall; ++i)
+				macoro::sync_wait(b[0].send(std::vector<u8>(8, static_cast<u8>(i))));
+
+			std::vector<u64> order;
+			auto recvOne = [&](Socket& sock, std::vector<u8>& msg, u64 id) -> macoro::task<> {
+				co_await sock.recv(msg);
+				order.push_back(id);
+			};
+
+			std::vector<u8> bigRecv(bigSize);
+			std::vector<std::vector<u8>> small(numSmall, std::vector<u8>(8));
+			auto r = macoro::sync_wait(macoro::when_all_ready(
+				recvOne(a[1], bigRecv, 0),
+				recvOne(b[1], small[0], 1),
+				recvOne(b[1], small[1], 2),
+				recvOne(b[1], small[2], 3)));
+			std::get<0>(r).result();
+			std::get<1>(r).result();
+			std::get<2>(r).result();
+			std::get<3>(r).result();
+
+			// the small messages arrive before the large one is done.
+			if (order != std::vector<u64>{ 1, 2, 3, 0 })
+				throw MACORO_RTE_LOC;
+			if (bigRecv != big)
+				throw MACORO_RTE_LOC;
+			for (u64 i = 0; i < numSmall; ++i)
+				if (small[i] != std::vector<u8>(8, static_cast<u8>(i)))
+					throw MACORO_RTE_LOC;
+
+			// a canceled send is aborted after the chunks
+			// that have been sent. The receiver is notified.
+			macoro::stop_source src;
+			auto sendTask = [&]() -> macoro::task<error_code> {
+				try {
+					co_await a[0].send(big, src.get_token());
+				}
+				catch (std::system_error& e) {
+					co_return e.code();
+				}
+				co_return error_code{};
+			};
+			auto recvTask = [&]() -> macoro::task<error_code> {
+				try {
+					co_await a[1].recv(bigRecv);
+				}
+				catch (std::system_error& e) {
+					co_return e.code();
+				}
+				co_return error_code{};
+			};
+
+			auto st = macoro::make_blocking(sendTask());
+			src.request_stop();
+			auto rt = macoro::make_blocking(recvTask());
+			if (st.get() != code::operation_aborted)
+				throw MACORO_RTE_LOC;
+			if (rt.get() != code::remoteCancel)
+				throw MACORO_RTE_LOC;
+
+			// the socket can still be used.
+			macoro::sync_wait(a[0].send(std::vector<u8>(8, 42)));
+			macoro::sync_wait(a[1].recv(small[0]));
+			if (small[0] != std::vector<u8>(8, 42))
+				throw MACORO_RTE_LOC;
+
+			// with the stash enabled, the chunks of a message whose recv
+			// has not been posted are stashed. An aborted message is 
+			// dropped from the stash.
+			s[1].setRecvStashLimit(bigSize);
+			src = {};
+			st = macoro::make_blocking(sendTask());
+			src.request_stop();
+			macoro::sync_wait(b[0].send(std::vector<u8>(8, 43)));
+			macoro::sync_wait(b[1].recv(small[0]));
+			if (small[0] != std::vector<u8>(8, 43))
+				throw MACORO_RTE_LOC;
+
+			// the receiver can await b before a. This requires
+			// the aborted chunks to have left the stash.
+			macoro::sync_wait(a[0].send(std::vector<i8>(big.begin(), big.end())));
+			macoro::sync_wait(b[0].send(std::vector<u8>(8, 44)));
+			macoro::sync_wait(b[1].recv(small[0]));
+			if (st.get() != code::operation_aborted ||
+				small[0] != std::vector<u8>(8, 44))
+				throw MACORO_RTE_LOC;
+			macoro::sync_wait(a[1].recv(bigRecv));
+			if (bigRecv != big)
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].flush());
+			if (s[1].bytesReceived() != s[0].bytesSent())
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_sendPriority_test()
+		{
+			// the forks of each priority take turns. A fork with priority 
+			// one should send twice as much per turn as one with priority 
+			// zero, which is not starved.
+			auto s = LocalAsyncSocket::makePair();
+			s[0].setSendBatchLimit(~0ull, 2);
+
+			std::array<Socket, 2> bulk{ s[0].fork(), s[1].fork() };
+			std::array<Socket, 2> ctrl{ s[0].fork(), s[1].fork() };
+			ctrl[0].setPriority(1);
+
+			// each message costs the quantum of priority zero.
+			u64 size = s[0].mImpl->mSendQuantum - sizeof(internal::Header);
+
+			// the first message is sent immediately, the rest are queued.
+			u64 numMsgs = 4, ctrlId = 10;
+			macoro::sync_wait(bulk[0].send(std::vector<u8>(8, 0)));
+			for (u64 i = 1; i <= numMsgs; ++i)
+				macoro::sync_wait(bulk[0].send(std::vector<u8>(size, static_cast<u8>(i))));
+			for (u64 i = 0; i < numMsgs; ++i)
+				macoro::sync_wait(ctrl[0].send(std::vector<u8>(size, static_cast<u8>(ctrlId + i))));
+
+			std::vector<u64> order;
+			auto recvOne = [&](Socket& sock, u64 id) -> macoro::task<> {
+				std::vector<u8> msg(id ? size : 8);
+				co_await sock.recv(msg);
+				if (msg != std::vector<u8>(msg.size(), static_cast<u8>(id)))
+					throw MACORO_RTE_LOC;
+				order.push_back(id);
+			};
+
+			auto r = macoro::sync_wait(macoro::when_all_ready(
+				recvOne(ctrl[1], ctrlId + 0),
+				recvOne(ctrl[1], ctrlId + 1),
+				recvOne(ctrl[1], ctrlId + 2),
+				recvOne(ctrl[1], ctrlId + 3),
+				recvOne(bulk[1], 0),
+				recvOne(bulk[1], 1),
+				recvOne(bulk[1], 2),
+				recvOne(bulk[1], 3),
+				recvOne(bulk[1], 4)));
+			std::get<0>(r).result();
+			std::get<1>(r).result();
+			std::get<2>(r).result();
+			std::get<3>(r).result();
+			std::get<4>(r).result();
+			std::get<5>(r).result();
+			std::get<6>(r).result();
+			std::get<7>(r).result();
+			std::get<8>(r).result();
+
+			if (order != std::vector<u64>{ 0, 1, 10, 11, 2, 12, 13, 3, 4 })
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].flush());
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_stream_test()
+		{
+			// a stream of unknown size should be received 
+			// in the chunks that it was written in.
+			auto s = LocalAsyncSocket::makePair();
+			u64 numChunks = 10;
+			std::vector<u8> sent, recvd;
+
+			auto sender = [&]() -> macoro::task<u64> {
+				auto w = s[0].sendStream();
+				for (u64 i = 0; i < numChunks; ++i)
+				{
+					std::vector<u8> chunk(i * 100 + 1, static_cast<u8>(i));
+					co_await w.write(chunk);
+					sent.insert(sent.end(), chunk.begin(), chunk.end());
+				}
+				co_await w.finish();
+				co_return w.size();
+			};
+
+			auto recver = [&]() -> macoro::task<u64> {
+				auto r = s[1].recvStream();
+				std::vector<u8> chunk;
+				u64 i = 0;
+				while (co_await r.read(chunk))
+				{
+					if (chunk != std::vector<u8>(i * 100 + 1, static_cast<u8>(i)))
+						throw MACORO_RTE_LOC;
+					recvd.insert(recvd.end(), chunk.begin(), chunk.end());
+					++i;
+				}
+				if (i != numChunks || !r.finished() || 
+					co_await r.read(chunk) || chunk.size())
+					throw MACORO_RTE_LOC;
+				co_return r.size();
+			};
+
+			auto r = macoro::sync_wait(macoro::when_all_ready(sender(), recver()));
+			auto sentSize = std::get<0>(r).result();
+			auto recvdSize = std::get<1>(r).result();
+			if (sent != recvd || sentSize != sent.size() || recvdSize != sent.size())
+				throw MACORO_RTE_LOC;
+
+			// each write is one message and the end is one meta message.
+			// The first message also initializes the fork.
+			u64 header = 8, meta = 24;
+			macoro::sync_wait(s[0].flush());
+			if (s[0].bytesSent() != meta + numChunks * header + sent.size() + meta)
+				throw MACORO_RTE_LOC;
+
+			// the socket can be used as normal afterwards.
+			macoro::sync_wait(s[0].send(std::vector<u8>(8, 42)));
+			std::vector<u8> msg(8);
+			macoro::sync_wait(s[1].recv(msg));
+			if (msg != std::vector<u8>(8, 42))
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].flush());
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_recvLease_test()
+		{
+			// recv<BufferLease>() should reuse the memory 
+			// of leases that have been destroyed.
+			auto s = LocalAsyncSocket::makePair();
+			if (s[1].mImpl->mBufferPool)
+				throw MACORO_RTE_LOC;
+			auto& pool = *s[1].mImpl->leasePool();
+
+			auto makeMsg = [](u64 size, u8 v) { return std::vector<u8>(size, v); };
+			auto check = [](BufferLease& l, const std::vector<u8>& m) {
+				if (l.size() != m.size() ||
+					std::memcmp(l.data(), m.data(), m.size()))
+					throw MACORO_RTE_LOC;
+			};
+
+			macoro::sync_wait(s[0].send(makeMsg(100, 1)));
+			macoro::sync_wait(s[0].send(makeMsg(100, 2)));
+			macoro::sync_wait(s[0].send(makeMsg(1000, 3)));
+
+			u8* ptr = nullptr;
+			{
+				auto lease = macoro::sync_wait(s[1].recv<BufferLease>());
+				check(lease, makeMsg(100, 1));
+				ptr = lease.data();
+				if (pool.size() != 0)
+					throw MACORO_RTE_LOC;
+			}
+			if (pool.size() != 1)
+				throw MACORO_RTE_LOC;
+
+			// the same size class reuses the block.
+			auto lease = macoro::sync_wait(s[1].recv<BufferLease>());
+			check(lease, makeMsg(100, 2));
+			if (lease.data() != ptr || pool.size() != 0)
+				throw MACORO_RTE_LOC;
+
+			// a lease can outlive the socket.
+			auto lease2 = macoro::sync_wait(s[1].recv<BufferLease>());
+			check(lease2, makeMsg(1000, 3));
+
+			macoro::sync_wait(s[0].flush());
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+			s = {};
+
+			check(lease2, makeMsg(1000, 3));
+
+			// the pool retains at most the given number of bytes.
+			BufferPool small(200);
+			small.releaseBlock(BufferPool::sizeClass(100), small.acquireBlock(BufferPool::sizeClass(100)));
+			small.release(std::vector<u8>(100));
+			if (small.size() != 1 || small.freeBytes() != 128)
+				throw MACORO_RTE_LOC;
+
+			if (BufferPool::sizeClass(1ull << 63) != BufferPool::mNumClasses - 1)
+				throw MACORO_RTE_LOC;
+			bool threw = false;
+			try { BufferPool::sizeClass((1ull << 63) + 1); }
+			catch (std::bad_alloc&) { threw = true; }
+			if (!threw)
+				throw MACORO_RTE_LOC;
+		}
+
+		void SocketScheduler_recvBuffer_test()
+		{
+			// recvResize into a Buffer should give aligned memory
+			// and reuse the capacity for smaller messages.
+			auto s = LocalAsyncSocket::makePair();
+
+			std::vector<u64> m0(1000), m1(10);
+			for (u64 i = 0; i < m0.size(); ++i)
+				m0[i] = i * 31;
+			for (u64 i = 0; i < m1.size(); ++i)
+				m1[i] = i * 7;
+			macoro::sync_wait(s[0].send(std::vector<u64>(m0)));
+			macoro::sync_wait(s[0].send(std::vector<u64>(m1)));
+
+			Buffer<u64> r;
+			macoro::sync_wait(s[1].recvResize(r));
+			if (r.size() != m0.size() ||
+				std::memcmp(r.data(), m0.data(), m0.size() * sizeof(u64)) ||
+				(std::size_t)r.data() % Buffer<u64>::alignment)
+				throw MACORO_RTE_LOC;
+
+			auto ptr = r.data();
+			macoro::sync_wait(s[1].recvResize(r));
+			if (r.size() != m1.size() ||
+				std::memcmp(r.data(), m1.data(), m1.size() * sizeof(u64)) ||
+				r.data() != ptr ||
+				r.capacity() != m0.size())
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].flush());
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_gatherScatter_test()
+		{
+			// several buffers can be sent and received as one message.
+			auto s = LocalAsyncSocket::makePair();
+
+			struct Head { u64 a; u32 b, c; };
+			Head h{ 1, 2, 3 };
+			std::vector<u8> v0(30), v1(1000);
+			for (u64 i = 0; i < v0.size(); ++i)
+				v0[i] = static_cast<u8>(i);
+			for (u64 i = 0; i < v1.size(); ++i)
+				v1[i] = static_cast<u8>(i * 3);
+
+			std::vector<u8> concat(sizeof(Head));
+			std::memcpy(concat.data(), &h, sizeof(Head));
+			concat.insert(concat.end(), v0.begin(), v0.end());
+			concat.insert(concat.end(), v1.begin(), v1.end());
+
+			// two buffers fit in the inline storage of a send.
+			internal::InlinePoly<internal::SendBuffer, 8 * sizeof(u64)> poly(
+				internal::RefSendBuffers<2>(nullptr, v0, v1));
+			if (poly.isStoredInline() == false)
+				throw MACORO_RTE_LOC;
+
+			auto check = [&](Head& h2, std::vector<u8>& r0, std::vector<u8>& r1) {
+				if (h2.a != h.a || h2.b != h.b || h2.c != h.c || r0 != v0 || r1 != v1)
+					throw MACORO_RTE_LOC;
+			};
+
+			auto sender = [&]() -> macoro::task<> {
+				co_await s[0].send(h, v0, v1);
+				co_await s[0].send(h, v0, v1);
+
+				// the chunks straddle the buffers.
+				s[0].setSendChunkSize(100);
+				co_await s[0].send(h, v0, v1);
+			};
+
+			auto recver = [&]() -> macoro::task<> {
+				Head h2;
+				std::vector<u8> r0(v0.size()), r1(v1.size());
+				co_await s[1].recv(h2, r0, r1);
+				check(h2, r0, r1);
+
+				// a gather send is an ordinary message.
+				std::vector<u8> all;
+				co_await s[1].recvResize(all);
+				if (all != concat)
+					throw MACORO_RTE_LOC;
+
+				h2 = {};
+				r0.assign(r0.size(), 0);
+				r1.assign(r1.size(), 0);
+				co_await s[1].recv(h2, r0, r1);
+				check(h2, r0, r1);
+			};
+
+			auto r = macoro::sync_wait(macoro::when_all_ready(sender(), recver()));
+			std::get<0>(r).result();
+			std::get<1>(r).result();
+
+			// a scatter recv of an ordinary message.
+			macoro::sync_wait(s[0].send(std::vector<u8>(concat)));
+			Head h2;
+			std::vector<u8> r0(v0.size()), r1(v1.size());
+			macoro::sync_wait(s[1].recv(h2, r0, r1));
+			check(h2, r0, r1);
+
+			// the buffers must add up to the message size.
+			macoro::sync_wait(s[0].send(std::vector<u8>(concat)));
+			r1.pop_back();
+			bool threw = false;
+			try { macoro::sync_wait(s[1].recv(h2, r0, r1)); }
+			catch (BadReceiveBufferSize&) { threw = true; }
+			if (!threw)
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_cork_test()
+		{
+			// messages sent while corked should be written
+			// together once the socket is uncorked.
+			auto state = std::make_shared<LocalAsyncSocket::SharedState>();
+			auto s0 = std::make_unique<LocalAsyncSocket::Sock>(0, state);
+			auto s1 = std::make_unique<LocalAsyncSocket::Sock>(1, state);
+			state->mSocks[0] = s0.get();
+			state->mSocks[1] = s1.get();
+
+			CountingSock::Counts counts;
+			auto& numSendv = counts.mSendv;
+			std::array<Socket, 2> s;
+			s[0] = makeSocket(CountingSock{ s0.get(), &counts });
+			s[1] = makeSocket(std::move(s1));
+
+			u64 numForks = 3, numMsgs = 10;
+			std::vector<Socket> f0(numForks), f1(numForks);
+			for (u64 i = 0; i < numForks; ++i)
+			{
+				f0[i] = s[0].fork();
+				f1[i] = s[1].fork();
+			}
+
+			auto sendRound = [&](u64 round) {
+				for (u64 i = 0; i < numMsgs; ++i)
+					macoro::sync_wait(f0[i % numForks].send(std::vector<u64>(i + 1, round * 1000 + i)));
+			};
+			auto recvRound = [&](u64 round) {
+				for (u64 i = 0; i < numMsgs; ++i)
+				{
+					std::vector<u64> msg(i + 1);
+					macoro::sync_wait(f1[i % numForks].recv(msg));
+					if (msg != std::vector<u64>(i + 1, round * 1000 + i))
+						throw MACORO_RTE_LOC;
+				}
+			};
+
+			s[0].cork();
+			sendRound(0);
+			if (numSendv != 0 || s[0].bytesSent() != 0)
+				throw MACORO_RTE_LOC;
+			s[0].uncork();
+			if (numSendv != 1)
+				throw MACORO_RTE_LOC;
+			recvRound(0);
+
+			{
+				// nested corks are released by the last uncork.
+				auto batch = s[0].batch();
+				s[0].cork();
+				sendRound(1);
+				s[0].uncork();
+				if (numSendv != 1)
+					throw MACORO_RTE_LOC;
+			}
+			if (numSendv != 2)
+				throw MACORO_RTE_LOC;
+			recvRound(1);
+
+			macoro::sync_wait(s[0].flush());
+			if (numSendv != 2)
+				throw MACORO_RTE_LOC;
+
+			{
+				// reference sends complete while corked. Their message is
+				// copied so the caller can change the buffer.
+				auto batch = s[0].batch();
+				std::vector<u64> a(3, 7), b(2, 8);
+				macoro::sync_wait(f0[0].send(a));
+				macoro::sync_wait(f0[1].send(a, b));
+				a.assign(3, 0);
+				b.assign(2, 0);
+
+				// a move-send over the send buffer limit does not wait 
+				// for the queue to drain while corked.
+				s[0].setSendBufferLimit(1, 1);
+				macoro::sync_wait(f0[2].send(std::vector<u64>(4, 9)));
+				if (numSendv != 2)
+					throw MACORO_RTE_LOC;
+			}
+			s[0].setSendBufferLimit(0, 0);
+			std::vector<u64> a(3), ab(5), c;
+			macoro::sync_wait(f1[0].recv(a));
+			macoro::sync_wait(f1[1].recv(ab));
+			macoro::sync_wait(f1[2].recvResize(c));
+			if (a != std::vector<u64>(3, 7) ||
+				ab != std::vector<u64>{ 7, 7, 7, 8, 8 } ||
+				c != std::vector<u64>(4, 9))
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_corkClose_test()
+		{
+			// a send by reference completes while corked. If the socket 
+			// is closed before it is written, the next flush of its fork 
+			// and of the socket should report the error, once.
+			auto s = LocalAsyncSocket::makePair();
+			auto f = s[0].fork();
+			auto g = s[0].fork();
+
+			s[0].cork();
+			std::vector<u64> a(3, 7);
+			macoro::sync_wait(f.send(a));
+			macoro::sync_wait(g.send(std::vector<u64>(2, 8)));
+			macoro::sync_wait(s[0].close());
+			s[0].uncork();
+
+			auto flushError = [](auto&& flush) {
+				try { macoro::sync_wait(std::move(flush)); }
+				catch (std::system_error& e) { return e.code(); }
+				return error_code{};
+			};
+
+			if (flushError(f.flushFork()) != code::closed)
+				throw MACORO_RTE_LOC;
+			if (flushError(f.flushFork()))
+				throw MACORO_RTE_LOC;
+
+			// the move-send of g was not detached.
+			if (flushError(g.flushFork()))
+				throw MACORO_RTE_LOC;
+
+			if (flushError(s[0].flush()) != code::closed)
+				throw MACORO_RTE_LOC;
+			if (flushError(s[0].flush()))
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[1].close());
+
+			// of the flushes that are waiting when the send fails, only
+			// the first reports the error.
+			auto p = LocalAsyncSocket::makePair();
+			p[0].cork();
+			macoro::sync_wait(p[0].send(a));
+			auto w0 = macoro::make_blocking(p[0].flush() | macoro::wrap());
+			auto w1 = macoro::make_blocking(p[0].flush() | macoro::wrap());
+			macoro::sync_wait(p[0].close());
+			p[0].uncork();
+			auto r0 = w0.get();
+			auto r1 = w1.get();
+			if (!r0.has_error() || r1.has_error())
+				throw MACORO_RTE_LOC;
+			macoro::sync_wait(p[1].close());
+		}
+
+		void SocketScheduler_concurrentSend_test()
+		{
+			// many threads sending and receiving on their own forks 
+			// should keep the order of the messages of each fork. Both
+			// go through the lock free intakes of the scheduler.
+			auto s = LocalAsyncSocket::makePair();
+
+			u64 numThreads = 8, numMsgs = 200;
+			std::vector<Socket> f0(numThreads), f1(numThreads);
+			for (u64 i = 0; i < numThreads; ++i)
+			{
+				f0[i] = s[0].fork();
+				f1[i] = s[1].fork();
+			}
+
+			std::vector<std::thread> thrds;
+			std::atomic<u64> failed = 0;
+			for (u64 i = 0; i < numThreads; ++i)
+			{
+				thrds.emplace_back([&, i] {
+					for (u64 j = 0; j < numMsgs; ++j)
+						macoro::sync_wait(f0[i].send(std::vector<u64>(j % 7 + 1, i * numMsgs + j)));
+					});
+				thrds.emplace_back([&, i] {
+					for (u64 j = 0; j < numMsgs; ++j)
+					{
+						auto msg = macoro::sync_wait(f1[i].recv<std::vector<u64>>());
+						if (msg != std::vector<u64>(j % 7 + 1, i * numMsgs + j))
+							++failed;
+					}
+					});
+			}
+			for (auto& t : thrds)
+				t.join();
+			if (failed)
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].flush());
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_submissionPool_test()
+		{
+			using internal::SendSubmission;
+
+			// submissions that are released on another thread should 
+			// be reused by the thread that allocated them. A new thread
+			// is used so that its pool starts out empty.
+			bool failed = false;
+			std::thread([&] {
+				std::vector<SendSubmission*> subs(100);
+				for (auto& s : subs)
+					s = SendSubmission::acquire();
+
+				std::thread([&] {
+					for (auto s : subs)
+						SendSubmission::release(s);
+					}).join();
+
+				std::sort(subs.begin(), subs.end());
+				std::vector<SendSubmission*> again(subs.size());
+				for (auto& s : again)
+				{
+					s = SendSubmission::acquire();
+					failed |= !std::binary_search(subs.begin(), subs.end(), s);
+				}
+				for (auto s : again)
+					SendSubmission::release(s);
+				}).join();
+			if (failed)
+				throw MACORO_RTE_LOC;
+
+			// a submission that outlives its thread is freed when released.
+			SendSubmission* s = nullptr;
+			std::thread([&] { s = SendSubmission::acquire(); }).join();
+			SendSubmission::release(s);
+		}
+
+		void SocketScheduler_singleThreaded_test()
+		{
+			// a single threaded socket should work with forks, 
+			// ref and move sends and flush without locking.
+			auto s = LocalAsyncSocket::makePair(single_threaded_tag{});
+			if (!s[0].mImpl->mMutex.singleThreaded())
+				throw MACORO_RTE_LOC;
+
+			u64 rounds = 100;
+			auto proto = [&](Socket sock, bool party) -> macoro::task<> {
+				auto f = sock.fork();
+				std::vector<u64> msg(4);
+				for (u64 i = 0; i < rounds; ++i)
+				{
+					if (party ^ (i & 1))
+					{
+						msg.assign(msg.size(), i);
+						co_await f.send(msg);
+						co_await sock.send(i);
+					}
+					else
+					{
+						co_await f.recv(msg);
+						auto j = co_await sock.recv<u64>();
+						if (msg != std::vector<u64>(msg.size(), i) || j != i)
+							throw MACORO_RTE_LOC;
+					}
+				}
+				co_await sock.flush();
+			};
+
+			auto r = macoro::sync_wait(macoro::when_all_ready(proto(s[0], 0), proto(s[1], 1)));
+			std::get<0>(r).result();
+			std::get<1>(r).result();
+
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_zeroAlloc_test()
+		{
+#ifdef ALLOC_TEST
+			// once warmed up, a ping-pong protocol should not 
+			// allocate. This includes flushing. Allocations that are
+			// registered with COPROTO_REG_NEW are reported by name, 
+			// others, e.g. by unique_function, stop_callback or 
+			// CBQueue, are only counted.
+			auto s = LocalAsyncSocket::makePair();
+
+			u64 warmup = 20, rounds = 100, before = 0, allocsBefore = 0, allocsAfter = 0;
+			auto proto = [&](Socket sock, bool party) -> macoro::task<> {
+				auto f = sock.fork();
+				std::vector<u8> msg(16);
+				u64 v = 0;
+				for (u64 i = 0; i < warmup + rounds; ++i)
+				{
+					if (party == 0 && i == warmup)
+					{
+						before = mNewIdx;
+						allocsBefore = gNumAllocs;
+					}
+
+					if (party ^ (i & 1))
+					{
+						co_await sock.send(std::move(i));
+						co_await sock.flush();
+						co_await f.send(msg);
+						co_await f.flushFork();
+					}
+					else
+					{
+						co_await sock.recv(v);
+						co_await f.recv(msg);
+						if (v != i)
+							throw MACORO_RTE_LOC;
+					}
+				}
+				if (party == 0)
+					allocsAfter = gNumAllocs;
+			};
+
+			auto r = macoro::sync_wait(macoro::when_all_ready(proto(s[0], 0), proto(s[1], 1)));
+			std::get<0>(r).result();
+			std::get<1>(r).result();
+
+			if (mNewIdx != before)
+				throw std::runtime_error(regStr() + COPROTO_LOCATION);
+			if (allocsAfter != allocsBefore)
+				throw std::runtime_error(std::to_string(allocsAfter - allocsBefore) +
+					" unregistered allocations. " + COPROTO_LOCATION);
+
+			macoro::sync_wait(s[0].flush());
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+#else
+			throw UnitTestSkipped("ALLOC_TEST not defined");
+#endif
+		}
+
+		void SocketScheduler_manyForks_test()
+		{
+			// forks are found by SessionID and by their remote id.
+			// Use enough forks to grow both tables several times and
+			// announce them out of order.
+			auto s = LocalAsyncSocket::makePair();
+
+			u64 numForks = 3000;
+			std::vector<Socket> f0(numForks), f1(numForks);
+			for (u64 i = 0; i < numForks; ++i)
+			{
+				f0[i] = s[0].fork();
+				f1[i] = s[1].fork();
+				if (f0[i].mId != f1[i].mId)
+					throw MACORO_RTE_LOC;
+			}
+
+			for (u64 i = 0; i < numForks; ++i)
+			{
+				if (s[0].mImpl->getLocalSocketFork(f0[i].mId) != f0[i].mFork ||
+					s[1].mImpl->getLocalSocketFork(f1[i].mId) != f1[i].mFork)
+					throw MACORO_RTE_LOC;
+			}
+
+			for (u64 i = numForks; i-- > 0;)
+				macoro::sync_wait(f0[i].send(std::move(i)));
+			for (u64 i = numForks; i-- > 0;)
+			{
+				if (macoro::sync_wait(f1[i].recv<u64>()) != i)
+					throw MACORO_RTE_LOC;
+			}
+
+			for (u64 i = 0; i < numForks; i += 2)
+				macoro::sync_wait(f1[i].send(std::move(i)));
+			for (u64 i = 0; i < numForks; i += 2)
+			{
+				if (macoro::sync_wait(f0[i].recv<u64>()) != i)
+					throw MACORO_RTE_LOC;
+			}
+
+			macoro::sync_wait(s[0].flush());
+			macoro::sync_wait(s[1].flush());
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_closeFork_test()
+		{
+			// closed forks should be released and their ids reused
+			// so that the memory does not grow with the number of forks.
+			auto s = LocalAsyncSocket::makePair();
+
+			u64 numForks = 20000;
+			for (u64 i = 0; i < numForks; ++i)
+			{
+				switch (i % 3)
+				{
+				case 0:
+				{
+					// both parties send.
+					auto a = s[0].fork();
+					auto b = s[1].fork();
+					macoro::sync_wait(a.send(std::move(i)));
+					if (macoro::sync_wait(b.recv<u64>()) != i)
+						throw MACORO_RTE_LOC;
+					macoro::sync_wait(b.send(i + 1));
+					if (macoro::sync_wait(a.recv<u64>()) != i + 1)
+						throw MACORO_RTE_LOC;
+					a.closeFork();
+					b.closeFork();
+					break;
+				}
+				case 1:
+				{
+					// only one party sends and a recv is pending when
+					// the fork is closed.
+					auto a = s[0].scopedFork();
+					auto b = s[1].scopedFork();
+					u64 v = 0;
+					auto r = macoro::make_blocking(b->recv(v));
+					macoro::sync_wait(a->send(std::move(i)));
+					r.get();
+					if (v != i)
+						throw MACORO_RTE_LOC;
+					break;
+				}
+				default:
+				{
+					// the fork is not used.
+					auto a = s[0].scopedFork();
+					auto b = s[1].scopedFork();
+					break;
+				}
+				}
+			}
+
+			for (u64 i = 0; i < 2; ++i)
+			{
+				auto& sched = *s[i].mImpl;
+				if (sched.mSocketForks_.size() > 4 ||
+					sched.mSocketForks_.capacity() > 64 ||
+					sched.mNextLocalSocketFork > 8)
+					throw MACORO_RTE_LOC;
+			}
+
+			// close every other fork of many open ones. The others
+			// must still be found.
+			u64 numOpen = 500;
+			std::vector<Socket> f0(numOpen), f1(numOpen);
+			for (u64 i = 0; i < numOpen; ++i)
+			{
+				f0[i] = s[0].fork();
+				f1[i] = s[1].fork();
+				macoro::sync_wait(f0[i].send(std::move(i)));
+				if (macoro::sync_wait(f1[i].recv<u64>()) != i)
+					throw MACORO_RTE_LOC;
+			}
+			for (u64 i = 0; i < numOpen; i += 2)
+			{
+				f0[i].closeFork();
+				f1[i].closeFork();
+			}
+			for (u64 i = 1; i < numOpen; i += 2)
+			{
+				if (s[0].mImpl->getLocalSocketFork(f0[i].mId) != f0[i].mFork ||
+					s[1].mImpl->getLocalSocketFork(f1[i].mId) != f1[i].mFork)
+					throw MACORO_RTE_LOC;
+				macoro::sync_wait(f0[i].send(i + 1));
+				if (macoro::sync_wait(f1[i].recv<u64>()) != i + 1)
+					throw MACORO_RTE_LOC;
+			}
+
+			macoro::sync_wait(s[0].flush());
+			macoro::sync_wait(s[1].flush());
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_forkRange_test()
+		{
+			// the forks of fork(n) have consecutive local ids and the
+			// other party learns about all of them from the first message.
+			auto s = LocalAsyncSocket::makePair();
+
+			u64 n = 1000;
+			auto f0 = s[0].fork(n);
+			auto f1 = s[1].fork(n);
+			if (f0.size() != n || f1.size() != n || s[0].fork(0).size())
+				throw MACORO_RTE_LOC;
+			for (u64 i = 0; i < n; ++i)
+			{
+				if (f0[i].mId != f1[i].mId ||
+					f0[i].mFork->mLocalId != f0[0].mFork->mLocalId + i ||
+					f1[i].mFork->mLocalId != f1[0].mFork->mLocalId + i)
+					throw MACORO_RTE_LOC;
+			}
+
+			u64 meta = sizeof(internal::Header) + sizeof(internal::ControlBlock);
+			u64 msg = sizeof(internal::Header) + sizeof(u64);
+			auto sent = s[0].bytesSent();
+			macoro::sync_wait(f0[n - 1].send(u64(n - 1)));
+			if (macoro::sync_wait(f1[n - 1].recv<u64>()) != n - 1)
+				throw MACORO_RTE_LOC;
+			if (s[0].bytesSent() - sent != 2 * meta + msg)
+				throw MACORO_RTE_LOC;
+			for (u64 i = 0; i < n; ++i)
+			{
+				if (s[1].mImpl->mSocketForks_.findRemote(f0[i].mFork->mLocalId) != f1[i].mFork)
+					throw MACORO_RTE_LOC;
+			}
+
+			// the other forks are already known.
+			sent = s[0].bytesSent();
+			for (u64 i = 0; i < n - 1; ++i)
+			{
+				macoro::sync_wait(f0[i].send(std::move(i)));
+				if (macoro::sync_wait(f1[i].recv<u64>()) != i)
+					throw MACORO_RTE_LOC;
+			}
+			if (s[0].bytesSent() - sent != (n - 1) * msg)
+				throw MACORO_RTE_LOC;
+
+			sent = s[1].bytesSent();
+			for (u64 i = 0; i < n; ++i)
+			{
+				macoro::sync_wait(f1[i].send(std::move(i)));
+				if (macoro::sync_wait(f0[i].recv<u64>()) != i)
+					throw MACORO_RTE_LOC;
+			}
+			if (s[1].bytesSent() - sent != 2 * meta + n * msg)
+				throw MACORO_RTE_LOC;
+
+			// the forks of a range are closed and released individually.
+			// The CloseFork meta messages are sent along with later messages.
+			for (u64 i = 0; i < n; ++i)
+			{
+				f0[i].closeFork();
+				f1[i].closeFork();
+			}
+			for (u64 i = 0; i < n && (
+				s[0].mImpl->mSocketForks_.size() > 1 ||
+				s[1].mImpl->mSocketForks_.size() > 1); ++i)
+			{
+				macoro::sync_wait(s[0].send(std::move(i)));
+				if (macoro::sync_wait(s[1].recv<u64>()) != i)
+					throw MACORO_RTE_LOC;
+				macoro::sync_wait(s[1].send(std::move(i)));
+				if (macoro::sync_wait(s[0].recv<u64>()) != i)
+					throw MACORO_RTE_LOC;
+			}
+			if (s[0].mImpl->mSocketForks_.size() != 1 ||
+				s[1].mImpl->mSocketForks_.size() != 1 ||
+				s[0].mImpl->mFreeLocalSocketForks.size() != n)
+				throw MACORO_RTE_LOC;
+
+			// a later range does not reuse the released ids.
+			auto g0 = s[0].fork(2);
+			auto g1 = s[1].fork(2);
+			macoro::sync_wait(g0[1].send(u64(1)));
+			if (macoro::sync_wait(g1[1].recv<u64>()) != 1 ||
+				g0[1].mFork->mLocalId != g0[0].mFork->mLocalId + 1)
+				throw MACORO_RTE_LOC;
+
+			// a fork of a range is closed before the range is announced.
+			// Its id is not reused until the other party has been told.
+			auto h0 = s[0].fork(3);
+			auto h1 = s[1].fork(3);
+			auto closed = h0[0].mFork->mLocalId;
+			h0[0].closeFork();
+			h1[0].closeFork();
+			auto k0 = s[0].fork();
+			auto k1 = s[1].fork();
+			if (k0.mFork->mLocalId == closed)
+				throw MACORO_RTE_LOC;
+			macoro::sync_wait(k0.send(u64(3)));
+			if (macoro::sync_wait(k1.recv<u64>()) != 3)
+				throw MACORO_RTE_LOC;
+			macoro::sync_wait(h0[1].send(u64(4)));
+			if (macoro::sync_wait(h1[1].recv<u64>()) != 4)
+				throw MACORO_RTE_LOC;
+			if (s[1].mImpl->mSocketForks_.findRemote(closed) != nullptr)
+				throw MACORO_RTE_LOC;
+		}
+
+		void SocketScheduler_deterministicForks_test()
+		{
+			// in deterministic mode no meta messages are sent for new
+			// forks of the root and messages can arrive before the fork is
+			// created. The range is announced as usual.
+			auto s = LocalAsyncSocket::makePair();
+			s[0].enableDeterministicForks();
+			s[1].enableDeterministicForks();
+			s[1].setRecvStashLimit(1 << 10);
+
+			u64 n = 100;
+			u64 msg = sizeof(internal::Header) + sizeof(u64);
+			u64 meta = sizeof(internal::Header) + sizeof(internal::ControlBlock);
+			auto sent = s[0].bytesSent();
+			std::vector<Socket> f0, f1;
+			for (u64 i = 0; i < n; ++i)
+				f0.push_back(s[0].fork());
+			for (auto& f : s[0].fork(n))
+				f0.push_back(std::move(f));
+			for (u64 i = 0; i < f0.size(); ++i)
+				macoro::sync_wait(f0[i].send(std::move(i)));
+			macoro::sync_wait(s[0].send(u64(42)));
+
+			// the messages of the forks are stashed until they are created.
+			if (macoro::sync_wait(s[1].recv<u64>()) != 42 ||
+				s[0].bytesSent() - sent != (f0.size() + 1) * msg + 2 * meta)
+				throw MACORO_RTE_LOC;
+			for (u64 i = 0; i < n; ++i)
+				f1.push_back(s[1].fork());
+			for (auto& f : s[1].fork(n))
+				f1.push_back(std::move(f));
+			for (u64 i = 0; i < f1.size(); ++i)
+			{
+				if (f0[i].mId != f1[i].mId ||
+					macoro::sync_wait(f1[i].recv<u64>()) != i)
+					throw MACORO_RTE_LOC;
+			}
+
+			// without the stash, the receive task waits for the fork.
+			s[1].setRecvStashLimit(0);
+			u64 v = 0;
+			auto r = macoro::make_blocking(s[1].recv(v));
+			auto a = s[0].fork();
+			macoro::sync_wait(a.send(u64(1)));
+			macoro::sync_wait(s[0].send(u64(2)));
+			auto b = s[1].fork();
+			if (macoro::sync_wait(b.recv<u64>()) != 1)
+				throw MACORO_RTE_LOC;
+			r.get();
+			if (v != 2)
+				throw MACORO_RTE_LOC;
+			f0.push_back(a);
+			f1.push_back(b);
+
+			// the forks are released once closed. Only the ids of the range
+			// are reused.
+			for (u64 i = 0; i < f0.size(); ++i)
+			{
+				f0[i].closeFork();
+				f1[i].closeFork();
+			}
+			for (u64 i = 0; i < f0.size() && (
+				s[0].mImpl->mSocketForks_.size() > 1 ||
+				s[1].mImpl->mSocketForks_.size() > 1); ++i)
+			{
+				macoro::sync_wait(s[0].send(std::move(i)));
+				if (macoro::sync_wait(s[1].recv<u64>()) != i)
+					throw MACORO_RTE_LOC;
+				macoro::sync_wait(s[1].send(std::move(i)));
+				if (macoro::sync_wait(s[0].recv<u64>()) != i)
+					throw MACORO_RTE_LOC;
+			}
+			if (s[0].mImpl->mSocketForks_.size() != 1 ||
+				s[1].mImpl->mSocketForks_.size() != 1 ||
+				s[0].mImpl->mFreeLocalSocketForks.size() != n)
+				throw MACORO_RTE_LOC;
+
+			// a message for a released fork of the root fails the socket.
+			{
+				auto p = LocalAsyncSocket::makePair();
+				p[0].enableDeterministicForks();
+				p[1].enableDeterministicForks();
+				auto c0 = p[0].fork();
+				auto c1 = p[1].fork();
+				macoro::sync_wait(c0.send(u64(1)));
+				if (macoro::sync_wait(c1.recv<u64>()) != 1)
+					throw MACORO_RTE_LOC;
+				auto slot = c1.mFork->mRemoteId;
+				if (slot != c0.mFork->mLocalId)
+					throw MACORO_RTE_LOC;
+				c0.closeFork();
+				c1.closeFork();
+				for (u64 i = 0; i < 10 && p[1].mImpl->mSocketForks_.size() > 1; ++i)
+				{
+					macoro::sync_wait(p[0].send(std::move(i)));
+					if (macoro::sync_wait(p[1].recv<u64>()) != i)
+						throw MACORO_RTE_LOC;
+					macoro::sync_wait(p[1].send(std::move(i)));
+					if (macoro::sync_wait(p[0].recv<u64>()) != i)
+						throw MACORO_RTE_LOC;
+				}
+				auto& sched = *p[1].mImpl;
+				internal::Lock l(sched.mMutex);
+				if (sched.mSocketForks_.size() != 1 ||
+					sched.findRemoteFork(slot, l) != nullptr)
+					throw MACORO_RTE_LOC;
+			}
+
+			// the forks of the root and fork(n) of the root are made in the
+			// same order by both parties. The forks of other forks can be
+			// interleaved with them differently.
+			{
+				auto p = LocalAsyncSocket::makePair();
+				p[0].enableDeterministicForks();
+				p[1].enableDeterministicForks();
+				p[1].setRecvStashLimit(1 << 10);
+				auto a0 = p[0].fork();
+				auto r0 = p[0].fork(4);
+				auto c0 = a0.fork();
+				auto b0 = p[0].fork();
+				auto a1 = p[1].fork();
+				auto c1 = a1.fork();
+				auto r1 = p[1].fork(4);
+				auto b1 = p[1].fork();
+				if (b0.mFork->mLocalId != b1.mFork->mLocalId || b0.mId != b1.mId)
+					throw MACORO_RTE_LOC;
+
+				macoro::sync_wait(b0.send(u64(1)));
+				macoro::sync_wait(c0.send(u64(2)));
+				macoro::sync_wait(r0[3].send(u64(3)));
+				macoro::sync_wait(a0.send(u64(4)));
+				if (macoro::sync_wait(a1.recv<u64>()) != 4 ||
+					macoro::sync_wait(r1[3].recv<u64>()) != 3 ||
+					macoro::sync_wait(c1.recv<u64>()) != 2 ||
+					macoro::sync_wait(b1.recv<u64>()) != 1)
+					throw MACORO_RTE_LOC;
+			}
+
+			// forks of other forks and fork(n) are told to the other party.
+			// They can be created in any order, also concurrently.
+			for (u64 recvFirst = 0; recvFirst < 2; ++recvFirst)
+			{
+				auto p = LocalAsyncSocket::makePair();
+				p[0].enableDeterministicForks();
+				p[1].enableDeterministicForks();
+				p[1].setRecvStashLimit(1 << 10);
+				Socket c1, d1, e1;
+				std::vector<Socket> g1;
+				if (recvFirst)
+				{
+					c1 = p[1].fork(); e1 = p[1].fork(); 
+					g1 = e1.fork(2); d1 = c1.fork();
+				}
+				auto c0 = p[0].fork(), d0 = c0.fork();
+				auto g0 = p[0].fork().fork(2);
+				macoro::sync_wait(d0.send(u64(42)));
+				macoro::sync_wait(g0[1].send(u64(43)));
+				if (!recvFirst)
+				{
+					// let the messages arrive first.
+					macoro::sync_wait(p[0].send(u64(1)));
+					if (macoro::sync_wait(p[1].recv<u64>()) != 1)
+						throw MACORO_RTE_LOC;
+					c1 = p[1].fork(); e1 = p[1].fork();
+					d1 = c1.fork(); g1 = e1.fork(2);
+				}
+
+				if (macoro::sync_wait(g1[1].recv<u64>()) != 43 ||
+					macoro::sync_wait(d1.recv<u64>()) != 42)
+					throw MACORO_RTE_LOC;
+
+				u64 m = 20;
+				std::array<std::vector<Socket>, 2> h0, h1;
+				auto forkAll = [&](std::array<std::vector<Socket>, 2>& h, Socket& a, Socket& b) {
+					std::thread t([&] {
+						for (u64 i = 0; i < m; ++i)
+							h[0].push_back(a.fork());
+						});
+					for (u64 i = 0; i < m; ++i)
+						h[1].push_back(b.fork());
+					t.join();
+					};
+				forkAll(h0, d0, g0[0]);
+				forkAll(h1, d1, g1[0]);
+				for (u64 j = 0; j < 2; ++j)
+					for (u64 i = 0; i < m; ++i)
+						macoro::sync_wait(h0[j][i].send(u64(i + j * m)));
+				for (u64 j = 0; j < 2; ++j)
+					for (u64 i = 0; i < m; ++i)
+						if (macoro::sync_wait(h1[j][i].recv<u64>()) != i + j * m)
+							throw MACORO_RTE_LOC;
+			}
+
+			// the mode must be enabled before the socket is used.
+			auto s2 = LocalAsyncSocket::makePair();
+			macoro::sync_wait(s2[0].send(u64(1)));
+			if (macoro::sync_wait(s2[1].recv<u64>()) != 1)
+				throw MACORO_RTE_LOC;
+			bool threw = false;
+			try { s2[0].enableDeterministicForks(); }
+			catch (std::runtime_error&) { threw = true; }
+			if (!threw)
+				throw MACORO_RTE_LOC;
+		}
+
+		void SocketScheduler_flushFork_test()
+		{
+			// flushFork() only waits for the operations of its fork. Both
+			// flushes only wait for the operations that were started before.
+			auto s = LocalAsyncSocket::makePair();
+			auto a0 = s[0].fork();
+			auto a1 = s[0].fork();
+			auto b0 = s[1].fork();
+			auto b1 = s[1].fork();
+
+			auto flushTask = [](internal::Flush f, bool& done) -> task<void>
+			{
+				MC_BEGIN(task<>, f, &done);
+				MC_AWAIT(f);
+				done = true;
+				MC_END();
+			};
+
+			u64 v0 = 0, v1 = 0, v2 = 0;
+			auto r0 = macoro::make_blocking(a0.recv(v0));
+			auto r1 = macoro::make_blocking(a1.recv(v1));
+
+			bool done0 = false, done1 = false, doneAll = false;
+			auto f0 = macoro::make_blocking(flushTask(a0.flushFork(), done0));
+			auto f1 = macoro::make_blocking(flushTask(a1.flushFork(), done1));
+			auto fAll = macoro::make_blocking(flushTask(s[0].flush(), doneAll));
+			auto r2 = macoro::make_blocking(a1.recv(v2));
+			if (done0 || done1 || doneAll)
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(b1.send(u64(1)));
+			r1.get();
+			if (v1 != 1 || !done1 || done0 || doneAll)
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(b0.send(u64(2)));
+			r0.get();
+			if (v0 != 2 || !done0 || !doneAll)
+				throw MACORO_RTE_LOC;
+			f0.get();
+			f1.get();
+			fAll.get();
+
+			// nothing is pending on a0.
+			bool done = false;
+			macoro::sync_wait(flushTask(a0.flushFork(), done));
+			if (!done)
+				throw MACORO_RTE_LOC;
+
+			// a flush after each recv. The flushes complete in order 
+			// as the recvs do.
+			const u64 n = 10;
+			std::array<u64, n> v;
+			std::array<bool, n> doneN;
+			std::vector<decltype(macoro::make_blocking(a0.recv(v[0])))> recvs;
+			std::vector<decltype(f0)> flushes;
+			for (u64 i = 0; i < n; ++i)
+			{
+				doneN[i] = false;
+				recvs.push_back(macoro::make_blocking(a0.recv(v[i])));
+				flushes.push_back(macoro::make_blocking(flushTask(s[0].flush(), doneN[i])));
+			}
+			macoro::sync_wait(b1.send(u64(3)));
+			r2.get();
+			if (v2 != 3 || doneN[0])
+				throw MACORO_RTE_LOC;
+			for (u64 i = 0; i < n; ++i)
+			{
+				macoro::sync_wait(b0.send(std::move(i)));
+				recvs[i].get();
+				if (v[i] != i || !doneN[i] || (i + 1 < n && doneN[i + 1]))
+					throw MACORO_RTE_LOC;
+				flushes[i].get();
+			}
+
+			macoro::sync_wait(s[0].flush());
+			macoro::sync_wait(s[1].flush());
+		}
+
+		void SocketScheduler_sendAfterClose_test()
+		{
+			// a send on a failed scheduler reports the error whether or 
+			// not it could have gone through the lock free intake.
+			auto s = LocalAsyncSocket::makePair();
+			macoro::sync_wait(s[0].close());
+
+			auto check = [](auto&& send) {
+				try {
+					macoro::sync_wait(std::move(send));
+				}
+				catch (std::system_error& ex)
+				{
+					if (ex.code() != code::closed)
+						throw;
+					return;
+				}
+				throw MACORO_RTE_LOC;
+				};
+
+			for (u64 i = 0; i < 2; ++i)
+			{
+				check(s[0].send(std::vector<u64>(4, i)));
+				u64 v = i;
+				check(s[0].send(v));
+			}
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_staleFork_test()
+		{
+			// a copy of a socket whose fork has been closed must not 
+			// operate on the fork that later reuses its slot.
+			auto s = LocalAsyncSocket::makePair();
+			auto a = s[0].fork();
+			auto b = s[1].fork();
+			auto stale = a;
+			a.closeFork();
+			b.closeFork();
+
+			auto c = s[0].fork();
+			auto d = s[1].fork();
+			if (c.mFork.mFork != stale.mFork.mFork)
+				throw MACORO_RTE_LOC;
+
+			auto check = [](auto&& op) {
+				try {
+					macoro::sync_wait(std::move(op));
+				}
+				catch (std::system_error& ex)
+				{
+					if (ex.code() != code::closed)
+						throw;
+					return;
+				}
+				throw MACORO_RTE_LOC;
+				};
+
+			u64 v = 1;
+			check(stale.send(v));
+			check(stale.recv(v));
+			check(stale.flushFork());
+
+			// a move-send does not wait for its message. Its error is 
+			// reported by the next flush.
+			macoro::sync_wait(stale.send(u64(2)));
+			check(s[0].flush());
+
+			// closing it again does nothing.
+			stale.closeFork();
+			try {
+				stale.fork();
+				throw MACORO_RTE_LOC;
+			}
+			catch (std::system_error& ex)
+			{
+				if (ex.code() != code::closed)
+					throw;
+			}
+
+			macoro::sync_wait(c.send(u64(3)));
+			if (macoro::sync_wait(d.recv<u64>()) != 3)
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].flush());
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
+
+		void SocketScheduler_closeForkDrop_test()
+		{
+			// messages that arrive on a fork that has been closed locally 
+			// are dropped. The stash is disabled so that they would 
+			// otherwise block the receive task.
+			auto s = LocalAsyncSocket::makePair();
+			auto a = s[0].fork();
+			auto b = s[1].fork();
+			macoro::sync_wait(a.send(u64(1)));
+			if (macoro::sync_wait(b.recv<u64>()) != 1)
+				throw MACORO_RTE_LOC;
+			b.closeFork();
+
+			for (u64 i = 0; i < 10; ++i)
+				macoro::sync_wait(a.send(std::vector<u8>(100, u8(i))));
+
+			auto c = s[0].fork();
+			auto d = s[1].fork();
+			macoro::sync_wait(c.send(u64(2)));
+			if (macoro::sync_wait(d.recv<u64>()) != 2)
+				throw MACORO_RTE_LOC;
+
+			// once the other party closes it too, the fork is released.
+			a.closeFork();
+			macoro::sync_wait(c.send(u64(3)));
+			if (macoro::sync_wait(d.recv<u64>()) != 3)
+				throw MACORO_RTE_LOC;
+			if (s[1].mImpl->mSocketForks_.size() != 2)
+				throw MACORO_RTE_LOC;
+
+			// a fork that waits for the other party to close it is 
+			// released once the socket fails.
+			d.closeFork();
+			if (s[1].mImpl->mSocketForks_.size() != 2)
+				throw MACORO_RTE_LOC;
+			s[1].mImpl->close();
+			if (s[1].mImpl->mSocketForks_.size() != 1)
+				throw MACORO_RTE_LOC;
+
+			macoro::sync_wait(s[0].close());
+			macoro::sync_wait(s[1].close());
+		}
 	}
 }
@@ -37,6 +37,33 @@ namespace coproto
 
 		void SocketScheduler_executor_test();
 
+		void SocketScheduler_vectoredSend_test();
+		void SocketScheduler_batchSend_test();
+		void SocketScheduler_batchBufferLimit_test();
+		void SocketScheduler_readAhead_test();
+		void SocketScheduler_recvStash_test();
+		void SocketScheduler_sendBackpressure_test();
+		void SocketScheduler_chunkedSend_test();
+		void SocketScheduler_sendPriority_test();
+		void SocketScheduler_stream_test();
+		void SocketScheduler_recvLease_test();
+		void SocketScheduler_recvBuffer_test();
+		void SocketScheduler_gatherScatter_test();
+		void SocketScheduler_cork_test();
+		void SocketScheduler_corkClose_test();
+		void SocketScheduler_concurrentSend_test();
+		void SocketScheduler_submissionPool_test();
+		void SocketScheduler_singleThreaded_test();
+		void SocketScheduler_zeroAlloc_test();
+		void SocketScheduler_manyForks_test();
+		void SocketScheduler_closeFork_test();
+		void SocketScheduler_forkRange_test();
+		void SocketScheduler_deterministicForks_test();
+		void SocketScheduler_flushFork_test();
+		void SocketScheduler_sendAfterClose_test();
+		void SocketScheduler_staleFork_test();
+		void SocketScheduler_closeForkDrop_test();
+
 
 
 	}
@@ -7,6 +7,9 @@
 #include "tests/SocketScheduler_tests.h"
 #include "tests/BufferingSocket_tests.h"
 #include "tests/AsioSocket_tests.h"
+#include "tests/PosixSocket_tests.h"
+#include "tests/IoUringSocket_tests.h"
+#include "tests/ShmSocket_tests.h"
 #include "tests/AsioTlsSocket_tests.h"
 
 #ifdef _MSC_VER
@@ -274,12 +277,19 @@ namespace coproto
 
         t.add("InlinePolyTest                        ", tests::InlinePolyTest);
         t.add("Queue_test                            ", tests::Queue_test);
+        t.add("CBQueue_test                          ", tests::CBQueue_test);
 
         t.add("LocalAsyncSocket_noop_test            ", tests::LocalAsyncSocket_noop_test);
         t.add("LocalAsyncSocket_sendRecv_test        ", tests::LocalAsyncSocket_sendRecv_test);
         t.add("LocalAsyncSocket_parSendRecv_test     ", tests::LocalAsyncSocket_parSendRecv_test);
         t.add("LocalAsyncSocket_cancellation_test    ", tests::LocalAsyncSocket_cancellation_test);
         t.add("LocalAsyncSocket_close_test           ", tests::LocalAsyncSocket_close_test);
+        t.add("LocalAsyncSocket_sendvRecvv_test      ", tests::LocalAsyncSocket_sendvRecvv_test);
+        t.add("LocalAsyncSocket_buffered_sendRecv_test", tests::LocalAsyncSocket_buffered_sendRecv_test);
+        t.add("LocalAsyncSocket_buffered_parSendRecv_test", tests::LocalAsyncSocket_buffered_parSendRecv_test);
+        t.add("LocalAsyncSocket_buffered_cancellation_test", tests::LocalAsyncSocket_buffered_cancellation_test);
+        t.add("LocalAsyncSocket_buffered_close_test  ", tests::LocalAsyncSocket_buffered_close_test);
+        t.add("LocalAsyncSocket_ownedHandoff_test    ", tests::LocalAsyncSocket_ownedHandoff_test);
 
         t.add("BufferingSocket_sendRecv_test         ", tests::BufferingSocket_sendRecv_test);
         t.add("BufferingSocket_asyncSend_test        ", tests::BufferingSocket_asyncSend_test);
@@ -287,6 +297,7 @@ namespace coproto
         t.add("BufferingSocket_cancellation_test     ", tests::BufferingSocket_cancellation_test);
         t.add("BufferingSocket_parCancellation_test  ", tests::BufferingSocket_parCancellation_test);
         t.add("BufferingSocket_close_test            ", tests::BufferingSocket_close_test);
+        t.add("BufferingSocket_sendvRecvv_test       ", tests::BufferingSocket_sendvRecvv_test);
         
 
         t.add("AsioSocket_Accept_test                ", tests::AsioSocket_Accept_test);
@@ -299,6 +310,31 @@ namespace coproto
         t.add("AsioSocket_parCancellation_test       ", tests::AsioSocket_parCancellation_test);
         t.add("AsioSocket_close_test                 ", tests::AsioSocket_close_test);
 
+        t.add("PosixSocket_Accept_test               ", tests::PosixSocket_Accept_test);
+        t.add("PosixSocket_Accept_sCancel_test       ", tests::PosixSocket_Accept_sCancel_test);
+        t.add("PosixSocket_Accept_cCancel_test       ", tests::PosixSocket_Accept_cCancel_test);
+        t.add("PosixSocket_sendRecv_test             ", tests::PosixSocket_sendRecv_test);
+        t.add("PosixSocket_largeSendRecv_test        ", tests::PosixSocket_largeSendRecv_test);
+        t.add("PosixSocket_pipe_test                 ", tests::PosixSocket_pipe_test);
+        t.add("PosixSocket_cancellation_test         ", tests::PosixSocket_cancellation_test);
+        t.add("PosixSocket_close_test                ", tests::PosixSocket_close_test);
+
+        t.add("IoUringSocket_sendRecv_test           ", tests::IoUringSocket_sendRecv_test);
+        t.add("IoUringSocket_largeSendRecv_test      ", tests::IoUringSocket_largeSendRecv_test);
+        t.add("IoUringSocket_registeredBuffer_test   ", tests::IoUringSocket_registeredBuffer_test);
+        t.add("IoUringSocket_poll_test               ", tests::IoUringSocket_poll_test);
+        t.add("IoUringSocket_smallRing_test          ", tests::IoUringSocket_smallRing_test);
+        t.add("IoUringSocket_cancellation_test       ", tests::IoUringSocket_cancellation_test);
+        t.add("IoUringSocket_close_test              ", tests::IoUringSocket_close_test);
+
+        t.add("ShmSocket_sendRecv_test               ", tests::ShmSocket_sendRecv_test);
+        t.add("ShmSocket_largeSendRecv_test          ", tests::ShmSocket_largeSendRecv_test);
+        t.add("ShmSocket_named_test                  ", tests::ShmSocket_named_test);
+        t.add("ShmSocket_sleep_test                  ", tests::ShmSocket_sleep_test);
+        t.add("ShmSocket_cancellation_test           ", tests::ShmSocket_cancellation_test);
+        t.add("ShmSocket_close_test                  ", tests::ShmSocket_close_test);
+        t.add("ShmSocket_peerFailure_test            ", tests::ShmSocket_peerFailure_test);
+
         t.add("AsioTlsSocket_Accept_test             ", tests::AsioTlsSocket_Accept_test);
         t.add("AsioTlsSocket_Accept_sCacnel_test     ", tests::AsioTlsSocket_Accept_sCacnel_test);
         t.add("AsioTlsSocket_Accept_cCacnel_test     ", tests::AsioTlsSocket_Accept_cCacnel_test);
@@ -321,6 +357,32 @@ namespace coproto
         t.add("SocketScheduler_repeatInitSlot_test   ", tests::SocketScheduler_repeatInitSlot_test);
         t.add("SocketScheduler_badSlotSend_test      ", tests::SocketScheduler_badSlotSend_test);
         t.add("SocketScheduler_executor_test         ", tests::SocketScheduler_executor_test);
+        t.add("SocketScheduler_vectoredSend_test     ", tests::SocketScheduler_vectoredSend_test);
+        t.add("SocketScheduler_batchSend_test        ", tests::SocketScheduler_batchSend_test);
+        t.add("SocketScheduler_batchBufferLimit_test ", tests::SocketScheduler_batchBufferLimit_test);
+        t.add("SocketScheduler_readAhead_test        ", tests::SocketScheduler_readAhead_test);
+        t.add("SocketScheduler_recvStash_test        ", tests::SocketScheduler_recvStash_test);
+        t.add("SocketScheduler_sendBackpressure_test ", tests::SocketScheduler_sendBackpressure_test);
+        t.add("SocketScheduler_chunkedSend_test      ", tests::SocketScheduler_chunkedSend_test);
+        t.add("SocketScheduler_sendPriority_test     ", tests::SocketScheduler_sendPriority_test);
+        t.add("SocketScheduler_stream_test           ", tests::SocketScheduler_stream_test);
+        t.add("SocketScheduler_recvLease_test        ", tests::SocketScheduler_recvLease_test);
+        t.add("SocketScheduler_recvBuffer_test       ", tests::SocketScheduler_recvBuffer_test);
+        t.add("SocketScheduler_gatherScatter_test    ", tests::SocketScheduler_gatherScatter_test);
+        t.add("SocketScheduler_cork_test             ", tests::SocketScheduler_cork_test);
+        t.add("SocketScheduler_corkClose_test        ", tests::SocketScheduler_corkClose_test);
+        t.add("SocketScheduler_concurrentSend_test   ", tests::SocketScheduler_concurrentSend_test);
+        t.add("SocketScheduler_submissionPool_test   ", tests::SocketScheduler_submissionPool_test);
+        t.add("SocketScheduler_singleThreaded_test   ", tests::SocketScheduler_singleThreaded_test);
+        t.add("SocketScheduler_zeroAlloc_test        ", tests::SocketScheduler_zeroAlloc_test);
+        t.add("SocketScheduler_manyForks_test        ", tests::SocketScheduler_manyForks_test);
+        t.add("SocketScheduler_closeFork_test        ", tests::SocketScheduler_closeFork_test);
+        t.add("SocketScheduler_forkRange_test        ", tests::SocketScheduler_forkRange_test);
+        t.add("SocketScheduler_deterministicForks_test", tests::SocketScheduler_deterministicForks_test);
+        t.add("SocketScheduler_flushFork_test        ", tests::SocketScheduler_flushFork_test);
+        t.add("SocketScheduler_sendAfterClose_test   ", tests::SocketScheduler_sendAfterClose_test);
+        t.add("SocketScheduler_staleFork_test        ", tests::SocketScheduler_staleFork_test);
+        t.add("SocketScheduler_closeForkDrop_test    ", tests::SocketScheduler_closeForkDrop_test);
         
         t.add("task_proto_test                       ", tests::task_proto_test);
         t.add("task_strSendRecv_Test                 ", tests::task_strSendRecv_Test);
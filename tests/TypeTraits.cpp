@@ -2,6 +2,8 @@
 #include "coproto/Common/TypeTraits.h"
 #include "coproto/Common/Defines.h"
 #include "coproto/Common/span.h"
+#include "coproto/Common/Buffer.h"
+#include "coproto/Common/BufferPool.h"
 #include <vector>
 #include <array>
 #include <string>
@@ -97,6 +99,9 @@ namespace coproto
 		static_assert(is_resizable_trivial_container<std::vector<long long>>::value, "");
 		static_assert(is_resizable_trivial_container<std::string>::value, "");
 		static_assert(is_resizable_trivial_container<int>::value == false, "");
+		static_assert(is_resizable_trivial_container<Buffer<u8>>::value, "");
+		static_assert(is_resizable_trivial_container<Buffer<u64, 128>>::value, "");
+		static_assert(is_resizable_trivial_container<BufferLease>::value, "");
 
 
 
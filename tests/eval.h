@@ -15,6 +15,10 @@
 #include "macoro/sync_wait.h"
 #include "macoro/start_on.h"
 #include <numeric>
+#include <array>
+#include <chrono>
+#include <future>
+#include <thread>
 #include "macoro/inline_scheduler.h"
 #include "macoro/thread_pool.h"
 namespace coproto
@@ -131,5 +135,183 @@ namespace coproto
 		{
 			return eval(p0, p0, type);
 		}
+
+
+		// a small protocol that is run over the sockets under test. The
+		// parties exchange a few messages of growing size and then a
+		// value over a fork.
+		inline task<void> echoProto(Socket& s, bool party)
+		{
+			MC_BEGIN(task<>, &s, party,
+				i = u64{},
+				v = std::vector<u64>{},
+				r = std::vector<u64>{},
+				ss = Socket{}
+			);
+
+			for (i = 0; i < 10; ++i)
+			{
+				v.resize(1 + i * 1000);
+				for (u64 j = 0; j < v.size(); ++j)
+					v[j] = i + j;
+
+				if (party)
+				{
+					MC_AWAIT(s.send(v));
+					MC_AWAIT(s.recvResize(r));
+				}
+				else
+				{
+					MC_AWAIT(s.recvResize(r));
+					MC_AWAIT(s.send(v));
+				}
+
+				if (r != v)
+					throw MACORO_RTE_LOC;
+			}
+
+			ss = s.fork();
+			if (party)
+				MC_AWAIT(ss.send(i));
+			else
+			{
+				MC_AWAIT(ss.recv(i));
+				if (i != 10)
+					throw MACORO_RTE_LOC;
+			}
+
+			MC_AWAIT(s.flush());
+			MC_END();
+		}
+
+		// awaits the socket operations a0 and a1 on two threads and 
+		// returns their results.
+		template<typename A0, typename A1>
+		std::array<std::pair<error_code, u64>, 2> awaitBoth(A0&& a0, A1&& a1)
+		{
+			auto fut = std::async([&] { return macoro::sync_wait(std::forward<A0>(a0)); });
+			auto r1 = macoro::sync_wait(std::forward<A1>(a1));
+			return { fut.get(), r1 };
+		}
+
+		// The tests below are shared by the socket backends. makePair()
+		// must return two connected sockets whose mSock member is the
+		// underlying socket.
+
+		// a small message followed by echoProto.
+		template<typename MakePair>
+		void socketSendRecvTest(MakePair&& makePair)
+		{
+			auto s = makePair();
+
+			std::vector<u8> sb(10), rb(10);
+			sb[4] = 5;
+			auto r = awaitBoth(s[0].mSock->send(sb), s[1].mSock->recv(rb));
+			if (r[0].first || r[1].first || sb != rb)
+				throw MACORO_RTE_LOC;
+
+			auto p = macoro::sync_wait(macoro::when_all_ready(
+				echoProto(s[0], 0),
+				echoProto(s[1], 1)
+			));
+			std::get<0>(p).result();
+			std::get<1>(p).result();
+		}
+
+		// a message that is larger than the socket buffers so that both
+		// sides have to wait. It is sent and received in vectored pieces.
+		template<typename MakePair>
+		void socketLargeSendRecvTest(MakePair&& makePair)
+		{
+			auto s = makePair();
+
+			std::vector<u8> sb(1 << 23), rb(sb.size());
+			for (u64 i = 0; i < sb.size(); ++i)
+				sb[i] = i * 31;
+
+			std::array<span<u8>, 2> sbs{
+				span<u8>(sb.data(), 777),
+				span<u8>(sb.data() + 777, sb.size() - 777) };
+			std::array<span<u8>, 2> rbs{
+				span<u8>(rb.data(), 12345),
+				span<u8>(rb.data() + 12345, rb.size() - 12345) };
+
+			auto r = awaitBoth(s[0].mSock->sendv(sbs), s[1].mSock->recvv(rbs));
+			if (r[0].first || r[1].first ||
+				r[0].second != sb.size() || r[1].second != sb.size())
+				throw MACORO_RTE_LOC;
+			if (sb != rb)
+				throw MACORO_RTE_LOC;
+		}
+
+		// a receive and a send that can not complete are stopped. An 
+		// already stopped token aborts right away.
+		template<typename MakePair>
+		void socketCancellationTest(MakePair&& makePair)
+		{
+			auto s = makePair();
+			auto stopLater = [](macoro::stop_source& src) {
+				return std::async([&src] {
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+					src.request_stop();
+					});
+			};
+
+			{
+				macoro::stop_source src;
+				std::vector<u8> rb(10);
+				auto fut = stopLater(src);
+				auto r = macoro::sync_wait(s[0].mSock->recv(rb, src.get_token()));
+				fut.get();
+				if (r.first != code::operation_aborted)
+					throw MACORO_RTE_LOC;
+			}
+
+			{
+				macoro::stop_source src;
+				std::vector<u8> sb(1 << 23);
+				auto fut = stopLater(src);
+				auto r = macoro::sync_wait(s[0].mSock->send(sb, src.get_token()));
+				fut.get();
+				if (r.first != code::operation_aborted || r.second == sb.size())
+					throw MACORO_RTE_LOC;
+			}
+
+			{
+				macoro::stop_source src;
+				src.request_stop();
+				std::vector<u8> rb(10);
+				auto r = macoro::sync_wait(s[1].mSock->recv(rb, src.get_token()));
+				if (r.first != code::operation_aborted)
+					throw MACORO_RTE_LOC;
+			}
+		}
+
+		// a socket is closed while a receive that has taken part of
+		// its data is waiting. The peer then sees the socket as closed.
+		template<typename MakePair>
+		void socketCloseTest(MakePair&& makePair)
+		{
+			u64 trials = 20;
+			for (u64 tt = 0; tt < trials; ++tt)
+			{
+				auto s = makePair();
+				std::vector<u8> rb(10), sb(5);
+				macoro::sync_wait(s[1].mSock->send(sb));
+
+				auto fut = std::async([&] {
+					std::this_thread::sleep_for(std::chrono::milliseconds(tt % 3));
+					macoro::sync_wait(s[0].mSock->close());
+					});
+				auto r = macoro::sync_wait(s[0].mSock->recv(rb));
+				fut.get();
+				if (r.first != code::operation_aborted || r.second > sb.size())
+					throw MACORO_RTE_LOC;
+
+				r = macoro::sync_wait(s[1].mSock->recv(rb));
+				if (r.first != code::remoteClosed)
+					throw MACORO_RTE_LOC;
+			}
+		}
 	}
 }
\ No newline at end of file